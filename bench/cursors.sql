@@ -0,0 +1 @@
+select bench_cursors(100);
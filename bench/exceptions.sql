@@ -0,0 +1 @@
+select bench_exceptions(1000);
@@ -0,0 +1 @@
+select bench_loop(10000);
@@ -0,0 +1 @@
+select bench_recursion(100);
@@ -0,0 +1,126 @@
+#!/usr/bin/env bash
+#
+# run_bench.sh
+#
+#   measures overhead of runtime plugins of plpgsql_check
+#
+# Every workload (pgbench script) is executed with every mode. The
+# baseline mode runs with loaded extension, but with all runtime
+# plugins disabled. The overhead is reported in nanoseconds per
+# executed PL/pgSQL statement. The number of statements executed by
+# one transaction of workload is taken from the profiler.
+#
+# The extension should be installed. When it is loaded by
+# shared_preload_libraries, then shared profiles are used.
+#
+# Environment variables:
+#
+#   PGBIN            directory with psql and pgbench (default from PATH)
+#   BENCH_DB         used database (default plpgsql_check_bench)
+#   BENCH_DURATION   duration of one run in seconds (default 10)
+#   BENCH_CLIENTS    number of pgbench's clients (default 1)
+#   BENCH_WORKLOADS  list of workloads (default all)
+#   BENCH_MODES      list of modes (default all)
+#
+# Connection is specified by usual libpq environment variables.
+#
+
+set -eu
+
+BENCH_DIR=$(cd "$(dirname "$0")" && pwd)
+
+if [ -n "${PGBIN:-}" ]; then
+	PSQL="$PGBIN/psql"
+	PGBENCH="$PGBIN/pgbench"
+else
+	PSQL=psql
+	PGBENCH=pgbench
+fi
+
+BENCH_DB=${BENCH_DB:-plpgsql_check_bench}
+BENCH_DURATION=${BENCH_DURATION:-10}
+BENCH_CLIENTS=${BENCH_CLIENTS:-1}
+BENCH_WORKLOADS=${BENCH_WORKLOADS:-"loop recursion exceptions trigger cursors"}
+BENCH_MODES=${BENCH_MODES:-"baseline profiler coverage tracer cursors_leaks passive"}
+
+# the library is loaded by every connection, although it is not in shared_preload_libraries
+LOAD_OPTS="-c session_preload_libraries=plpgsql_check"
+DISABLED_OPTS="-c plpgsql_check.mode=disabled -c plpgsql_check.cursors_leaks=off"
+
+mode_options()
+{
+	case "$1" in
+		baseline)
+			echo "$LOAD_OPTS $DISABLED_OPTS"
+			;;
+		profiler)
+			echo "$LOAD_OPTS $DISABLED_OPTS -c plpgsql_check.profiler=on"
+			;;
+		coverage)
+			echo "$LOAD_OPTS $DISABLED_OPTS -c plpgsql_check.coverage=on"
+			;;
+		tracer)
+			echo "$LOAD_OPTS $DISABLED_OPTS -c plpgsql_check.enable_tracer=on -c plpgsql_check.tracer=on -c plpgsql_check.tracer_output=buffer"
+			;;
+		cursors_leaks)
+			echo "$LOAD_OPTS -c plpgsql_check.mode=disabled -c plpgsql_check.cursors_leaks=on"
+			;;
+		passive)
+			echo "$LOAD_OPTS -c plpgsql_check.mode=every_start -c plpgsql_check.cursors_leaks=off"
+			;;
+		*)
+			echo "unknown mode \"$1\"" >&2
+			exit 1
+			;;
+	esac
+}
+
+# returns number of PL/pgSQL statements executed by one transaction of workload
+statements_per_xact()
+{
+	PGOPTIONS="$(mode_options baseline)" "$PSQL" -X -q -At -v ON_ERROR_STOP=1 -d "$BENCH_DB" \
+		-c "select plpgsql_profiler_reset_all()" \
+		-c "set plpgsql_check.profiler to on" \
+		-f "$BENCH_DIR/$1.sql" \
+		-c "set plpgsql_check.profiler to off" \
+		-c "select sum(exec_count) from plpgsql_profiler_snapshot() where stmtid is not null" | tail -n 1
+}
+
+# returns tps of workload in mode
+run_pgbench()
+{
+	PGOPTIONS="$(mode_options "$2")" "$PGBENCH" -n -M prepared \
+		-c "$BENCH_CLIENTS" -j "$BENCH_CLIENTS" -T "$BENCH_DURATION" \
+		-f "$BENCH_DIR/$1.sql" "$BENCH_DB" 2>/dev/null |
+		grep '^tps' | tail -n 1 | awk '{ print $3 }'
+}
+
+if ! "$PSQL" -X -At -d postgres -c "select 1 from pg_database where datname = '$BENCH_DB'" | grep -q 1; then
+	"$PSQL" -X -q -d postgres -c "create database $BENCH_DB" > /dev/null
+fi
+
+"$PSQL" -X -q -v ON_ERROR_STOP=1 -d "$BENCH_DB" -f "$BENCH_DIR/setup.sql" > /dev/null
+
+printf "%-12s %-14s %12s %12s %14s\n" "workload" "mode" "stmts/xact" "tps" "ns/statement"
+
+for workload in $BENCH_WORKLOADS; do
+	nstmts=$(statements_per_xact "$workload")
+	baseline_tps=""
+
+	for mode in $BENCH_MODES; do
+		tps=$(run_pgbench "$workload" "$mode")
+
+		if [ "$mode" = "baseline" ]; then
+			baseline_tps=$tps
+			overhead="-"
+		elif [ -n "$baseline_tps" ]; then
+			# (latency of mode - latency of baseline) / statements per transaction
+			overhead=$(awk -v tps="$tps" -v base="$baseline_tps" -v n="$nstmts" -v c="$BENCH_CLIENTS" \
+				'BEGIN { printf "%.1f", (c / tps - c / base) * 1e9 / n }')
+		else
+			overhead="?"
+		fi
+
+		printf "%-12s %-14s %12s %12s %14s\n" "$workload" "$mode" "$nstmts" "$tps" "$overhead"
+	done
+done
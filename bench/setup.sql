@@ -0,0 +1,87 @@
+--
+-- Workloads used by run_bench.sh. Every workload is one pgbench script,
+-- and it calls one of the following functions (or fires the trigger).
+--
+create extension if not exists plpgsql_check;
+
+-- tight loop with assignments and conditions
+create or replace function bench_loop(n int)
+returns int as $$
+declare s int = 0;
+begin
+  for i in 1..n loop
+    s := s + i;
+    if s > 1000000 then
+      s := 0;
+    end if;
+  end loop;
+  return s;
+end;
+$$ language plpgsql;
+
+-- deep recursion (every call initializes plugins)
+create or replace function bench_recursion(depth int)
+returns int as $$
+begin
+  if depth <= 0 then
+    return 0;
+  end if;
+  return bench_recursion(depth - 1) + 1;
+end;
+$$ language plpgsql;
+
+-- blocks with exception handlers (subtransactions)
+create or replace function bench_exceptions(n int)
+returns int as $$
+declare r int = 0;
+begin
+  for i in 1..n loop
+    begin
+      r := r + 1 / (i % 2);
+    exception when division_by_zero then
+      r := r - 1;
+    end;
+  end loop;
+  return r;
+end;
+$$ language plpgsql;
+
+-- row trigger
+drop table if exists bench_trigger_tab;
+create table bench_trigger_tab(id int, v int, updated int);
+
+create or replace function bench_trigger_fx()
+returns trigger as $$
+begin
+  new.updated := coalesce(new.updated, 0) + 1;
+  if new.v < 0 then
+    new.v := 0;
+  end if;
+  return new;
+end;
+$$ language plpgsql;
+
+create trigger bench_trigger_tab_trg
+  before insert or update on bench_trigger_tab
+  for each row execute function bench_trigger_fx();
+
+-- opening, fetching and closing of cursors
+create or replace function bench_cursors(n int)
+returns int as $$
+declare
+  c refcursor;
+  r record;
+  s int = 0;
+begin
+  for i in 1..n loop
+    open c for select g from generate_series(1, 10) g;
+    loop
+      fetch c into r;
+      exit when not found;
+      s := s + r.g;
+    end loop;
+    close c;
+  end loop;
+  return s;
+end;
+$$ language plpgsql;
@@ -0,0 +1,3 @@
+begin;
+insert into bench_trigger_tab select i, i from generate_series(1, 100) g(i);
+rollback;
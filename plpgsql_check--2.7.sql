@@ -119,6 +119,38 @@ RETURNS SETOF text
 AS 'MODULE_PATHNAME','plpgsql_check_function_name'
 LANGUAGE C;
 
+CREATE FUNCTION plpgsql_check_all(nspname name DEFAULT null,
+                                  fatal_errors boolean DEFAULT true,
+                                  other_warnings boolean DEFAULT true,
+                                  performance_warnings boolean DEFAULT false,
+                                  extra_warnings boolean DEFAULT true,
+                                  security_warnings boolean DEFAULT false,
+                                  compatibility_warnings boolean DEFAULT false,
+                                  without_warnings boolean DEFAULT false,
+                                  all_warnings boolean DEFAULT false,
+                                  use_incomment_options boolean DEFAULT true,
+                                  incomment_options_usage_warning boolean DEFAULT false,
+                                  constant_tracing boolean DEFAULT true,
+                                  nshards int DEFAULT 1,
+                                  shard int DEFAULT 0)
+RETURNS TABLE(functionid regproc,
+              lineno int,
+              statement text,
+              sqlstate text,
+              message text,
+              detail text,
+              hint text,
+              level text,
+              "position" int,
+              query text,
+              context text)
+AS 'MODULE_PATHNAME','plpgsql_check_all_tb'
+LANGUAGE C;
+
+CREATE FUNCTION plpgsql_check_cache_reset()
+RETURNS void AS 'MODULE_PATHNAME','plpgsql_check_cache_reset'
+LANGUAGE C STRICT;
+
 CREATE FUNCTION __plpgsql_show_dependency_tb(funcoid regprocedure,
                                              relid regclass DEFAULT 0,
                                              anyelememttype regtype DEFAULT 'int',
@@ -227,6 +259,8 @@ RETURNS TABLE(stmtid int,
               total_time double precision,
               avg_time double precision,
               max_time double precision,
+              p95_time double precision,
+              p99_time double precision,
               processed_rows int8,
               stmtname text)
 AS 'MODULE_PATHNAME','plpgsql_profiler_function_statements_tb'
@@ -244,6 +278,8 @@ RETURNS TABLE(stmtid int,
               total_time double precision,
               avg_time double precision,
               max_time double precision,
+              p95_time double precision,
+              p99_time double precision,
               processed_rows int8,
               stmtname text)
 AS 'MODULE_PATHNAME','plpgsql_profiler_function_statements_tb_name'
@@ -293,14 +329,165 @@ RETURNS TABLE(funcoid regprocedure,
               avg_time double precision,
               stddev_time double precision,
               min_time double precision,
-              max_time double precision)
+              max_time double precision,
+              p95_time double precision,
+              p99_time double precision)
 AS 'MODULE_PATHNAME','plpgsql_profiler_functions_all_tb'
 LANGUAGE C STRICT;
 
+CREATE OR REPLACE FUNCTION plpgsql_profiler_critical_path(funcoid regprocedure)
+RETURNS TABLE(level int,
+              stmtid int,
+              lineno int,
+              stmtname text,
+              exec_stmts int8,
+              total_time double precision,
+              self_time double precision)
+AS 'MODULE_PATHNAME','plpgsql_profiler_critical_path'
+LANGUAGE C STRICT;
+
+CREATE OR REPLACE FUNCTION plpgsql_profiler_critical_path(name text)
+RETURNS TABLE(level int,
+              stmtid int,
+              lineno int,
+              stmtname text,
+              exec_stmts int8,
+              total_time double precision,
+              self_time double precision)
+AS 'MODULE_PATHNAME','plpgsql_profiler_critical_path_name'
+LANGUAGE C STRICT;
+
+CREATE OR REPLACE FUNCTION plpgsql_profiler_call_stacks()
+RETURNS TABLE(stack text,
+              exec_count int8,
+              total_time double precision,
+              self_time double precision)
+AS 'MODULE_PATHNAME','plpgsql_profiler_call_stacks_tb'
+LANGUAGE C STRICT;
+
+CREATE OR REPLACE FUNCTION plpgsql_profiler_collapsed_stacks()
+RETURNS SETOF text
+AS 'MODULE_PATHNAME','plpgsql_profiler_collapsed_stacks'
+LANGUAGE C STRICT;
+
+CREATE OR REPLACE FUNCTION plpgsql_profiler_snapshot()
+RETURNS TABLE(funcoid oid,
+              stmtid int,
+              lineno int,
+              exec_count int8,
+              exec_count_err int8,
+              total_time double precision,
+              processed_rows int8)
+AS 'MODULE_PATHNAME','plpgsql_profiler_snapshot'
+LANGUAGE C STRICT;
+
 CREATE OR REPLACE FUNCTION plpgsql_check_profiler(enable boolean DEFAULT NULL)
 RETURNS boolean AS 'MODULE_PATHNAME', 'plpgsql_check_profiler_ctrl'
 LANGUAGE C VOLATILE;
 
 CREATE OR REPLACE FUNCTION plpgsql_check_tracer(enable boolean DEFAULT NULL, verbosity text DEFAULT NULL)
 RETURNS boolean AS 'MODULE_PATHNAME', 'plpgsql_check_tracer_ctrl'
-LANGUAGE C VOLATILE;
\ No newline at end of file
+LANGUAGE C VOLATILE;
+
+CREATE OR REPLACE FUNCTION plpgsql_check_tracer_messages()
+RETURNS TABLE(pid int, seqno bigint, "time" timestamptz, message text)
+AS 'MODULE_PATHNAME','plpgsql_check_tracer_messages'
+LANGUAGE C;
+
+CREATE OR REPLACE FUNCTION plpgsql_check_tracer_messages_reset()
+RETURNS void AS 'MODULE_PATHNAME','plpgsql_check_tracer_messages_reset'
+LANGUAGE C STRICT;
+
+CREATE OR REPLACE FUNCTION plpgsql_profiler_function_hotspots_tb(funcoid regprocedure)
+RETURNS TABLE(lineno int,
+              exec_stmts int8,
+              total_time double precision,
+              sqlstate text,
+              message text,
+              detail text,
+              hint text,
+              statement text)
+AS $$
+  SELECT p.lineno, p.exec_stmts, p.total_time,
+         w.sqlstate, w.message, w.detail, w.hint, w.statement
+    FROM @extschema@.plpgsql_check_function_tb($1, performance_warnings => true) w
+         JOIN @extschema@.plpgsql_profiler_function_tb($1) p ON p.lineno = w.lineno
+   WHERE w.level = 'performance' AND p.exec_stmts > 0
+   ORDER BY p.total_time DESC, p.lineno;
+$$ LANGUAGE sql;
+
+CREATE OR REPLACE FUNCTION plpgsql_profiler_function_hotspots_tb(name text)
+RETURNS TABLE(lineno int,
+              exec_stmts int8,
+              total_time double precision,
+              sqlstate text,
+              message text,
+              detail text,
+              hint text,
+              statement text)
+AS $$
+  SELECT p.lineno, p.exec_stmts, p.total_time,
+         w.sqlstate, w.message, w.detail, w.hint, w.statement
+    FROM @extschema@.plpgsql_check_function_tb($1, performance_warnings => true) w
+         JOIN @extschema@.plpgsql_profiler_function_tb($1) p ON p.lineno = w.lineno
+   WHERE w.level = 'performance' AND p.exec_stmts > 0
+   ORDER BY p.total_time DESC, p.lineno;
+$$ LANGUAGE sql;
+
+CREATE OR REPLACE FUNCTION plpgsql_profiler_hotspots()
+RETURNS TABLE(funcoid regprocedure,
+              lineno int,
+              exec_stmts int8,
+              total_time double precision,
+              sqlstate text,
+              message text,
+              detail text,
+              hint text,
+              statement text)
+AS $$
+  SELECT f.funcoid, h.*
+    FROM @extschema@.plpgsql_profiler_functions_all() f
+         JOIN pg_catalog.pg_proc p ON p.oid = f.funcoid
+         CROSS JOIN LATERAL @extschema@.plpgsql_profiler_function_hotspots_tb(f.funcoid) h
+   WHERE p.prorettype NOT IN ('pg_catalog.trigger'::pg_catalog.regtype,
+                              'pg_catalog.event_trigger'::pg_catalog.regtype)
+   ORDER BY h.total_time DESC, 1, h.lineno;
+$$ LANGUAGE sql;
+
+CREATE OR REPLACE FUNCTION plpgsql_profiler_export()
+RETURNS bytea AS 'MODULE_PATHNAME','plpgsql_profiler_export'
+LANGUAGE C STRICT;
+
+CREATE OR REPLACE FUNCTION plpgsql_profiler_delta(consumer text)
+RETURNS TABLE(funcoid oid,
+              stmtid int,
+              lineno int,
+              exec_count int8,
+              exec_count_err int8,
+              total_time double precision,
+              processed_rows int8)
+AS 'MODULE_PATHNAME','plpgsql_profiler_delta'
+LANGUAGE C STRICT;
+
+CREATE OR REPLACE FUNCTION plpgsql_profiler_delta_close(consumer text)
+RETURNS bool AS 'MODULE_PATHNAME','plpgsql_profiler_delta_close'
+LANGUAGE C STRICT;
+
+CREATE OR REPLACE FUNCTION plpgsql_profiler_dynamic_queries()
+RETURNS TABLE(funcoid oid,
+              stmtid int,
+              lineno int,
+              queryid int8,
+              exec_count int8,
+              total_time double precision,
+              max_time double precision,
+              processed_rows int8)
+AS 'MODULE_PATHNAME','plpgsql_profiler_dynamic_queries'
+LANGUAGE C STRICT;
+
+CREATE OR REPLACE FUNCTION plpgsql_check_internal_stats()
+RETURNS TABLE(name text,
+              count int8,
+              total_time double precision)
+AS 'MODULE_PATHNAME','plpgsql_check_internal_stats'
+LANGUAGE C STRICT;
\ No newline at end of file
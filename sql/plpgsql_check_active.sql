@@ -125,6 +125,40 @@ select plpgsql_profiler_remove_fake_queryid_hook();
 
 drop function f1();
 
+-- queries of dynamic statements
+create table dq_tab(a int);
+
+create function dq_test()
+returns void as $$
+begin
+  for i in 1..3 loop
+    execute case when i < 3 then 'select ' || i else 'delete from dq_tab' end;
+  end loop;
+end;
+$$ language plpgsql;
+
+select plpgsql_profiler_install_fake_queryid_hook();
+
+set plpgsql_check.profiler_dynamic_queries to on;
+
+select dq_test();
+
+select lineno, queryid, exec_count from plpgsql_profiler_dynamic_queries() where funcoid = 'dq_test()'::regprocedure order by queryid;
+
+set plpgsql_check.profiler_dynamic_queries to off;
+
+select plpgsql_profiler_remove_fake_queryid_hook();
+
+drop function dq_test();
+
+drop table dq_tab;
+
+-- counters of own overhead of profiler
+select name from plpgsql_check_internal_stats() order by 1;
+
+-- the profiles of previous calls were merged
+select count > 0 from plpgsql_check_internal_stats() where name = 'profile_update';
+
 -- don't crash on empty dynamic query
 create or replace function f1()
 returns void as $$
@@ -4089,6 +4123,10 @@ select lineno, stmt_lineno, exec_stmts, source from plpgsql_profiler_function_tb
 
 select funcoid, exec_count from plpgsql_profiler_functions_all();
 
+select funcoid, p95_time <= p99_time and p99_time <= max_time as valid_percentiles from plpgsql_profiler_functions_all();
+
+select count(*) from plpgsql_profiler_function_statements_tb('longfx') where p95_time > p99_time or p99_time > max_time;
+
 create table testr(a int);
 create rule testr_rule as on insert to testr do nothing;
 
@@ -4140,6 +4178,36 @@ select plpgsql_coverage_branches('covtest');
 
 set plpgsql_check.profiler to off;
 
+-- coverage collection mode (without profiler)
+set plpgsql_check.coverage to on;
+
+create or replace function covtest2(int)
+returns int as $$
+declare a int = $1;
+begin
+  a := a + 1;
+  if a < 10 then
+    a := a + 1;
+  end if;
+  a := a + 1;
+  return a;
+end;
+$$ language plpgsql;
+
+select covtest2(10);
+
+select plpgsql_coverage_statements('covtest2');
+select plpgsql_coverage_branches('covtest2');
+
+select covtest2(1);
+
+select plpgsql_coverage_statements('covtest2');
+select plpgsql_coverage_branches('covtest2');
+
+set plpgsql_check.coverage to off;
+
+drop function covtest2(int);
+
 create or replace function f() returns void as $$
 declare
   r1 record;
@@ -5612,6 +5680,314 @@ begin
 end;
 $$ language plpgsql;
 
+create function ac_f1(a text)
+returns text as $$
+begin
+  return format('%s', a, a);
+end;
+$$ language plpgsql;
+
+create function ac_f2(a text)
+returns text as $$
+begin
+  return format('%s', a, a);
+end;
+$$ language plpgsql;
+
+set plpgsql_check.analysis_cache to on;
+
+select lineno, message from plpgsql_check_function_tb('ac_f1(text)');
+
+-- should to use cached result of analysis
+select lineno, message from plpgsql_check_function_tb('ac_f2(text)');
+
+set plpgsql_check.analysis_cache to off;
+
+drop function ac_f1(text);
+drop function ac_f2(text);
+
+create table pa_tab(a int, b int);
+create index on pa_tab(b);
+
+create function pa_f1(v int)
+returns int as $$
+declare r int;
+begin
+  select b into r from pa_tab where a = v;
+  return r;
+end;
+$$ language plpgsql stable;
+
+set plpgsql_check.plan_advisor to on;
+set plpgsql_check.plan_advisor_min_cost to 0;
+
+-- should to raise warning, the predicate is not evaluated by index
+select lineno, message from plpgsql_check_function_tb('pa_f1(int)', performance_warnings => true);
+
+set plpgsql_check.plan_advisor to off;
+set plpgsql_check.plan_advisor_min_cost to default;
+
+drop function pa_f1(int);
+drop table pa_tab;
+
+create table check_cache_tab(a int);
+
+create function check_cache_test()
+returns void as $$
+declare x int;
+begin
+  perform a from check_cache_tab;
+end;
+$$ language plpgsql;
+
+set plpgsql_check.check_cache to on;
+
+select lineno, message from plpgsql_check_function_tb('check_cache_test()');
+
+-- should to use cached result
+select lineno, message from plpgsql_check_function_tb('check_cache_test()');
+
+-- change of used relation invalidates cached result
+alter table check_cache_tab rename column a to b;
+
+select message from plpgsql_check_function_tb('check_cache_test()') where level = 'error';
+
+set plpgsql_check.check_cache to off;
+
+drop function check_cache_test();
+drop table check_cache_tab;
+
+create schema plpgsql_check_all_test;
+
+create function plpgsql_check_all_test.f1()
+returns void as $$
+begin
+  insert into nonexist_tab values(10);
+end;
+$$ language plpgsql;
+
+create function plpgsql_check_all_test.f2()
+returns void as $$
+begin
+  perform 1;
+end;
+$$ language plpgsql;
+
+select functionid, lineno, sqlstate, message from plpgsql_check_all('plpgsql_check_all_test');
+
+-- every function is checked just in one shard
+select (select count(*) from plpgsql_check_all('plpgsql_check_all_test', nshards => 2, shard => 0)) +
+       (select count(*) from plpgsql_check_all('plpgsql_check_all_test', nshards => 2, shard => 1)) as count;
+
+drop function plpgsql_check_all_test.f1();
+drop function plpgsql_check_all_test.f2();
+drop schema plpgsql_check_all_test;
+
+-- tracer prints only prefix of long values
+set plpgsql_check.enable_tracer to on;
+set plpgsql_check.tracer to on;
+set plpgsql_check.tracer_test_mode = true;
+set plpgsql_check.tracer_verbosity to default;
+set plpgsql_check.tracer_variable_max_length = 10;
+
+create function tracer_long_values(a text, b int[], c bytea, d text[])
+returns void as $$
+begin
+end;
+$$ language plpgsql;
+
+select tracer_long_values(repeat('x', 20000), array[1,2,3,4,5,6,7,8,9,10], '\x0102030405060708', array['a b', 'c']);
+
+set plpgsql_check.enable_tracer to off;
+set plpgsql_check.tracer to off;
+reset plpgsql_check.tracer_variable_max_length;
+
+drop function tracer_long_values(text, int[], bytea, text[]);
+
+-- tracer stores messages in buffer
+set plpgsql_check.enable_tracer to on;
+set plpgsql_check.tracer to on;
+set plpgsql_check.tracer_test_mode = true;
+set plpgsql_check.tracer_output to buffer;
+
+create function tracer_buffer_test(a int)
+returns int as $$
+begin
+  return a + 1;
+end;
+$$ language plpgsql;
+
+select plpgsql_check_tracer_messages_reset();
+
+select tracer_buffer_test(1);
+
+select seqno > 0 as has_seqno, message
+  from plpgsql_check_tracer_messages()
+ where pid = pg_backend_pid()
+ order by seqno;
+
+select plpgsql_check_tracer_messages_reset();
+
+select count(*)
+  from plpgsql_check_tracer_messages()
+ where pid = pg_backend_pid();
+
+reset plpgsql_check.tracer_output;
+set plpgsql_check.enable_tracer to off;
+set plpgsql_check.tracer to off;
+
+drop function tracer_buffer_test(int);
+
+-- tracer shows only selected functions
+create function tracer_filter_nested(a int)
+returns int as $$
+begin
+  return a + 1;
+end;
+$$ language plpgsql;
+
+create function tracer_filter_test(b int)
+returns int as $$
+declare r int default 0;
+begin
+  for i in 1..b
+  loop
+    r := tracer_filter_nested(r);
+  end loop;
+  return r;
+end;
+$$ language plpgsql;
+
+set plpgsql_check.enable_tracer to on;
+set plpgsql_check.tracer to on;
+set plpgsql_check.tracer_test_mode = true;
+set plpgsql_check.tracer_functions = 'tracer_filter_nested';
+
+select tracer_filter_test(2);
+
+-- should fail
+set plpgsql_check.tracer_lines = '10-5';
+
+set plpgsql_check.enable_tracer to off;
+set plpgsql_check.tracer to off;
+reset plpgsql_check.tracer_functions;
+
+drop function tracer_filter_test(int);
+drop function tracer_filter_nested(int);
+
+create function cs_inner(a int)
+returns int as $$
+begin
+  return a + 1;
+end;
+$$ language plpgsql;
+
+create function cs_outer(a int)
+returns int as $$
+begin
+  perform cs_inner(a);
+  for i in 1..2
+  loop
+    perform cs_inner(i);
+  end loop;
+  return cs_inner(a);
+end;
+$$ language plpgsql;
+
+set plpgsql_check.profiler to on;
+set plpgsql_check.profiler_call_stacks to on;
+
+select cs_outer(10);
+
+select stack, exec_count from plpgsql_profiler_call_stacks() where stack like 'cs_outer%' order by stack;
+
+select count(*) from plpgsql_profiler_collapsed_stacks() where plpgsql_profiler_collapsed_stacks like 'cs_outer(integer):6;cs_inner(integer) %';
+
+set plpgsql_check.profiler to off;
+reset plpgsql_check.profiler_call_stacks;
+
+drop function cs_outer(int);
+drop function cs_inner(int);
+
+create function cp_test(a int)
+returns int as $$
+declare r int default 0;
+begin
+  if a > 0 then
+    for i in 1..a
+    loop
+      perform pg_sleep(0.01);
+    end loop;
+  end if;
+  r := a + 1;
+  return r;
+end;
+$$ language plpgsql;
+
+set plpgsql_check.profiler to on;
+
+select cp_test(3);
+
+select level, lineno, stmtname, exec_stmts from plpgsql_profiler_critical_path('cp_test');
+
+select bool_and(total_time >= self_time) from plpgsql_profiler_critical_path('cp_test');
+
+select stmtid is null as is_function, lineno, exec_count from plpgsql_profiler_snapshot() where funcoid = 'cp_test'::regproc order by stmtid nulls first;
+
+-- first read returns all counters
+select count(*) > 0 from plpgsql_profiler_delta('cons1');
+
+select cp_test(0);
+
+-- only statements executed from last read
+select stmtid is null as is_function, lineno, exec_count from plpgsql_profiler_delta('cons1') where funcoid = 'cp_test'::regproc order by stmtid nulls first;
+
+-- nothing was executed
+select count(*) from plpgsql_profiler_delta('cons1');
+
+select plpgsql_profiler_delta_close('cons1');
+
+select plpgsql_profiler_reset_all();
+
+select cp_test(0);
+
+-- decode header and first statement record of exported profiles
+select substring(d from 1 for 8) as header,
+       ('x' || encode(substring(d from 9 for 4), 'hex'))::bit(32)::int as nfuncs,
+       ('x' || encode(substring(d from 13 for 4), 'hex'))::bit(32)::int = 'cp_test'::regproc::oid::int as is_cp_test,
+       ('x' || encode(substring(d from 17 for 4), 'hex'))::bit(32)::int as nstmts,
+       ('x' || encode(substring(d from 21 for 4), 'hex'))::bit(32)::int as stmtid,
+       ('x' || encode(substring(d from 25 for 4), 'hex'))::bit(32)::int as lineno,
+       ('x' || encode(substring(d from 37 for 8), 'hex'))::bit(64)::bigint as exec_count
+  from plpgsql_profiler_export() d;
+
+set plpgsql_check.profiler to off;
+
+drop function cp_test(int);
+
+create function hs_test(a int)
+returns int as $$
+declare r int default 0;
+begin
+  for i in 1..a
+  loop
+    r := r + 1.5;
+  end loop;
+  return r;
+end;
+$$ language plpgsql immutable;
+
+set plpgsql_check.profiler to on;
+
+select hs_test(3);
+
+set plpgsql_check.profiler to off;
+
+-- only performance warnings on executed lines are displayed
+select lineno, exec_stmts, message from plpgsql_profiler_function_hotspots_tb('hs_test');
+
+drop function hs_test(int);
+
 -- when plpgsql_check is not loaded yet, then plpgsql_check is
 -- load by perform plpgsql_check_pragma and this is another
 -- case, when fmgr hook is not called in expected order.
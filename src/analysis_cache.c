@@ -0,0 +1,366 @@
+/*-------------------------------------------------------------------------
+ *
+ * analysis_cache.c
+ *
+ *			  session cache of results of analysis of embedded queries
+ *
+ * by Pavel Stehule 2013-2025
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#include "plpgsql_check.h"
+
+#include "catalog/namespace.h"
+#include "catalog/pg_type.h"
+#include "miscadmin.h"
+#include "utils/catcache.h"
+#include "utils/hsearch.h"
+#include "utils/inval.h"
+#include "utils/memutils.h"
+#include "utils/syscache.h"
+
+#if PG_VERSION_NUM >= 130000
+
+#include "common/hashfn.h"
+
+#else
+
+#include "access/hash.h"
+#include "utils/hashutils.h"
+
+#endif
+
+/*
+ * Same queries (audit inserts, lookups to code tables) are used in lot
+ * of functions. The results of analysis of parsed query (checks of
+ * function's calls, volatility and used objects) are same, when the
+ * query has same text, it is executed with same search_path, and it
+ * uses variables with same names and types. The key of cache is
+ * composed from these values.
+ *
+ * The query should be planned for any function again, because the plan
+ * holds references to function's variables, and it is used by other
+ * checks.
+ *
+ * Any change of system catalogue, that can change the result of
+ * analysis, invalidates all entries.
+ */
+typedef struct analysis_cache_entry
+{
+	uint32		hashval;
+	char	   *key;
+	int			keylen;
+	char		volatility;
+	int			ndeps;
+	check_cache_dep *deps;
+	List	   *errors;			/* list of plpgsql_check_captured_error */
+} analysis_cache_entry;
+
+#define ANALYSIS_CACHE_MAX_ENTRIES		10000
+
+bool plpgsql_check_analysis_cache = false;
+
+static HTAB *analysis_cache_HashTable = NULL;
+static MemoryContext analysis_cache_mcxt = NULL;
+static bool analysis_cache_valid = false;
+static bool analysis_cache_callbacks_registered = false;
+static uint64 analysis_cache_generation = 0;
+
+/*
+ * The cache can be invalidated inside usage of entry, so the entries
+ * are released later (before next lookup).
+ */
+static void
+analysis_cache_syscache_callback(Datum arg, int cacheid, uint32 hashvalue)
+{
+	(void) arg;
+	(void) cacheid;
+	(void) hashvalue;
+
+	analysis_cache_valid = false;
+	analysis_cache_generation += 1;
+}
+
+static void
+analysis_cache_relcache_callback(Datum arg, Oid relid)
+{
+	(void) arg;
+	(void) relid;
+
+	analysis_cache_valid = false;
+	analysis_cache_generation += 1;
+}
+
+static void
+analysis_cache_init(void)
+{
+	HASHCTL		ctl;
+
+	if (!analysis_cache_callbacks_registered)
+	{
+		CacheRegisterSyscacheCallback(PROCOID, analysis_cache_syscache_callback, (Datum) 0);
+		CacheRegisterSyscacheCallback(TYPEOID, analysis_cache_syscache_callback, (Datum) 0);
+		CacheRegisterSyscacheCallback(OPEROID, analysis_cache_syscache_callback, (Datum) 0);
+		CacheRegisterSyscacheCallback(NAMESPACEOID, analysis_cache_syscache_callback, (Datum) 0);
+		CacheRegisterRelcacheCallback(analysis_cache_relcache_callback, (Datum) 0);
+
+		analysis_cache_callbacks_registered = true;
+	}
+
+	if (analysis_cache_mcxt)
+		MemoryContextReset(analysis_cache_mcxt);
+	else
+		analysis_cache_mcxt = AllocSetContextCreate(TopMemoryContext,
+													"plpgsql_check analysis cache",
+													ALLOCSET_DEFAULT_SIZES);
+
+	memset(&ctl, 0, sizeof(ctl));
+	ctl.keysize = sizeof(uint32);
+	ctl.entrysize = sizeof(analysis_cache_entry);
+	ctl.hcxt = analysis_cache_mcxt;
+
+	analysis_cache_HashTable = hash_create("plpgsql_check analysis cache",
+										   256,
+										   &ctl,
+										   HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+
+	analysis_cache_valid = true;
+}
+
+/*
+ * Serialize key of query. Returns false, when the query uses variables,
+ * that has not known type (records), and then the result of analysis
+ * cannot be cached.
+ */
+static bool
+get_key(PLpgSQL_checkstate *cstate, PLpgSQL_expr *expr, StringInfo key)
+{
+	int			dno;
+
+	appendStringInfoString(key, expr->query);
+	appendStringInfoChar(key, '\0');
+
+	appendStringInfoString(key, namespace_search_path);
+	appendStringInfoChar(key, '\0');
+
+	appendStringInfo(key, "%u %d %u %d",
+					 GetUserId(),
+					 (int) cstate->estate->func->resolve_option,
+					 cstate->pragma_foid,
+					 cstate->allow_mp);
+
+	dno = -1;
+	while ((dno = bms_next_member(expr->paramnos, dno)) >= 0)
+	{
+		PLpgSQL_datum *datum = cstate->estate->datums[dno];
+
+		if (datum->dtype == PLPGSQL_DTYPE_VAR ||
+			datum->dtype == PLPGSQL_DTYPE_PROMISE)
+		{
+			PLpgSQL_var *var = (PLpgSQL_var *) datum;
+
+			appendStringInfo(key, " %s:%u:%d:%u",
+							 var->refname,
+							 var->datatype->typoid,
+							 var->datatype->atttypmod,
+							 var->datatype->collation);
+		}
+		else if (datum->dtype == PLPGSQL_DTYPE_REC)
+		{
+			PLpgSQL_rec *rec = (PLpgSQL_rec *) datum;
+
+			if (rec->rectypeid == RECORDOID)
+				return false;
+
+			appendStringInfo(key, " %s:%u", rec->refname, rec->rectypeid);
+		}
+		else
+			return false;
+	}
+
+	return true;
+}
+
+static void
+replay_entry(PLpgSQL_checkstate *cstate, PLpgSQL_expr *expr, analysis_cache_entry *entry)
+{
+	plpgsql_check_result_info *ri = cstate->result_info;
+	ListCell   *lc;
+
+	foreach(lc, entry->errors)
+	{
+		plpgsql_check_captured_error *err = (plpgsql_check_captured_error *) lfirst(lc);
+
+		plpgsql_check_put_error(cstate,
+								err->sqlerrcode, err->lineno,
+								err->message, err->detail, err->hint,
+								err->level, err->position,
+								expr->query, NULL);
+	}
+
+	plpgsql_check_update_volatility(cstate, entry->volatility);
+
+	if (ri->cache_deps)
+	{
+		int			i;
+
+		for (i = 0; i < entry->ndeps; i++)
+			plpgsql_check_cache_add_dep(ri, entry->deps[i].kind, entry->deps[i].oid);
+	}
+}
+
+/*
+ * Run checks, that are common for every query, and collects volatility
+ * and used objects. When it is possible, then the cached result is used.
+ */
+void
+plpgsql_check_analyze_query(PLpgSQL_checkstate *cstate, PLpgSQL_expr *expr, Query *query)
+{
+	plpgsql_check_result_info *ri = cstate->result_info;
+	StringInfoData key;
+	uint32		hashval;
+	uint64		generation;
+	analysis_cache_entry *entry;
+	StringInfo	saved_cache_deps;
+	StringInfo	cache_deps;
+	List	   *errors;
+	char		volatility;
+	bool		found;
+	MemoryContext oldcxt;
+	ListCell   *lc;
+
+	/* dependencies are displayed with names, and then cache is not used */
+	if (!plpgsql_check_analysis_cache ||
+		ri->format == PLPGSQL_SHOW_DEPENDENCY_FORMAT_TABULAR ||
+		cstate->capture_errors)
+	{
+		plpgsql_check_funcexpr(cstate, query, expr->query);
+		plpgsql_check_collect_volatility(cstate, query);
+		plpgsql_check_detect_dependency(cstate, query);
+		return;
+	}
+
+	initStringInfo(&key);
+
+	if (!get_key(cstate, expr, &key))
+	{
+		pfree(key.data);
+
+		plpgsql_check_funcexpr(cstate, query, expr->query);
+		plpgsql_check_collect_volatility(cstate, query);
+		plpgsql_check_detect_dependency(cstate, query);
+		return;
+	}
+
+	if (!analysis_cache_valid ||
+		hash_get_num_entries(analysis_cache_HashTable) >= ANALYSIS_CACHE_MAX_ENTRIES)
+		analysis_cache_init();
+
+	hashval = DatumGetUInt32(hash_any((const unsigned char *) key.data, key.len));
+
+	entry = (analysis_cache_entry *) hash_search(analysis_cache_HashTable,
+												 (void *) &hashval,
+												 HASH_FIND,
+												 &found);
+
+	if (found &&
+		entry->keylen == key.len &&
+		memcmp(entry->key, key.data, key.len) == 0)
+	{
+		pfree(key.data);
+		replay_entry(cstate, expr, entry);
+		return;
+	}
+
+	/*
+	 * Run checks with captured messages and dependencies. The result
+	 * is stored only when the cache was not invalidated in this time.
+	 */
+	generation = analysis_cache_generation;
+
+	saved_cache_deps = ri->cache_deps;
+	cache_deps = makeStringInfo();
+
+	ri->cache_deps = cache_deps;
+	cstate->capture_errors = true;
+	cstate->captured_errors = NIL;
+
+	PG_TRY();
+	{
+		plpgsql_check_funcexpr(cstate, query, expr->query);
+		plpgsql_check_detect_dependency(cstate, query);
+
+		volatility = plpgsql_check_query_volatility(cstate, query);
+	}
+	PG_CATCH();
+	{
+		ri->cache_deps = saved_cache_deps;
+		cstate->capture_errors = false;
+		cstate->captured_errors = NIL;
+
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+
+	ri->cache_deps = saved_cache_deps;
+	errors = cstate->captured_errors;
+	cstate->capture_errors = false;
+	cstate->captured_errors = NIL;
+
+	if (generation == analysis_cache_generation && analysis_cache_valid)
+	{
+		entry = (analysis_cache_entry *) hash_search(analysis_cache_HashTable,
+													 (void *) &hashval,
+													 HASH_ENTER,
+													 &found);
+
+		oldcxt = MemoryContextSwitchTo(analysis_cache_mcxt);
+
+		/* the entry with same hash is replaced (memory is released by reset of cache) */
+		entry->key = palloc(key.len);
+		memcpy(entry->key, key.data, key.len);
+		entry->keylen = key.len;
+		entry->volatility = volatility;
+		entry->ndeps = cache_deps->len / sizeof(check_cache_dep);
+		entry->deps = palloc(Max(cache_deps->len, 1));
+		memcpy(entry->deps, cache_deps->data, cache_deps->len);
+		entry->errors = NIL;
+
+		foreach(lc, errors)
+		{
+			plpgsql_check_captured_error *err = (plpgsql_check_captured_error *) lfirst(lc);
+			plpgsql_check_captured_error *copy;
+
+			copy = palloc(sizeof(plpgsql_check_captured_error));
+			copy->sqlerrcode = err->sqlerrcode;
+			copy->lineno = err->lineno;
+			copy->message = err->message ? pstrdup(err->message) : NULL;
+			copy->detail = err->detail ? pstrdup(err->detail) : NULL;
+			copy->hint = err->hint ? pstrdup(err->hint) : NULL;
+			copy->level = err->level;
+			copy->position = err->position;
+
+			entry->errors = lappend(entry->errors, copy);
+		}
+
+		MemoryContextSwitchTo(oldcxt);
+
+		replay_entry(cstate, expr, entry);
+	}
+	else
+	{
+		analysis_cache_entry tmp;
+
+		tmp.volatility = volatility;
+		tmp.ndeps = cache_deps->len / sizeof(check_cache_dep);
+		tmp.deps = (check_cache_dep *) cache_deps->data;
+		tmp.errors = errors;
+
+		replay_entry(cstate, expr, &tmp);
+	}
+
+	pfree(key.data);
+	pfree(cache_deps->data);
+	pfree(cache_deps);
+}
@@ -0,0 +1,933 @@
+/*-------------------------------------------------------------------------
+ *
+ * check_cache.c
+ *
+ *			  cache of results of active mode checks
+ *
+ * by Pavel Stehule 2013-2025
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#include "plpgsql_check.h"
+#include "plpgsql_check_builtins.h"
+
+#include "access/htup_details.h"
+#include "catalog/namespace.h"
+#include "catalog/pg_class.h"
+#include "catalog/pg_namespace.h"
+#include "catalog/pg_type.h"
+#include "port/atomics.h"
+#include "storage/lwlock.h"
+#include "storage/shmem.h"
+#include "utils/builtins.h"
+#include "utils/dsa.h"
+#include "utils/guc.h"
+#include "utils/hsearch.h"
+#include "utils/lsyscache.h"
+#include "utils/memutils.h"
+#include "utils/syscache.h"
+#include "utils/timestamp.h"
+
+#if PG_VERSION_NUM >= 130000
+
+#include "common/hashfn.h"
+
+#else
+
+#include "access/hash.h"
+#include "utils/hashutils.h"
+
+#endif
+
+/*
+ * The result of check is cached for the version of function (fn_xmin,
+ * fn_tid), trigger relation, output format and options of check. The
+ * cached result is used only when the fingerprint of all objects used
+ * by the function (relations, functions, operators and types) is same.
+ * The fingerprint is calculated from versions (xmin, tid) of related
+ * catalog tuples, from namespaces of search_path, and from the objects
+ * found by names of related objects (so new object, that shadows some
+ * related object, is detected).
+ */
+typedef struct check_cache_hashkey
+{
+	Oid			db_oid;
+	Oid			fn_oid;
+	TransactionId fn_xmin;
+	ItemPointerData fn_tid;
+	Oid			relid;
+	int			format;
+	uint32		options_hash;
+} check_cache_hashkey;
+
+typedef struct check_cache_entry
+{
+	check_cache_hashkey key;
+	Size		size;
+	dsa_pointer data_dp;		/* data of entry in shared memory */
+	char	   *data;			/* data of entry in local memory */
+	pg_atomic_uint64 last_used;
+} check_cache_entry;
+
+/*
+ * Data of entry are in format: header, dependencies and rows of result.
+ * Any column of row is stored as isnull flag and int32 value (for byval
+ * types) or length and content of varlena.
+ */
+typedef struct check_cache_data_header
+{
+	uint64		fingerprint;
+	int			ndeps;
+	int			nrows;
+} check_cache_data_header;
+
+typedef struct check_cache_shared_state
+{
+	LWLock	   *lock;
+} check_cache_shared_state;
+
+bool plpgsql_check_cache = false;
+int plpgsql_check_cache_max_entries = 5000;
+
+static check_cache_shared_state *check_cache_ss = NULL;
+static HTAB *shared_cache_HashTable = NULL;
+static HTAB *cache_HashTable = NULL;
+static MemoryContext cache_mcxt = NULL;
+
+#define FINGERPRINT_MISSING_OBJECT		UINT64CONST(0x7fb5d329728ea185)
+
+PG_FUNCTION_INFO_V1(plpgsql_check_cache_reset);
+
+/*
+ * Calculate required size of shared memory for check cache
+ *
+ */
+Size
+plpgsql_check_cache_shmem_size(void)
+{
+	Size		num_bytes;
+
+	num_bytes = MAXALIGN(sizeof(check_cache_shared_state));
+	num_bytes = add_size(num_bytes,
+						 hash_estimate_size(plpgsql_check_cache_max_entries,
+											sizeof(check_cache_entry)));
+
+	return num_bytes;
+}
+
+/*
+ * Initialize shared memory of check cache. It is called from profiler's
+ * shmem startup hook, and caller should to hold AddinShmemInitLock.
+ *
+ */
+void
+plpgsql_check_cache_shmem_init(void)
+{
+	bool		found;
+	HASHCTL		info;
+
+	check_cache_ss = ShmemInitStruct("plpgsql_check check cache state",
+									 sizeof(check_cache_shared_state),
+									 &found);
+
+	if (!found)
+		check_cache_ss->lock = &(GetNamedLWLockTranche("plpgsql_check check cache"))->lock;
+
+	memset(&info, 0, sizeof(info));
+	info.keysize = sizeof(check_cache_hashkey);
+	info.entrysize = sizeof(check_cache_entry);
+
+	shared_cache_HashTable = ShmemInitHash("plpgsql_check check cache",
+										   plpgsql_check_cache_max_entries,
+										   plpgsql_check_cache_max_entries,
+										   &info,
+										   HASH_ELEM | HASH_BLOBS);
+}
+
+/*
+ * When shared memory is not available, then the results are cached
+ * in session memory.
+ */
+static void
+cache_HashTableInit(void)
+{
+	HASHCTL		ctl;
+
+	Assert(cache_HashTable == NULL);
+
+	cache_mcxt = AllocSetContextCreate(TopMemoryContext,
+									   "plpgsql_check check cache",
+									   ALLOCSET_DEFAULT_SIZES);
+
+	memset(&ctl, 0, sizeof(ctl));
+	ctl.keysize = sizeof(check_cache_hashkey);
+	ctl.entrysize = sizeof(check_cache_entry);
+	ctl.hcxt = cache_mcxt;
+
+	cache_HashTable = hash_create("plpgsql_check check cache",
+								  128,
+								  &ctl,
+								  HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+}
+
+static uint32
+hash_cstring(const char *str)
+{
+	if (!str)
+		return 0;
+
+	return DatumGetUInt32(hash_any((const unsigned char *) str, strlen(str)));
+}
+
+/*
+ * Returns hash of options of check and of configuration that can
+ * have an impact on result of check.
+ */
+static uint32
+get_options_hash(plpgsql_check_info *cinfo)
+{
+	bool		flags[9];
+	Oid			oids[5];
+	uint32		result;
+
+	flags[0] = cinfo->fatal_errors;
+	flags[1] = cinfo->other_warnings;
+	flags[2] = cinfo->performance_warnings;
+	flags[3] = cinfo->extra_warnings;
+	flags[4] = cinfo->security_warnings;
+	flags[5] = cinfo->compatibility_warnings;
+	flags[6] = cinfo->constants_tracing;
+	flags[7] = cinfo->incomment_options_usage_warning;
+	flags[8] = plpgsql_check_regress_test_mode;
+
+	oids[0] = cinfo->anyelementoid;
+	oids[1] = cinfo->anyenumoid;
+	oids[2] = cinfo->anyrangeoid;
+	oids[3] = cinfo->anycompatibleoid;
+	oids[4] = cinfo->anycompatiblerangeoid;
+
+	result = DatumGetUInt32(hash_any((const unsigned char *) flags, sizeof(flags)));
+	result = hash_combine(result,
+						  DatumGetUInt32(hash_any((const unsigned char *) oids, sizeof(oids))));
+
+	result = hash_combine(result, hash_cstring(cinfo->oldtable));
+	result = hash_combine(result, hash_cstring(cinfo->newtable));
+
+	result = hash_combine(result, hash_cstring(GetConfigOption("search_path", true, false)));
+	result = hash_combine(result, hash_cstring(GetConfigOption("plpgsql.extra_warnings", true, false)));
+	result = hash_combine(result, hash_cstring(GetConfigOption("plpgsql.extra_errors", true, false)));
+	result = hash_combine(result, hash_cstring(GetConfigOption("plpgsql_check.plan_advisor", true, false)));
+	result = hash_combine(result, hash_cstring(GetConfigOption("plpgsql_check.plan_advisor_min_cost", true, false)));
+	result = hash_combine(result, hash_cstring(GetConfigOption("plpgsql.variable_conflict", true, false)));
+
+	return result;
+}
+
+static void
+init_hashkey(check_cache_hashkey *hk,
+			 plpgsql_check_result_info *ri,
+			 plpgsql_check_info *cinfo)
+{
+	memset(hk, 0, sizeof(check_cache_hashkey));
+
+	hk->db_oid = MyDatabaseId;
+	hk->fn_oid = cinfo->fn_oid;
+	hk->fn_xmin = HeapTupleHeaderGetRawXmin(cinfo->proctuple->t_data);
+	hk->fn_tid = cinfo->proctuple->t_self;
+	hk->relid = cinfo->relid;
+	hk->format = ri->format;
+	hk->options_hash = get_options_hash(cinfo);
+}
+
+static uint64
+tuple_version_hash(uint64 result, HeapTuple tuple)
+{
+	result = hash_combine64(result, (uint64) HeapTupleHeaderGetRawXmin(tuple->t_data));
+	result = hash_combine64(result, (uint64) ItemPointerGetBlockNumber(&tuple->t_self));
+	result = hash_combine64(result, (uint64) ItemPointerGetOffsetNumber(&tuple->t_self));
+
+	return result;
+}
+
+/*
+ * Relation can be changed without change of pg_class tuple (renaming
+ * of column), so the versions of attributes are used too.
+ */
+static uint64
+relation_fingerprint(uint64 result, Oid relid)
+{
+	HeapTuple	tuple;
+	int			natts;
+	int			i;
+
+	tuple = SearchSysCache1(RELOID, ObjectIdGetDatum(relid));
+	if (!HeapTupleIsValid(tuple))
+		return hash_combine64(result, FINGERPRINT_MISSING_OBJECT);
+
+	result = tuple_version_hash(result, tuple);
+	natts = ((Form_pg_class) GETSTRUCT(tuple))->relnatts;
+
+	ReleaseSysCache(tuple);
+
+	for (i = 1; i <= natts; i++)
+	{
+		tuple = SearchSysCache2(ATTNUM,
+								ObjectIdGetDatum(relid),
+								Int16GetDatum(i));
+
+		if (!HeapTupleIsValid(tuple))
+			return hash_combine64(result, FINGERPRINT_MISSING_OBJECT);
+
+		result = tuple_version_hash(result, tuple);
+
+		ReleaseSysCache(tuple);
+	}
+
+	return result;
+}
+
+static uint64
+syscache_fingerprint(uint64 result, int cacheid, Oid oid)
+{
+	HeapTuple	tuple;
+	Oid			typrelid = InvalidOid;
+
+	tuple = SearchSysCache1(cacheid, ObjectIdGetDatum(oid));
+	if (!HeapTupleIsValid(tuple))
+		return hash_combine64(result, FINGERPRINT_MISSING_OBJECT);
+
+	result = tuple_version_hash(result, tuple);
+
+	if (cacheid == TYPEOID)
+		typrelid = ((Form_pg_type) GETSTRUCT(tuple))->typrelid;
+
+	ReleaseSysCache(tuple);
+
+	/* composite type is described by relation */
+	if (OidIsValid(typrelid))
+		result = relation_fingerprint(result, typrelid);
+
+	return result;
+}
+
+/*
+ * Adds the object, that is found by unqualified name of related object
+ * in current search_path, to fingerprint. When new object with same name
+ * is created in some schema before schema of related object, then the
+ * fingerprint is changed.
+ */
+static uint64
+name_fingerprint(uint64 result, int kind, Oid oid)
+{
+	char	   *name = NULL;
+
+	switch (kind)
+	{
+		case PLPGSQL_CHECK_CACHE_DEP_RELATION:
+			name = get_rel_name(oid);
+			if (name)
+				result = hash_combine64(result, (uint64) RelnameGetRelid(name));
+			break;
+
+		case PLPGSQL_CHECK_CACHE_DEP_TYPE:
+			{
+				HeapTuple	tuple;
+
+				tuple = SearchSysCache1(TYPEOID, ObjectIdGetDatum(oid));
+				if (HeapTupleIsValid(tuple))
+				{
+					name = pstrdup(NameStr(((Form_pg_type) GETSTRUCT(tuple))->typname));
+					ReleaseSysCache(tuple);
+
+					result = hash_combine64(result, (uint64) TypenameGetTypid(name));
+				}
+			}
+			break;
+
+		case PLPGSQL_CHECK_CACHE_DEP_FUNCTION:
+			name = get_func_name(oid);
+			if (name)
+			{
+				FuncCandidateList clist;
+
+#if PG_VERSION_NUM >= 140000
+
+				clist = FuncnameGetCandidates(list_make1(makeString(name)), -1, NIL,
+											  false, false, false, true);
+
+#else
+
+				clist = FuncnameGetCandidates(list_make1(makeString(name)), -1, NIL,
+											  false, false, true);
+
+#endif
+
+				for (; clist; clist = clist->next)
+					result = hash_combine64(result, (uint64) clist->oid);
+			}
+			break;
+
+		case PLPGSQL_CHECK_CACHE_DEP_OPERATOR:
+			name = get_opname(oid);
+			if (name)
+			{
+				FuncCandidateList clist;
+
+				clist = OpernameGetCandidates(list_make1(makeString(name)), '\0', true);
+
+				for (; clist; clist = clist->next)
+					result = hash_combine64(result, (uint64) clist->oid);
+			}
+			break;
+	}
+
+	return result;
+}
+
+static uint64
+get_fingerprint(check_cache_dep *deps, int ndeps)
+{
+	uint64		result = 0;
+	List	   *search_path;
+	ListCell   *lc;
+	int			i;
+
+	/* the namespaces of search_path can be changed without change of search_path */
+	search_path = fetch_search_path(false);
+
+	foreach(lc, search_path)
+		result = hash_combine64(result, (uint64) lfirst_oid(lc));
+
+	list_free(search_path);
+
+	for (i = 0; i < ndeps; i++)
+	{
+		result = hash_combine64(result, (uint64) deps[i].kind);
+
+		switch (deps[i].kind)
+		{
+			case PLPGSQL_CHECK_CACHE_DEP_RELATION:
+				result = relation_fingerprint(result, deps[i].oid);
+				break;
+
+			case PLPGSQL_CHECK_CACHE_DEP_FUNCTION:
+				result = syscache_fingerprint(result, PROCOID, deps[i].oid);
+				break;
+
+			case PLPGSQL_CHECK_CACHE_DEP_OPERATOR:
+				result = syscache_fingerprint(result, OPEROID, deps[i].oid);
+				break;
+
+			case PLPGSQL_CHECK_CACHE_DEP_TYPE:
+				result = syscache_fingerprint(result, TYPEOID, deps[i].oid);
+				break;
+
+			default:
+				elog(ERROR, "unknown kind of check cache dependency %d", deps[i].kind);
+		}
+
+		result = name_fingerprint(result, deps[i].kind, deps[i].oid);
+	}
+
+	return result;
+}
+
+/*
+ * Returns true, when the result of check can be cached. Only
+ * formats with independent rows for any checked function are
+ * supported.
+ */
+bool
+plpgsql_check_cache_is_usable(plpgsql_check_result_info *ri,
+							  plpgsql_check_info *cinfo)
+{
+	if (!plpgsql_check_cache ||
+		plpgsql_check_mode == PLPGSQL_CHECK_MODE_DISABLED)
+		return false;
+
+	if (!ri->tuple_store || !OidIsValid(cinfo->fn_oid))
+		return false;
+
+	return ri->format == PLPGSQL_CHECK_FORMAT_TEXT ||
+		   ri->format == PLPGSQL_CHECK_FORMAT_TABULAR;
+}
+
+/*
+ * Copy rows of cached result to result tuplestore
+ */
+static void
+replay_rows(plpgsql_check_result_info *ri, char *ptr, int nrows)
+{
+	int			natts = ri->tupdesc->natts;
+	Datum	   *values;
+	bool	   *nulls;
+	int			i;
+
+	values = palloc(natts * sizeof(Datum));
+	nulls = palloc(natts * sizeof(bool));
+
+	for (i = 0; i < nrows; i++)
+	{
+		int			j;
+
+		for (j = 0; j < natts; j++)
+		{
+			int32		value;
+
+			nulls[j] = *ptr++ != 0;
+			if (nulls[j])
+				continue;
+
+			memcpy(&value, ptr, sizeof(int32));
+			ptr += sizeof(int32);
+
+			if (TupleDescAttr(ri->tupdesc, j)->attbyval)
+				values[j] = Int32GetDatum(value);
+			else
+			{
+				values[j] = PointerGetDatum(cstring_to_text_with_len(ptr, value));
+				ptr += value;
+			}
+		}
+
+		tuplestore_putvalues(ri->tuple_store, ri->tupdesc, values, nulls);
+	}
+
+	pfree(values);
+	pfree(nulls);
+}
+
+/*
+ * Try to find valid cached result of check. When it is found, the
+ * rows are stored to result tuplestore, and returns true.
+ */
+bool
+plpgsql_check_cache_lookup(plpgsql_check_result_info *ri,
+						   plpgsql_check_info *cinfo)
+{
+	check_cache_hashkey hk;
+	check_cache_entry *entry;
+	check_cache_data_header *header;
+	char	   *data = NULL;
+
+	init_hashkey(&hk, ri, cinfo);
+
+	if (shared_cache_HashTable)
+	{
+		LWLockAcquire(check_cache_ss->lock, LW_SHARED);
+
+		entry = (check_cache_entry *) hash_search(shared_cache_HashTable,
+												  (void *) &hk,
+												  HASH_FIND,
+												  NULL);
+
+		if (entry)
+		{
+			data = palloc(entry->size);
+			memcpy(data,
+				   dsa_get_address(plpgsql_check_get_dsa(), entry->data_dp),
+				   entry->size);
+
+			pg_atomic_write_u64(&entry->last_used,
+								(uint64) GetCurrentStatementStartTimestamp());
+		}
+
+		LWLockRelease(check_cache_ss->lock);
+	}
+	else if (cache_HashTable)
+	{
+		entry = (check_cache_entry *) hash_search(cache_HashTable,
+												  (void *) &hk,
+												  HASH_FIND,
+												  NULL);
+
+		if (entry)
+		{
+			data = entry->data;
+
+			pg_atomic_write_u64(&entry->last_used,
+								(uint64) GetCurrentStatementStartTimestamp());
+		}
+	}
+
+	if (!data)
+		return false;
+
+	header = (check_cache_data_header *) data;
+
+	/* some used object was changed */
+	if (get_fingerprint((check_cache_dep *) (data + sizeof(check_cache_data_header)),
+						header->ndeps) != header->fingerprint)
+	{
+		if (shared_cache_HashTable)
+			pfree(data);
+
+		return false;
+	}
+
+	replay_rows(ri,
+				data + sizeof(check_cache_data_header) + header->ndeps * sizeof(check_cache_dep),
+				header->nrows);
+
+	if (shared_cache_HashTable)
+		pfree(data);
+
+	return true;
+}
+
+/*
+ * Prepare result info for serialization of result and collecting
+ * of dependencies.
+ */
+void
+plpgsql_check_cache_start(plpgsql_check_result_info *ri)
+{
+	ri->cache_rows = makeStringInfo();
+	ri->cache_deps = makeStringInfo();
+	ri->cache_nrows = 0;
+	ri->cache_fingerprint = 0;
+	ri->cache_has_fingerprint = false;
+	ri->cache_found_error = false;
+}
+
+void
+plpgsql_check_cache_add_dep(plpgsql_check_result_info *ri, int kind, Oid oid)
+{
+	check_cache_dep *deps = (check_cache_dep *) ri->cache_deps->data;
+	int			ndeps = ri->cache_deps->len / sizeof(check_cache_dep);
+	check_cache_dep dep;
+	int			i;
+
+	for (i = 0; i < ndeps; i++)
+	{
+		if (deps[i].kind == kind && deps[i].oid == oid)
+			return;
+	}
+
+	dep.kind = kind;
+	dep.oid = oid;
+
+	appendBinaryStringInfo(ri->cache_deps, (char *) &dep, sizeof(check_cache_dep));
+}
+
+/*
+ * Collect types of variables and calculate fingerprint of used objects.
+ * It should be called when used objects are locked.
+ */
+void
+plpgsql_check_cache_collect_deps(PLpgSQL_checkstate *cstate,
+								 PLpgSQL_function *func)
+{
+	plpgsql_check_result_info *ri = cstate->result_info;
+	List	   *relids;
+	ListCell   *lc;
+	int			i;
+
+	Assert(ri->cache_deps);
+
+	if (OidIsValid(cstate->cinfo->relid))
+		plpgsql_check_cache_add_dep(ri, PLPGSQL_CHECK_CACHE_DEP_RELATION,
+									cstate->cinfo->relid);
+
+	/*
+	 * The type of variable declared by %TYPE can be a type from pg_catalog,
+	 * so the relations referenced by %TYPE and %ROWTYPE are used too.
+	 */
+	relids = plpgsql_check_get_type_relations(plpgsql_check_get_src(cstate->cinfo->proctuple));
+
+	foreach(lc, relids)
+		plpgsql_check_cache_add_dep(ri, PLPGSQL_CHECK_CACHE_DEP_RELATION, lfirst_oid(lc));
+
+	list_free(relids);
+
+	for (i = 0; i < func->ndatums; i++)
+	{
+		PLpgSQL_datum *d = func->datums[i];
+		Oid			typoid = InvalidOid;
+
+		if (d->dtype == PLPGSQL_DTYPE_VAR ||
+			d->dtype == PLPGSQL_DTYPE_PROMISE)
+			typoid = ((PLpgSQL_var *) d)->datatype->typoid;
+		else if (d->dtype == PLPGSQL_DTYPE_REC)
+			typoid = ((PLpgSQL_rec *) d)->rectypeid;
+
+		if (OidIsValid(typoid) && typoid != RECORDOID)
+		{
+			HeapTuple	tuple;
+			bool		is_catalog_type = true;
+
+			tuple = SearchSysCache1(TYPEOID, ObjectIdGetDatum(typoid));
+			if (HeapTupleIsValid(tuple))
+			{
+				is_catalog_type = ((Form_pg_type) GETSTRUCT(tuple))->typnamespace == PG_CATALOG_NAMESPACE;
+				ReleaseSysCache(tuple);
+			}
+
+			if (!is_catalog_type)
+				plpgsql_check_cache_add_dep(ri, PLPGSQL_CHECK_CACHE_DEP_TYPE, typoid);
+		}
+	}
+
+	ri->cache_fingerprint = get_fingerprint((check_cache_dep *) ri->cache_deps->data,
+											ri->cache_deps->len / sizeof(check_cache_dep));
+	ri->cache_has_fingerprint = true;
+}
+
+/*
+ * Serialize one row of result
+ */
+void
+plpgsql_check_cache_put_row(plpgsql_check_result_info *ri, Datum *values, bool *nulls)
+{
+	int			i;
+
+	for (i = 0; i < ri->tupdesc->natts; i++)
+	{
+		int32		value;
+
+		appendStringInfoChar(ri->cache_rows, nulls[i] ? 1 : 0);
+		if (nulls[i])
+			continue;
+
+		if (TupleDescAttr(ri->tupdesc, i)->attbyval)
+		{
+			value = DatumGetInt32(values[i]);
+			appendBinaryStringInfo(ri->cache_rows, (char *) &value, sizeof(int32));
+		}
+		else
+		{
+			text	   *txt = DatumGetTextPP(values[i]);
+
+			value = VARSIZE_ANY_EXHDR(txt);
+			appendBinaryStringInfo(ri->cache_rows, (char *) &value, sizeof(int32));
+			appendBinaryStringInfo(ri->cache_rows, VARDATA_ANY(txt), value);
+		}
+	}
+
+	ri->cache_nrows += 1;
+}
+
+/*
+ * Returns least recently used entry (except entry with skip_hk key)
+ */
+static check_cache_entry *
+get_lru_entry(HTAB *cache, check_cache_hashkey *skip_hk)
+{
+	HASH_SEQ_STATUS hash_seq;
+	check_cache_entry *entry;
+	check_cache_entry *victim = NULL;
+	uint64		victim_last_used = 0;
+
+	hash_seq_init(&hash_seq, cache);
+
+	while ((entry = hash_seq_search(&hash_seq)) != NULL)
+	{
+		uint64		last_used;
+
+		if (memcmp(&entry->key, skip_hk, sizeof(check_cache_hashkey)) == 0)
+			continue;
+
+		last_used = pg_atomic_read_u64(&entry->last_used);
+
+		if (!victim || last_used < victim_last_used)
+		{
+			victim = entry;
+			victim_last_used = last_used;
+		}
+	}
+
+	return victim;
+}
+
+static void
+remove_entry(HTAB *cache, bool is_shared, check_cache_entry *entry)
+{
+	if (is_shared)
+	{
+		if (DsaPointerIsValid(entry->data_dp))
+			dsa_free(plpgsql_check_get_dsa(), entry->data_dp);
+	}
+	else if (entry->data)
+		pfree(entry->data);
+
+	hash_search(cache, (void *) &entry->key, HASH_REMOVE, NULL);
+}
+
+/*
+ * Store entry to shared memory. When there is not free space, then
+ * least recently used entries are removed.
+ */
+static void
+store_shared_entry(check_cache_hashkey *hk, char *data, Size size)
+{
+	dsa_area   *dsa = plpgsql_check_get_dsa();
+	check_cache_entry *entry;
+	bool		found;
+
+	LWLockAcquire(check_cache_ss->lock, LW_EXCLUSIVE);
+
+	for (;;)
+	{
+		entry = (check_cache_entry *) hash_search(shared_cache_HashTable,
+												  (void *) hk,
+												  HASH_ENTER_NULL,
+												  &found);
+		if (entry)
+			break;
+
+		entry = get_lru_entry(shared_cache_HashTable, hk);
+		if (!entry)
+		{
+			LWLockRelease(check_cache_ss->lock);
+			return;
+		}
+
+		remove_entry(shared_cache_HashTable, true, entry);
+	}
+
+	if (found && DsaPointerIsValid(entry->data_dp))
+		dsa_free(dsa, entry->data_dp);
+
+	entry->data = NULL;
+	entry->size = size;
+	pg_atomic_init_u64(&entry->last_used, (uint64) GetCurrentStatementStartTimestamp());
+
+	for (;;)
+	{
+		check_cache_entry *victim;
+
+		entry->data_dp = dsa_allocate_extended(dsa, size, DSA_ALLOC_NO_OOM);
+		if (DsaPointerIsValid(entry->data_dp))
+			break;
+
+		victim = get_lru_entry(shared_cache_HashTable, hk);
+		if (!victim)
+		{
+			/* there is not space for this entry */
+			hash_search(shared_cache_HashTable, (void *) hk, HASH_REMOVE, NULL);
+			LWLockRelease(check_cache_ss->lock);
+			return;
+		}
+
+		remove_entry(shared_cache_HashTable, true, victim);
+	}
+
+	memcpy(dsa_get_address(dsa, entry->data_dp), data, size);
+
+	LWLockRelease(check_cache_ss->lock);
+}
+
+static void
+store_local_entry(check_cache_hashkey *hk, char *data, Size size)
+{
+	check_cache_entry *entry;
+	bool		found;
+
+	if (!cache_HashTable)
+		cache_HashTableInit();
+
+	if (hash_get_num_entries(cache_HashTable) >= plpgsql_check_cache_max_entries)
+	{
+		entry = get_lru_entry(cache_HashTable, hk);
+		if (entry)
+			remove_entry(cache_HashTable, false, entry);
+	}
+
+	entry = (check_cache_entry *) hash_search(cache_HashTable,
+											  (void *) hk,
+											  HASH_ENTER,
+											  &found);
+
+	if (found && entry->data)
+		pfree(entry->data);
+
+	entry->data = MemoryContextAlloc(cache_mcxt, size);
+	memcpy(entry->data, data, size);
+
+	entry->data_dp = InvalidDsaPointer;
+	entry->size = size;
+	pg_atomic_init_u64(&entry->last_used, (uint64) GetCurrentStatementStartTimestamp());
+}
+
+/*
+ * Store the result of check to cache. The result with errors is not
+ * stored, because the error can be raised by missing object, and then
+ * the fingerprint cannot to detect creating of this object.
+ */
+void
+plpgsql_check_cache_store(plpgsql_check_result_info *ri,
+						  plpgsql_check_info *cinfo)
+{
+	Assert(ri->cache_rows && ri->cache_deps);
+
+	/* fingerprint is not calculated when check was broken by exception */
+	if (!ri->cache_found_error && ri->cache_has_fingerprint)
+	{
+		check_cache_hashkey hk;
+		check_cache_data_header header;
+		StringInfoData buf;
+
+		init_hashkey(&hk, ri, cinfo);
+
+		header.fingerprint = ri->cache_fingerprint;
+		header.ndeps = ri->cache_deps->len / sizeof(check_cache_dep);
+		header.nrows = ri->cache_nrows;
+
+		initStringInfo(&buf);
+		appendBinaryStringInfo(&buf, (char *) &header, sizeof(check_cache_data_header));
+		appendBinaryStringInfo(&buf, ri->cache_deps->data, ri->cache_deps->len);
+		appendBinaryStringInfo(&buf, ri->cache_rows->data, ri->cache_rows->len);
+
+		if (shared_cache_HashTable)
+			store_shared_entry(&hk, buf.data, buf.len);
+		else
+			store_local_entry(&hk, buf.data, buf.len);
+
+		pfree(buf.data);
+	}
+
+	pfree(ri->cache_rows->data);
+	pfree(ri->cache_rows);
+	pfree(ri->cache_deps->data);
+	pfree(ri->cache_deps);
+
+	ri->cache_rows = NULL;
+	ri->cache_deps = NULL;
+}
+
+/*
+ * Remove all entries of check cache
+ */
+Datum
+plpgsql_check_cache_reset(PG_FUNCTION_ARGS)
+{
+	HASH_SEQ_STATUS hash_seq;
+	check_cache_entry *entry;
+
+	/*be compiler quite */
+	(void) fcinfo;
+
+	if (shared_cache_HashTable)
+	{
+		LWLockAcquire(check_cache_ss->lock, LW_EXCLUSIVE);
+
+		hash_seq_init(&hash_seq, shared_cache_HashTable);
+
+		while ((entry = hash_seq_search(&hash_seq)) != NULL)
+			remove_entry(shared_cache_HashTable, true, entry);
+
+		LWLockRelease(check_cache_ss->lock);
+	}
+
+	if (cache_HashTable)
+	{
+		hash_destroy(cache_HashTable);
+		MemoryContextDelete(cache_mcxt);
+
+		cache_HashTable = NULL;
+		cache_mcxt = NULL;
+	}
+
+	PG_RETURN_VOID();
+}
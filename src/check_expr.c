@@ -34,7 +34,6 @@
 #include "tcop/utility.h"
 #include "utils/lsyscache.h"
 
-static void collect_volatility(PLpgSQL_checkstate *cstate, Query *query);
 static Query * ExprGetQuery(PLpgSQL_checkstate *cstate, PLpgSQL_expr *expr, CachedPlanSource *plansource);
 
 static CachedPlan * get_cached_plan(PLpgSQL_checkstate *cstate, PLpgSQL_expr *expr, bool *has_result_desc);
@@ -301,50 +300,73 @@ prepare_plan(PLpgSQL_checkstate *cstate,
 		return;
 
 	/* there checks are common on every expr/query */
-	plpgsql_check_funcexpr(cstate, query, expr->query);
-	collect_volatility(cstate, query);
-	plpgsql_check_detect_dependency(cstate, query);
+	plpgsql_check_analyze_query(cstate, expr, query);
 }
 
 /*
- * Update function's volatility flag by query
+ * Returns volatility of query
  */
-static void
-collect_volatility(PLpgSQL_checkstate *cstate, Query *query)
+char
+plpgsql_check_query_volatility(PLpgSQL_checkstate *cstate, Query *query)
 {
-	if (cstate->skip_volatility_check ||
-			cstate->volatility == PROVOLATILE_VOLATILE ||
-			!cstate->cinfo->performance_warnings)
-		return;
-
 	if (query->commandType == CMD_SELECT)
 	{
 		if (!query->hasModifyingCTE && !query->hasForUpdate)
 		{
 			/* there is chance so query will be immutable */
 			if (plpgsql_check_contain_volatile_functions((Node *) query, cstate))
-				cstate->volatility = PROVOLATILE_VOLATILE;
-			else if (!plpgsql_check_contain_mutable_functions((Node *) query, cstate))
-			{
-				/*
-				 * when level is still immutable, check if there
-				 * are not reference to tables.
-				 */
-				if (cstate->volatility == PROVOLATILE_IMMUTABLE)
-				{
-					if (plpgsql_check_has_rtable(query))
-						cstate->volatility = PROVOLATILE_STABLE;
-				}
-			}
-			else
-				cstate->volatility = PROVOLATILE_STABLE;
+				return PROVOLATILE_VOLATILE;
+			else if (plpgsql_check_contain_mutable_functions((Node *) query, cstate))
+				return PROVOLATILE_STABLE;
+
+			/* immutable query cannot to reference tables */
+			if (plpgsql_check_has_rtable(query))
+				return PROVOLATILE_STABLE;
+
+			return PROVOLATILE_IMMUTABLE;
 		}
-		else
-			cstate->volatility = PROVOLATILE_VOLATILE;
+
+		return PROVOLATILE_VOLATILE;
 	}
-	else
-		/* not read only statements requare VOLATILE flag */
+
+	/* not read only statements requare VOLATILE flag */
+	return PROVOLATILE_VOLATILE;
+}
+
+static bool
+volatility_check_is_required(PLpgSQL_checkstate *cstate)
+{
+	return !(cstate->skip_volatility_check ||
+			 cstate->volatility == PROVOLATILE_VOLATILE ||
+			 !cstate->cinfo->performance_warnings);
+}
+
+/*
+ * Update function's volatility flag by volatility of query
+ */
+void
+plpgsql_check_update_volatility(PLpgSQL_checkstate *cstate, char volatility)
+{
+	if (!volatility_check_is_required(cstate))
+		return;
+
+	if (volatility == PROVOLATILE_VOLATILE)
 		cstate->volatility = PROVOLATILE_VOLATILE;
+	else if (volatility == PROVOLATILE_STABLE)
+		cstate->volatility = PROVOLATILE_STABLE;
+}
+
+/*
+ * Update function's volatility flag by query
+ */
+void
+plpgsql_check_collect_volatility(PLpgSQL_checkstate *cstate, Query *query)
+{
+	if (!volatility_check_is_required(cstate))
+		return;
+
+	plpgsql_check_update_volatility(cstate,
+									plpgsql_check_query_volatility(cstate, query));
 }
 
 /*
@@ -586,6 +608,9 @@ plan_checks(PLpgSQL_checkstate *cstate, CachedPlan *cplan, char *query_str)
 	/* detect bad casts in quals */
 	check_fishy_qual(cstate, cplan, query_str);
 
+	/* detect expensive nodes of plan */
+	plpgsql_check_plan_advisor_check(cstate, cplan, query_str);
+
 	/* disallow BEGIN TRANS, COMMIT, ROLLBACK, .. */
 	prohibit_transaction_stmt(cstate, cplan, query_str);
 }
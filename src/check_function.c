@@ -131,6 +131,20 @@ plpgsql_check_function_internal(plpgsql_check_result_info *ri,
 	PLpgSQL_execstate estate;
 	ReturnSetInfo rsinfo;
 	bool		fake_rtd;
+	bool		use_cache;
+
+	/*
+	 * When the function and all objects used by function are not changed,
+	 * then the result of previous check can be used.
+	 */
+	use_cache = plpgsql_check_cache_is_usable(ri, cinfo);
+	if (use_cache)
+	{
+		if (plpgsql_check_cache_lookup(ri, cinfo))
+			return;
+
+		plpgsql_check_cache_start(ri);
+	}
 
 	/*
 	 * Connect to SPI manager
@@ -228,6 +242,10 @@ plpgsql_check_function_internal(plpgsql_check_result_info *ri,
 					break;
 			}
 
+			/* used objects are locked still, so fingerprint is consistent */
+			if (ri->cache_rows)
+				plpgsql_check_cache_collect_deps(&cstate, function);
+
 			function->cur_estate = cur_estate;
 			function->use_count--;
 		}
@@ -284,6 +302,9 @@ plpgsql_check_function_internal(plpgsql_check_result_info *ri,
 	 */
 	if ((rc = SPI_finish()) != SPI_OK_FINISH)
 		elog(ERROR, "SPI_finish failed: %s", SPI_result_code_string(rc));
+
+	if (use_cache)
+		plpgsql_check_cache_store(ri, cinfo);
 }
 
 /*
@@ -1170,6 +1191,9 @@ setup_cstate(PLpgSQL_checkstate *cstate,
 
 	/* for simple string constants tracing */
 	cstate->strconstvars = NULL;
+
+	cstate->capture_errors = false;
+	cstate->captured_errors = NIL;
 }
 
 /*
@@ -24,11 +24,23 @@ int plpgsql_check_cursors_leaks_level = WARNING;
 
 #define MAX_NAMES_PER_STATEMENT			20
 
+/*
+ * Traces of opened cursors are stored in array of slots. The used slots
+ * are linked to list of slots of statement (by stmtid) and to list of
+ * slots of recursion level, so both statement's end and function's end
+ * process only related slots. Released slots are linked to list of free
+ * slots.
+ */
 typedef struct
 {
 	int			stmtid;
 	int			rec_level;
 	char	   *curname;
+
+	int			prev_stmt_slot;
+	int			next_stmt_slot;		/* or next free slot */
+	int			prev_level_slot;
+	int			next_level_slot;
 } CursorTrace;
 
 typedef struct
@@ -41,15 +53,27 @@ typedef struct
 {
 	FunctionTraceKey key;
 
+	int			nstatements;
+	int		   *stmt_slots;			/* first slot of statement */
+	int			nlevels;
+	int		   *level_slots;		/* first slot of recursion level */
+
+	int			free_slot;
 	int			ncursors;
 	int			cursors_size;
 	CursorTrace *cursors_traces;
 } FunctionTrace;
 
+/*
+ * The plugin's info is allocated only once for FmgrInfo, and it is reused
+ * by all calls of function by this FmgrInfo. The trace is searched only
+ * when the transaction or the version of function is changed.
+ */
 typedef struct
 {
 	FunctionTrace *ftrace;
 	LocalTransactionId lxid;
+	TransactionId fn_xmin;
 } CursorLeaksPlugin2Info;
 
 MemoryContextCallback contextCallback;
@@ -113,8 +137,21 @@ get_function_trace(PLpgSQL_function *func)
 
 	if (!found)
 	{
+		int			i;
+
 		ftrace->key.fn_oid = func->fn_oid;
 		ftrace->key.fn_xmin = func->fn_xmin;
+
+		ftrace->nstatements = func->nstatements;
+		ftrace->stmt_slots = MemoryContextAlloc(traces_mcxt,
+												func->nstatements * sizeof(int));
+		for (i = 0; i < func->nstatements; i++)
+			ftrace->stmt_slots[i] = -1;
+
+		ftrace->nlevels = 0;
+		ftrace->level_slots = NULL;
+
+		ftrace->free_slot = -1;
 		ftrace->ncursors = 0;
 		ftrace->cursors_size = 0;
 		ftrace->cursors_traces = NULL;
@@ -123,6 +160,136 @@ get_function_trace(PLpgSQL_function *func)
 	return ftrace;
 }
 
+/*
+ * The key of trace is not unique for function's version. The function can
+ * be replaced in same transaction (with same xmin), and all anonymous
+ * blocks use same key, so the array of statement's slots can be too small
+ * for current function.
+ */
+static void
+trace_ensure_statements(FunctionTrace *ftrace, int nstatements)
+{
+	int			i;
+
+	if (nstatements <= ftrace->nstatements)
+		return;
+
+	ftrace->stmt_slots = repalloc_array(ftrace->stmt_slots, int, nstatements);
+
+	for (i = ftrace->nstatements; i < nstatements; i++)
+		ftrace->stmt_slots[i] = -1;
+
+	ftrace->nstatements = nstatements;
+}
+
+/*
+ * Returns free slot linked to lists of statement and recursion level
+ */
+static CursorTrace *
+trace_add(FunctionTrace *ftrace, int stmtid, int rec_level, char *curname)
+{
+	CursorTrace *ct;
+	int			slot;
+
+	Assert(stmtid > 0 && stmtid <= ftrace->nstatements);
+	Assert(rec_level > 0);
+
+	if (ftrace->free_slot != -1)
+	{
+		slot = ftrace->free_slot;
+		ftrace->free_slot = ftrace->cursors_traces[slot].next_stmt_slot;
+	}
+	else
+	{
+		if (ftrace->ncursors == ftrace->cursors_size)
+		{
+			if (ftrace->cursors_size > 0)
+			{
+				ftrace->cursors_size += 10;
+				ftrace->cursors_traces = repalloc_array(ftrace->cursors_traces,
+														CursorTrace,
+														ftrace->cursors_size);
+			}
+			else
+			{
+				ftrace->cursors_size = 10;
+				ftrace->cursors_traces = MemoryContextAlloc(traces_mcxt,
+															ftrace->cursors_size * sizeof(CursorTrace));
+			}
+		}
+
+		slot = ftrace->ncursors++;
+	}
+
+	if (rec_level > ftrace->nlevels)
+	{
+		int			nlevels = Max(rec_level, ftrace->nlevels + 10);
+		int			i;
+
+		if (ftrace->level_slots)
+			ftrace->level_slots = repalloc_array(ftrace->level_slots, int, nlevels);
+		else
+			ftrace->level_slots = MemoryContextAlloc(traces_mcxt, nlevels * sizeof(int));
+
+		for (i = ftrace->nlevels; i < nlevels; i++)
+			ftrace->level_slots[i] = -1;
+
+		ftrace->nlevels = nlevels;
+	}
+
+	ct = &ftrace->cursors_traces[slot];
+
+	ct->stmtid = stmtid;
+	ct->rec_level = rec_level;
+	ct->curname = MemoryContextStrdup(traces_mcxt, curname);
+
+	ct->prev_stmt_slot = -1;
+	ct->next_stmt_slot = ftrace->stmt_slots[stmtid - 1];
+	if (ct->next_stmt_slot != -1)
+		ftrace->cursors_traces[ct->next_stmt_slot].prev_stmt_slot = slot;
+	ftrace->stmt_slots[stmtid - 1] = slot;
+
+	ct->prev_level_slot = -1;
+	ct->next_level_slot = ftrace->level_slots[rec_level - 1];
+	if (ct->next_level_slot != -1)
+		ftrace->cursors_traces[ct->next_level_slot].prev_level_slot = slot;
+	ftrace->level_slots[rec_level - 1] = slot;
+
+	return ct;
+}
+
+/*
+ * Unlink slot from lists of statement and recursion level, and
+ * push it to list of free slots.
+ */
+static void
+trace_remove(FunctionTrace *ftrace, int slot)
+{
+	CursorTrace *ct = &ftrace->cursors_traces[slot];
+
+	if (ct->prev_stmt_slot != -1)
+		ftrace->cursors_traces[ct->prev_stmt_slot].next_stmt_slot = ct->next_stmt_slot;
+	else
+		ftrace->stmt_slots[ct->stmtid - 1] = ct->next_stmt_slot;
+
+	if (ct->next_stmt_slot != -1)
+		ftrace->cursors_traces[ct->next_stmt_slot].prev_stmt_slot = ct->prev_stmt_slot;
+
+	if (ct->prev_level_slot != -1)
+		ftrace->cursors_traces[ct->prev_level_slot].next_level_slot = ct->next_level_slot;
+	else
+		ftrace->level_slots[ct->rec_level - 1] = ct->next_level_slot;
+
+	if (ct->next_level_slot != -1)
+		ftrace->cursors_traces[ct->next_level_slot].prev_level_slot = ct->prev_level_slot;
+
+	pfree(ct->curname);
+	ct->curname = NULL;
+	ct->stmtid = -1;
+
+	ct->next_stmt_slot = ftrace->free_slot;
+	ftrace->free_slot = slot;
+}
 
 static void
 func_setup(PLpgSQL_execstate *estate, PLpgSQL_function *func, void **plugin2_info)
@@ -130,13 +297,35 @@ func_setup(PLpgSQL_execstate *estate, PLpgSQL_function *func, void **plugin2_inf
 	if (plpgsql_check_cursors_leaks)
 	{
 		CursorLeaksPlugin2Info *pinfo;
-		MemoryContext fn_mcxt;
+		void	  **pinfo_ptr;
 
-		fn_mcxt = plpgsql_check_get_current_fn_mcxt();
-		pinfo = MemoryContextAlloc(fn_mcxt, sizeof(CursorLeaksPlugin2Info));
+		pinfo_ptr = plpgsql_check_get_current_fn_plugin2_data(&cursors_leaks_plugin2);
+		pinfo = *pinfo_ptr;
 
-		pinfo->ftrace = get_function_trace(func);
-		pinfo->lxid = CURRENT_LXID;
+		if (!pinfo)
+		{
+			pinfo = MemoryContextAlloc(plpgsql_check_get_current_fn_mcxt(),
+									   sizeof(CursorLeaksPlugin2Info));
+
+			pinfo->ftrace = NULL;
+			pinfo->lxid = InvalidLocalTransactionId;
+			pinfo->fn_xmin = InvalidTransactionId;
+
+			*pinfo_ptr = pinfo;
+		}
+
+		/* traces are released at the end of transaction */
+		if (!pinfo->ftrace ||
+			pinfo->lxid != CURRENT_LXID ||
+			traces_lxid != CURRENT_LXID ||
+			pinfo->fn_xmin != func->fn_xmin)
+		{
+			pinfo->ftrace = get_function_trace(func);
+			pinfo->lxid = CURRENT_LXID;
+			pinfo->fn_xmin = func->fn_xmin;
+		}
+
+		trace_ensure_statements(pinfo->ftrace, func->nstatements);
 
 		*plugin2_info = pinfo;
 	}
@@ -151,49 +340,49 @@ func_end(PLpgSQL_execstate *estate,
 {
 	CursorLeaksPlugin2Info *pinfo = *plugin2_info;
 	FunctionTrace *ftrace;
-	int			i;
+	int			slot;
 
 	if (!pinfo || pinfo->lxid != CURRENT_LXID)
 		return;
 
+	/*
+	 * In not strict mode, the slots of closed cursors are released
+	 * lazily by next open of the cursor (or together with all traces at
+	 * the end of transaction), so there is not necessary to check all
+	 * traced cursors at the end of any call of function.
+	 */
+	if (!plpgsql_check_cursors_leaks_strict)
+		return;
+
 	ftrace = pinfo->ftrace;
 
-	for (i = 0; i < ftrace->ncursors; i++)
+	if (func->use_count > ftrace->nlevels)
+		return;
+
+	/* iterate over cursors opened on current recursion level */
+	slot = ftrace->level_slots[func->use_count - 1];
+	while (slot != -1)
 	{
-		CursorTrace *ct = &ftrace->cursors_traces[i];
+		CursorTrace *ct = &ftrace->cursors_traces[slot];
+		int			next_slot = ct->next_level_slot;
 
-		/*
-		 * Iterate over traced cursors. Remove slots for tracing
-		 * immediately, when traced cursor is closed already.
-		 */
-		if (ct->curname && ct->rec_level == func->use_count)
+		if (SPI_cursor_find(ct->curname))
 		{
-			if (SPI_cursor_find(ct->curname))
-			{
-				if (plpgsql_check_cursors_leaks_strict)
-				{
-					char	*context;
+			char	*context;
 
-					context = GetErrorContextStack();
+			context = GetErrorContextStack();
 
-					ereport(plpgsql_check_cursors_leaks_level,
-							errcode(ERRCODE_INVALID_CURSOR_STATE),
-							errmsg("cursor is not closed"),
-							errdetail("%s", context));
-					pfree(context);
-
-					pfree(ct->curname);
-					ct->stmtid = -1;
-					ct->curname = NULL;
-				}
-			}
-			else
-			{
-				pfree(ct->curname);
-				ct->stmtid = -1;
-				ct->curname = NULL;
-			}
+			ereport(plpgsql_check_cursors_leaks_level,
+					errcode(ERRCODE_INVALID_CURSOR_STATE),
+					errmsg("cursor is not closed"),
+					errdetail("%s", context));
+			pfree(context);
 		}
+
+		/* remove traces of closed cursors immediately */
+		trace_remove(ftrace, slot);
+
+		slot = next_slot;
 	}
 }
 
@@ -211,15 +400,15 @@ stmt_end(PLpgSQL_execstate *estate, PLpgSQL_stmt *stmt, void **plugin2_info)
 	{
 		pinfo->ftrace = get_function_trace(estate->func);
 		pinfo->lxid = CURRENT_LXID;
+		pinfo->fn_xmin = estate->func->fn_xmin;
 	}
 
 	ftrace = pinfo->ftrace;
 
 	if (stmt->cmd_type == PLPGSQL_STMT_OPEN)
 	{
-		int			i;
+		int			slot;
 		int			cursors_for_current_stmt = 0;
-		int			free_slot = -1;
 		PLpgSQL_var *curvar;
 		char	   *curname;
 
@@ -228,97 +417,55 @@ stmt_end(PLpgSQL_execstate *estate, PLpgSQL_stmt *stmt, void **plugin2_info)
 		Assert(!curvar->isnull);
 		curname = TextDatumGetCString(curvar->value);
 
-		for (i = 0; i < ftrace->ncursors; i++)
+		/* iterate over cursors opened by this statement */
+		slot = ftrace->stmt_slots[stmt->stmtid - 1];
+		while (slot != -1)
 		{
-			CursorTrace *ct = &ftrace->cursors_traces[i];
+			CursorTrace *ct = &ftrace->cursors_traces[slot];
+			int			next_slot = ct->next_stmt_slot;
+
+			/*
+			 * PLpgSQL open statements reuses portal name and does check
+			 * already used portal with already used portal name. So when
+			 * the traced name and name in cursor variable is same, we should
+			 * not to do this check. This eliminate false alarms.
+			 */
+			if (strcmp(curname, ct->curname) == 0)
+			{
+				pfree(curname);
+				return;
+			}
 
-			if (ct->curname && ct->stmtid == stmt->stmtid)
+			if (SPI_cursor_find(ct->curname))
 			{
-				/*
-				 * PLpgSQL open statements reuses portal name and does check
-				 * already used portal with already used portal name. So when
-				 * the traced name and name in cursor variable is same, we should
-				 * not to do this check. This eliminate false alarms.
-				 */
-				if (strcmp(curname, ct->curname) == 0)
+				if (estate->func->use_count == 1 && !plpgsql_check_cursors_leaks_strict)
 				{
-					pfree(curname);
-					return;
-				}
+					char	*context;
 
-				if (SPI_cursor_find(ct->curname))
-				{
-					if (estate->func->use_count == 1 && !plpgsql_check_cursors_leaks_strict)
-					{
-						char	*context;
-
-						context = GetErrorContextStack();
-
-						ereport(plpgsql_check_cursors_leaks_level,
-								errcode(ERRCODE_INVALID_CURSOR_STATE),
-								errmsg("cursor \"%s\" is not closed", curvar->refname),
-								errdetail("%s", context));
-
-						pfree(context);
-
-						pfree(ct->curname);
-						ct->stmtid = -1;
-						ct->curname = NULL;
-					}
-					else
-					{
-						cursors_for_current_stmt += 1;
-					}
+					context = GetErrorContextStack();
+
+					ereport(plpgsql_check_cursors_leaks_level,
+							errcode(ERRCODE_INVALID_CURSOR_STATE),
+							errmsg("cursor \"%s\" is not closed", curvar->refname),
+							errdetail("%s", context));
+
+					pfree(context);
+
+					trace_remove(ftrace, slot);
 				}
 				else
 				{
-					pfree(ct->curname);
-					ct->stmtid = -1;
-					ct->curname = NULL;
+					cursors_for_current_stmt += 1;
 				}
 			}
+			else
+				trace_remove(ftrace, slot);
 
-			if (ct->stmtid == -1 && free_slot == -1)
-				free_slot = i;
+			slot = next_slot;
 		}
 
 		if (cursors_for_current_stmt < MAX_NAMES_PER_STATEMENT)
-		{
-			MemoryContext oldcxt;
-			CursorTrace *ct = NULL;
-
-			oldcxt = MemoryContextSwitchTo(traces_mcxt);
-
-			if (free_slot != -1)
-				ct = &ftrace->cursors_traces[free_slot];
-			else
-			{
-				if (ftrace->ncursors == ftrace->cursors_size)
-				{
-					if (ftrace->cursors_size > 0)
-					{
-						ftrace->cursors_size += 10;
-						ftrace->cursors_traces = repalloc_array(ftrace->cursors_traces,
-																CursorTrace,
-																ftrace->cursors_size);
-					}
-					else
-					{
-						ftrace->cursors_size = 10;
-						ftrace->cursors_traces = palloc_array(CursorTrace,
-														  ftrace->cursors_size);
-					}
-				}
-
-				ct = &ftrace->cursors_traces[ftrace->ncursors++];
-			}
-
-			ct->stmtid = stmt->stmtid;
-			ct->rec_level = estate->func->use_count;
-			ct->curname = pstrdup(curname);
-
-			MemoryContextSwitchTo(oldcxt);
-		}
+			trace_add(ftrace, stmt->stmtid, estate->func->use_count, curname);
 
 		pfree(curname);
 	}
@@ -38,12 +38,15 @@ static int check_fmt_string(const char *fmt,
 
 /*
  * Send to ouput all not yet displayed relations, operators and functions.
+ * When the result of check should be cached, then used objects are
+ * collected for fingerprint of function's dependencies.
  */
 static bool
 detect_dependency_walker(Node *node, void *context)
 {
 	PLpgSQL_checkstate *cstate = (PLpgSQL_checkstate *) context;
 	plpgsql_check_result_info *ri = cstate->result_info;
+	bool		show_dependency = ri->format == PLPGSQL_SHOW_DEPENDENCY_FORMAT_TABULAR;
 
 	if (node == NULL)
 		return false;
@@ -59,7 +62,10 @@ detect_dependency_walker(Node *node, void *context)
 
 			if (rt->rtekind == RTE_RELATION)
 			{
-				if (!bms_is_member(rt->relid, cstate->rel_oids))
+				if (ri->cache_deps)
+					plpgsql_check_cache_add_dep(ri, PLPGSQL_CHECK_CACHE_DEP_RELATION, rt->relid);
+
+				if (show_dependency && !bms_is_member(rt->relid, cstate->rel_oids))
 				{
 					plpgsql_check_put_dependency(ri,
 												 "RELATION",
@@ -91,7 +97,10 @@ detect_dependency_walker(Node *node, void *context)
 
 		if (get_func_namespace(fexpr->funcid) != PG_CATALOG_NAMESPACE)
 		{
-			if (!bms_is_member(fexpr->funcid, cstate->func_oids))
+			if (ri->cache_deps)
+				plpgsql_check_cache_add_dep(ri, PLPGSQL_CHECK_CACHE_DEP_FUNCTION, fexpr->funcid);
+
+			if (show_dependency && !bms_is_member(fexpr->funcid, cstate->func_oids))
 			{
 				StringInfoData	str;
 				ListCell   *lc;
@@ -131,7 +140,12 @@ detect_dependency_walker(Node *node, void *context)
 	{
 		OpExpr *opexpr = (OpExpr *) node;
 
-		if (plpgsql_check_get_op_namespace(opexpr->opno) != PG_CATALOG_NAMESPACE)
+		if (ri->cache_deps &&
+			plpgsql_check_get_op_namespace(opexpr->opno) != PG_CATALOG_NAMESPACE)
+			plpgsql_check_cache_add_dep(ri, PLPGSQL_CHECK_CACHE_DEP_OPERATOR, opexpr->opno);
+
+		if (show_dependency &&
+			plpgsql_check_get_op_namespace(opexpr->opno) != PG_CATALOG_NAMESPACE)
 		{
 				StringInfoData		str;
 				Oid					lefttype;
@@ -168,7 +182,8 @@ detect_dependency_walker(Node *node, void *context)
 void
 plpgsql_check_detect_dependency(PLpgSQL_checkstate *cstate, Query *query)
 {
-	if (cstate->result_info->format != PLPGSQL_SHOW_DEPENDENCY_FORMAT_TABULAR)
+	if (cstate->result_info->format != PLPGSQL_SHOW_DEPENDENCY_FORMAT_TABULAR &&
+		!cstate->result_info->cache_deps)
 		return;
 
 	detect_dependency_walker((Node *) query, cstate);
@@ -19,6 +19,7 @@
 #include "utils/builtins.h"
 #include "utils/formatting.h"
 #include "utils/json.h"
+#include "utils/timestamp.h"
 #include "utils/xml.h"
 
 static void put_text_line(plpgsql_check_result_info *ri, const char *message, int len);
@@ -90,7 +91,7 @@ static void put_error_tabular(plpgsql_check_result_info *ri, PLpgSQL_execstate *
  * columns of plpgsql_profiler_function_statements_tb result
  *
  */
-#define Natts_profiler_statements					13
+#define Natts_profiler_statements					15
 
 #define Anum_profiler_statements_stmtid				0
 #define Anum_profiler_statements_parent_stmtid		1
@@ -103,14 +104,16 @@ static void put_error_tabular(plpgsql_check_result_info *ri, PLpgSQL_execstate *
 #define Anum_profiler_statements_total_time			8
 #define Anum_profiler_statements_avg_time			9
 #define Anum_profiler_statements_max_time			10
-#define Anum_profiler_statements_processed_rows		11
-#define Anum_profiler_statements_stmtname			12
+#define Anum_profiler_statements_p95_time			11
+#define Anum_profiler_statements_p99_time			12
+#define Anum_profiler_statements_processed_rows		13
+#define Anum_profiler_statements_stmtname			14
 
 /*
  * columns of plpgsql_profiler_functions_all_tb result
  *
  */
-#define Natts_profiler_functions_all_tb		8
+#define Natts_profiler_functions_all_tb		10
 
 #define Anum_profiler_functions_all_funcoid			0
 #define Anum_profiler_functions_all_exec_count		1
@@ -120,6 +123,83 @@ static void put_error_tabular(plpgsql_check_result_info *ri, PLpgSQL_execstate *
 #define Anum_profiler_functions_all_stddev_time		5
 #define Anum_profiler_functions_all_min_time		6
 #define Anum_profiler_functions_all_max_time		7
+#define Anum_profiler_functions_all_p95_time		8
+#define Anum_profiler_functions_all_p99_time		9
+
+/*
+ * columns of plpgsql_check_tracer_messages result
+ *
+ */
+#define Natts_tracer_messages		4
+
+#define Anum_tracer_messages_pid			0
+#define Anum_tracer_messages_seqno			1
+#define Anum_tracer_messages_time			2
+#define Anum_tracer_messages_message		3
+
+/*
+ * columns of plpgsql_profiler_call_stacks result
+ *
+ */
+#define Natts_profiler_call_stacks			4
+
+#define Anum_profiler_call_stacks_stack			0
+#define Anum_profiler_call_stacks_exec_count	1
+#define Anum_profiler_call_stacks_total_time	2
+#define Anum_profiler_call_stacks_self_time		3
+
+/*
+ * columns of plpgsql_profiler_critical_path result
+ *
+ */
+#define Natts_profiler_critical_path			7
+
+#define Anum_profiler_critical_path_level		0
+#define Anum_profiler_critical_path_stmtid		1
+#define Anum_profiler_critical_path_lineno		2
+#define Anum_profiler_critical_path_stmtname	3
+#define Anum_profiler_critical_path_exec_stmts	4
+#define Anum_profiler_critical_path_total_time	5
+#define Anum_profiler_critical_path_self_time	6
+
+/*
+ * columns of plpgsql_profiler_snapshot result
+ *
+ */
+#define Natts_profiler_snapshot					7
+
+#define Anum_profiler_snapshot_funcoid			0
+#define Anum_profiler_snapshot_stmtid			1
+#define Anum_profiler_snapshot_lineno			2
+#define Anum_profiler_snapshot_exec_count		3
+#define Anum_profiler_snapshot_exec_count_err	4
+#define Anum_profiler_snapshot_total_time		5
+#define Anum_profiler_snapshot_processed_rows	6
+
+/*
+ * columns of plpgsql_profiler_dynamic_queries result
+ *
+ */
+#define Natts_profiler_dynamic_queries				8
+
+#define Anum_profiler_dynamic_queries_funcoid			0
+#define Anum_profiler_dynamic_queries_stmtid			1
+#define Anum_profiler_dynamic_queries_lineno			2
+#define Anum_profiler_dynamic_queries_queryid			3
+#define Anum_profiler_dynamic_queries_exec_count		4
+#define Anum_profiler_dynamic_queries_total_time		5
+#define Anum_profiler_dynamic_queries_max_time			6
+#define Anum_profiler_dynamic_queries_processed_rows	7
+
+/*
+ * columns of plpgsql_check_internal_stats result
+ *
+ */
+#define Natts_internal_stats					3
+
+#define Anum_internal_stats_name				0
+#define Anum_internal_stats_count				1
+#define Anum_internal_stats_total_time			2
 
 
 #define SET_RESULT_NULL(anum) \
@@ -199,6 +279,8 @@ plpgsql_check_init_ri(plpgsql_check_result_info *ri,
 
 	ri->format = format;
 	ri->sinfo = NULL;
+	ri->cache_rows = NULL;
+	ri->cache_deps = NULL;
 
 	switch (format)
 	{
@@ -222,6 +304,27 @@ plpgsql_check_init_ri(plpgsql_check_result_info *ri,
 		case PLPGSQL_SHOW_PROFILE_FUNCTIONS_ALL_TABULAR:
 			natts = Natts_profiler_functions_all_tb;
 			break;
+		case PLPGSQL_SHOW_TRACER_MESSAGES_TABULAR:
+			natts = Natts_tracer_messages;
+			break;
+		case PLPGSQL_SHOW_PROFILE_CALL_STACKS_TABULAR:
+			natts = Natts_profiler_call_stacks;
+			break;
+		case PLPGSQL_SHOW_PROFILE_COLLAPSED_STACKS:
+			natts = 1;
+			break;
+		case PLPGSQL_SHOW_PROFILE_CRITICAL_PATH_TABULAR:
+			natts = Natts_profiler_critical_path;
+			break;
+		case PLPGSQL_SHOW_PROFILE_SNAPSHOT_TABULAR:
+			natts = Natts_profiler_snapshot;
+			break;
+		case PLPGSQL_SHOW_PROFILE_DYNAMIC_QUERIES_TABULAR:
+			natts = Natts_profiler_dynamic_queries;
+			break;
+		case PLPGSQL_SHOW_INTERNAL_STATS_TABULAR:
+			natts = Natts_internal_stats;
+			break;
 		default:
 			elog(ERROR, "unknown format %d", format);
 	}
@@ -342,6 +445,10 @@ plpgsql_check_put_error_internal(PLpgSQL_checkstate *cstate,
 			break;
 		}
 
+		/* errors can be related to missing objects, so don't cache them */
+		if (level == PLPGSQL_CHECK_ERROR)
+			ri->cache_found_error = true;
+
 		/* stop checking if it is necessary */
 		if (level == PLPGSQL_CHECK_ERROR && cstate->cinfo->fatal_errors)
 			cstate->stop_check = true;
@@ -403,6 +510,23 @@ plpgsql_check_put_error(PLpgSQL_checkstate *cstate,
 					  const char *query,
 					  const char *context)
 {
+	if (cstate->capture_errors)
+	{
+		plpgsql_check_captured_error *err;
+
+		err = palloc(sizeof(plpgsql_check_captured_error));
+		err->sqlerrcode = sqlerrcode;
+		err->lineno = lineno;
+		err->message = message ? pstrdup(message) : NULL;
+		err->detail = detail ? pstrdup(detail) : NULL;
+		err->hint = hint ? pstrdup(hint) : NULL;
+		err->level = level;
+		err->position = position;
+
+		cstate->captured_errors = lappend(cstate->captured_errors, err);
+		return;
+	}
+
 	/*
 	 * Trapped internal errors has transformed position. The plpgsql_check
 	 * errors (and warnings) have to have same transformation for position
@@ -441,6 +565,9 @@ put_text_line(plpgsql_check_result_info *ri, const char *message, int len)
 
 	tuple = heap_form_tuple(ri->tupdesc, &value, &isnull);
 	tuplestore_puttuple(ri->tuple_store, tuple);
+
+	if (ri->cache_rows)
+		plpgsql_check_cache_put_row(ri, &value, &isnull);
 }
 
 static const char *
@@ -880,6 +1007,9 @@ put_error_tabular(plpgsql_check_result_info *ri,
 	SET_RESULT_TEXT(Anum_result_context, context);
 
 	tuplestore_putvalues(ri->tuple_store, ri->tupdesc, values, nulls);
+
+	if (ri->cache_rows)
+		plpgsql_check_cache_put_row(ri, values, nulls);
 }
 
 /*
@@ -980,6 +1110,8 @@ plpgsql_check_put_profile_statement(plpgsql_check_result_info *ri,
 									int64 exec_stmts_err,
 									double total_time,
 									double max_time,
+									double p95_time,
+									double p99_time,
 									int64 processed_rows,
 									char *stmtname)
 {
@@ -1022,9 +1154,17 @@ plpgsql_check_put_profile_statement(plpgsql_check_result_info *ri,
 		SET_RESULT_INT32(Anum_profiler_statements_parent_stmtid, parent_stmtid);
 
 	if (exec_stmts > 0)
+	{
 		SET_RESULT_FLOAT8(Anum_profiler_statements_avg_time, ceil(((float8) total_time) / exec_stmts) / 1000.0);
+		SET_RESULT_FLOAT8(Anum_profiler_statements_p95_time, p95_time / 1000.0);
+		SET_RESULT_FLOAT8(Anum_profiler_statements_p99_time, p99_time / 1000.0);
+	}
 	else
+	{
 		SET_RESULT_NULL(Anum_profiler_statements_avg_time);
+		SET_RESULT_NULL(Anum_profiler_statements_p95_time);
+		SET_RESULT_NULL(Anum_profiler_statements_p99_time);
+	}
 
 	tuplestore_putvalues(ri->tuple_store, ri->tupdesc, values, nulls);
 }
@@ -1038,7 +1178,9 @@ plpgsql_check_put_profiler_functions_all_tb(plpgsql_check_result_info *ri,
 											double avg_time,
 											double stddev_time,
 											double min_time,
-											double max_time)
+											double max_time,
+											double p95_time,
+											double p99_time)
 {
 	Datum	values[Natts_profiler_functions_all_tb];
 	bool	nulls[Natts_profiler_functions_all_tb];
@@ -1054,6 +1196,206 @@ plpgsql_check_put_profiler_functions_all_tb(plpgsql_check_result_info *ri,
 	SET_RESULT_FLOAT8(Anum_profiler_functions_all_stddev_time, stddev_time / 1000.0);
 	SET_RESULT_FLOAT8(Anum_profiler_functions_all_min_time, min_time / 1000.0);
 	SET_RESULT_FLOAT8(Anum_profiler_functions_all_max_time, max_time / 1000.0);
+	SET_RESULT_FLOAT8(Anum_profiler_functions_all_p95_time, p95_time / 1000.0);
+	SET_RESULT_FLOAT8(Anum_profiler_functions_all_p99_time, p99_time / 1000.0);
+
+	tuplestore_putvalues(ri->tuple_store, ri->tupdesc, values, nulls);
+}
+
+/*
+ * Store one message of tracer's buffer to result tuplestore
+ *
+ */
+void
+plpgsql_check_put_tracer_message(plpgsql_check_result_info *ri,
+								 int pid,
+								 int64 seqno,
+								 TimestampTz time,
+								 const char *message)
+{
+	Datum	values[Natts_tracer_messages];
+	bool	nulls[Natts_tracer_messages];
+
+	Assert(ri->tuple_store);
+	Assert(ri->tupdesc);
+
+	SET_RESULT_INT32(Anum_tracer_messages_pid, pid);
+	SET_RESULT_INT64(Anum_tracer_messages_seqno, seqno);
+	SET_RESULT(Anum_tracer_messages_time, TimestampTzGetDatum(time));
+	SET_RESULT_TEXT(Anum_tracer_messages_message, message);
+
+	tuplestore_putvalues(ri->tuple_store, ri->tupdesc, values, nulls);
+}
+
+/*
+ * Store one statement of critical path to result tuplestore
+ *
+ */
+void
+plpgsql_check_put_profiler_critical_path(plpgsql_check_result_info *ri,
+										 int level,
+										 int stmtid,
+										 int lineno,
+										 const char *stmtname,
+										 int64 exec_stmts,
+										 double total_time,
+										 double self_time)
+{
+	Datum	values[Natts_profiler_critical_path];
+	bool	nulls[Natts_profiler_critical_path];
+
+	Assert(ri->tuple_store);
+	Assert(ri->tupdesc);
+
+	SET_RESULT_INT32(Anum_profiler_critical_path_level, level);
+	SET_RESULT_INT32(Anum_profiler_critical_path_stmtid, stmtid);
+	SET_RESULT_INT32(Anum_profiler_critical_path_lineno, lineno);
+	SET_RESULT_TEXT(Anum_profiler_critical_path_stmtname, stmtname);
+	SET_RESULT_INT64(Anum_profiler_critical_path_exec_stmts, exec_stmts);
+	SET_RESULT_FLOAT8(Anum_profiler_critical_path_total_time, total_time / 1000.0);
+	SET_RESULT_FLOAT8(Anum_profiler_critical_path_self_time, self_time / 1000.0);
+
+	tuplestore_putvalues(ri->tuple_store, ri->tupdesc, values, nulls);
+}
+
+/*
+ * Store one call stack of profiler to result tuplestore. The collapsed
+ * format (used by flamegraph tools) is the stack followed by self time
+ * in microseconds.
+ *
+ */
+void
+plpgsql_check_put_profiler_call_stack(plpgsql_check_result_info *ri,
+									  const char *stack,
+									  int64 exec_count,
+									  double total_time,
+									  double self_time)
+{
+	Datum	values[Natts_profiler_call_stacks];
+	bool	nulls[Natts_profiler_call_stacks];
+
+	Assert(ri->tuple_store);
+	Assert(ri->tupdesc);
+
+	if (ri->format == PLPGSQL_SHOW_PROFILE_COLLAPSED_STACKS)
+	{
+		char	   *line;
+
+		line = psprintf("%s " INT64_FORMAT, stack, (int64) self_time);
+		SET_RESULT_TEXT(0, line);
+		pfree(line);
+	}
+	else
+	{
+		SET_RESULT_TEXT(Anum_profiler_call_stacks_stack, stack);
+		SET_RESULT_INT64(Anum_profiler_call_stacks_exec_count, exec_count);
+		SET_RESULT_FLOAT8(Anum_profiler_call_stacks_total_time, total_time / 1000.0);
+		SET_RESULT_FLOAT8(Anum_profiler_call_stacks_self_time, self_time / 1000.0);
+	}
+
+	tuplestore_putvalues(ri->tuple_store, ri->tupdesc, values, nulls);
+}
+
+/*
+ * Store one row of profiler's snapshot to result tuplestore. The row
+ * of function has not stmtid, lineno and processed_rows.
+ *
+ */
+void
+plpgsql_check_put_profiler_snapshot(plpgsql_check_result_info *ri,
+									Oid funcoid,
+									int stmtid,
+									int lineno,
+									int64 exec_count,
+									int64 exec_count_err,
+									double total_time,
+									int64 processed_rows)
+{
+	Datum	values[Natts_profiler_snapshot];
+	bool	nulls[Natts_profiler_snapshot];
+
+	Assert(ri->tuple_store);
+	Assert(ri->tupdesc);
+
+	SET_RESULT_OID(Anum_profiler_snapshot_funcoid, funcoid);
+
+	if (stmtid > 0)
+	{
+		SET_RESULT_INT32(Anum_profiler_snapshot_stmtid, stmtid);
+		SET_RESULT_INT32(Anum_profiler_snapshot_lineno, lineno);
+		SET_RESULT_INT64(Anum_profiler_snapshot_processed_rows, processed_rows);
+	}
+	else
+	{
+		SET_RESULT_NULL(Anum_profiler_snapshot_stmtid);
+		SET_RESULT_NULL(Anum_profiler_snapshot_lineno);
+		SET_RESULT_NULL(Anum_profiler_snapshot_processed_rows);
+	}
+
+	SET_RESULT_INT64(Anum_profiler_snapshot_exec_count, exec_count);
+	SET_RESULT_INT64(Anum_profiler_snapshot_exec_count_err, exec_count_err);
+	SET_RESULT_FLOAT8(Anum_profiler_snapshot_total_time, total_time / 1000.0);
+
+	tuplestore_putvalues(ri->tuple_store, ri->tupdesc, values, nulls);
+}
+
+/*
+ * Store counters of one query of dynamic statement to result tuplestore
+ *
+ */
+void
+plpgsql_check_put_profiler_dynamic_query(plpgsql_check_result_info *ri,
+										 Oid funcoid,
+										 int stmtid,
+										 int lineno,
+										 pc_queryid queryid,
+										 int64 exec_count,
+										 double total_time,
+										 double max_time,
+										 int64 processed_rows)
+{
+	Datum	values[Natts_profiler_dynamic_queries];
+	bool	nulls[Natts_profiler_dynamic_queries];
+
+	Assert(ri->tuple_store);
+	Assert(ri->tupdesc);
+
+	SET_RESULT_OID(Anum_profiler_dynamic_queries_funcoid, funcoid);
+	SET_RESULT_INT32(Anum_profiler_dynamic_queries_stmtid, stmtid);
+	SET_RESULT_INT32(Anum_profiler_dynamic_queries_lineno, lineno);
+	SET_RESULT_QUERYID(Anum_profiler_dynamic_queries_queryid, queryid);
+	SET_RESULT_INT64(Anum_profiler_dynamic_queries_exec_count, exec_count);
+	SET_RESULT_FLOAT8(Anum_profiler_dynamic_queries_total_time, total_time / 1000.0);
+	SET_RESULT_FLOAT8(Anum_profiler_dynamic_queries_max_time, max_time / 1000.0);
+	SET_RESULT_INT64(Anum_profiler_dynamic_queries_processed_rows, processed_rows);
+
+	tuplestore_putvalues(ri->tuple_store, ri->tupdesc, values, nulls);
+}
+
+/*
+ * Store one counter of own overhead to result tuplestore
+ *
+ */
+void
+plpgsql_check_put_internal_stat(plpgsql_check_result_info *ri,
+								const char *name,
+								int64 count,
+								bool has_time,
+								double total_time)
+{
+	Datum	values[Natts_internal_stats];
+	bool	nulls[Natts_internal_stats];
+
+	Assert(ri->tuple_store);
+	Assert(ri->tupdesc);
+
+	SET_RESULT_TEXT(Anum_internal_stats_name, name);
+	SET_RESULT_INT64(Anum_internal_stats_count, count);
+
+	if (has_time)
+		SET_RESULT_FLOAT8(Anum_internal_stats_total_time, total_time / 1000.0);
+	else
+		SET_RESULT_NULL(Anum_internal_stats_total_time);
 
 	tuplestore_putvalues(ri->tuple_store, ri->tupdesc, values, nulls);
 }
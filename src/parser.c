@@ -1923,3 +1923,204 @@ next_char:
 	else if (cinfo->without_warnings)
 		plpgsql_check_set_without_warnings(cinfo);
 }
+
+/*
+ * Relation is referenced by %ROWTYPE (all names) or by %TYPE (names
+ * without column name). The names of schema and relation are searched
+ * without an access check, so an error is not raised here.
+ */
+static List *
+add_type_relation(List *result, List *names, bool is_rowtype)
+{
+	int			nnames = list_length(names);
+	Oid			relid;
+
+	if (!is_rowtype)
+		nnames -= 1;
+
+	if (nnames < 1)
+		return result;
+
+	if (nnames == 1)
+		relid = RelnameGetRelid(strVal(linitial(names)));
+	else
+	{
+		Oid			nspid;
+
+		/* database name is ignored */
+		nspid = get_namespace_oid(strVal(list_nth(names, nnames - 2)), true);
+		relid = OidIsValid(nspid) ?
+			get_relname_relid(strVal(list_nth(names, nnames - 1)), nspid) : InvalidOid;
+	}
+
+	if (OidIsValid(relid))
+		result = list_append_unique_oid(result, relid);
+
+	return result;
+}
+
+/*
+ * Returns list of relations referenced by %TYPE or %ROWTYPE in the source
+ * of function. The compiled function holds only the result types, so the
+ * source is scanned. Comments, string literals and dollar quoted strings
+ * are skipped, and the names, that are not names of relations (variables),
+ * are ignored. An error is not raised for invalid source.
+ */
+List *
+plpgsql_check_get_type_relations(const char *src)
+{
+	List	   *result = NIL;
+	List	   *names = NIL;
+	bool		expect_name = false;
+
+	while (*src)
+	{
+		char	   *ident = NULL;
+
+		if (scanner_isspace(*src))
+		{
+			src += 1;
+			continue;
+		}
+
+		if (*src == '-' && src[1] == '-')
+		{
+			while (*src && *src != '\n')
+				src += 1;
+		}
+		else if (*src == '/' && src[1] == '*')
+		{
+			int			depth = 1;
+
+			src += 2;
+
+			while (*src && depth > 0)
+			{
+				if (*src == '/' && src[1] == '*')
+				{
+					depth += 1;
+					src += 2;
+				}
+				else if (*src == '*' && src[1] == '/')
+				{
+					depth -= 1;
+					src += 2;
+				}
+				else
+					src += 1;
+			}
+		}
+		else if (*src == '\'')
+		{
+			src += 1;
+
+			while (*src)
+			{
+				if (*src++ == '\'')
+				{
+					if (*src == '\'')
+						src += 1;
+					else
+						break;
+				}
+			}
+		}
+		else if (*src == '"')
+		{
+			StringInfoData str;
+
+			initStringInfo(&str);
+			src += 1;
+
+			while (*src)
+			{
+				if (*src == '"')
+				{
+					if (src[1] != '"')
+						break;
+
+					src += 1;
+				}
+
+				appendStringInfoChar(&str, *src++);
+			}
+
+			if (!*src)
+				break;
+
+			src += 1;
+
+			truncate_identifier(str.data, str.len, false);
+			ident = str.data;
+		}
+		else if (*src == '$' && (src[1] == '$' || (is_ident_start(src[1]))))
+		{
+			const char *start = src++;
+			const char *end;
+
+			while (*src && *src != '$' && is_ident_cont(*src))
+				src += 1;
+
+			if (*src != '$')
+				continue;
+
+			src += 1;
+
+			/* search end of dollar quoted string */
+			{
+				char	   *tag = pnstrdup(start, src - start);
+
+				end = strstr(src, tag);
+				src = end ? end + strlen(tag) : src + strlen(src);
+
+				pfree(tag);
+			}
+		}
+		else if (is_ident_start(*src))
+		{
+			const char *start = src++;
+
+			while (is_ident_cont(*src))
+				src += 1;
+
+			ident = downcase_truncate_identifier(start, (int) (src - start), false);
+		}
+		else if (*src == '.' && names)
+		{
+			src += 1;
+			expect_name = true;
+			continue;
+		}
+		else if (*src == '%' && names && is_ident_start(src[1]))
+		{
+			const char *start = ++src;
+			size_t		size;
+
+			while (is_ident_cont(*src))
+				src += 1;
+
+			size = src - start;
+
+			if (size == 4 && pg_strncasecmp(start, "type", 4) == 0)
+				result = add_type_relation(result, names, false);
+			else if (size == 7 && pg_strncasecmp(start, "rowtype", 7) == 0)
+				result = add_type_relation(result, names, true);
+		}
+		else
+			src += 1;
+
+		if (ident)
+		{
+			if (names && expect_name)
+				names = lappend(names, makeString(ident));
+			else
+				names = list_make1(makeString(ident));
+		}
+		else
+			names = NIL;
+
+		expect_name = false;
+	}
+
+	return result;
+}
@@ -0,0 +1,459 @@
+/*-------------------------------------------------------------------------
+ *
+ * plan_advisor.c
+ *
+ *			  performance warnings based on estimated costs of plans
+ *
+ * by Pavel Stehule 2013-2025
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#include "plpgsql_check.h"
+
+#include "access/htup_details.h"
+#include "catalog/pg_class.h"
+#include "catalog/pg_statistic.h"
+#include "miscadmin.h"
+#include "nodes/nodeFuncs.h"
+#include "parser/parsetree.h"
+#include "utils/lsyscache.h"
+#include "utils/syscache.h"
+
+/*
+ * The advisor walks the generic plan of any embedded query, and it
+ * reports nodes, that can be slow:
+ *
+ *   - sequential scan of relation with high estimated cost,
+ *   - sequential scan with predicate with variable on relation with
+ *     some index (the index cannot be used (types), or it is missing),
+ *   - nested loop that is efficient only when the estimation of
+ *     rows of outer relation (one row) is right,
+ *   - predicate with variable on column with nonuniform distribution
+ *     of values, where the generic plan can be bad for some values.
+ *
+ * Only nodes with estimated cost higher than plan_advisor_min_cost
+ * are reported. The warnings holds the estimated cost and queryid,
+ * so they can be joined with the result of profiler.
+ */
+bool plpgsql_check_plan_advisor = false;
+double plpgsql_check_plan_advisor_min_cost = 1000.0;
+
+/* frequency of most common value, when the distribution is nonuniform */
+#define PLAN_ADVISOR_SKEWED_FREQUENCY		0.3
+
+typedef struct
+{
+	PLpgSQL_checkstate *cstate;
+	PlannedStmt *pstmt;
+	char	   *query_str;
+} plan_advisor_context;
+
+typedef struct
+{
+	Index		scanrelid;
+	Var		   *var;
+	Param	   *param;
+} param_qual_context;
+
+static void plan_advisor_walker(plan_advisor_context *context, Plan *plan);
+
+/*
+ * Search predicate in form "column op variable" over scanned relation
+ */
+static bool
+param_qual_walker(Node *node, void *context)
+{
+	param_qual_context *pqc = (param_qual_context *) context;
+
+	if (node == NULL)
+		return false;
+
+	if (IsA(node, OpExpr))
+	{
+		OpExpr	   *opexpr = (OpExpr *) node;
+
+		if (list_length(opexpr->args) == 2)
+		{
+			Node	   *l1 = strip_implicit_coercions(linitial(opexpr->args));
+			Node	   *l2 = strip_implicit_coercions(lsecond(opexpr->args));
+			Var		   *var = NULL;
+			Param	   *param = NULL;
+
+			if (IsA(l1, Var))
+				var = (Var *) l1;
+			else if (IsA(l1, Param))
+				param = (Param *) l1;
+
+			if (IsA(l2, Var))
+				var = (Var *) l2;
+			else if (IsA(l2, Param))
+				param = (Param *) l2;
+
+			if (var && param &&
+				param->paramkind == PARAM_EXTERN &&
+				var->varno == pqc->scanrelid &&
+				var->varattno > 0)
+			{
+				pqc->var = var;
+				pqc->param = param;
+
+				return true;
+			}
+		}
+	}
+
+	return expression_tree_walker(node, param_qual_walker, context);
+}
+
+static bool
+find_param_qual(Node *qual, Index scanrelid, Var **var, Param **param)
+{
+	param_qual_context pqc;
+
+	pqc.scanrelid = scanrelid;
+	pqc.var = NULL;
+	pqc.param = NULL;
+
+	if (param_qual_walker(qual, &pqc))
+	{
+		*var = pqc.var;
+		*param = pqc.param;
+
+		return true;
+	}
+
+	return false;
+}
+
+static bool
+relation_has_index(Oid relid)
+{
+	HeapTuple	tp;
+	bool		result = false;
+
+	tp = SearchSysCache1(RELOID, ObjectIdGetDatum(relid));
+	if (HeapTupleIsValid(tp))
+	{
+		result = ((Form_pg_class) GETSTRUCT(tp))->relhasindex;
+		ReleaseSysCache(tp);
+	}
+
+	return result;
+}
+
+/*
+ * Returns frequency of most common value of column, or -1 when there
+ * are not statistics.
+ */
+static double
+most_common_value_frequency(Oid relid, AttrNumber attnum)
+{
+	HeapTuple	statstuple;
+	double		result = -1.0;
+
+	statstuple = SearchSysCache3(STATRELATTINH,
+								 ObjectIdGetDatum(relid),
+								 Int16GetDatum(attnum),
+								 BoolGetDatum(false));
+
+	if (HeapTupleIsValid(statstuple))
+	{
+		AttStatsSlot sslot;
+
+		if (get_attstatsslot(&sslot, statstuple,
+							 STATISTIC_KIND_MCV, InvalidOid,
+							 ATTSTATSSLOT_NUMBERS))
+		{
+			if (sslot.nnumbers > 0)
+				result = sslot.numbers[0];
+
+			free_attstatsslot(&sslot);
+		}
+
+		ReleaseSysCache(statstuple);
+	}
+
+	return result;
+}
+
+/*
+ * The position -1 is used for findings, that are not related to
+ * some part of query.
+ */
+static void
+put_finding(plan_advisor_context *context,
+			Plan *plan,
+			const char *message,
+			const char *extra_detail,
+			const char *hint,
+			int position)
+{
+	StringInfoData detail;
+
+	initStringInfo(&detail);
+
+	if (extra_detail)
+		appendStringInfo(&detail, "%s ", extra_detail);
+
+	appendStringInfo(&detail, "Estimated cost: %.2f, estimated rows: %.0f.",
+					 plan->total_cost, plan->plan_rows);
+
+	if (context->pstmt->queryId != NOQUERYID)
+		appendStringInfo(&detail, " Queryid: " UINT64_FORMAT ".",
+						 (uint64) context->pstmt->queryId);
+
+	plpgsql_check_put_error(context->cstate,
+							0, 0,
+							message,
+							detail.data,
+							hint,
+							PLPGSQL_CHECK_WARNING_PERFORMANCE,
+							position,
+							context->query_str, NULL);
+
+	pfree(detail.data);
+}
+
+/*
+ * Check predicate with variable on column with nonuniform distribution
+ */
+static void
+check_generic_plan_risk(plan_advisor_context *context,
+						Plan *plan,
+						Index scanrelid,
+						Node *qual)
+{
+	Var		   *var;
+	Param	   *param;
+
+	if (find_param_qual(qual, scanrelid, &var, &param))
+	{
+		Oid			relid = rt_fetch(scanrelid, context->pstmt->rtable)->relid;
+		double		freq;
+
+		freq = most_common_value_frequency(relid, var->varattno);
+		if (freq >= PLAN_ADVISOR_SKEWED_FREQUENCY)
+		{
+			StringInfoData message;
+			char		detail[100];
+
+			initStringInfo(&message);
+			appendStringInfo(&message,
+							 "generic plan can be inefficient for variable used in predicate on column \"%s\" of relation \"%s\"",
+							 get_attname(relid, var->varattno, false),
+							 get_rel_name(relid));
+
+			snprintf(detail, sizeof(detail),
+					 "The most common value of column has frequency %.2f.", freq);
+
+			put_finding(context, plan,
+						message.data,
+						detail,
+						"The plan is not optimal for all values of variable. Consider dynamic SQL or plan_cache_mode = force_custom_plan.",
+						param->location);
+
+			pfree(message.data);
+		}
+	}
+}
+
+static void
+check_seqscan(plan_advisor_context *context, Scan *scan)
+{
+	Plan	   *plan = (Plan *) scan;
+	Oid			relid;
+	Var		   *var;
+	Param	   *param;
+	char	   *relname;
+	StringInfoData message;
+
+	relid = rt_fetch(scan->scanrelid, context->pstmt->rtable)->relid;
+	relname = get_rel_name(relid);
+
+	initStringInfo(&message);
+
+	if (find_param_qual((Node *) plan->qual, scan->scanrelid, &var, &param) &&
+		relation_has_index(relid))
+	{
+		appendStringInfo(&message,
+						 "predicate with variable on column \"%s\" is not evaluated by index of relation \"%s\"",
+						 get_attname(relid, var->varattno, false),
+						 relname);
+
+		put_finding(context, plan,
+					message.data,
+					"The relation has indexes, but the sequential scan is used.",
+					"Check if the index on the column exists, and check a variable type.",
+					param->location);
+	}
+	else
+	{
+		appendStringInfo(&message,
+						 "sequential scan of relation \"%s\"",
+						 relname);
+
+		put_finding(context, plan,
+					message.data,
+					NULL,
+					"Check if the relation should be scanned by index.",
+					-1);
+	}
+
+	pfree(message.data);
+}
+
+static void
+check_nestloop(plan_advisor_context *context, NestLoop *nl)
+{
+	Plan	   *outer = outerPlan(nl);
+	Plan	   *inner = innerPlan(nl);
+
+	if (!outer || !inner)
+		return;
+
+	/* the planner clamps the estimation to one row */
+	if (outer->plan_rows > 1.0)
+		return;
+
+	if (IsA(inner, Material))
+		inner = outerPlan(inner);
+
+	if (inner &&
+		(IsA(inner, IndexScan) ||
+		 IsA(inner, IndexOnlyScan) ||
+		 IsA(inner, BitmapHeapScan)))
+		return;
+
+	put_finding(context, (Plan *) nl,
+				"nested loop depends on estimation of one row of outer relation",
+				"The inner relation is not scanned by index, and it is scanned for every row of outer relation.",
+				"Check the statistics of outer relation.",
+				-1);
+}
+
+static void
+plan_advisor_walker_list(plan_advisor_context *context, List *plans)
+{
+	ListCell   *lc;
+
+	foreach(lc, plans)
+		plan_advisor_walker(context, (Plan *) lfirst(lc));
+}
+
+static void
+plan_advisor_walker(plan_advisor_context *context, Plan *plan)
+{
+	if (plan == NULL)
+		return;
+
+	check_stack_depth();
+
+	if (plan->total_cost >= plpgsql_check_plan_advisor_min_cost)
+	{
+		switch (nodeTag(plan))
+		{
+			case T_SeqScan:
+				check_seqscan(context, (Scan *) plan);
+				check_generic_plan_risk(context, plan,
+										((Scan *) plan)->scanrelid,
+										(Node *) plan->qual);
+				break;
+
+			case T_IndexScan:
+				check_generic_plan_risk(context, plan,
+										((Scan *) plan)->scanrelid,
+										(Node *) ((IndexScan *) plan)->indexqualorig);
+				break;
+
+			case T_BitmapHeapScan:
+				check_generic_plan_risk(context, plan,
+										((Scan *) plan)->scanrelid,
+										(Node *) ((BitmapHeapScan *) plan)->bitmapqualorig);
+				break;
+
+			case T_NestLoop:
+				check_nestloop(context, (NestLoop *) plan);
+				break;
+
+			default:
+				break;
+		}
+	}
+
+	plan_advisor_walker(context, outerPlan(plan));
+	plan_advisor_walker(context, innerPlan(plan));
+
+	switch (nodeTag(plan))
+	{
+		case T_Append:
+			plan_advisor_walker_list(context, ((Append *) plan)->appendplans);
+			break;
+
+		case T_MergeAppend:
+			plan_advisor_walker_list(context, ((MergeAppend *) plan)->mergeplans);
+			break;
+
+		case T_BitmapAnd:
+			plan_advisor_walker_list(context, ((BitmapAnd *) plan)->bitmapplans);
+			break;
+
+		case T_BitmapOr:
+			plan_advisor_walker_list(context, ((BitmapOr *) plan)->bitmapplans);
+			break;
+
+#if PG_VERSION_NUM < 140000
+
+		/* on PostgreSQL 14 and higher the subplan of ModifyTable is outer plan */
+		case T_ModifyTable:
+			plan_advisor_walker_list(context, ((ModifyTable *) plan)->plans);
+			break;
+
+#endif
+
+		case T_SubqueryScan:
+			plan_advisor_walker(context, ((SubqueryScan *) plan)->subplan);
+			break;
+
+		case T_CustomScan:
+			plan_advisor_walker_list(context, ((CustomScan *) plan)->custom_plans);
+			break;
+
+		default:
+			break;
+	}
+}
+
+/*
+ * Raise performance warnings for expensive nodes of plan
+ */
+void
+plpgsql_check_plan_advisor_check(PLpgSQL_checkstate *cstate,
+								 CachedPlan *cplan,
+								 char *query_str)
+{
+	ListCell   *lc;
+
+	if (!plpgsql_check_plan_advisor ||
+		!cstate->cinfo->performance_warnings)
+		return;
+
+	foreach(lc, cplan->stmt_list)
+	{
+		PlannedStmt *pstmt = (PlannedStmt *) lfirst(lc);
+		plan_advisor_context context;
+
+		if (!IsA(pstmt, PlannedStmt) ||
+			pstmt->commandType == CMD_UTILITY)
+			continue;
+
+		context.cstate = cstate;
+		context.pstmt = pstmt;
+		context.query_str = query_str;
+
+		plan_advisor_walker(&context, pstmt->planTree);
+
+		/* initplans and subplans */
+		plan_advisor_walker_list(&context, pstmt->subplans);
+	}
+}
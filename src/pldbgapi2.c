@@ -63,12 +63,29 @@ typedef struct func_info_entry
 	int		   *stmtid_map;
 	int			nstatements;
 
+	/* plugin's data related to this version of function */
+	void	   *plugin2_func_info[MAX_PLDBGAPI2_PLUGINS];
+
 	int			use_count;
 	bool		is_valid;
 } func_info_entry;
 
 static HTAB *func_info_HashTable = NULL;
 
+/*
+ * Cache of languages of functions. The fmgr hook is checked for every
+ * function used by executor, and we don't want to search system cache
+ * for every call of any not plpgsql function.
+ */
+typedef struct func_lang_entry
+{
+	Oid			fn_oid;
+	uint32		hashValue;
+	Oid			lang_oid;
+} func_lang_entry;
+
+static HTAB *func_lang_HashTable = NULL;
+
 typedef struct fmgr_cache
 {
 	int			magic;
@@ -89,6 +106,19 @@ typedef struct fmgr_plpgsql_cache
 
 	void	   *plugin2_info[MAX_PLDBGAPI2_PLUGINS];
 
+	/*
+	 * Plugin's data, that are not reset before call of function, so
+	 * they can be reused by next calls of function by same FmgrInfo.
+	 */
+	void	   *plugin2_fn_data[MAX_PLDBGAPI2_PLUGINS];
+
+	/*
+	 * Bitmap of plugins with statement's hooks, that are active for
+	 * current call of function (plugin is active, when it sets plugin2_info).
+	 * When it is zero, then statement's hooks are skipped.
+	 */
+	uint32		active_stmt_plugins;
+
 	MemoryContext fn_mcxt;
 	int		   *stmtid_stack;
 	int			stmtid_stack_size;
@@ -111,6 +141,9 @@ static void pldbgapi2_func_end(PLpgSQL_execstate *estate, PLpgSQL_function *func
 static void pldbgapi2_stmt_beg(PLpgSQL_execstate *estate, PLpgSQL_stmt *stmt);
 static void pldbgapi2_stmt_end(PLpgSQL_execstate *estate, PLpgSQL_stmt *stmt);
 
+#define IS_ACTIVE_STMT_PLUGIN(fcache_plpgsql, i) \
+	(((fcache_plpgsql)->active_stmt_plugins & (((uint32) 1) << (i))) != 0)
+
 static PLpgSQL_plugin pldbgapi2_plugin = { pldbgapi2_func_setup,
 										   pldbgapi2_func_beg, pldbgapi2_func_end,
 										   pldbgapi2_stmt_beg, pldbgapi2_stmt_end,
@@ -238,6 +271,69 @@ plpgsql_check_get_current_fn_mcxt(void)
 	return current_fmgr_plpgsql_cache->fn_mcxt;
 }
 
+/*
+ * Returns pointer to plugin's slot in fmgr cache of current call. Unlike
+ * plugin2_info, the slot is not reset before func_setup2, so the plugin
+ * can store there a pointer to memory allocated in the context returned
+ * by plpgsql_check_get_current_fn_mcxt, and reuse it in next calls of the
+ * function by same FmgrInfo. Without it, the memory allocated by plugin
+ * for every call is released only together with FmgrInfo.
+ */
+void **
+plpgsql_check_get_current_fn_plugin2_data(plpgsql_check_plugin2 *plugin2)
+{
+	int			i;
+
+	Assert(current_fmgr_plpgsql_cache);
+
+	for (i = 0; i < nplpgsql_plugins2; i++)
+	{
+		if (plpgsql_plugins2[i] == plugin2)
+			return &current_fmgr_plpgsql_cache->plugin2_fn_data[i];
+	}
+
+	elog(ERROR, "pldbgapi2 plugin is not registered");
+
+	return NULL;				/* be compiler quiet */
+}
+
+/*
+ * Returns pointer to plugin's slot in session cache of current version
+ * of function. The plugin can store there a pointer to one chunk of memory
+ * allocated in the context returned by plpgsql_check_get_func_info_mcxt.
+ * This chunk is released together with other metadata of function, when
+ * the function is invalidated. Returns NULL for anonymous blocks, because
+ * the metadata of anonymous blocks are not cached.
+ */
+void **
+plpgsql_check_get_current_func_info_plugin2_data(plpgsql_check_plugin2 *plugin2)
+{
+	int			i;
+
+	Assert(current_fmgr_plpgsql_cache);
+	Assert(current_fmgr_plpgsql_cache->func_info);
+	Assert(current_fmgr_plpgsql_cache->func_info->use_count > 0);
+
+	if (current_fmgr_plpgsql_cache->funcid == PLpgSQLinlineFunc)
+		return NULL;
+
+	for (i = 0; i < nplpgsql_plugins2; i++)
+	{
+		if (plpgsql_plugins2[i] == plugin2)
+			return &current_fmgr_plpgsql_cache->func_info->plugin2_func_info[i];
+	}
+
+	elog(ERROR, "pldbgapi2 plugin is not registered");
+
+	return NULL;				/* be compiler quiet */
+}
+
+MemoryContext
+plpgsql_check_get_func_info_mcxt(void)
+{
+	return pldbgapi2_mcxt;
+}
+
 static void
 func_info_init_hashkey(func_info_hashkey *hk, PLpgSQL_function *func)
 {
@@ -269,6 +365,27 @@ func_info_HashTableInit(void)
 									   HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
 }
 
+/*
+ * Hash table for languages of functions
+ */
+static void
+func_lang_HashTableInit(void)
+{
+	HASHCTL		ctl;
+
+	Assert(func_lang_HashTable == NULL);
+
+	memset(&ctl, 0, sizeof(ctl));
+	ctl.keysize = sizeof(Oid);
+	ctl.entrysize = sizeof(func_lang_entry);
+	ctl.hcxt = pldbgapi2_mcxt;
+
+	func_lang_HashTable = hash_create("plpgsql_check function pldbgapi2 language cache",
+									   FUNCS_PER_USER,
+									   &ctl,
+									   HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+}
+
 static void
 init_hash_tables(void)
 {
@@ -276,6 +393,7 @@ init_hash_tables(void)
 	{
 		MemoryContextReset(pldbgapi2_mcxt);
 		func_info_HashTable = NULL;
+		func_lang_HashTable = NULL;
 	}
 	else
 	{
@@ -287,6 +405,27 @@ init_hash_tables(void)
 	}
 
 	func_info_HashTableInit();
+	func_lang_HashTableInit();
+}
+
+/*
+ * Release all memory owned by persistent func_info entry
+ */
+static void
+release_func_info(func_info_entry *func_info)
+{
+	int			i;
+
+	pfree(func_info->fn_name);
+	pfree(func_info->fn_signature);
+	pfree(func_info->stmts_info);
+	pfree(func_info->stmtid_map);
+
+	for (i = 0; i < MAX_PLDBGAPI2_PLUGINS; i++)
+	{
+		if (func_info->plugin2_func_info[i])
+			pfree(func_info->plugin2_func_info[i]);
+	}
 }
 
 static void set_stmt_info(PLpgSQL_stmt *stmt, plpgsql_check_plugin2_stmt_info *stmts_info, int *stmtid_map, int level, int *natural_id, int parent_id);
@@ -350,6 +489,7 @@ set_stmt_info(PLpgSQL_stmt *stmt,
 	 * when syntax tree can be unaccessable
 	 */
 	stmts_info[stmtid_idx].typname = plpgsql_check__stmt_typename_p(stmt);
+	stmts_info[stmtid_idx].lineno = stmt->lineno;
 
 	/* used for skipping printing invisible block statement */
 	stmts_info[stmtid_idx].is_invisible = is_invisible;
@@ -532,6 +672,14 @@ get_func_lang(Oid funcid)
 {
 	HeapTuple	procTuple;
 	Oid			result;
+	func_lang_entry *entry;
+
+	entry = (func_lang_entry *) hash_search(func_lang_HashTable,
+											(void *) &funcid,
+											HASH_FIND,
+											NULL);
+	if (entry)
+		return entry->lang_oid;
 
 	procTuple = SearchSysCache1(PROCOID, ObjectIdGetDatum(funcid));
 	if (!HeapTupleIsValid(procTuple))
@@ -540,6 +688,18 @@ get_func_lang(Oid funcid)
 	result = ((Form_pg_proc) GETSTRUCT(procTuple))->prolang;
 	ReleaseSysCache(procTuple);
 
+	/*
+	 * The sinval messages can be processed by SearchSysCache1, so the
+	 * entry is created after searching.
+	 */
+	entry = (func_lang_entry *) hash_search(func_lang_HashTable,
+											(void *) &funcid,
+											HASH_ENTER,
+											NULL);
+
+	entry->hashValue = GetSysCacheHashValue1(PROCOID, ObjectIdGetDatum(funcid));
+	entry->lang_oid = result;
+
 	return result;
 }
 
@@ -689,7 +849,8 @@ pldbgapi2_fmgr_hook(FmgrHookEventType event,
 
 					for (i = 0; i < nplpgsql_plugins2; i++)
 					{
-						if (plpgsql_plugins2[i]->stmt_end2_aborted)
+						if (IS_ACTIVE_STMT_PLUGIN(fcache_plpgsql, i) &&
+							plpgsql_plugins2[i]->stmt_end2_aborted)
 							(plpgsql_plugins2[i]->stmt_end2_aborted)(fn_oid, stmtid,
 																	 &fcache_plpgsql->plugin2_info[i]);
 					}
@@ -736,10 +897,7 @@ get_func_info(PLpgSQL_function *func)
 
 		if (found_func_info_entry && !func_info->is_valid)
 		{
-			pfree(func_info->fn_name);
-			pfree(func_info->fn_signature);
-			pfree(func_info->stmts_info);
-			pfree(func_info->stmtid_map);
+			release_func_info(func_info);
 
 			if (hash_search(func_info_HashTable,
 							&func_info->key,
@@ -754,7 +912,7 @@ get_func_info(PLpgSQL_function *func)
 	else
 	{
 		/* one shot sie for anonymous blocks */
-		func_info = palloc(sizeof(func_info_entry));
+		func_info = palloc0(sizeof(func_info_entry));
 		persistent_func_info = false;
 		found_func_info_entry = false;
 	}
@@ -805,6 +963,8 @@ get_func_info(PLpgSQL_function *func)
 			func_info->stmtid_map = palloc(func->nstatements * sizeof(int));
 		}
 
+		memset(func_info->plugin2_func_info, 0, sizeof(func_info->plugin2_func_info));
+
 		func_info->nstatements = func->nstatements;
 		func_info->use_count = 0;
 		func_info->is_valid = true;
@@ -905,6 +1065,17 @@ pldbgapi2_func_setup(PLpgSQL_execstate *estate, PLpgSQL_function *func)
 		MemoryContextSwitchTo(oldcxt);
 	}
 
+	fcache_plpgsql->active_stmt_plugins = 0;
+
+	for (i = 0; i < nplpgsql_plugins2; i++)
+	{
+		if (fcache_plpgsql->plugin2_info[i] &&
+			(plpgsql_plugins2[i]->stmt_beg2 ||
+			 plpgsql_plugins2[i]->stmt_end2 ||
+			 plpgsql_plugins2[i]->stmt_end2_aborted))
+			fcache_plpgsql->active_stmt_plugins |= ((uint32) 1) << i;
+	}
+
 	if (prev_plpgsql_plugin)
 	{
 		prev_plpgsql_plugin->error_callback = pldbgapi2_plugin.error_callback;
@@ -1080,6 +1251,52 @@ pldbgapi2_func_end(PLpgSQL_execstate *estate, PLpgSQL_function *func)
 	}
 }
 
+static void
+prev_plugin_stmt_beg(PLpgSQL_execstate *estate, PLpgSQL_stmt *stmt,
+					 pldbgapi2_plugin_info *plugin_info)
+{
+	PG_TRY();
+	{
+		estate->plugin_info = plugin_info->prev_plugin_info;
+
+		(prev_plpgsql_plugin->stmt_beg)(estate, stmt);
+
+		plugin_info->prev_plugin_info = estate->plugin_info;
+		estate->plugin_info = plugin_info;
+	}
+	PG_CATCH();
+	{
+		plugin_info->prev_plugin_info = estate->plugin_info;
+		estate->plugin_info = plugin_info;
+
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+}
+
+static void
+prev_plugin_stmt_end(PLpgSQL_execstate *estate, PLpgSQL_stmt *stmt,
+					 pldbgapi2_plugin_info *plugin_info)
+{
+	PG_TRY();
+	{
+		estate->plugin_info = plugin_info->prev_plugin_info;
+
+		(prev_plpgsql_plugin->stmt_end)(estate, stmt);
+
+		plugin_info->prev_plugin_info = estate->plugin_info;
+		estate->plugin_info = plugin_info;
+	}
+	PG_CATCH();
+	{
+		plugin_info->prev_plugin_info = estate->plugin_info;
+		estate->plugin_info = plugin_info;
+
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+}
+
 static void
 pldbgapi2_stmt_beg(PLpgSQL_execstate *estate, PLpgSQL_stmt *stmt)
 {
@@ -1112,6 +1329,15 @@ pldbgapi2_stmt_beg(PLpgSQL_execstate *estate, PLpgSQL_stmt *stmt)
 
 #endif
 
+	/* fast path, when there are not any active statement's plugins */
+	if (!fcache_plpgsql->active_stmt_plugins)
+	{
+		if (prev_plpgsql_plugin && prev_plpgsql_plugin->stmt_beg)
+			prev_plugin_stmt_beg(estate, stmt, plugin_info);
+
+		return;
+	}
+
 	current_fmgr_plpgsql_cache = fcache_plpgsql;
 
 	if (fcache_plpgsql->current_stmtid_stack_size > 0)
@@ -1126,7 +1352,8 @@ pldbgapi2_stmt_beg(PLpgSQL_execstate *estate, PLpgSQL_stmt *stmt)
 
 			for (i = 0; i < nplpgsql_plugins2; i++)
 			{
-				if (plpgsql_plugins2[i]->stmt_end2_aborted)
+				if (IS_ACTIVE_STMT_PLUGIN(fcache_plpgsql, i) &&
+					plpgsql_plugins2[i]->stmt_end2_aborted)
 					(plpgsql_plugins2[i]->stmt_end2_aborted)(estate->func->fn_oid, stmtid,
 															 &fcache_plpgsql->plugin2_info[i]);
 			}
@@ -1158,7 +1385,8 @@ pldbgapi2_stmt_beg(PLpgSQL_execstate *estate, PLpgSQL_stmt *stmt)
 
 	for (i = 0; i < nplpgsql_plugins2; i++)
 	{
-		if (plpgsql_plugins2[i]->stmt_beg2)
+		if (IS_ACTIVE_STMT_PLUGIN(fcache_plpgsql, i) &&
+			plpgsql_plugins2[i]->stmt_beg2)
 			(plpgsql_plugins2[i]->stmt_beg2)(estate, stmt,
 											 &fcache_plpgsql->plugin2_info[i]);
 	}
@@ -1166,25 +1394,7 @@ pldbgapi2_stmt_beg(PLpgSQL_execstate *estate, PLpgSQL_stmt *stmt)
 	current_fmgr_plpgsql_cache = NULL;
 
 	if (prev_plpgsql_plugin && prev_plpgsql_plugin->stmt_beg)
-	{
-		PG_TRY();
-		{
-			estate->plugin_info = plugin_info->prev_plugin_info;
-
-			(prev_plpgsql_plugin->stmt_beg)(estate, stmt);
-
-			plugin_info->prev_plugin_info = estate->plugin_info;
-			estate->plugin_info = plugin_info;
-		}
-		PG_CATCH();
-		{
-			plugin_info->prev_plugin_info = estate->plugin_info;
-			estate->plugin_info = plugin_info;
-
-			PG_RE_THROW();
-		}
-		PG_END_TRY();
-	}
+		prev_plugin_stmt_beg(estate, stmt, plugin_info);
 }
 
 static void
@@ -1218,6 +1428,15 @@ pldbgapi2_stmt_end(PLpgSQL_execstate *estate, PLpgSQL_stmt *stmt)
 
 #endif
 
+	/* fast path, when there are not any active statement's plugins */
+	if (!fcache_plpgsql->active_stmt_plugins)
+	{
+		if (prev_plpgsql_plugin && prev_plpgsql_plugin->stmt_end)
+			prev_plugin_stmt_end(estate, stmt, plugin_info);
+
+		return;
+	}
+
 	Assert(fcache_plpgsql->current_stmtid_stack_size > 0);
 
 	fcache_plpgsql->current_stmtid_stack_size -= 1;
@@ -1238,7 +1457,8 @@ pldbgapi2_stmt_end(PLpgSQL_execstate *estate, PLpgSQL_stmt *stmt)
 
 			for (i = 0; i < nplpgsql_plugins2; i++)
 			{
-				if (plpgsql_plugins2[i]->stmt_end2_aborted)
+				if (IS_ACTIVE_STMT_PLUGIN(fcache_plpgsql, i) &&
+					plpgsql_plugins2[i]->stmt_end2_aborted)
 					(plpgsql_plugins2[i]->stmt_end2_aborted)(estate->func->fn_oid, stmtid,
 															 &fcache_plpgsql->plugin2_info[i]);
 			}
@@ -1252,7 +1472,8 @@ pldbgapi2_stmt_end(PLpgSQL_execstate *estate, PLpgSQL_stmt *stmt)
 
 	for (i = 0; i < nplpgsql_plugins2; i++)
 	{
-		if (plpgsql_plugins2[i]->stmt_end2)
+		if (IS_ACTIVE_STMT_PLUGIN(fcache_plpgsql, i) &&
+			plpgsql_plugins2[i]->stmt_end2)
 			(plpgsql_plugins2[i]->stmt_end2)(estate, stmt,
 											 &fcache_plpgsql->plugin2_info[i]);
 	}
@@ -1260,25 +1481,7 @@ pldbgapi2_stmt_end(PLpgSQL_execstate *estate, PLpgSQL_stmt *stmt)
 	current_fmgr_plpgsql_cache = NULL;
 
 	if (prev_plpgsql_plugin && prev_plpgsql_plugin->stmt_end)
-	{
-		PG_TRY();
-		{
-			estate->plugin_info = plugin_info->prev_plugin_info;
-
-			(prev_plpgsql_plugin->stmt_end)(estate, stmt);
-
-			plugin_info->prev_plugin_info = estate->plugin_info;
-			estate->plugin_info = plugin_info;
-		}
-		PG_CATCH();
-		{
-			plugin_info->prev_plugin_info = estate->plugin_info;
-			estate->plugin_info = plugin_info;
-
-			PG_RE_THROW();
-		}
-		PG_END_TRY();
-	}
+		prev_plugin_stmt_end(estate, stmt, plugin_info);
 }
 
 void
@@ -1295,8 +1498,23 @@ func_info_CacheObjectCallback(Datum arg, int cacheid, uint32 hashValue)
 {
 	HASH_SEQ_STATUS status;
 	func_info_entry *func_info;
+	func_lang_entry *func_lang;
 
 	Assert(func_info_HashTable);
+	Assert(func_lang_HashTable);
+
+	hash_seq_init(&status, func_lang_HashTable);
+
+	while ((func_lang = (func_lang_entry *) hash_seq_search(&status)) != NULL)
+	{
+		if (hashValue == 0 || func_lang->hashValue == hashValue)
+		{
+			if (hash_search(func_lang_HashTable,
+							&func_lang->fn_oid,
+							HASH_REMOVE, NULL) == NULL)
+				elog(ERROR, "hash table corrupted");
+		}
+	}
 
 	/* Currently we just flush all entries; hard to be smarter ... */
 	hash_seq_init(&status, func_info_HashTable);
@@ -1308,10 +1526,7 @@ func_info_CacheObjectCallback(Datum arg, int cacheid, uint32 hashValue)
 
 		if (!func_info->is_valid && func_info->use_count == 0)
 		{
-			pfree(func_info->fn_name);
-			pfree(func_info->fn_signature);
-			pfree(func_info->stmts_info);
-			pfree(func_info->stmtid_map);
+			release_func_info(func_info);
 
 			if (hash_search(func_info_HashTable,
 							&func_info->key,
@@ -35,6 +35,8 @@
 #include "utils/guc.h"
 #include "utils/memutils.h"
 
+#include <float.h>
+
 #if PG_VERSION_NUM >= 180000
 
 #include "utils/inval.h"
@@ -77,6 +79,12 @@ static const struct config_enum_entry tracer_level_options[] = {
 	{NULL, 0, false}
 };
 
+static const struct config_enum_entry tracer_output_options[] = {
+	{"notice", PLPGSQL_CHECK_TRACER_OUTPUT_NOTICE, false},
+	{"buffer", PLPGSQL_CHECK_TRACER_OUTPUT_BUFFER, false},
+	{NULL, 0, false}
+};
+
 static const struct config_enum_entry cursors_leaks_level_options[] = {
 	{"notice", NOTICE, false},
 	{"WARNING", WARNING, false},
@@ -285,6 +293,39 @@ _PG_init(void)
 					    PGC_USERSET, 0,
 					    NULL, NULL, NULL);
 
+	DefineCustomBoolVariable("plpgsql_check.check_cache",
+					    "when is true, then results of active mode checks are cached",
+					    "The cached result is used when the function and used objects were not changed.",
+					    &plpgsql_check_cache,
+					    false,
+					    PGC_USERSET, 0,
+					    NULL, NULL, NULL);
+
+	DefineCustomBoolVariable("plpgsql_check.analysis_cache",
+					    "when is true, then results of analysis of embedded queries are cached in session",
+					    "The cached result is used for queries with same text and same variables in other functions.",
+					    &plpgsql_check_analysis_cache,
+					    false,
+					    PGC_USERSET, 0,
+					    NULL, NULL, NULL);
+
+	DefineCustomBoolVariable("plpgsql_check.plan_advisor",
+					    "when is true, then plans of embedded queries are checked for expensive nodes",
+					    "The performance warnings are raised only when performance warnings are enabled.",
+					    &plpgsql_check_plan_advisor,
+					    false,
+					    PGC_USERSET, 0,
+					    NULL, NULL, NULL);
+
+	DefineCustomRealVariable("plpgsql_check.plan_advisor_min_cost",
+							 "sets the minimal estimated cost of plan node reported by plan advisor",
+							 NULL,
+							 &plpgsql_check_plan_advisor_min_cost,
+							 1000.0,
+							 0.0, DBL_MAX,
+							 PGC_USERSET, 0,
+							 NULL, NULL, NULL);
+
 	DefineCustomBoolVariable("plpgsql_check.profiler",
 					    "when is true, then function execution profile is updated",
 					    NULL,
@@ -293,6 +334,48 @@ _PG_init(void)
 					    PGC_USERSET, 0,
 					    NULL, NULL, NULL);
 
+	DefineCustomIntVariable("plpgsql_check.profiler_flush_interval",
+							"sets the interval between merges of session's profiles to shared memory",
+							"Zero means that the profile is merged immediately when function is finished.",
+							&plpgsql_check_profiler_flush_interval,
+							0,
+							0, 3600000,
+							PGC_USERSET, GUC_UNIT_MS,
+							NULL, NULL, NULL);
+
+	DefineCustomIntVariable("plpgsql_check.profiler_sample_rate",
+							"sets the rate of profiled function's calls",
+							"Only one call from this number of calls is profiled, and the profile is extrapolated.",
+							&plpgsql_check_profiler_sample_rate,
+							1,
+							1, 1000000,
+							PGC_USERSET, 0,
+							NULL, NULL, NULL);
+
+	DefineCustomBoolVariable("plpgsql_check.profiler_call_stacks",
+					    "when is true, then profiler records call stacks of functions",
+					    NULL,
+					    &plpgsql_check_profiler_call_stacks,
+					    false,
+					    PGC_USERSET, 0,
+					    NULL, NULL, NULL);
+
+	DefineCustomBoolVariable("plpgsql_check.coverage",
+					    "when is true, then executed statements are marked for coverage metrics",
+					    "A bitmap of executed statements is collected without measuring of time.",
+					    &plpgsql_check_coverage,
+					    false,
+					    PGC_USERSET, 0,
+					    NULL, NULL, NULL);
+
+	DefineCustomBoolVariable("plpgsql_check.profiler_dynamic_queries",
+					    "when is true, then profiler collects counters of queries of dynamic statements",
+					    "Every execution of dynamic statement evaluates its query string again.",
+					    &plpgsql_check_profiler_dynamic_queries,
+					    false,
+					    PGC_USERSET, 0,
+					    NULL, NULL, NULL);
+
 	DefineCustomBoolVariable("plpgsql_check.enable_tracer",
 					    "when is true, then tracer's functionality is enabled",
 					    NULL,
@@ -360,6 +443,44 @@ _PG_init(void)
 					    PGC_USERSET, 0,
 					    NULL, NULL, NULL);
 
+	DefineCustomEnumVariable("plpgsql_check.tracer_output",
+					    "sets a target of tracer's messages",
+					    NULL,
+					    (int *) &plpgsql_check_tracer_output,
+					    PLPGSQL_CHECK_TRACER_OUTPUT_NOTICE,
+					    tracer_output_options,
+					    PGC_USERSET, 0,
+					    NULL, NULL, NULL);
+
+	DefineCustomStringVariable("plpgsql_check.tracer_functions",
+							   "list of traced functions (by name or by oid)",
+							   NULL,
+							   &plpgsql_check_tracer_functions,
+							   "",
+							   PGC_USERSET, 0,
+							   plpgsql_check_tracer_functions_check_hook,
+							   plpgsql_check_tracer_functions_assign_hook,
+							   NULL);
+
+	DefineCustomStringVariable("plpgsql_check.tracer_lines",
+							   "list of traced lines or ranges of lines",
+							   NULL,
+							   &plpgsql_check_tracer_lines,
+							   "",
+							   PGC_USERSET, 0,
+							   plpgsql_check_tracer_lines_check_hook,
+							   plpgsql_check_tracer_lines_assign_hook,
+							   NULL);
+
+	DefineCustomIntVariable("plpgsql_check.tracer_stmt_min_duration",
+							"when it is greater than zero, then only end of statements running longer are displayed",
+							NULL,
+							&plpgsql_check_tracer_stmt_min_duration,
+							0,
+							0, INT_MAX,
+							PGC_USERSET, GUC_UNIT_MS,
+							NULL, NULL, NULL);
+
 	DefineCustomIntVariable("plpgsql_check.tracer_variable_max_length",
 							"Maximum output length of content of variables in bytes",
 							NULL,
@@ -404,13 +525,45 @@ _PG_init(void)
 	{
 
 		DefineCustomIntVariable("plpgsql_check.profiler_max_shared_chunks",
-						    "maximum numbers of statements chunks in shared memory",
+						    "maximum numbers of function's profiles in shared memory",
 						    NULL,
 						    &plpgsql_check_profiler_max_shared_chunks,
-						    15000, 50, 100000,
+						    15000, 50, 1000000,
 						    PGC_POSTMASTER, 0,
 						    NULL, NULL, NULL);
 
+		DefineCustomIntVariable("plpgsql_check.profiler_max_shared_memory",
+						    "maximum size of dynamic shared memory used for statements of profiles",
+						    NULL,
+						    &plpgsql_check_profiler_max_shared_memory,
+						    102400, 1024, MAX_KILOBYTES,
+						    PGC_SIGHUP, GUC_UNIT_KB,
+						    NULL, NULL, NULL);
+
+		DefineCustomBoolVariable("plpgsql_check.profiler_save",
+						    "when is true, then shared profiles are saved across server shutdowns",
+						    NULL,
+						    &plpgsql_check_profiler_save,
+						    true,
+						    PGC_SIGHUP, 0,
+						    NULL, NULL, NULL);
+
+		DefineCustomIntVariable("plpgsql_check.check_cache_max_entries",
+						    "maximum numbers of cached results of checks",
+						    NULL,
+						    &plpgsql_check_cache_max_entries,
+						    5000, 50, 1000000,
+						    PGC_POSTMASTER, 0,
+						    NULL, NULL, NULL);
+
+		DefineCustomIntVariable("plpgsql_check.tracer_buffer_size",
+						    "size of shared buffer used for tracer's messages",
+						    NULL,
+						    &plpgsql_check_tracer_buffer_size,
+						    1024, 64, MAX_KILOBYTES,
+						    PGC_POSTMASTER, GUC_UNIT_KB,
+						    NULL, NULL, NULL);
+
 #if PG_VERSION_NUM < 150000
 
 		/*
@@ -422,6 +575,11 @@ _PG_init(void)
 
 		RequestNamedLWLockTranche("plpgsql_check profiler", 1);
 		RequestNamedLWLockTranche("plpgsql_check fstats", 1);
+		RequestNamedLWLockTranche("plpgsql_check call stacks", 1);
+		RequestNamedLWLockTranche("plpgsql_check dynamic queries", 1);
+		RequestNamedLWLockTranche("plpgsql_check coverage", 1);
+		RequestNamedLWLockTranche("plpgsql_check check cache", 1);
+		RequestNamedLWLockTranche("plpgsql_check tracer", 1);
 
 #endif
 
@@ -5,7 +5,9 @@
 #include "funcapi.h"
 #include "miscadmin.h"
 #include "access/tupdesc.h"
+#include "datatype/timestamp.h"
 #include "storage/ipc.h"
+#include "utils/guc.h"
 
 typedef uint64 pc_queryid;
 #define NOQUERYID				(UINT64CONST(0))
@@ -34,7 +36,20 @@ enum
 	PLPGSQL_SHOW_DEPENDENCY_FORMAT_TABULAR,
 	PLPGSQL_SHOW_PROFILE_TABULAR,
 	PLPGSQL_SHOW_PROFILE_STATEMENTS_TABULAR,
-	PLPGSQL_SHOW_PROFILE_FUNCTIONS_ALL_TABULAR
+	PLPGSQL_SHOW_PROFILE_FUNCTIONS_ALL_TABULAR,
+	PLPGSQL_SHOW_TRACER_MESSAGES_TABULAR,
+	PLPGSQL_SHOW_PROFILE_CALL_STACKS_TABULAR,
+	PLPGSQL_SHOW_PROFILE_COLLAPSED_STACKS,
+	PLPGSQL_SHOW_PROFILE_CRITICAL_PATH_TABULAR,
+	PLPGSQL_SHOW_PROFILE_SNAPSHOT_TABULAR,
+	PLPGSQL_SHOW_PROFILE_DYNAMIC_QUERIES_TABULAR,
+	PLPGSQL_SHOW_INTERNAL_STATS_TABULAR
+};
+
+enum
+{
+	PLPGSQL_CHECK_TRACER_OUTPUT_NOTICE,		/* messages are raised by elog (default) */
+	PLPGSQL_CHECK_TRACER_OUTPUT_BUFFER		/* messages are stored to tracer's buffer */
 };
 
 enum
@@ -56,9 +71,9 @@ enum
 
 typedef enum
 {
-	PLPGSQL_CHECK_STMT_WALKER_COUNT_EXEC_TIME,
 	PLPGSQL_CHECK_STMT_WALKER_PREPARE_RESULT,
-	PLPGSQL_CHECK_STMT_WALKER_COLLECT_COVERAGE
+	PLPGSQL_CHECK_STMT_WALKER_COLLECT_COVERAGE,
+	PLPGSQL_CHECK_STMT_WALKER_CRITICAL_PATH
 } profiler_stmt_walker_mode;
 
 typedef enum
@@ -84,6 +99,35 @@ typedef struct PLpgSQL_statements
 	Bitmapset  *invalidate_strconstvars;
 } PLpgSQL_statements;
 
+enum
+{
+	PLPGSQL_CHECK_CACHE_DEP_RELATION,
+	PLPGSQL_CHECK_CACHE_DEP_FUNCTION,
+	PLPGSQL_CHECK_CACHE_DEP_OPERATOR,
+	PLPGSQL_CHECK_CACHE_DEP_TYPE
+};
+
+typedef struct check_cache_dep
+{
+	int			kind;
+	Oid			oid;
+} check_cache_dep;
+
+/*
+ * Error or warning raised by checks of query, that is not displayed
+ * immediately (used by analysis cache).
+ */
+typedef struct plpgsql_check_captured_error
+{
+	int			sqlerrcode;
+	int			lineno;
+	char	   *message;
+	char	   *detail;
+	char	   *hint;
+	int			level;
+	int			position;
+} plpgsql_check_captured_error;
+
 typedef struct plpgsql_check_result_info
 {
 	int			format;						/* produced / expected format */
@@ -92,6 +136,12 @@ typedef struct plpgsql_check_result_info
 	MemoryContext query_ctx;				/* memory context for string operations */
 	StringInfo	sinfo;						/* buffer for multi line one value output formats */
 	bool		init_tag;					/* true, when init tag should be created */
+	StringInfo	cache_rows;					/* serialized result for check cache or NULL */
+	int			cache_nrows;				/* number of serialized rows */
+	StringInfo	cache_deps;					/* objects used by checked function */
+	uint64		cache_fingerprint;			/* fingerprint of used objects */
+	bool		cache_has_fingerprint;		/* true, when fingerprint is calculated */
+	bool		cache_found_error;			/* true, when result should not be cached */
 } plpgsql_check_result_info;
 
 typedef struct plpgsql_check_info
@@ -177,6 +227,8 @@ typedef struct PLpgSQL_checkstate
 	Oid			pragma_foid;				/* oid of plpgsql_check pragma function */
 	char	  **strconstvars;				/* the values of string variables where the value is constant */
 	PLpgSQL_statements *top_stmts;			/* pointer to current statement group */
+	bool		capture_errors;				/* true, when errors are collected to captured_errors */
+	List	   *captured_errors;			/* list of plpgsql_check_captured_error */
 } PLpgSQL_checkstate;
 
 typedef struct
@@ -216,9 +268,18 @@ extern void plpgsql_check_put_dependency(plpgsql_check_result_info *ri, char *ty
 extern void plpgsql_check_put_profile(plpgsql_check_result_info *ri, Datum queryids_array, int lineno, int stmt_lineno,
 	int cmds_on_row, int64 exec_count, int64 exec_count_err, int64 us_total, Datum max_time_array, Datum processed_rows_array, char *source_row);
 extern void plpgsql_check_put_profile_statement(plpgsql_check_result_info *ri, pc_queryid queryid, int stmtid, int parent_stmtid, const char *parent_note, int block_num, int lineno,
-	int64 exec_stmts, int64 exec_count_err, double total_time, double max_time, int64 processed_rows, char *stmtname);
+	int64 exec_stmts, int64 exec_count_err, double total_time, double max_time, double p95_time, double p99_time, int64 processed_rows, char *stmtname);
 extern void plpgsql_check_put_profiler_functions_all_tb(plpgsql_check_result_info *ri, Oid funcoid, int64 exec_count, int64 exec_count_err,
-	double total_time, double avg_time, double stddev_time, double min_time, double max_time);
+	double total_time, double avg_time, double stddev_time, double min_time, double max_time, double p95_time, double p99_time);
+extern void plpgsql_check_put_profiler_critical_path(plpgsql_check_result_info *ri, int level, int stmtid, int lineno, const char *stmtname,
+	int64 exec_stmts, double total_time, double self_time);
+extern void plpgsql_check_put_profiler_call_stack(plpgsql_check_result_info *ri, const char *stack, int64 exec_count, double total_time, double self_time);
+extern void plpgsql_check_put_profiler_snapshot(plpgsql_check_result_info *ri, Oid funcoid, int stmtid, int lineno,
+	int64 exec_count, int64 exec_count_err, double total_time, int64 processed_rows);
+extern void plpgsql_check_put_profiler_dynamic_query(plpgsql_check_result_info *ri, Oid funcoid, int stmtid, int lineno,
+	pc_queryid queryid, int64 exec_count, double total_time, double max_time, int64 processed_rows);
+extern void plpgsql_check_put_internal_stat(plpgsql_check_result_info *ri, const char *name, int64 count, bool has_time, double total_time);
+extern void plpgsql_check_put_tracer_message(plpgsql_check_result_info *ri, int pid, int64 seqno, TimestampTz time, const char *message);
 
 /*
  * function from catalog.c
@@ -267,6 +328,37 @@ extern bool plpgsql_check_fatal_errors;
 extern bool plpgsql_check_constants_tracing;
 extern int plpgsql_check_mode;
 
+/*
+ * functions from check_cache.c
+ */
+extern Size plpgsql_check_cache_shmem_size(void);
+extern void plpgsql_check_cache_shmem_init(void);
+extern bool plpgsql_check_cache_is_usable(plpgsql_check_result_info *ri, plpgsql_check_info *cinfo);
+extern bool plpgsql_check_cache_lookup(plpgsql_check_result_info *ri, plpgsql_check_info *cinfo);
+extern void plpgsql_check_cache_start(plpgsql_check_result_info *ri);
+extern void plpgsql_check_cache_add_dep(plpgsql_check_result_info *ri, int kind, Oid oid);
+extern void plpgsql_check_cache_collect_deps(PLpgSQL_checkstate *cstate, PLpgSQL_function *func);
+extern void plpgsql_check_cache_store(plpgsql_check_result_info *ri, plpgsql_check_info *cinfo);
+extern void plpgsql_check_cache_put_row(plpgsql_check_result_info *ri, Datum *values, bool *nulls);
+
+extern bool plpgsql_check_cache;
+extern int plpgsql_check_cache_max_entries;
+
+/*
+ * functions from analysis_cache.c
+ */
+extern void plpgsql_check_analyze_query(PLpgSQL_checkstate *cstate, PLpgSQL_expr *expr, Query *query);
+
+extern bool plpgsql_check_analysis_cache;
+
+/*
+ * functions from plan_advisor.c
+ */
+extern void plpgsql_check_plan_advisor_check(PLpgSQL_checkstate *cstate, CachedPlan *cplan, char *query_str);
+
+extern bool plpgsql_check_plan_advisor;
+extern double plpgsql_check_plan_advisor_min_cost;
+
 /*
  * functions from expr_walk.c
  */
@@ -306,6 +398,9 @@ extern void plpgsql_check_expr_generic_with_parser_setup(PLpgSQL_checkstate *cst
 extern Node *plpgsql_check_expr_get_node(PLpgSQL_checkstate *cstate, PLpgSQL_expr *expr, bool force_plan_checks);
 extern char *plpgsql_check_const_to_string(Node *node, int *location);
 extern CachedPlanSource *plpgsql_check_get_plan_source(PLpgSQL_checkstate *cstate, SPIPlanPtr plan);
+extern char plpgsql_check_query_volatility(PLpgSQL_checkstate *cstate, Query *query);
+extern void plpgsql_check_update_volatility(PLpgSQL_checkstate *cstate, char volatility);
+extern void plpgsql_check_collect_volatility(PLpgSQL_checkstate *cstate, Query *query);
 
 extern void plpgsql_check_assignment_to_variable(PLpgSQL_checkstate *cstate, PLpgSQL_expr *expr,
 	PLpgSQL_variable *targetvar, int targetdno);
@@ -343,12 +438,20 @@ extern bool plpgsql_check_pragma_assert(PLpgSQL_checkstate *cstate, PragmaAssert
 										PLpgSQL_nsitem *ns, int lineno);
 extern void plpgsql_check_search_comment_options(plpgsql_check_info *cinfo);
 extern char *plpgsql_check_process_echo_string(char *str, plpgsql_check_info *cinfo);
+extern List *plpgsql_check_get_type_relations(const char *src);
 
 /*
  * functions from profiler.c
  */
 extern bool plpgsql_check_profiler;
 extern int plpgsql_check_profiler_max_shared_chunks;
+extern int plpgsql_check_profiler_max_shared_memory;
+extern int plpgsql_check_profiler_flush_interval;
+extern int plpgsql_check_profiler_sample_rate;
+extern bool plpgsql_check_profiler_call_stacks;
+extern bool plpgsql_check_profiler_dynamic_queries;
+extern bool plpgsql_check_coverage;
+extern bool plpgsql_check_profiler_save;
 
 extern needs_fmgr_hook_type		plpgsql_check_next_needs_fmgr_hook;
 extern fmgr_hook_type			plpgsql_check_next_fmgr_hook;
@@ -359,13 +462,20 @@ extern void plpgsql_check_profiler_shmem_request(void);
 extern void plpgsql_check_profiler_shmem_startup(void);
 
 extern Size plpgsql_check_shmem_size(void);
+extern struct dsa_area *plpgsql_check_get_dsa(void);
 extern void plpgsql_check_profiler_init_hash_tables(void);
 
 extern void plpgsql_check_iterate_over_profile(plpgsql_check_info *cinfo, profiler_stmt_walker_mode mode,
    plpgsql_check_result_info *ri, coverage_state *cs);
 
 extern void plpgsql_check_profiler_show_profile(plpgsql_check_result_info *ri, plpgsql_check_info *cinfo);
-extern void plpgsql_check_profiler_iterate_over_all_profiles(plpgsql_check_result_info *ri);
+extern Oid *plpgsql_check_profiler_get_all_functions(int *nfuncs);
+extern void plpgsql_check_profiler_put_function_stats(plpgsql_check_result_info *ri, Oid fn_oid);
+extern void plpgsql_check_profiler_iterate_over_all_stacks(plpgsql_check_result_info *ri);
+extern void plpgsql_check_profiler_iterate_snapshot(plpgsql_check_result_info *ri);
+extern void plpgsql_check_profiler_iterate_delta(plpgsql_check_result_info *ri, text *consumer);
+extern void plpgsql_check_profiler_iterate_dynamic_queries(plpgsql_check_result_info *ri);
+extern void plpgsql_check_profiler_iterate_internal_stats(plpgsql_check_result_info *ri);
 
 extern void plpgsql_check_init_trace_info(PLpgSQL_execstate *estate);
 extern bool plpgsql_check_get_trace_info(PLpgSQL_execstate *estate, PLpgSQL_stmt *stmt, PLpgSQL_execstate **outer_estate, int *frame_num, int *level, instr_time *start_time);
@@ -398,6 +508,21 @@ extern void plpgsql_check_set_stmt_group_number(PLpgSQL_stmt *stmt, int *group_n
 
 extern void plpgsql_check_tracer_init(void);
 
+extern int plpgsql_check_tracer_output;
+extern int plpgsql_check_tracer_buffer_size;
+
+extern char *plpgsql_check_tracer_functions;
+extern char *plpgsql_check_tracer_lines;
+extern int plpgsql_check_tracer_stmt_min_duration;
+
+extern bool plpgsql_check_tracer_functions_check_hook(char **newval, void **extra, GucSource source);
+extern void plpgsql_check_tracer_functions_assign_hook(const char *newval, void *extra);
+extern bool plpgsql_check_tracer_lines_check_hook(char **newval, void **extra, GucSource source);
+extern void plpgsql_check_tracer_lines_assign_hook(const char *newval, void *extra);
+
+extern Size plpgsql_check_tracer_shmem_size(void);
+extern void plpgsql_check_tracer_shmem_init(void);
+
 /*
  * variables from pragma.c
  */
@@ -412,6 +537,7 @@ typedef struct plpgsql_check_plugin2_stmt_info
 	int			level;
 	int			natural_id;
 	int			parent_id;
+	int			lineno;
 	const char *typname;
 	bool		is_invisible;
 	bool		is_container;
@@ -419,6 +545,10 @@ typedef struct plpgsql_check_plugin2_stmt_info
 
 /*
  * functions from pldbgapi2
+ *
+ * The plugin is active for current call of function, when func_setup2
+ * sets plugin2_info to not NULL value. Statement's hooks of not active
+ * plugins are not called.
  */
 typedef struct plpgsql_check_plugin2
 {
@@ -464,6 +594,9 @@ extern int *plpgsql_check_get_stmtid_map(PLpgSQL_function *func);
 extern char *plpgsql_check_get_current_func_info_name(void);
 extern char *plpgsql_check_get_current_func_info_signature(void);
 extern MemoryContext plpgsql_check_get_current_fn_mcxt(void);
+extern void **plpgsql_check_get_current_fn_plugin2_data(plpgsql_check_plugin2 *plugin2);
+extern void **plpgsql_check_get_current_func_info_plugin2_data(plpgsql_check_plugin2 *plugin2);
+extern MemoryContext plpgsql_check_get_func_info_mcxt(void);
 
 #if PG_VERSION_NUM < 150000
 
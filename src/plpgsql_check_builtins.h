@@ -63,12 +63,24 @@ extern PGDLLEXPORT Datum plpgsql_check_function_tb_name(PG_FUNCTION_ARGS);
 extern PGDLLEXPORT Datum plpgsql_check_function_name(PG_FUNCTION_ARGS);
 extern PGDLLEXPORT Datum plpgsql_show_dependency_tb_name(PG_FUNCTION_ARGS);
 extern PGDLLEXPORT Datum plpgsql_profiler_reset(PG_FUNCTION_ARGS);
+extern PGDLLEXPORT Datum plpgsql_profiler_export(PG_FUNCTION_ARGS);
+extern PGDLLEXPORT Datum plpgsql_profiler_delta_close(PG_FUNCTION_ARGS);
+extern PGDLLEXPORT Datum plpgsql_profiler_delta(PG_FUNCTION_ARGS);
 extern PGDLLEXPORT Datum plpgsql_profiler_reset_all(PG_FUNCTION_ARGS);
 extern PGDLLEXPORT Datum plpgsql_profiler_function_tb(PG_FUNCTION_ARGS);
 extern PGDLLEXPORT Datum plpgsql_profiler_function_statements_tb(PG_FUNCTION_ARGS);
 extern PGDLLEXPORT Datum plpgsql_profiler_function_tb_name(PG_FUNCTION_ARGS);
 extern PGDLLEXPORT Datum plpgsql_profiler_function_statements_tb_name(PG_FUNCTION_ARGS);
 extern PGDLLEXPORT Datum plpgsql_profiler_functions_all_tb(PG_FUNCTION_ARGS);
+extern PGDLLEXPORT Datum plpgsql_profiler_critical_path(PG_FUNCTION_ARGS);
+extern PGDLLEXPORT Datum plpgsql_profiler_critical_path_name(PG_FUNCTION_ARGS);
+extern PGDLLEXPORT Datum plpgsql_profiler_call_stacks_tb(PG_FUNCTION_ARGS);
+extern PGDLLEXPORT Datum plpgsql_profiler_dynamic_queries(PG_FUNCTION_ARGS);
+extern PGDLLEXPORT Datum plpgsql_check_internal_stats(PG_FUNCTION_ARGS);
+extern PGDLLEXPORT Datum plpgsql_profiler_collapsed_stacks(PG_FUNCTION_ARGS);
+extern PGDLLEXPORT Datum plpgsql_profiler_snapshot(PG_FUNCTION_ARGS);
+extern PGDLLEXPORT Datum plpgsql_check_all_tb(PG_FUNCTION_ARGS);
+extern PGDLLEXPORT Datum plpgsql_check_cache_reset(PG_FUNCTION_ARGS);
 extern PGDLLEXPORT Datum plpgsql_coverage_statements(PG_FUNCTION_ARGS);
 extern PGDLLEXPORT Datum plpgsql_coverage_branches(PG_FUNCTION_ARGS);
 extern PGDLLEXPORT Datum plpgsql_coverage_statements_name(PG_FUNCTION_ARGS);
@@ -78,5 +90,7 @@ extern PGDLLEXPORT Datum plpgsql_profiler_install_fake_queryid_hook(PG_FUNCTION_
 extern PGDLLEXPORT Datum plpgsql_profiler_remove_fake_queryid_hook(PG_FUNCTION_ARGS);
 extern PGDLLEXPORT Datum plpgsql_check_profiler_ctrl(PG_FUNCTION_ARGS);
 extern PGDLLEXPORT Datum plpgsql_check_tracer_ctrl(PG_FUNCTION_ARGS);
+extern PGDLLEXPORT Datum plpgsql_check_tracer_messages(PG_FUNCTION_ARGS);
+extern PGDLLEXPORT Datum plpgsql_check_tracer_messages_reset(PG_FUNCTION_ARGS);
 
 #endif
@@ -12,22 +12,56 @@
 #include "plpgsql_check_builtins.h"
 
 #include "access/htup_details.h"
+#include "access/xact.h"
+#include "catalog/namespace.h"
 #include "catalog/pg_type.h"
 #include "commands/dbcommands.h"
+#include "libpq/pqformat.h"
+
+#if PG_VERSION_NUM >= 150000
+
+#include "common/pg_prng.h"
+
+#endif
+
+#if PG_VERSION_NUM >= 130000
+
+#include "common/hashfn.h"
+
+#else
+
+#include "access/hash.h"
+#include "utils/hashutils.h"
+
+#endif
+
 #include "nodes/pg_list.h"
 #include "parser/analyze.h"
+#include "pgstat.h"
+#include "port/atomics.h"
+#include "port/pg_bitutils.h"
+#include "port/pg_bswap.h"
+#include "storage/fd.h"
+#include "storage/ipc.h"
 #include "storage/lwlock.h"
+#include "storage/proc.h"
 #include "storage/shmem.h"
+#include "storage/spin.h"
 #include "tcop/tcopprot.h"
 #include "utils/array.h"
 #include "utils/builtins.h"
+#include "utils/dsa.h"
+#include "utils/inval.h"
 #include "utils/memutils.h"
 #include "utils/lsyscache.h"
+#include "utils/regproc.h"
 #include "utils/snapmgr.h"
 #include "utils/syscache.h"
+#include "utils/timestamp.h"
 #include "utils/float.h"
 
 #include <math.h>
+#include <unistd.h>
 
 /*
  * Any instance of plpgsql function will have a own profile.
@@ -44,7 +78,6 @@ typedef struct profiler_hashkey
 	Oid			db_oid;
 	TransactionId fn_xmin;
 	ItemPointerData fn_tid;
-	int16		chunk_num;
 } profiler_hashkey;
 
 /*
@@ -59,9 +92,34 @@ typedef struct fstats_hashkey
 	Oid			db_oid;
 } fstats_hashkey;
 
-typedef struct fstats
+/*
+ * Latencies of statements and functions are counted in log-linear
+ * histogram. Every power of two (in microseconds) is split into two
+ * buckets, so the relative error of estimated percentile is lower than
+ * 33%. Last bucket counts all latencies longer than 12 sec.
+ */
+#define PROFILER_HISTOGRAM_BUCKETS		48
+
+/*
+ * Counters of shared function's statistics are sharded by number of
+ * process, so concurrent backends usually update different shards, and
+ * they don't wait on spinlock. The shards are aggregated, when the
+ * statistics are displayed.
+ */
+#define FSTATS_SHARDS		16
+
+#if PG_VERSION_NUM >= 170000
+
+#define FSTATS_SHARD_ID		(MyProcNumber % FSTATS_SHARDS)
+
+#else
+
+#define FSTATS_SHARD_ID		(MyProc->pgprocno % FSTATS_SHARDS)
+
+#endif
+
+typedef struct fstats_shard
 {
-	fstats_hashkey key;
 	slock_t		mutex;
 	uint64		exec_count;
 	uint64		exec_count_err;
@@ -69,8 +127,147 @@ typedef struct fstats
 	double		total_time_xx;
 	uint64		min_time;
 	uint64		max_time;
+	uint32		histogram[PROFILER_HISTOGRAM_BUCKETS];
+} fstats_shard;
+
+/*
+ * Every shard uses own cache lines, because the shards are updated by
+ * different backends in same time.
+ */
+typedef union fstats_shard_padded
+{
+	fstats_shard shard;
+	char		pad[TYPEALIGN(PG_CACHE_LINE_SIZE, sizeof(fstats_shard))];
+} fstats_shard_padded;
+
+#define FSTATS_SHARDS_SIZE		(sizeof(fstats_shard_padded) * FSTATS_SHARDS + PG_CACHE_LINE_SIZE)
+
+/*
+ * The entries of hash table are not aligned to cache line, so the shards
+ * are stored in buffer with space for alignment, and they should be
+ * accessed by get_fstats_shard.
+ */
+typedef struct fstats
+{
+	fstats_hashkey key;
+	pg_atomic_uint64 generation;			/* generation of last update */
+	char		shards[FSTATS_SHARDS_SIZE];	/* local statistics use only first shard */
 } fstats;
 
+#define FSTATS_MAX_SHARED_ENTRIES		1000
+
+/*
+ * Call stacks of profiled functions. Every frame holds function and
+ * line of statement, that called next function (zero for last frame).
+ * The frames are part of hash key, so different stacks are never merged,
+ * and the unused frames of key have to be zeroed. Deeper calls are not
+ * recorded, and their time is counted as self time of last recorded
+ * function.
+ */
+#define PROFILER_MAX_STACK_DEPTH		32
+#define PROFILER_MAX_SHARED_STACKS		5000
+
+typedef struct profiler_stack_frame
+{
+	Oid			fn_oid;
+	int			lineno;
+} profiler_stack_frame;
+
+typedef struct profiler_stack_hashkey
+{
+	Oid			db_oid;
+	int			depth;
+	profiler_stack_frame frames[PROFILER_MAX_STACK_DEPTH];
+} profiler_stack_hashkey;
+
+typedef struct profiler_stack
+{
+	profiler_stack_hashkey key;
+	slock_t		mutex;			/* used only by shared stacks */
+	uint64		exec_count;
+	uint64		total_time;
+	uint64		self_time;
+} profiler_stack;
+
+/*
+ * Dynamic statements (EXECUTE, FOR IN EXECUTE, RETURN QUERY EXECUTE)
+ * can execute different queries. The counters of queries (identified
+ * by queryid) are collected separately for any dynamic statement. Only
+ * PROFILER_DYNQ_TOPK most expensive queries are held per statement.
+ * When there is not free slot, then the query with lowest total time
+ * is replaced, and the new query inherits its counters (like the
+ * Space-Saving algorithm), so the total time of query is overestimated
+ * rather than underestimated.
+ */
+#define PROFILER_DYNQ_TOPK				10
+#define PROFILER_MAX_SHARED_DYNQ		2000
+
+typedef struct profiler_dynq_hashkey
+{
+	profiler_hashkey fkey;
+	int			stmtid;
+} profiler_dynq_hashkey;
+
+typedef struct profiler_dynq_counters
+{
+	pc_queryid	queryid;
+	uint64		exec_count;
+	uint64		us_total;
+	uint64		us_max;
+	uint64		rows;
+} profiler_dynq_counters;
+
+typedef struct profiler_dynq
+{
+	profiler_dynq_hashkey key;
+	slock_t		mutex;			/* used only by shared entries */
+	int			lineno;
+	int			nqueries;
+	profiler_dynq_counters queries[PROFILER_DYNQ_TOPK];
+} profiler_dynq;
+
+/*
+ * Coverage collection mode doesn't use clock, and it doesn't count
+ * executions. The coverage plugin sets only bit of executed statement.
+ * Second part of bitmap is used for IF statements without ELSE, and
+ * the bit is set, when no branch of this IF statement was executed
+ * (implicit else path). The bitmaps (indexed by stmtid) are merged
+ * to session bitmap of function by bitwise OR when function is finished.
+ * The session bitmaps are merged to shared bitmaps together with pending
+ * profiles, so the shared bitmaps are not locked after any call.
+ */
+#define COVERAGE_BITMAP_WORDS(nstmts)		(((nstmts) * 2 + 31) / 32)
+#define COVERAGE_BIT_SET(bits, n)			((bits)[(n) / 32] |= ((uint32) 1 << ((n) % 32)))
+#define COVERAGE_BIT_IS_SET(bits, n)		(((bits)[(n) / 32] & ((uint32) 1 << ((n) % 32))) != 0)
+
+#define COVERAGE_MAX_SHARED_ENTRIES		5000
+
+/*
+ * The words of shared bitmap are allocated in profiler's dynamic shared
+ * memory, and they are updated by atomic operations (only shared lock is
+ * required like for shared profiles).
+ */
+typedef struct coverage_bitmap
+{
+	profiler_hashkey key;
+	int			nstatements;
+	dsa_pointer	bits_dp;
+	uint32	   *bits;			/* used only by local bitmaps */
+} coverage_bitmap;
+
+/*
+ * The coverage_info is stored in fmgr cache, and it is reused by next
+ * calls of function by same FmgrInfo.
+ */
+typedef struct coverage_info
+{
+	PLpgSQL_function *func;
+	int			last_stmtid;
+	bool		is_active;
+	int			nwords;
+	uint32	   *bits;
+} coverage_info;
+
 /*
  * This is used as cache for types of expressions of USING clause
  * (EXECUTE like statements).
@@ -83,24 +280,90 @@ typedef struct
 
 /*
  * Attention - the commands that can contains nestested commands
- * has attached own time and nested statements time too.
+ * has attached own time and nested statements time too. The time
+ * of nested statements is accumulated in us_nested, and it is
+ * subtracted when statement is finished.
  */
 typedef struct profiler_stmt
 {
-	int			lineno;
 	pc_queryid	queryid;
 	uint64		us_max;
-	uint64		us_total;
+	uint64		us_total;		/* self time */
+	uint64		us_nested;		/* total time of nested statements */
+	uint64		us_nested_start;	/* us_nested in start of last execution */
 	uint64		rows;
 	uint64		exec_count;
 	uint64		exec_count_err;
 	instr_time	start_time;
 	instr_time	total;
 	bool		has_queryid;
+	bool		is_dynamic;
 	query_params *qparams;
+	uint32	   *histogram;		/* allocated when statement is executed more times */
 } profiler_stmt;
 
+/*
+ * The counters of persistent profile are updated by atomic operations,
+ * so more backends can merge their local profiles of same function
+ * in parallel (only shared lock on profiler's hash table is required).
+ * The lineno, queryid and has_queryid are set when the profile is created
+ * (under exclusive lock), and then they are read only.
+ */
 typedef struct profiler_stmt_reduced
+{
+	int			lineno;
+	pc_queryid	queryid;
+	pg_atomic_uint64 us_max;
+	pg_atomic_uint64 us_total;
+	pg_atomic_uint64 rows;
+	pg_atomic_uint64 exec_count;
+	pg_atomic_uint64 exec_count_err;
+	bool		has_queryid;
+	pg_atomic_uint32 histogram[PROFILER_HISTOGRAM_BUCKETS];
+} profiler_stmt_reduced;
+
+/*
+ * Statements of persistent profile are stored in one array. Every
+ * statement uses own cache lines, because the counters of different
+ * statements are updated by different backends in same time.
+ */
+typedef union profiler_stmt_reduced_padded
+{
+	profiler_stmt_reduced stmt;
+	char		pad[TYPEALIGN(PG_CACHE_LINE_SIZE, sizeof(profiler_stmt_reduced))];
+} profiler_stmt_reduced_padded;
+
+/*
+ * The persistent profile of function. The statements of shared profile
+ * are allocated in dynamic shared memory area, so the hash table of
+ * profiles holds only small entries, and the memory used for profiles
+ * can grow without restart. The statements of local profile are allocated
+ * in profiler's memory context.
+ *
+ * The time of last update of profile is used for eviction of least
+ * recently updated profiles, when there is not free space for new profile.
+ */
+typedef struct profiler_profile
+{
+	profiler_hashkey key;
+	int			nstatements;
+	dsa_pointer	stmts_dp;
+	void	   *stmts;
+	pg_atomic_uint64 last_update;
+	pg_atomic_uint64 generation;	/* generation of last update */
+} profiler_profile;
+
+#define PROFILER_PROFILE_STMTS_SIZE(n)	(sizeof(profiler_stmt_reduced_padded) * (n) + PG_CACHE_LINE_SIZE)
+
+/* size of dynamic shared memory area allocated in main shared memory */
+#define PROFILER_DSA_INITIAL_SIZE		(1024 * 1024)
+
+/*
+ * Plain statement's counters in natural order. These counters are
+ * accumulated in session memory, and later they are merged to
+ * persistent profile.
+ */
+typedef struct profiler_stmt_counters
 {
 	int			lineno;
 	pc_queryid	queryid;
@@ -110,26 +373,143 @@ typedef struct profiler_stmt_reduced
 	uint64		exec_count;
 	uint64		exec_count_err;
 	bool		has_queryid;
-} profiler_stmt_reduced;
-
-#define		STATEMENTS_PER_CHUNK		30
+	uint32		histogram[PROFILER_HISTOGRAM_BUCKETS];
+} profiler_stmt_counters;
 
 /*
- * The shared profile will be stored as set of chunks
+ * Already aggregated profile of function, that is not merged to
+ * persistent profile yet. When plpgsql_check.profiler_flush_interval
+ * is zero, then the pending profile is flushed immediately when
+ * function is finished.
  */
-typedef struct profiler_stmt_chunk
+typedef struct profiler_pending_profile
 {
 	profiler_hashkey key;
-	slock_t		mutex;			/* only first chunk require mutex */
-	profiler_stmt_reduced stmts[STATEMENTS_PER_CHUNK];
-} profiler_stmt_chunk;
+	uint64		ncalls;
+	uint64		ncalls_err;
+	uint64		total_time;
+	float8		total_time_xx;
+	uint64		min_time;
+	uint64		max_time;
+	uint32		histogram[PROFILER_HISTOGRAM_BUCKETS];
+	int			nstatements;
+	profiler_stmt_counters *stmts;
+} profiler_pending_profile;
+
+/*
+ * Counters of own overhead of profiler. They are accumulated in session
+ * memory, and they are added to shared counters, when pending profiles
+ * are flushed. Only waits on locks are counted (the acquisitions without
+ * waiting are not counted), so these counters are cheap. Some events
+ * have not measured time.
+ */
+typedef enum profiler_internal_counter
+{
+	PROFILER_INTERNAL_PROFILE_UPDATE,
+	PROFILER_INTERNAL_FSTATS_UPDATE,
+	PROFILER_INTERNAL_STACK_UPDATE,
+	PROFILER_INTERNAL_PROFILER_LOCK_WAIT,
+	PROFILER_INTERNAL_FSTATS_LOCK_WAIT,
+	PROFILER_INTERNAL_FSTATS_SPINLOCK_CONTENTION,
+	PROFILER_INTERNAL_PROFILE_EVICTION,
+	PROFILER_INTERNAL_PROFILE_INSERT_FAILURE,
+	PROFILER_INTERNAL_FSTATS_INSERT_FAILURE,
+	PROFILER_INTERNAL_STACK_INSERT_FAILURE,
+	PROFILER_INTERNAL_DYNQ_INSERT_FAILURE,
+	PROFILER_INTERNAL_COVERAGE_INSERT_FAILURE,
+	PROFILER_INTERNAL_COUNTERS
+} profiler_internal_counter;
+
+static const struct
+{
+	const char *name;
+	bool		has_time;
+} profiler_internal_counter_desc[PROFILER_INTERNAL_COUNTERS] = {
+	{"profile_update", true},
+	{"fstats_update", true},
+	{"stack_update", true},
+	{"profiler_lock_wait", true},
+	{"fstats_lock_wait", true},
+	{"fstats_spinlock_contention", false},
+	{"profile_eviction", false},
+	{"profile_insert_failure", false},
+	{"fstats_insert_failure", false},
+	{"stack_insert_failure", false},
+	{"dynq_insert_failure", false},
+	{"coverage_insert_failure", false}
+};
+
+typedef struct profiler_internal_stat
+{
+	uint64		count;
+	uint64		us_total;
+} profiler_internal_stat;
 
 typedef struct profiler_shared_state
 {
 	LWLock	   *lock;
 	LWLock	   *fstats_lock;
+	LWLock	   *stacks_lock;
+	LWLock	   *dynq_lock;
+	LWLock	   *coverage_lock;
+	int			dsa_tranche_id;
+	slock_t		attach_mutex;	/* protects nattached and nattaches */
+	int			nattached;		/* number of backends that use shared profiles */
+	uint64		nattaches;		/* number of attaches from server start */
+	bool		snapshot_loaded;
+	pg_atomic_uint64 internal_count[PROFILER_INTERNAL_COUNTERS];
+	pg_atomic_uint64 internal_us_total[PROFILER_INTERNAL_COUNTERS];
 } profiler_shared_state;
 
+/*
+ * The shared profiles, function's statistics and call stacks are saved
+ * to file, when last backend, that uses them, is finished, and they are
+ * loaded by first backend, that uses them after start of server. The
+ * statements of profiles are stored in dynamic shared memory, that is
+ * not accessible from postmaster, so the file cannot be written and read
+ * inside postmaster (like pg_stat_statements does).
+ */
+#define PROFILER_DUMP_FILE		PGSTAT_STAT_PERMANENT_DIRECTORY "/plpgsql_check_profiler.stat"
+
+/* magic number identifying the file format */
+static const uint32 PROFILER_FILE_HEADER = 0x50430001;
+
+/* files from different major versions can differ in layout */
+static const uint32 PROFILER_PG_MAJOR_VERSION = PG_VERSION_NUM / 100;
+
+/*
+ * The queryid of static query is same for all calls of one version
+ * of function, so it is cached in pldbgapi2's function's cache and
+ * it is not searched again for every call of function.
+ */
+typedef struct profiler_queryid_cache_entry
+{
+	pc_queryid	queryid;
+	bool		has_queryid;
+	bool		is_valid;
+} profiler_queryid_cache_entry;
+
+typedef struct profiler_func_info_cache
+{
+	int			nstatements;
+	profiler_queryid_cache_entry stmts[FLEXIBLE_ARRAY_MEMBER];
+} profiler_func_info_cache;
+
+/*
+ * The queryid of dynamic query is calculated by parse analysis of query
+ * string. The result is cached in session by hash of query string,
+ * search_path and types of parameters. The cache is reset, when it is
+ * full, or when some relation, function, type or schema is changed
+ * (the queryid depends on oids of used objects).
+ */
+typedef struct profiler_dyn_queryid_entry
+{
+	uint64		hashval;
+	pc_queryid	queryid;
+} profiler_dyn_queryid_entry;
+
+#define PROFILER_DYN_QUERYID_CACHE_MAX_ENTRIES		1000
+
 /*
  * This structure is used as plpgsql extension parameter
  */
@@ -139,14 +519,24 @@ typedef struct profiler_info
 	int			nstatements;
 	instr_time	start_time;
 	PLpgSQL_function *func;
+	profiler_func_info_cache *fcache;
+	MemoryContext mcxt;
+	uint64		weight;			/* number of calls represented by this call */
+
+	/* fields used when call stacks are recorded */
+	struct profiler_info *caller;
+	int			stack_depth;	/* zero, when call stack is not recorded */
+	int			current_stmtid;
+	uint64		nested_time;	/* time of nested profiled calls */
+	plpgsql_check_plugin2_stmt_info *stmts_info;
 } profiler_info;
 
 typedef struct profiler_iterator
 {
 	profiler_hashkey key;
 	plpgsql_check_result_info *ri;
-	HTAB	   *chunks;
-	profiler_stmt_chunk *current_chunk;
+	profiler_profile *profile;
+	profiler_stmt_reduced_padded *stmts;
 	int			current_statement;
 
 #ifdef USE_ASSERT_CHECKING
@@ -160,10 +550,11 @@ typedef struct profiler_iterator
 typedef struct
 {
 	int			stmtid;
-	int64 nested_us_time;
 	int64 nested_exec_count;
 	profiler_iterator *pi;
 	coverage_state *cs;
+	uint32	   *coverage_bits;	/* bitmap of coverage plugin or NULL */
+	int			nstatements;
 	int		   *stmtid_map;
 	plpgsql_check_plugin2_stmt_info *stmts_info;
 } profiler_stmt_walker_options;
@@ -179,10 +570,23 @@ enum
  * It should to take about 24.4MB of shared memory.
  */
 int plpgsql_check_profiler_max_shared_chunks = 15000;
+int plpgsql_check_profiler_max_shared_memory = 102400;
+
+/*
+ * When it is higher than zero, then the aggregated profiles are
+ * merged to shared memory only once per this interval (in ms).
+ */
+int plpgsql_check_profiler_flush_interval = 0;
+int plpgsql_check_profiler_sample_rate = 1;
+
+/* when true, then shared profiles are saved across server restarts */
+bool plpgsql_check_profiler_save = true;
 
 PG_FUNCTION_INFO_V1(plpgsql_check_profiler_ctrl);
 PG_FUNCTION_INFO_V1(plpgsql_profiler_reset_all);
 PG_FUNCTION_INFO_V1(plpgsql_profiler_reset);
+PG_FUNCTION_INFO_V1(plpgsql_profiler_export);
+PG_FUNCTION_INFO_V1(plpgsql_profiler_delta_close);
 PG_FUNCTION_INFO_V1(plpgsql_coverage_statements);
 PG_FUNCTION_INFO_V1(plpgsql_coverage_branches);
 PG_FUNCTION_INFO_V1(plpgsql_coverage_statements_name);
@@ -190,9 +594,22 @@ PG_FUNCTION_INFO_V1(plpgsql_coverage_branches_name);
 PG_FUNCTION_INFO_V1(plpgsql_profiler_install_fake_queryid_hook);
 PG_FUNCTION_INFO_V1(plpgsql_profiler_remove_fake_queryid_hook);
 
-static void update_persistent_profile(profiler_info *pinfo, PLpgSQL_function *func, const int *stmtid_map);
+static void profiler_snapshot_attach(void);
+static void profiler_snapshot_detach(int code, Datum arg);
+static bool update_persistent_profile(profiler_pending_profile *pp, int elevel);
+static bool update_persistent_fstats(profiler_pending_profile *pp, int elevel);
+static bool update_persistent_stack(profiler_stack *pstack, int elevel);
+static bool update_persistent_dynq(profiler_dynq *pdynq, int elevel);
+static bool update_persistent_coverage(coverage_bitmap *pcb, int elevel);
+static void profiler_flush_pending(int elevel);
+static void profiler_xact_callback(XactEvent event, void *arg);
+static void profiler_exit_callback(int code, Datum arg);
+static uint64 initial_generation(void);
+static uint32 *get_coverage_bits(profiler_hashkey *hk, int nstatements);
 static PLpgSQL_expr *profiler_get_expr(PLpgSQL_stmt *stmt, bool *dynamic, List **params);
-static pc_queryid profiler_get_queryid(PLpgSQL_execstate *estate, PLpgSQL_stmt *stmt, bool *has_queryid, query_params **qparams);
+static pc_queryid profiler_get_queryid(PLpgSQL_execstate *estate, PLpgSQL_stmt *stmt, bool *has_queryid, bool *is_dynamic, query_params **qparams, MemoryContext mcxt);
+static profiler_stmt_reduced_padded *get_profile_stmts(profiler_profile *profile);
+static fstats_shard *get_fstats_shard(fstats *fstats_item, int shard_id);
 
 #if PG_VERSION_NUM >= 140000
 
@@ -204,9 +621,9 @@ static void profiler_fake_queryid_hook(ParseState *pstate, Query *query);
 
 #endif
 
-static void stmts_walker(profiler_info *pinfo, profiler_stmt_walker_mode, List *stmts, PLpgSQL_stmt *parent_stmt,
+static void stmts_walker(profiler_stmt_walker_mode, List *stmts, PLpgSQL_stmt *parent_stmt,
 	 const char *description, profiler_stmt_walker_options *opts);
-static void profiler_stmt_walker(profiler_info *pinfo, profiler_stmt_walker_mode mode, PLpgSQL_stmt *stmt,
+static void profiler_stmt_walker(profiler_stmt_walker_mode mode, PLpgSQL_stmt *stmt,
 	 PLpgSQL_stmt *parent_stmt, const char *description, int stmt_block_num, profiler_stmt_walker_options *opts);
 
 static void profiler_func_setup(PLpgSQL_execstate *estate, PLpgSQL_function *func, void **plugin2_info);
@@ -216,25 +633,68 @@ static void profiler_stmt_beg(PLpgSQL_execstate *estate, PLpgSQL_stmt *stmt, voi
 static void profiler_stmt_end(PLpgSQL_execstate *estate, PLpgSQL_stmt *stmt, void **plugin2_info);
 static void profiler_stmt_end_aborted(Oid fn_oid, int stmtid, void **plugin2_info);
 
+static void coverage_func_setup(PLpgSQL_execstate *estate, PLpgSQL_function *func, void **plugin2_info);
+static void coverage_func_end(PLpgSQL_execstate *estate, PLpgSQL_function *func, void **plugin2_info);
+static void coverage_func_end_aborted(Oid fn_oid, void **plugin2_info);
+static void coverage_stmt_beg(PLpgSQL_execstate *estate, PLpgSQL_stmt *stmt, void **plugin2_info);
+static void coverage_stmt_end(PLpgSQL_execstate *estate, PLpgSQL_stmt *stmt, void **plugin2_info);
+
 
 static plpgsql_check_plugin2 profiler_plugin2 = { profiler_func_setup,
 												  NULL, profiler_func_end, profiler_func_end_aborted,
 												  profiler_stmt_beg, profiler_stmt_end, profiler_stmt_end_aborted,
 												  NULL, NULL, NULL, NULL, NULL };
 
+static plpgsql_check_plugin2 coverage_plugin2 = { coverage_func_setup,
+												  NULL, coverage_func_end, coverage_func_end_aborted,
+												  coverage_stmt_beg, coverage_stmt_end, NULL,
+												  NULL, NULL, NULL, NULL, NULL };
+
 static HTAB *profiler_HashTable = NULL;
-static HTAB *shared_profiler_chunks_HashTable = NULL;
-static HTAB *profiler_chunks_HashTable = NULL;
+static HTAB *shared_profiles_HashTable = NULL;
+static HTAB *profiles_HashTable = NULL;
 static HTAB *fstats_HashTable = NULL;
 static HTAB *shared_fstats_HashTable = NULL;
+static HTAB *profiler_pending_HashTable = NULL;
+static HTAB *stacks_HashTable = NULL;
+static HTAB *shared_stacks_HashTable = NULL;
+static HTAB *profiler_pending_stacks_HashTable = NULL;
+static HTAB *dynq_HashTable = NULL;
+static HTAB *shared_dynq_HashTable = NULL;
+static HTAB *profiler_pending_dynq_HashTable = NULL;
+static HTAB *coverage_HashTable = NULL;
+static HTAB *shared_coverage_HashTable = NULL;
+static HTAB *coverage_pending_HashTable = NULL;
+static HTAB *profiler_cursors_HashTable = NULL;
+
+/* innermost profiled call, when call stacks are recorded */
+static profiler_info *profiler_current_pinfo = NULL;
+
+static instr_time profiler_last_flush_time;
+static bool profiler_flush_callbacks_registered = false;
+static bool profiler_snapshot_attached = false;
 
 static post_parse_analyze_hook_type prev_post_parse_analyze_hook = NULL;
 
 static profiler_shared_state *profiler_ss = NULL;
+static void *profiler_dsa_place = NULL;
+static dsa_area *profiler_dsa = NULL;
+static int profiler_dsa_size_limit = -1;
 static MemoryContext profiler_mcxt = NULL;
+
+/* not flushed counters of own overhead */
+static profiler_internal_stat profiler_internal_stats[PROFILER_INTERNAL_COUNTERS];
+
 static MemoryContext profiler_queryid_mcxt = NULL;
 
+static HTAB *profiler_dyn_queryid_HashTable = NULL;
+static MemoryContext profiler_dyn_queryid_mcxt = NULL;
+static bool profiler_dyn_queryid_callbacks_registered = false;
+
 bool plpgsql_check_profiler = false;
+bool plpgsql_check_profiler_call_stacks = false;
+bool plpgsql_check_profiler_dynamic_queries = false;
+bool plpgsql_check_coverage = false;
 
 /*
  * Use the Youngs-Cramer algorithm to incorporate the new value into the
@@ -272,27 +732,137 @@ eval_stddev_accum(uint64 *_N, uint64 *_Sx, float8 *_Sxx, uint64 newval)
 	*_Sxx = Sxx;
 }
 
-static profiler_stmt_reduced *
-get_stmt_profile_next(profiler_iterator *pi)
+/*
+ * Atomic update of maximum. The CAS loop is usually finished
+ * by first iteration, because an max value is not changed often.
+ */
+static void
+atomic_update_max_u64(pg_atomic_uint64 *target, uint64 value)
 {
-	if (pi->current_chunk)
+	uint64		current = pg_atomic_read_u64(target);
+
+	while (current < value)
 	{
-		if (pi->current_statement >= STATEMENTS_PER_CHUNK)
-		{
-			bool		found;
+		if (pg_atomic_compare_exchange_u64(target, &current, value))
+			break;
+	}
+}
+
+/*
+ * Merge two sets of transition values of Youngs-Cramer algorithm
+ * (same formula is used by float8_combine).
+ */
+static void
+eval_stddev_combine(uint64 *_N, uint64 *_Sx, float8 *_Sxx,
+					uint64 N2, uint64 Sx2, float8 Sxx2)
+{
+	uint64		N1 = *_N;
+	uint64		Sx1 = *_Sx;
+	float8		Sxx1 = *_Sxx;
 
-			pi->key.chunk_num += 1;
+	if (N1 == 0)
+	{
+		*_N = N2;
+		*_Sx = Sx2;
+		*_Sxx = Sxx2;
+	}
+	else if (N2 > 0)
+	{
+		uint64		N = N1 + N2;
+		float8		tmp;
 
-			pi->current_chunk = (profiler_stmt_chunk *) hash_search(pi->chunks,
-														 (void *) &pi->key,
-														 HASH_FIND,
-														 &found);
+		tmp = ((float8) Sx1) / ((float8) N1) - ((float8) Sx2) / ((float8) N2);
+
+		Sxx1 += Sxx2 + ((float8) N1) * ((float8) N2) * tmp * tmp / ((float8) N);
+
+		if (isinf(Sxx1))
+			Sxx1 = get_float8_nan();
+
+		*_N = N;
+		*_Sx = Sx1 + Sx2;
+		*_Sxx = Sxx1;
+	}
+}
+
+/*
+ * Returns bucket of latency histogram for time in microseconds.
+ */
+static inline int
+histogram_bucket(uint64 us)
+{
+	int			msb;
+	int			bucket;
+
+	if (us < 2)
+		return (int) us;
+
+	msb = pg_leftmost_one_pos64(us);
+	bucket = 2 * msb + (int) ((us >> (msb - 1)) & 1);
+
+	return bucket < PROFILER_HISTOGRAM_BUCKETS ? bucket : PROFILER_HISTOGRAM_BUCKETS - 1;
+}
+
+/*
+ * Returns highest time (in microseconds) counted by bucket.
+ */
+static uint64
+histogram_bucket_upper_bound(int bucket)
+{
+	int			msb;
+
+	if (bucket < 2)
+		return (uint64) bucket;
+
+	msb = bucket / 2;
+
+	return ((uint64) 1 << msb) + ((uint64) (bucket % 2 + 1) << (msb - 1)) - 1;
+}
+
+/*
+ * Returns estimated percentile (in microseconds) of latencies counted
+ * by histogram. The upper bound of bucket is used as estimation, but
+ * it cannot be higher than known maximal time.
+ */
+static double
+histogram_percentile(const uint32 *histogram, double percentile, uint64 max_time)
+{
+	uint64		total = 0;
+	uint64		threshold;
+	uint64		count = 0;
+	int			i;
+
+	for (i = 0; i < PROFILER_HISTOGRAM_BUCKETS; i++)
+		total += histogram[i];
+
+	if (total == 0)
+		return 0.0;
 
-			if (!found)
-				elog(ERROR, "broken consistency of plpgsql_check profiler chunks");
+	threshold = (uint64) ceil(total * percentile);
+	if (threshold == 0)
+		threshold = 1;
+
+	for (i = 0; i < PROFILER_HISTOGRAM_BUCKETS; i++)
+	{
+		count += histogram[i];
+
+		if (count >= threshold)
+		{
+			uint64		upper_bound = histogram_bucket_upper_bound(i);
 
-			pi->current_statement = 0;
+			return (double) (upper_bound < max_time ? upper_bound : max_time);
 		}
+	}
+
+	return (double) max_time;
+}
+
+static profiler_stmt_reduced *
+get_stmt_profile_next(profiler_iterator *pi)
+{
+	if (pi->profile)
+	{
+		if (pi->current_statement >= pi->profile->nstatements)
+			elog(ERROR, "broken consistency of plpgsql_check profile");
 
 #ifdef USE_ASSERT_CHECKING
 
@@ -300,14 +870,14 @@ get_stmt_profile_next(profiler_iterator *pi)
 
 #endif
 
-		return &pi->current_chunk->stmts[pi->current_statement++];
+		return &pi->stmts[pi->current_statement++].stmt;
 	}
 
 	return NULL;
 }
 
 /*
- * Calculate required size of shared memory for chunks
+ * Calculate required size of shared memory for profiles
  *
  */
 Size
@@ -318,7 +888,22 @@ plpgsql_check_shmem_size(void)
 	num_bytes = MAXALIGN(sizeof(profiler_shared_state));
 	num_bytes = add_size(num_bytes,
 						 hash_estimate_size(plpgsql_check_profiler_max_shared_chunks,
-											sizeof(profiler_stmt_chunk)));
+											sizeof(profiler_profile)));
+	num_bytes = add_size(num_bytes, MAXALIGN(PROFILER_DSA_INITIAL_SIZE));
+	num_bytes = add_size(num_bytes,
+						 hash_estimate_size(FSTATS_MAX_SHARED_ENTRIES,
+											sizeof(fstats)));
+	num_bytes = add_size(num_bytes,
+						 hash_estimate_size(PROFILER_MAX_SHARED_STACKS,
+											sizeof(profiler_stack)));
+	num_bytes = add_size(num_bytes,
+						 hash_estimate_size(PROFILER_MAX_SHARED_DYNQ,
+											sizeof(profiler_dynq)));
+	num_bytes = add_size(num_bytes,
+						 hash_estimate_size(COVERAGE_MAX_SHARED_ENTRIES,
+											sizeof(coverage_bitmap)));
+	num_bytes = add_size(num_bytes, plpgsql_check_cache_shmem_size());
+	num_bytes = add_size(num_bytes, plpgsql_check_tracer_shmem_size());
 
 	return num_bytes;
 }
@@ -341,13 +926,18 @@ plpgsql_check_profiler_shmem_request(void)
 
 	RequestNamedLWLockTranche("plpgsql_check profiler", 1);
 	RequestNamedLWLockTranche("plpgsql_check fstats", 1);
+	RequestNamedLWLockTranche("plpgsql_check call stacks", 1);
+	RequestNamedLWLockTranche("plpgsql_check dynamic queries", 1);
+	RequestNamedLWLockTranche("plpgsql_check coverage", 1);
+	RequestNamedLWLockTranche("plpgsql_check check cache", 1);
+	RequestNamedLWLockTranche("plpgsql_check tracer", 1);
 }
 
 #endif
 
 /*
  * Initialize shared memory used like permanent profile storage.
- * No other parts use shared memory, so this code is completly here.
+ * The shared memory of check cache and tracer's buffer is initialized here too.
  *
  */
 void
@@ -355,9 +945,15 @@ plpgsql_check_profiler_shmem_startup(void)
 {
 	bool		found;
 	HASHCTL		info;
+	int			i;
 
-	shared_profiler_chunks_HashTable = NULL;
+	shared_profiles_HashTable = NULL;
 	shared_fstats_HashTable = NULL;
+	shared_stacks_HashTable = NULL;
+	shared_dynq_HashTable = NULL;
+	shared_coverage_HashTable = NULL;
+	profiler_dsa_place = NULL;
+	profiler_dsa = NULL;
 
 	if (plpgsql_check_prev_shmem_startup_hook)
 		plpgsql_check_prev_shmem_startup_hook();
@@ -375,17 +971,59 @@ plpgsql_check_profiler_shmem_startup(void)
 	{
 		profiler_ss->lock = &(GetNamedLWLockTranche("plpgsql_check profiler"))->lock;
 		profiler_ss->fstats_lock = &(GetNamedLWLockTranche("plpgsql_check fstats"))->lock;
+		profiler_ss->stacks_lock = &(GetNamedLWLockTranche("plpgsql_check call stacks"))->lock;
+		profiler_ss->dynq_lock = &(GetNamedLWLockTranche("plpgsql_check dynamic queries"))->lock;
+		profiler_ss->coverage_lock = &(GetNamedLWLockTranche("plpgsql_check coverage"))->lock;
+		profiler_ss->dsa_tranche_id = LWLockNewTrancheId();
+		SpinLockInit(&profiler_ss->attach_mutex);
+		profiler_ss->nattached = 0;
+		profiler_ss->nattaches = 0;
+		profiler_ss->snapshot_loaded = false;
+
+		for (i = 0; i < PROFILER_INTERNAL_COUNTERS; i++)
+		{
+			pg_atomic_init_u64(&profiler_ss->internal_count[i], 0);
+			pg_atomic_init_u64(&profiler_ss->internal_us_total[i], 0);
+		}
+	}
+
+	/*
+	 * Register name of tranche of dynamic shared memory area early, so the
+	 * waits on its locks are displayed with name by any process.
+	 */
+	LWLockRegisterTranche(profiler_ss->dsa_tranche_id,
+						  "plpgsql_check profiler dsa");
+
+	profiler_dsa_place = ShmemInitStruct("plpgsql_check profiler dsa",
+										 PROFILER_DSA_INITIAL_SIZE,
+										 &found);
+
+	if (!found)
+	{
+		dsa_area   *dsa;
+
+		/*
+		 * The area is created in postmaster, and backends attach it
+		 * when they need it. The area is pinned, so it is not released
+		 * when the last backend detaches it.
+		 */
+		dsa = dsa_create_in_place(profiler_dsa_place,
+								  PROFILER_DSA_INITIAL_SIZE,
+								  profiler_ss->dsa_tranche_id,
+								  NULL);
+		dsa_pin(dsa);
+		dsa_detach(dsa);
 	}
 
 	memset(&info, 0, sizeof(info));
 	info.keysize = sizeof(profiler_hashkey);
-	info.entrysize = sizeof(profiler_stmt_chunk);
+	info.entrysize = sizeof(profiler_profile);
 
-	shared_profiler_chunks_HashTable = ShmemInitHash("plpgsql_check profiler chunks",
-													plpgsql_check_profiler_max_shared_chunks,
-													plpgsql_check_profiler_max_shared_chunks,
-													&info,
-													HASH_ELEM | HASH_BLOBS);
+	shared_profiles_HashTable = ShmemInitHash("plpgsql_check profiler profiles",
+											  plpgsql_check_profiler_max_shared_chunks,
+											  plpgsql_check_profiler_max_shared_chunks,
+											  &info,
+											  HASH_ELEM | HASH_BLOBS);
 
 	memset(&info, 0, sizeof(info));
 	info.keysize = sizeof(fstats_hashkey);
@@ -393,46 +1031,327 @@ plpgsql_check_profiler_shmem_startup(void)
 
 	shared_fstats_HashTable = ShmemInitHash("plpgsql_check fstats",
 													500,
-													1000,
+													FSTATS_MAX_SHARED_ENTRIES,
 													&info,
 													HASH_ELEM | HASH_BLOBS);
 
+	memset(&info, 0, sizeof(info));
+	info.keysize = sizeof(profiler_stack_hashkey);
+	info.entrysize = sizeof(profiler_stack);
+
+	shared_stacks_HashTable = ShmemInitHash("plpgsql_check call stacks",
+											PROFILER_MAX_SHARED_STACKS / 2,
+											PROFILER_MAX_SHARED_STACKS,
+											&info,
+											HASH_ELEM | HASH_BLOBS);
+
+	memset(&info, 0, sizeof(info));
+	info.keysize = sizeof(profiler_dynq_hashkey);
+	info.entrysize = sizeof(profiler_dynq);
+
+	shared_dynq_HashTable = ShmemInitHash("plpgsql_check dynamic queries",
+										  PROFILER_MAX_SHARED_DYNQ / 2,
+										  PROFILER_MAX_SHARED_DYNQ,
+										  &info,
+										  HASH_ELEM | HASH_BLOBS);
+
+	memset(&info, 0, sizeof(info));
+	info.keysize = sizeof(profiler_hashkey);
+	info.entrysize = sizeof(coverage_bitmap);
+
+	shared_coverage_HashTable = ShmemInitHash("plpgsql_check coverage",
+											  COVERAGE_MAX_SHARED_ENTRIES / 2,
+											  COVERAGE_MAX_SHARED_ENTRIES,
+											  &info,
+											  HASH_ELEM | HASH_BLOBS);
+
+	plpgsql_check_cache_shmem_init();
+	plpgsql_check_tracer_shmem_init();
+
 	LWLockRelease(AddinShmemInitLock);
 }
 
-/*
- * Profiler implementation
- */
-
 static void
-profiler_init_hashkey(profiler_hashkey *hk, PLpgSQL_function *func)
+profiler_internal_stat_add(profiler_internal_counter counter, instr_time *start_time)
 {
-	memset(hk, 0, sizeof(profiler_hashkey));
+	profiler_internal_stats[counter].count += 1;
 
-	hk->db_oid = MyDatabaseId;
-	hk->fn_oid = func->fn_oid;
-	hk->fn_xmin = func->fn_xmin;
+	if (start_time)
+	{
+		instr_time	end_time;
+
+		INSTR_TIME_SET_CURRENT(end_time);
+		INSTR_TIME_SUBTRACT(end_time, *start_time);
+
+		profiler_internal_stats[counter].us_total += INSTR_TIME_GET_MICROSEC(end_time);
+	}
+}
+
+/*
+ * Acquire lock, and count waiting on lock (the lock is acquired
+ * without waiting usually, so the clock is not used then).
+ */
+static void
+profiler_lwlock_acquire(LWLock *lock, LWLockMode mode, profiler_internal_counter counter)
+{
+	if (!LWLockConditionalAcquire(lock, mode))
+	{
+		instr_time	start_time;
+
+		INSTR_TIME_SET_CURRENT(start_time);
+		LWLockAcquire(lock, mode);
+		profiler_internal_stat_add(counter, &start_time);
+	}
+}
+
+/*
+ * Add not flushed counters of own overhead to shared counters
+ */
+static void
+profiler_flush_internal_stats(void)
+{
+	int			i;
+
+	if (!shared_profiles_HashTable)
+		return;
+
+	for (i = 0; i < PROFILER_INTERNAL_COUNTERS; i++)
+	{
+		if (profiler_internal_stats[i].count == 0)
+			continue;
+
+		pg_atomic_fetch_add_u64(&profiler_ss->internal_count[i],
+								profiler_internal_stats[i].count);
+		pg_atomic_fetch_add_u64(&profiler_ss->internal_us_total[i],
+								profiler_internal_stats[i].us_total);
+
+		profiler_internal_stats[i].count = 0;
+		profiler_internal_stats[i].us_total = 0;
+	}
+}
+
+/*
+ * Returns dynamic shared memory area used for statements of shared profiles.
+ * The area is attached when it is used first time.
+ */
+static dsa_area *
+profiler_get_dsa(void)
+{
+	Assert(profiler_dsa_place);
+
+	if (!profiler_dsa)
+	{
+		MemoryContext oldcxt;
+
+		oldcxt = MemoryContextSwitchTo(TopMemoryContext);
+
+		LWLockRegisterTranche(profiler_ss->dsa_tranche_id,
+							  "plpgsql_check profiler dsa");
+
+		profiler_dsa = dsa_attach_in_place(profiler_dsa_place, NULL);
+		dsa_pin_mapping(profiler_dsa);
+
+		on_shmem_exit(dsa_on_shmem_exit_release_in_place,
+					  PointerGetDatum(profiler_dsa_place));
+
+		MemoryContextSwitchTo(oldcxt);
+	}
+
+	/* plpgsql_check.profiler_max_shared_memory can be changed by reload */
+	if (profiler_dsa_size_limit != plpgsql_check_profiler_max_shared_memory)
+	{
+		dsa_set_size_limit(profiler_dsa,
+						   (size_t) plpgsql_check_profiler_max_shared_memory * 1024);
+		profiler_dsa_size_limit = plpgsql_check_profiler_max_shared_memory;
+	}
+
+	return profiler_dsa;
+}
+
+/*
+ * Returns dynamic shared memory area for other modules. The area is
+ * shared with profiler, so the size is limited by
+ * plpgsql_check.profiler_max_shared_memory.
+ */
+dsa_area *
+plpgsql_check_get_dsa(void)
+{
+	return profiler_get_dsa();
+}
+
+/*
+ * Returns (cache line aligned) shard of function's statistics
+ */
+static fstats_shard *
+get_fstats_shard(fstats *fstats_item, int shard_id)
+{
+	fstats_shard_padded *shards;
+
+	Assert(shard_id >= 0 && shard_id < FSTATS_SHARDS);
+
+	shards = (fstats_shard_padded *) CACHELINEALIGN(fstats_item->shards);
+
+	return &shards[shard_id].shard;
+}
+
+/*
+ * Returns (cache line aligned) statements of profile
+ */
+static profiler_stmt_reduced_padded *
+get_profile_stmts(profiler_profile *profile)
+{
+	void	   *stmts = profile->stmts;
+
+	if (!stmts)
+	{
+		Assert(DsaPointerIsValid(profile->stmts_dp));
+
+		stmts = dsa_get_address(profiler_get_dsa(), profile->stmts_dp);
+	}
+
+	return (profiler_stmt_reduced_padded *) CACHELINEALIGN(stmts);
+}
+
+/*
+ * Releases statements of profile and removes the profile from
+ * hash table. When profile is stored in shared memory, then caller
+ * should to hold exclusive lock.
+ */
+static void
+remove_profile(HTAB *profiles, profiler_profile *profile)
+{
+	if (profile->stmts)
+		pfree(profile->stmts);
+	else if (DsaPointerIsValid(profile->stmts_dp))
+		dsa_free(profiler_get_dsa(), profile->stmts_dp);
+
+	hash_search(profiles, (void *) &profile->key, HASH_REMOVE, NULL);
+}
+
+/*
+ * Removes least recently updated shared profile (except profile
+ * with key skip_hk). Returns false, when there is nothing to remove.
+ * Exclusive lock should be hold.
+ */
+static bool
+evict_lru_profile(profiler_hashkey *skip_hk)
+{
+	HASH_SEQ_STATUS hash_seq;
+	profiler_profile *profile;
+	profiler_profile *victim = NULL;
+	uint64		victim_last_update = 0;
+
+	Assert(shared_profiles_HashTable);
+
+	hash_seq_init(&hash_seq, shared_profiles_HashTable);
+
+	while ((profile = hash_seq_search(&hash_seq)) != NULL)
+	{
+		uint64		last_update;
+
+		if (memcmp(&profile->key, skip_hk, sizeof(profiler_hashkey)) == 0)
+			continue;
+
+		last_update = pg_atomic_read_u64(&profile->last_update);
+
+		if (!victim || last_update < victim_last_update)
+		{
+			victim = profile;
+			victim_last_update = last_update;
+		}
+	}
+
+	if (victim)
+		remove_profile(shared_profiles_HashTable, victim);
+
+	return victim != NULL;
+}
+
+/*
+ * Creates new profile with allocated statements. When there is not
+ * free space in shared memory, then least recently updated profiles
+ * are removed. Returns NULL, when the profile cannot be created.
+ * When profile is stored in shared memory, then caller should to hold
+ * exclusive lock.
+ */
+static profiler_profile *
+create_profile(HTAB *profiles, bool shared_profiles, profiler_hashkey *hk, int nstatements)
+{
+	for (;;)
+	{
+		profiler_profile *profile;
+		bool		found;
+
+		profile = (profiler_profile *) hash_search(profiles,
+												   (void *) hk,
+												   shared_profiles ? HASH_ENTER_NULL : HASH_ENTER,
+												   &found);
+
+		if (profile)
+		{
+			if (found)
+				elog(ERROR, "broken consistency of plpgsql_check profiles");
+
+			profile->nstatements = nstatements;
+
+			if (!shared_profiles)
+			{
+				profile->stmts_dp = InvalidDsaPointer;
+				profile->stmts = MemoryContextAlloc(profiler_mcxt,
+													PROFILER_PROFILE_STMTS_SIZE(nstatements));
+				return profile;
+			}
+
+			profile->stmts = NULL;
+			profile->stmts_dp = dsa_allocate_extended(profiler_get_dsa(),
+													  PROFILER_PROFILE_STMTS_SIZE(nstatements),
+													  DSA_ALLOC_NO_OOM);
+
+			if (DsaPointerIsValid(profile->stmts_dp))
+				return profile;
+
+			hash_search(profiles, (void *) hk, HASH_REMOVE, NULL);
+		}
+
+		if (!shared_profiles || !evict_lru_profile(hk))
+			return NULL;
+
+		profiler_internal_stat_add(PROFILER_INTERNAL_PROFILE_EVICTION, NULL);
+	}
+}
+
+/*
+ * Profiler implementation
+ */
+
+static void
+profiler_init_hashkey(profiler_hashkey *hk, PLpgSQL_function *func)
+{
+	memset(hk, 0, sizeof(profiler_hashkey));
+
+	hk->db_oid = MyDatabaseId;
+	hk->fn_oid = func->fn_oid;
+	hk->fn_xmin = func->fn_xmin;
 	hk->fn_tid = func->fn_tid;
-	hk->chunk_num = 1;
 }
 
 /*
  * Hash table for local function profiles. When shared memory is not available
  * because plpgsql_check was not loaded by shared_proload_libraries, then function
- * profiles is stored in local profile chunks. A format is same for shared profiles.
+ * profiles is stored in local profiles. A format is same for shared profiles.
  */
 static void
-profiler_chunks_HashTableInit(void)
+profiles_HashTableInit(void)
 {
 	HASHCTL		ctl;
 
-	Assert(profiler_chunks_HashTable == NULL);
+	Assert(profiles_HashTable == NULL);
 
 	memset(&ctl, 0, sizeof(ctl));
 	ctl.keysize = sizeof(profiler_hashkey);
-	ctl.entrysize = sizeof(profiler_stmt_chunk);
+	ctl.entrysize = sizeof(profiler_profile);
 	ctl.hcxt = profiler_mcxt;
-	profiler_chunks_HashTable = hash_create("plpgsql_check function profiler local chunks",
+	profiles_HashTable = hash_create("plpgsql_check function profiler local profiles",
 									FUNCS_PER_USER,
 									&ctl,
 									HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
@@ -464,6 +1383,108 @@ fstats_HashTableInit(void)
 									HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
 }
 
+/*
+ * Hash table for profiles aggregated in session, that are not merged
+ * to persistent profiles yet.
+ */
+static void
+profiler_pending_HashTableInit(void)
+{
+	HASHCTL		ctl;
+
+	Assert(profiler_pending_HashTable == NULL);
+
+	memset(&ctl, 0, sizeof(ctl));
+	ctl.keysize = sizeof(profiler_hashkey);
+	ctl.entrysize = sizeof(profiler_pending_profile);
+	ctl.hcxt = profiler_mcxt;
+	profiler_pending_HashTable = hash_create("plpgsql_check function profiler pending profiles",
+									FUNCS_PER_USER,
+									&ctl,
+									HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+}
+
+/*
+ * Hash tables for call stacks stored in session memory, and for call
+ * stacks, that are not merged to persistent call stacks yet.
+ */
+static void
+stacks_HashTablesInit(void)
+{
+	HASHCTL		ctl;
+
+	Assert(stacks_HashTable == NULL);
+	Assert(profiler_pending_stacks_HashTable == NULL);
+
+	memset(&ctl, 0, sizeof(ctl));
+	ctl.keysize = sizeof(profiler_stack_hashkey);
+	ctl.entrysize = sizeof(profiler_stack);
+	ctl.hcxt = profiler_mcxt;
+	stacks_HashTable = hash_create("plpgsql_check function profiler call stacks",
+									FUNCS_PER_USER,
+									&ctl,
+									HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+
+	profiler_pending_stacks_HashTable = hash_create("plpgsql_check function profiler pending call stacks",
+									FUNCS_PER_USER,
+									&ctl,
+									HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+}
+
+/*
+ * Hash tables for queries of dynamic statements stored in session memory,
+ * and for queries, that are not merged to persistent storage yet.
+ */
+static void
+dynq_HashTablesInit(void)
+{
+	HASHCTL		ctl;
+
+	Assert(dynq_HashTable == NULL);
+	Assert(profiler_pending_dynq_HashTable == NULL);
+
+	memset(&ctl, 0, sizeof(ctl));
+	ctl.keysize = sizeof(profiler_dynq_hashkey);
+	ctl.entrysize = sizeof(profiler_dynq);
+	ctl.hcxt = profiler_mcxt;
+	dynq_HashTable = hash_create("plpgsql_check function profiler dynamic queries",
+									FUNCS_PER_USER,
+									&ctl,
+									HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+
+	profiler_pending_dynq_HashTable = hash_create("plpgsql_check function profiler pending dynamic queries",
+									FUNCS_PER_USER,
+									&ctl,
+									HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+}
+
+/*
+ * Hash table for coverage bitmaps stored in session memory.
+ */
+static void
+coverage_HashTableInit(void)
+{
+	HASHCTL		ctl;
+
+	Assert(coverage_HashTable == NULL);
+	Assert(coverage_pending_HashTable == NULL);
+
+	memset(&ctl, 0, sizeof(ctl));
+	ctl.keysize = sizeof(profiler_hashkey);
+	ctl.entrysize = sizeof(coverage_bitmap);
+	ctl.hcxt = profiler_mcxt;
+	coverage_HashTable = hash_create("plpgsql_check function coverage",
+									FUNCS_PER_USER,
+									&ctl,
+									HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+
+	/* the bitmaps of session, that are not merged to shared bitmaps yet */
+	coverage_pending_HashTable = hash_create("plpgsql_check function pending coverage",
+									FUNCS_PER_USER,
+									&ctl,
+									HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+}
+
 void
 plpgsql_check_profiler_init_hash_tables(void)
 {
@@ -472,8 +1493,16 @@ plpgsql_check_profiler_init_hash_tables(void)
 		MemoryContextReset(profiler_mcxt);
 
 		profiler_HashTable = NULL;
-		profiler_chunks_HashTable = NULL;
+		profiles_HashTable = NULL;
 		fstats_HashTable = NULL;
+		profiler_pending_HashTable = NULL;
+		stacks_HashTable = NULL;
+		profiler_pending_stacks_HashTable = NULL;
+		dynq_HashTable = NULL;
+		profiler_pending_dynq_HashTable = NULL;
+		coverage_HashTable = NULL;
+		coverage_pending_HashTable = NULL;
+		profiler_cursors_HashTable = NULL;
 	}
 	else
 	{
@@ -484,8 +1513,14 @@ plpgsql_check_profiler_init_hash_tables(void)
 												ALLOCSET_DEFAULT_MAXSIZE);
 	}
 
-	profiler_chunks_HashTableInit();
+	profiles_HashTableInit();
 	fstats_HashTableInit();
+	profiler_pending_HashTableInit();
+	stacks_HashTablesInit();
+	dynq_HashTablesInit();
+	coverage_HashTableInit();
+
+	INSTR_TIME_SET_ZERO(profiler_last_flush_time);
 }
 
 /*
@@ -562,33 +1597,32 @@ get_cycle_body(PLpgSQL_stmt *stmt)
 /*
  * profiler_stmt_walker - iterator over plpgsql statements.
  *
- * This function is designed for three different purposes:
+ * This function is designed for two different purposes:
  *
- *   a) iterate over all commends and finalize total time
- *      as measured total time substract child total time.
- *   b) iterate over all commands and prepare result for
+ *   a) iterate over all commands and prepare result for
  *      plpgsql_profiler_function_statements_tb function.
- *   c) iterate over all commands to collect code coverage
+ *   b) iterate over all commands to collect code coverage
  *      metrics
+ *
+ * The self time of statements is calculated incrementally by
+ * statement's end hook, so the statement tree is not walked when
+ * function is finished.
  */
 static void
-profiler_stmt_walker(profiler_info *pinfo,
-					profiler_stmt_walker_mode mode,
+profiler_stmt_walker(profiler_stmt_walker_mode mode,
 					PLpgSQL_stmt *stmt,
 					PLpgSQL_stmt *parent_stmt,
 					const char *description,
 					int stmt_block_num,
 					profiler_stmt_walker_options *opts)
 {
-	profiler_stmt *pstmt = NULL;
-	bool		count_exec_time_mode  = mode == PLPGSQL_CHECK_STMT_WALKER_COUNT_EXEC_TIME;
 	bool		prepare_result_mode	  = mode == PLPGSQL_CHECK_STMT_WALKER_PREPARE_RESULT;
 	bool		collect_coverage_mode = mode == PLPGSQL_CHECK_STMT_WALKER_COLLECT_COVERAGE;
 
-	int64		nested_us_time = 0;
 	int64		exec_count = 0;
 
 	int			stmtid = -1;
+	profiler_stmt_reduced *ppstmt = NULL;
 
 	char		strbuf[100];
 	int			n = 0;
@@ -597,69 +1631,75 @@ profiler_stmt_walker(profiler_info *pinfo,
 
 	stmtid = stmt->stmtid - 1;
 
-	if (count_exec_time_mode)
-	{
-		/*
-		 * Get statement info from function execution context
-		 * by statement id.
-		 */
-		pstmt = &pinfo->stmts[stmtid];
-		pstmt->lineno = stmt->lineno;
-	}
-	else
-	{
-		profiler_stmt_reduced *ppstmt = NULL;
+	Assert(opts->pi);
 
-		Assert(opts->pi);
+	/*
+	 * When iterator is used, then id of iterator's current statement
+	 * have to be same like stmtid of stmt. When function was not executed
+	 * in active profile mode, then we have not any stored profile, and
+	 * iterator returns 0 stmtid.
+	 */
+	Assert(!opts->pi->profile ||
+		   (opts->stmtid_map[opts->pi->current_statement_no] - 1) == stmtid);
 
-		/*
-		 * When iterator is used, then id of iterator's current statement
-		 * have to be same like stmtid of stmt. When function was not executed
-		 * in active profile mode, then we have not any stored chunk, and
-		 * iterator returns 0 stmtid.
-		 */
-		Assert(!opts->pi->current_chunk ||
-			   (opts->stmtid_map[opts->pi->current_statement_no] - 1) == stmtid);
+	/*
+	 * Get persistent statement info stored in shared memory
+	 * or in session memory by iterator.
+	 */
+	ppstmt = get_stmt_profile_next(opts->pi);
 
-		/*
-		 * Get persistent statement info stored in shared memory
-		 * or in session memory by iterator.
-		 */
-		ppstmt = get_stmt_profile_next(opts->pi);
+	if (prepare_result_mode && opts->pi->ri)
+	{
+		plpgsql_check_plugin2_stmt_info *sinfo;
+		int			parent_natural_stmtid = -1;
+		uint32		histogram[PROFILER_HISTOGRAM_BUCKETS];
+		uint64		us_max = 0;
+		int			i;
 
-		if (prepare_result_mode && opts->pi->ri)
+		if (ppstmt)
 		{
-			plpgsql_check_plugin2_stmt_info *sinfo;
-			int			parent_natural_stmtid = -1;
-
-			parent_natural_stmtid = parent_stmt ? opts->stmts_info[parent_stmt->stmtid - 1].natural_id : -1;
-			sinfo = &opts->stmts_info[stmt->stmtid - 1];
+			for (i = 0; i < PROFILER_HISTOGRAM_BUCKETS; i++)
+				histogram[i] = pg_atomic_read_u32(&ppstmt->histogram[i]);
 
-			plpgsql_check_put_profile_statement(opts->pi->ri,
-												ppstmt ? ppstmt->queryid : NOQUERYID,
-												sinfo->natural_id,
-												parent_natural_stmtid,
-												description,
-												stmt_block_num,
-												stmt->lineno,
-												ppstmt ? ppstmt->exec_count : 0,
-												ppstmt ? ppstmt->exec_count_err : 0,
-												ppstmt ? ppstmt->us_total : 0.0,
-												ppstmt ? ppstmt->us_max : 0.0,
-												ppstmt ? ppstmt->rows : 0,
-												(char *) sinfo->typname);
+			us_max = pg_atomic_read_u64(&ppstmt->us_max);
 		}
-		else if (collect_coverage_mode)
-		{
-			/* save statement exec count */
-			exec_count = ppstmt ? ppstmt->exec_count : 0;
+		else
+			memset(histogram, 0, sizeof(histogram));
+
+		parent_natural_stmtid = parent_stmt ? opts->stmts_info[parent_stmt->stmtid - 1].natural_id : -1;
+		sinfo = &opts->stmts_info[stmt->stmtid - 1];
+
+		plpgsql_check_put_profile_statement(opts->pi->ri,
+											ppstmt ? ppstmt->queryid : NOQUERYID,
+											sinfo->natural_id,
+											parent_natural_stmtid,
+											description,
+											stmt_block_num,
+											stmt->lineno,
+											ppstmt ? pg_atomic_read_u64(&ppstmt->exec_count) : 0,
+											ppstmt ? pg_atomic_read_u64(&ppstmt->exec_count_err) : 0,
+											ppstmt ? pg_atomic_read_u64(&ppstmt->us_total) : 0.0,
+											us_max,
+											histogram_percentile(histogram, 0.95, us_max),
+											histogram_percentile(histogram, 0.99, us_max),
+											ppstmt ? pg_atomic_read_u64(&ppstmt->rows) : 0,
+											(char *) sinfo->typname);
+	}
+	else if (collect_coverage_mode)
+	{
+		/* save statement exec count */
+		exec_count = ppstmt ? pg_atomic_read_u64(&ppstmt->exec_count) : 0;
 
-			/* ignore invisible BLOCK */
-			if (stmt->lineno != -1)
-			{
-				opts->cs->statements += 1;
-				opts->cs->executed_statements += exec_count > 0 ? 1 : 0;
-			}
+		/* the coverage plugin knows only if statement was executed */
+		if (exec_count == 0 && opts->coverage_bits &&
+			COVERAGE_BIT_IS_SET(opts->coverage_bits, stmtid))
+			exec_count = 1;
+
+		/* ignore invisible BLOCK */
+		if (stmt->lineno != -1)
+		{
+			opts->cs->statements += 1;
+			opts->cs->executed_statements += exec_count > 0 ? 1 : 0;
 		}
 	}
 
@@ -667,7 +1707,7 @@ profiler_stmt_walker(profiler_info *pinfo,
 	{
 		stmts = get_cycle_body(stmt);
 
-		stmts_walker(pinfo, mode,
+		stmts_walker(mode,
 					 stmts, stmt, "loop body",
 					 opts);
 
@@ -688,15 +1728,11 @@ profiler_stmt_walker(profiler_info *pinfo,
 		 * an number of execution of nested paths.
 		 */
 
-		stmts_walker(pinfo, mode,
+		stmts_walker(mode,
 					 stmt_if->then_body, stmt, "then body",
 					 opts);
 
-		if (count_exec_time_mode)
-		{
-			nested_us_time = opts->nested_us_time;
-		}
-		else if (collect_coverage_mode)
+		if (collect_coverage_mode)
 		{
 			increment_branch_counter(opts->cs,
 									 opts->nested_exec_count);
@@ -710,14 +1746,11 @@ profiler_stmt_walker(profiler_info *pinfo,
 
 			sprintf(strbuf, "elsif %d", ++n);
 
-			stmts_walker(pinfo, mode,
+			stmts_walker(mode,
 						 stmts, stmt, strbuf,
 						 opts);
 
-			if (count_exec_time_mode)
-				nested_us_time += opts->nested_us_time;
-
-			else if (collect_coverage_mode)
+			if (collect_coverage_mode)
 			{
 				increment_branch_counter(opts->cs,
 										 opts->nested_exec_count);
@@ -728,14 +1761,11 @@ profiler_stmt_walker(profiler_info *pinfo,
 
 		if (stmt_if->else_body)
 		{
-			stmts_walker(pinfo, mode,
+			stmts_walker(mode,
 						 stmt_if->else_body, stmt, "else body",
 						 opts);
 
-			if (count_exec_time_mode)
-				nested_us_time += opts->nested_us_time;
-
-			else if (collect_coverage_mode)
+			if (collect_coverage_mode)
 				increment_branch_counter(opts->cs,
 										 opts->nested_exec_count);
 		}
@@ -746,6 +1776,10 @@ profiler_stmt_walker(profiler_info *pinfo,
 			{
 				int64 else_exec_count = exec_count - all_nested_branches_exec_count;
 
+				if (opts->coverage_bits &&
+					COVERAGE_BIT_IS_SET(opts->coverage_bits, opts->nstatements + stmtid))
+					else_exec_count = Max(else_exec_count, 1);
+
 				increment_branch_counter(opts->cs,
 										 else_exec_count);
 			}
@@ -761,26 +1795,20 @@ profiler_stmt_walker(profiler_info *pinfo,
 
 			sprintf(strbuf, "case when %d", ++n);
 
-			stmts_walker(pinfo, mode,
+			stmts_walker(mode,
 						 stmts, stmt, strbuf,
 						 opts);
 
-			if (count_exec_time_mode)
-				nested_us_time = opts->nested_us_time;
-
-			else if (collect_coverage_mode)
+			if (collect_coverage_mode)
 				increment_branch_counter(opts->cs,
 										 opts->nested_exec_count);
 		}
 
-		stmts_walker(pinfo, mode,
+		stmts_walker(mode,
 					 stmt_case->else_stmts, stmt, "case else",
 					 opts);
 
-		if (count_exec_time_mode)
-			nested_us_time = opts->nested_us_time;
-
-		else if (collect_coverage_mode)
+		if (collect_coverage_mode)
 			increment_branch_counter(opts->cs,
 									 opts->nested_exec_count);
 	}
@@ -788,13 +1816,10 @@ profiler_stmt_walker(profiler_info *pinfo,
 	{
 		PLpgSQL_stmt_block *stmt_block = (PLpgSQL_stmt_block *) stmt;
 
-		stmts_walker(pinfo, mode,
+		stmts_walker(mode,
 					 stmt_block->body, stmt, "body",
 					 opts);
 
-		if (count_exec_time_mode)
-			nested_us_time = opts->nested_us_time;
-
 		if (stmt_block->exceptions)
 		{
 			if (collect_coverage_mode)
@@ -807,37 +1832,19 @@ profiler_stmt_walker(profiler_info *pinfo,
 
 				sprintf(strbuf, "exception %d", ++n);
 
-				stmts_walker(pinfo, mode,
+				stmts_walker(mode,
 							 stmts, stmt, strbuf,
 							 opts);
 
-				if (count_exec_time_mode)
-					nested_us_time += opts->nested_us_time;
-				else if (collect_coverage_mode)
+				if (collect_coverage_mode)
 					increment_branch_counter(opts->cs,
 											 opts->nested_exec_count);
 			}
 		}
 	}
 
-	if (count_exec_time_mode)
-	{
-		Assert (pstmt);
-
-		opts->nested_us_time = pstmt->us_total;
-		pstmt->us_total -= nested_us_time;
-
-		/*
-		 * When max time is unknown, but statement was executed only
-		 * only once, we can se max time.
-		 */
-		if (pstmt->exec_count == 1 && pstmt->us_max == 1)
-			pstmt->us_max = pstmt->us_total;
-	}
-	else if (collect_coverage_mode)
-	{
+	if (collect_coverage_mode)
 		opts->nested_exec_count = exec_count;
-	}
 }
 
 /*
@@ -878,7 +1885,7 @@ plpgsql_check_profiler_ctrl(PG_FUNCTION_ARGS)
 }
 
 /*
- * clean all chunks used by profiler
+ * clean all profiles used by profiler
  */
 Datum
 plpgsql_profiler_reset_all(PG_FUNCTION_ARGS)
@@ -886,23 +1893,24 @@ plpgsql_profiler_reset_all(PG_FUNCTION_ARGS)
 	/*be compiler quite */
 	(void) fcinfo;
 
-	if (shared_profiler_chunks_HashTable)
+	if (shared_profiles_HashTable)
 	{
 		HASH_SEQ_STATUS hash_seq;
-		profiler_stmt_chunk *chunk;
+		profiler_profile *profile;
 		fstats	   *fstats_entry;
+		profiler_stack *stack;
+		profiler_dynq *dynq;
+		coverage_bitmap *cb;
+
+		/* saved profiles should not be loaded later */
+		profiler_snapshot_attach();
 
 		LWLockAcquire(profiler_ss->lock, LW_EXCLUSIVE);
 
-		hash_seq_init(&hash_seq, shared_profiler_chunks_HashTable);
+		hash_seq_init(&hash_seq, shared_profiles_HashTable);
 
-		while ((chunk = hash_seq_search(&hash_seq)) != NULL)
-		{
-			hash_search(shared_profiler_chunks_HashTable,
-						&(chunk->key),
-						HASH_REMOVE,
-						NULL);
-		}
+		while ((profile = hash_seq_search(&hash_seq)) != NULL)
+			remove_profile(shared_profiles_HashTable, profile);
 
 		LWLockRelease(profiler_ss->lock);
 
@@ -921,15 +1929,64 @@ plpgsql_profiler_reset_all(PG_FUNCTION_ARGS)
 		}
 
 		LWLockRelease(profiler_ss->fstats_lock);
-	}
 
-	plpgsql_check_profiler_init_hash_tables();
+		Assert(shared_stacks_HashTable);
 
-	PG_RETURN_VOID();
-}
+		LWLockAcquire(profiler_ss->stacks_lock, LW_EXCLUSIVE);
+
+		hash_seq_init(&hash_seq, shared_stacks_HashTable);
+
+		while ((stack = hash_seq_search(&hash_seq)) != NULL)
+		{
+			hash_search(shared_stacks_HashTable,
+						&(stack->key),
+						HASH_REMOVE,
+						NULL);
+		}
+
+		LWLockRelease(profiler_ss->stacks_lock);
+
+		Assert(shared_dynq_HashTable);
+
+		LWLockAcquire(profiler_ss->dynq_lock, LW_EXCLUSIVE);
+
+		hash_seq_init(&hash_seq, shared_dynq_HashTable);
+
+		while ((dynq = hash_seq_search(&hash_seq)) != NULL)
+		{
+			hash_search(shared_dynq_HashTable,
+						&(dynq->key),
+						HASH_REMOVE,
+						NULL);
+		}
+
+		LWLockRelease(profiler_ss->dynq_lock);
+
+		Assert(shared_coverage_HashTable);
+
+		LWLockAcquire(profiler_ss->coverage_lock, LW_EXCLUSIVE);
+
+		hash_seq_init(&hash_seq, shared_coverage_HashTable);
+
+		while ((cb = hash_seq_search(&hash_seq)) != NULL)
+		{
+			dsa_free(profiler_get_dsa(), cb->bits_dp);
+			hash_search(shared_coverage_HashTable,
+						&(cb->key),
+						HASH_REMOVE,
+						NULL);
+		}
+
+		LWLockRelease(profiler_ss->coverage_lock);
+	}
+
+	plpgsql_check_profiler_init_hash_tables();
+
+	PG_RETURN_VOID();
+}
 
 /*
- * Clean chunks related to some function
+ * Clean profile related to some function
  */
 Datum
 plpgsql_profiler_reset(PG_FUNCTION_ARGS)
@@ -937,10 +1994,15 @@ plpgsql_profiler_reset(PG_FUNCTION_ARGS)
 	Oid			funcoid = PG_GETARG_OID(0);
 	profiler_hashkey hk;
 	fstats_hashkey fhk;
-	HTAB	   *chunks;
+	HTAB	   *profiles;
 	HeapTuple	procTuple;
-	bool		found;
-	bool		shared_chunks;
+	bool		shared_profiles;
+	profiler_profile *profile;
+	HASH_SEQ_STATUS hash_seq;
+	profiler_pending_profile *pp;
+	profiler_dynq *dynq;
+	HTAB	   *dynq_ht;
+	coverage_bitmap *cb;
 
 	procTuple = SearchSysCache1(PROCOID, ObjectIdGetDatum(funcoid));
 	if (!HeapTupleIsValid(procTuple))
@@ -952,31 +2014,31 @@ plpgsql_profiler_reset(PG_FUNCTION_ARGS)
 	hk.db_oid = MyDatabaseId;
 	hk.fn_xmin = HeapTupleHeaderGetRawXmin(procTuple->t_data);
 	hk.fn_tid =  procTuple->t_self;
-	hk.chunk_num = 1;
 
 	ReleaseSysCache(procTuple);
 
-	if (shared_profiler_chunks_HashTable)
+	if (shared_profiles_HashTable)
 	{
+		profiler_snapshot_attach();
+
 		LWLockAcquire(profiler_ss->lock, LW_EXCLUSIVE);
-		chunks = shared_profiler_chunks_HashTable;
-		shared_chunks = true;
+		profiles = shared_profiles_HashTable;
+		shared_profiles = true;
 	}
 	else
 	{
-		chunks = profiler_chunks_HashTable;
-		shared_chunks = false;
+		profiles = profiles_HashTable;
+		shared_profiles = false;
 	}
 
-	for(;;)
-	{
-		hash_search(chunks, (void *) &hk, HASH_REMOVE, &found);
-		if (!found)
-			break;
-		hk.chunk_num += 1;
-	}
+	profile = (profiler_profile *) hash_search(profiles,
+											   (void *) &hk,
+											   HASH_FIND,
+											   NULL);
+	if (profile)
+		remove_profile(profiles, profile);
 
-	if (shared_chunks)
+	if (shared_profiles)
 		LWLockRelease(profiler_ss->lock);
 
 	fstats_init_hashkey(&fhk, funcoid);
@@ -992,6 +2054,90 @@ plpgsql_profiler_reset(PG_FUNCTION_ARGS)
 	else
 		hash_search(fstats_HashTable, (void *) &fhk, HASH_REMOVE, NULL);
 
+	if (shared_dynq_HashTable)
+	{
+		LWLockAcquire(profiler_ss->dynq_lock, LW_EXCLUSIVE);
+		dynq_ht = shared_dynq_HashTable;
+	}
+	else
+		dynq_ht = dynq_HashTable;
+
+	hash_seq_init(&hash_seq, dynq_ht);
+
+	while ((dynq = hash_seq_search(&hash_seq)) != NULL)
+	{
+		if (dynq->key.fkey.fn_oid == funcoid && dynq->key.fkey.db_oid == MyDatabaseId)
+			hash_search(dynq_ht, (void *) &dynq->key, HASH_REMOVE, NULL);
+	}
+
+	if (shared_dynq_HashTable)
+		LWLockRelease(profiler_ss->dynq_lock);
+
+	if (shared_coverage_HashTable)
+	{
+		LWLockAcquire(profiler_ss->coverage_lock, LW_EXCLUSIVE);
+
+		cb = (coverage_bitmap *) hash_search(shared_coverage_HashTable,
+											 (void *) &hk,
+											 HASH_FIND,
+											 NULL);
+		if (cb)
+		{
+			dsa_free(profiler_get_dsa(), cb->bits_dp);
+			hash_search(shared_coverage_HashTable, (void *) &hk, HASH_REMOVE, NULL);
+		}
+
+		LWLockRelease(profiler_ss->coverage_lock);
+	}
+	else
+	{
+		cb = (coverage_bitmap *) hash_search(coverage_HashTable,
+											 (void *) &hk,
+											 HASH_FIND,
+											 NULL);
+		if (cb)
+		{
+			pfree(cb->bits);
+			hash_search(coverage_HashTable, (void *) &hk, HASH_REMOVE, NULL);
+		}
+	}
+
+	cb = (coverage_bitmap *) hash_search(coverage_pending_HashTable,
+										 (void *) &hk,
+										 HASH_FIND,
+										 NULL);
+	if (cb)
+	{
+		pfree(cb->bits);
+		hash_search(coverage_pending_HashTable, (void *) &hk, HASH_REMOVE, NULL);
+	}
+
+	hash_seq_init(&hash_seq, profiler_pending_dynq_HashTable);
+
+	while ((dynq = hash_seq_search(&hash_seq)) != NULL)
+	{
+		if (dynq->key.fkey.fn_oid == funcoid && dynq->key.fkey.db_oid == MyDatabaseId)
+			hash_search(profiler_pending_dynq_HashTable,
+						(void *) &dynq->key,
+						HASH_REMOVE,
+						NULL);
+	}
+
+	/* remove not flushed data of this function too */
+	hash_seq_init(&hash_seq, profiler_pending_HashTable);
+
+	while ((pp = hash_seq_search(&hash_seq)) != NULL)
+	{
+		if (pp->key.fn_oid == funcoid && pp->key.db_oid == MyDatabaseId)
+		{
+			pfree(pp->stmts);
+			hash_search(profiler_pending_HashTable,
+						(void *) &pp->key,
+						HASH_REMOVE,
+						NULL);
+		}
+	}
+
 	PG_RETURN_VOID();
 }
 
@@ -1108,6 +2254,9 @@ plpgsql_profiler_install_fake_queryid_hook(PG_FUNCTION_ARGS)
 
 	post_parse_analyze_hook = profiler_fake_queryid_hook;
 
+	/* cached queryids of dynamic queries are not valid now */
+	profiler_dyn_queryid_HashTable = NULL;
+
 	PG_RETURN_VOID();
 }
 
@@ -1120,28 +2269,35 @@ plpgsql_profiler_remove_fake_queryid_hook(PG_FUNCTION_ARGS)
 	{
 		post_parse_analyze_hook = prev_post_parse_analyze_hook;
 		prev_post_parse_analyze_hook = NULL;
+
+		profiler_dyn_queryid_HashTable = NULL;
 	}
 
 	PG_RETURN_VOID();
 }
 
-static void
-update_persistent_fstats(PLpgSQL_function *func,
-						 uint64 elapsed)
+/*
+ * Merge function's execution statistics from pending profile
+ * to persistent (shared or local) function's statistics.
+ */
+static bool
+update_persistent_fstats(profiler_pending_profile *pp, int elevel)
 {
 	HTAB	   *fstats_ht;
 	bool		htab_is_shared;
 	fstats_hashkey fhk;
 	fstats	   *fstats_item;
+	fstats_shard *shard;
 	bool		found;
-	bool		use_spinlock = false;
+	int			i;
 
-	fstats_init_hashkey(&fhk, func->fn_oid);
+	fstats_init_hashkey(&fhk, pp->key.fn_oid);
 
 	/* try to find first chunk in shared (or local) memory */
 	if (shared_fstats_HashTable)
 	{
-		LWLockAcquire(profiler_ss->fstats_lock, LW_SHARED);
+		profiler_lwlock_acquire(profiler_ss->fstats_lock, LW_SHARED,
+								PROFILER_INTERNAL_FSTATS_LOCK_WAIT);
 		fstats_ht = shared_fstats_HashTable;
 		htab_is_shared = true;
 	}
@@ -1161,1235 +2317,4064 @@ update_persistent_fstats(PLpgSQL_function *func,
 		if (htab_is_shared)
 		{
 			LWLockRelease(profiler_ss->fstats_lock);
-			LWLockAcquire(profiler_ss->fstats_lock, LW_EXCLUSIVE);
+			profiler_lwlock_acquire(profiler_ss->fstats_lock, LW_EXCLUSIVE,
+									PROFILER_INTERNAL_FSTATS_LOCK_WAIT);
 		}
 
 		fstats_item = (fstats *) hash_search(fstats_ht,
 											 (void *) &fhk,
-											 HASH_ENTER,
+											 htab_is_shared ? HASH_ENTER_NULL : HASH_ENTER,
 											 &found);
 	}
 
 	if (!fstats_item)
-		elog(ERROR,
+	{
+		if (htab_is_shared)
+			LWLockRelease(profiler_ss->fstats_lock);
+
+		profiler_internal_stat_add(PROFILER_INTERNAL_FSTATS_INSERT_FAILURE, NULL);
+
+		elog(elevel,
 			"cannot to insert new entry to profiler's function statistics");
 
-	if (htab_is_shared)
+		return false;
+	}
+
+	if (!found)
 	{
-		if (found)
+		/* new entry is visible only for us (we hold exclusive lock) */
+		for (i = 0; i < FSTATS_SHARDS; i++)
 		{
-			SpinLockAcquire(&fstats_item->mutex);
-			use_spinlock = true;
+			shard = get_fstats_shard(fstats_item, i);
+
+			SpinLockInit(&shard->mutex);
+			shard->exec_count = 0;
+			shard->exec_count_err = 0;
+			shard->total_time = 0;
+			shard->total_time_xx = 0.0;
+			shard->min_time = 0;
+			shard->max_time = 0;
+			memset(shard->histogram, 0, sizeof(shard->histogram));
 		}
-		else
-			SpinLockInit(&fstats_item->mutex);
+
+		pg_atomic_init_u64(&fstats_item->generation, initial_generation());
 	}
 
-	if (!found)
+	shard = get_fstats_shard(fstats_item, htab_is_shared ? FSTATS_SHARD_ID : 0);
+
+	if (htab_is_shared)
+	{
+		/* the shards should be enough to don't wait on spinlock usually */
+		if (!SpinLockFree(&shard->mutex))
+			profiler_internal_stat_add(PROFILER_INTERNAL_FSTATS_SPINLOCK_CONTENTION, NULL);
+
+		SpinLockAcquire(&shard->mutex);
+	}
+
+	if (shard->exec_count == 0)
 	{
-		fstats_item->exec_count = 0;
-		fstats_item->exec_count_err = 0;
-		fstats_item->total_time = 0;
-		fstats_item->total_time_xx = 0.0;
-		fstats_item->min_time = elapsed;
-		fstats_item->max_time = elapsed;
+		shard->min_time = pp->min_time;
+		shard->max_time = pp->max_time;
 	}
 	else
 	{
-		fstats_item->min_time = fstats_item->min_time < elapsed ? fstats_item->min_time : elapsed;
-		fstats_item->max_time = fstats_item->max_time > elapsed ? fstats_item->max_time : elapsed;
+		shard->min_time = shard->min_time < pp->min_time ? shard->min_time : pp->min_time;
+		shard->max_time = shard->max_time > pp->max_time ? shard->max_time : pp->max_time;
 	}
 
-	eval_stddev_accum(&fstats_item->exec_count,
-					  &fstats_item->total_time,
-					  &fstats_item->total_time_xx,
-					  elapsed);
+	eval_stddev_combine(&shard->exec_count,
+						&shard->total_time,
+						&shard->total_time_xx,
+						pp->ncalls,
+						pp->total_time,
+						pp->total_time_xx);
+
+	shard->exec_count_err += pp->ncalls_err;
+
+	for (i = 0; i < PROFILER_HISTOGRAM_BUCKETS; i++)
+		shard->histogram[i] += pp->histogram[i];
 
-	if (use_spinlock)
-		SpinLockRelease(&fstats_item->mutex);
+	if (htab_is_shared)
+		SpinLockRelease(&shard->mutex);
+
+	/* should be incremented after update of counters */
+	pg_atomic_fetch_add_u64(&fstats_item->generation, 1);
 
 	if (htab_is_shared)
 		LWLockRelease(profiler_ss->fstats_lock);
+
+	return true;
 }
 
+/*
+ * Aggregate shards of function's statistics to one shard. The mutex
+ * of result is not initialized.
+ */
 static void
-update_persistent_profile(profiler_info *pinfo,
-						  PLpgSQL_function *func,
-						  const int *stmtid_map)
+aggregate_fstats(fstats *fstats_item, bool htab_is_shared, fstats_shard *result)
 {
-	profiler_hashkey hk;
-	profiler_stmt_chunk *chunk = NULL;
-	bool		found;
-	HTAB	   *chunks;
-	bool		shared_chunks;
-
-	volatile profiler_stmt_chunk *chunk_with_mutex = NULL;
-
-	if (shared_profiler_chunks_HashTable)
-	{
-		chunks = shared_profiler_chunks_HashTable;
-		LWLockAcquire(profiler_ss->lock, LW_SHARED);
-		shared_chunks = true;
-	}
-	else
-	{
-		chunks = profiler_chunks_HashTable;
-		shared_chunks = false;
-	}
+	int			nshards;
+	int			i,
+				j;
 
-	profiler_init_hashkey(&hk, func) ;
+	result->exec_count = 0;
+	result->exec_count_err = 0;
+	result->total_time = 0;
+	result->total_time_xx = 0.0;
+	result->min_time = 0;
+	result->max_time = 0;
+	memset(result->histogram, 0, sizeof(result->histogram));
 
-	/* don't need too strong lock for reading shared memory */
-	chunk = (profiler_stmt_chunk *) hash_search(chunks,
-											 (void *) &hk,
-											 HASH_FIND,
-											 &found);
+	nshards = htab_is_shared ? FSTATS_SHARDS : 1;
 
-	/* We need exclusive lock, when we want to add new chunk */
-	if (!found && shared_chunks)
+	for (i = 0; i < nshards; i++)
 	{
-		LWLockRelease(profiler_ss->lock);
-		LWLockAcquire(profiler_ss->lock, LW_EXCLUSIVE);
+		fstats_shard *shard = get_fstats_shard(fstats_item, i);
+		fstats_shard shard_copy;
 
-		/* repeat searching under exclusive lock */
-		chunk = (profiler_stmt_chunk *) hash_search(chunks,
-												 (void *) &hk,
-												 HASH_FIND,
-												 &found);
-	}
+		if (htab_is_shared)
+			SpinLockAcquire(&shard->mutex);
 
-	if (!found)
-	{
-		int		stmt_counter = 0;
-		int		i;
+		shard_copy = *shard;
 
-		/* aftre increment first chunk will be created with chunk number 1 */
-		hk.chunk_num = 0;
+		if (htab_is_shared)
+			SpinLockRelease(&shard->mutex);
 
-		/* we should to enter empty chunks first */
+		if (shard_copy.exec_count == 0)
+			continue;
 
-		for (i = 0; i < func->nstatements; i++)
+		if (result->exec_count == 0)
 		{
-			volatile profiler_stmt_reduced *prstmt;
-			profiler_stmt *pstmt;
+			result->min_time = shard_copy.min_time;
+			result->max_time = shard_copy.max_time;
+		}
+		else
+		{
+			result->min_time = result->min_time < shard_copy.min_time ? result->min_time : shard_copy.min_time;
+			result->max_time = result->max_time > shard_copy.max_time ? result->max_time : shard_copy.max_time;
+		}
 
-			/*
-			 * We need to store statement statistics to chunks in natural order
-			 * next statistics should be related to statement on same or higher
-			 * line. Unfortunately buildin stmtid has inverse order based on
-			 * bison parser processing 
-			 * statement should to be on same or higher line)
-			 *
-			 */
-			int		n = stmtid_map[i] - 1;
+		result->exec_count_err += shard_copy.exec_count_err;
 
-			/* Skip gaps in reorder map */
-			if (n == -1)
-				continue;
+		for (j = 0; j < PROFILER_HISTOGRAM_BUCKETS; j++)
+			result->histogram[j] += shard_copy.histogram[j];
 
-			pstmt = &pinfo->stmts[n];
+		eval_stddev_combine(&result->exec_count,
+							&result->total_time,
+							&result->total_time_xx,
+							shard_copy.exec_count,
+							shard_copy.total_time,
+							shard_copy.total_time_xx);
+	}
+}
 
-			if (hk.chunk_num == 0 || stmt_counter >= STATEMENTS_PER_CHUNK)
-			{
-				hk.chunk_num += 1;
+/*
+ * Merge pending call stack to persistent (shared or local) call stacks.
+ */
+static bool
+update_persistent_stack(profiler_stack *pstack, int elevel)
+{
+	HTAB	   *stacks_ht;
+	bool		htab_is_shared;
+	profiler_stack *stack;
+	bool		found;
 
-				chunk = (profiler_stmt_chunk *) hash_search(chunks,
-															 (void *) &hk,
-															 HASH_ENTER,
-															 &found);
+	if (shared_stacks_HashTable)
+	{
+		LWLockAcquire(profiler_ss->stacks_lock, LW_SHARED);
+		stacks_ht = shared_stacks_HashTable;
+		htab_is_shared = true;
+	}
+	else
+	{
+		stacks_ht = stacks_HashTable;
+		htab_is_shared = false;
+	}
 
-				if (found)
-					elog(ERROR, "broken consistency of plpgsql_check profiler chunks");
+	stack = (profiler_stack *) hash_search(stacks_ht,
+										   (void *) &pstack->key,
+										   HASH_FIND,
+										   &found);
 
-				if (hk.chunk_num == 1 && shared_chunks)
-					SpinLockInit(&chunk->mutex);
+	if (!found)
+	{
+		if (htab_is_shared)
+		{
+			LWLockRelease(profiler_ss->stacks_lock);
+			LWLockAcquire(profiler_ss->stacks_lock, LW_EXCLUSIVE);
+		}
 
-				stmt_counter = 0;
-			}
+		stack = (profiler_stack *) hash_search(stacks_ht,
+											   (void *) &pstack->key,
+											   htab_is_shared ? HASH_ENTER_NULL : HASH_ENTER,
+											   &found);
+	}
 
-			prstmt = &chunk->stmts[stmt_counter++];
+	if (!stack)
+	{
+		if (htab_is_shared)
+			LWLockRelease(profiler_ss->stacks_lock);
 
-			prstmt->lineno = pstmt->lineno;
-			prstmt->queryid = pstmt->queryid;
-			prstmt->has_queryid = pstmt->has_queryid;
-			prstmt->us_max = pstmt->us_max;
-			prstmt->us_total = pstmt->us_total;
-			prstmt->rows = pstmt->rows;
-			prstmt->exec_count = pstmt->exec_count;
-			prstmt->exec_count_err = pstmt->exec_count_err;
-		}
+		profiler_internal_stat_add(PROFILER_INTERNAL_STACK_INSERT_FAILURE, NULL);
 
-		/* clean unused stmts in chunk */
-		while (stmt_counter < STATEMENTS_PER_CHUNK)
-			chunk->stmts[stmt_counter++].lineno = -1;
+		elog(elevel,
+			"cannot to insert new entry to profiler's call stacks");
 
-		if (shared_chunks)
-			LWLockRelease(profiler_ss->lock);
+		return false;
+	}
 
-		return;
+	if (!found)
+	{
+		/* new entry is visible only for us (we hold exclusive lock) */
+		SpinLockInit(&stack->mutex);
+		stack->exec_count = 0;
+		stack->total_time = 0;
+		stack->self_time = 0;
 	}
 
-	/*
-	 * Now we know, so there is already profile, and we have all necessary locks.
-	 * Teoreticaly, we can reuse existing chunk, but inside PG_TRY block is better
-	 * to take this value again to fix warning - "might be clobbered by 'longjmp"
-	 */
-	PG_TRY();
+	if (htab_is_shared)
+		SpinLockAcquire(&stack->mutex);
+
+	stack->exec_count += pstack->exec_count;
+	stack->total_time += pstack->total_time;
+	stack->self_time += pstack->self_time;
+
+	if (htab_is_shared)
 	{
-		profiler_stmt_chunk *_chunk = NULL;
-		HTAB   *_chunks;
-		int		stmt_counter = 0;
-		int		i = 0;
+		SpinLockRelease(&stack->mutex);
+		LWLockRelease(profiler_ss->stacks_lock);
+	}
 
-		_chunks = shared_chunks ? shared_profiler_chunks_HashTable : profiler_chunks_HashTable;
-		profiler_init_hashkey(&hk, func) ;
+	return true;
+}
 
-		/* search chunk again */
-		_chunk = (profiler_stmt_chunk *) hash_search(_chunks,
-												    (void *) &hk,
-													HASH_FIND,
-													&found);
+/*
+ * Add counters of query to top-K queries of dynamic statement. When
+ * there is not free slot, then the query with lowest total time is
+ * replaced, and its counters are inherited.
+ */
+static void
+dynq_add_query(profiler_dynq *dynq, profiler_dynq_counters *q)
+{
+	profiler_dynq_counters *target = NULL;
+	int			i;
 
-		if (shared_chunks)
+	for (i = 0; i < dynq->nqueries; i++)
+	{
+		if (dynq->queries[i].queryid == q->queryid)
 		{
-			chunk_with_mutex = _chunk;
-			SpinLockAcquire(&chunk_with_mutex->mutex);
+			target = &dynq->queries[i];
+			break;
 		}
-		else
-			chunk_with_mutex = NULL;
 
-		hk.chunk_num = 1;
-		stmt_counter = 0;
+		if (!target || dynq->queries[i].us_total < target->us_total)
+			target = &dynq->queries[i];
+	}
+
+	if (i == dynq->nqueries && dynq->nqueries < PROFILER_DYNQ_TOPK)
+	{
+		dynq->queries[dynq->nqueries++] = *q;
+		return;
+	}
 
-		/* there is a profiler chunk already */
-		for (i = 0; i < func->nstatements; i++)
-		{
-			volatile profiler_stmt_reduced *prstmt;
-			profiler_stmt *pstmt;
+	Assert(target);
 
-			/*
-			 * We need to store statement statistics to chunks in natural order
-			 * (next statistics should be related to statement on same or higher
-			 * line). Unfortunately buildin stmtid has inverse order based on
-			 * bison parser processing statement.
-			 */
-			int		n = stmtid_map[i] - 1;
+	target->queryid = q->queryid;
+	target->exec_count += q->exec_count;
+	target->us_total += q->us_total;
+	target->rows += q->rows;
 
-			/* Skip gaps in reorder map */
-			if (n == -1)
-				continue;
+	if (q->us_max > target->us_max)
+		target->us_max = q->us_max;
+}
 
-			pstmt = &pinfo->stmts[n];
+/*
+ * Merge pending queries of dynamic statement to persistent (shared or
+ * local) storage.
+ */
+static bool
+update_persistent_dynq(profiler_dynq *pdynq, int elevel)
+{
+	HTAB	   *dynq_ht;
+	bool		htab_is_shared;
+	profiler_dynq *dynq;
+	bool		found;
+	int			i;
 
-			if (stmt_counter >= STATEMENTS_PER_CHUNK)
-			{
-				hk.chunk_num += 1;
+	if (shared_dynq_HashTable)
+	{
+		LWLockAcquire(profiler_ss->dynq_lock, LW_SHARED);
+		dynq_ht = shared_dynq_HashTable;
+		htab_is_shared = true;
+	}
+	else
+	{
+		dynq_ht = dynq_HashTable;
+		htab_is_shared = false;
+	}
 
-				_chunk = (profiler_stmt_chunk *) hash_search(_chunks,
-															 (void *) &hk,
-															 HASH_FIND,
-															 &found);
+	dynq = (profiler_dynq *) hash_search(dynq_ht,
+										 (void *) &pdynq->key,
+										 HASH_FIND,
+										 &found);
 
-				if (!found)
-					elog(ERROR, "broken consistency of plpgsql_check profiler chunks");
+	if (!found)
+	{
+		if (htab_is_shared)
+		{
+			LWLockRelease(profiler_ss->dynq_lock);
+			LWLockAcquire(profiler_ss->dynq_lock, LW_EXCLUSIVE);
+		}
 
-				stmt_counter = 0;
-			}
+		dynq = (profiler_dynq *) hash_search(dynq_ht,
+											 (void *) &pdynq->key,
+											 htab_is_shared ? HASH_ENTER_NULL : HASH_ENTER,
+											 &found);
+	}
 
-			prstmt = &_chunk->stmts[stmt_counter++];
+	if (!dynq)
+	{
+		if (htab_is_shared)
+			LWLockRelease(profiler_ss->dynq_lock);
 
-			if (prstmt->lineno != pstmt->lineno)
-				elog(ERROR, "broken consistency of plpgsql_check profiler chunks %d %d", prstmt->lineno, pstmt->lineno);
+		profiler_internal_stat_add(PROFILER_INTERNAL_DYNQ_INSERT_FAILURE, NULL);
 
-			if (prstmt->us_max < pstmt->us_max)
-				prstmt->us_max = pstmt->us_max;
+		elog(elevel,
+			"cannot to insert new entry to profiler's dynamic queries");
 
-			prstmt->us_total += pstmt->us_total;
-			prstmt->rows += pstmt->rows;
-			prstmt->exec_count += pstmt->exec_count;
-			prstmt->exec_count_err += pstmt->exec_count_err;
-		}
+		return false;
 	}
-	PG_CATCH();
+
+	if (!found)
 	{
-		if (chunk_with_mutex)
-			SpinLockRelease(&chunk_with_mutex->mutex);
-		PG_RE_THROW();
+		/* new entry is visible only for us (we hold exclusive lock) */
+		SpinLockInit(&dynq->mutex);
+		dynq->lineno = pdynq->lineno;
+		dynq->nqueries = 0;
 	}
-	PG_END_TRY();
 
-	if (chunk_with_mutex)
-		SpinLockRelease(&chunk_with_mutex->mutex);
+	if (htab_is_shared)
+		SpinLockAcquire(&dynq->mutex);
+
+	for (i = 0; i < pdynq->nqueries; i++)
+		dynq_add_query(dynq, &pdynq->queries[i]);
 
-	if (shared_chunks)
-		LWLockRelease(profiler_ss->lock);
+	if (htab_is_shared)
+	{
+		SpinLockRelease(&dynq->mutex);
+		LWLockRelease(profiler_ss->dynq_lock);
+	}
+
+	return true;
 }
 
 /*
- * Iterate over list of statements
+ * The generation of profile (or function's statistics) is incremented
+ * after any update of counters, and the readers of deltas (see
+ * plpgsql_profiler_delta) skip entries with already processed generation.
+ * The initial generation is current time in microseconds, so the entry
+ * created again (after reset) has not same generation like removed entry
+ * with same key (the entry is not updated more times than once per
+ * microsecond).
+ */
+static uint64
+initial_generation(void)
+{
+	return (uint64) GetCurrentTimestamp();
+}
+
+/*
+ * Initialize counters of new profile. The profile should be visible
+ * only for us (exclusive lock should be hold, when profile is shared).
  */
 static void
-stmts_walker(profiler_info *pinfo,
-			 profiler_stmt_walker_mode mode,
-			 List *stmts,
-			 PLpgSQL_stmt *parent_stmt,
-			 const char *description,
-			 profiler_stmt_walker_options *opts)
+init_profile_stmts(profiler_profile *profile,
+				   profiler_stmt_counters *pstmts,
+				   uint64 last_update)
 {
-	bool	count_exec_time = mode == PLPGSQL_CHECK_STMT_WALKER_COUNT_EXEC_TIME;
-	bool	collect_coverage = mode == PLPGSQL_CHECK_STMT_WALKER_COLLECT_COVERAGE;
+	profiler_stmt_reduced_padded *stmts;
+	int			i,
+				j;
 
-	int64 nested_us_time = 0;
-	int64 nested_exec_count = 0;
+	pg_atomic_init_u64(&profile->last_update, last_update);
 
-	int			stmt_block_num = 1;
+	pg_atomic_init_u64(&profile->generation, initial_generation());
 
-	ListCell   *lc;
+	/*
+	 * Statement statistics are stored in natural order (next statistics
+	 * should be related to statement on same or higher line).
+	 */
+	stmts = get_profile_stmts(profile);
 
-	foreach(lc, stmts)
+	for (i = 0; i < profile->nstatements; i++)
 	{
-		PLpgSQL_stmt *stmt = (PLpgSQL_stmt *) lfirst(lc);
+		profiler_stmt_reduced *prstmt = &stmts[i].stmt;
+		profiler_stmt_counters *pstmt = &pstmts[i];
+
+		prstmt->lineno = pstmt->lineno;
+		prstmt->queryid = pstmt->queryid;
+		prstmt->has_queryid = pstmt->has_queryid;
+		pg_atomic_init_u64(&prstmt->us_max, pstmt->us_max);
+		pg_atomic_init_u64(&prstmt->us_total, pstmt->us_total);
+		pg_atomic_init_u64(&prstmt->rows, pstmt->rows);
+		pg_atomic_init_u64(&prstmt->exec_count, pstmt->exec_count);
+		pg_atomic_init_u64(&prstmt->exec_count_err, pstmt->exec_count_err);
+
+		for (j = 0; j < PROFILER_HISTOGRAM_BUCKETS; j++)
+			pg_atomic_init_u32(&prstmt->histogram[j], pstmt->histogram[j]);
+	}
+}
+
+/*
+ * Merge pending profile to persistent (shared or local) profile.
+ * Returns false (after raising message with level elevel), when
+ * the profile cannot be merged.
+ */
+static bool
+update_persistent_profile(profiler_pending_profile *pp, int elevel)
+{
+	profiler_profile *profile = NULL;
+	bool		found;
+	HTAB	   *profiles;
+	bool		shared_profiles;
+	int			i,
+				j;
+	profiler_stmt_reduced_padded *stmts;
+	uint64		now = (uint64) GetCurrentStatementStartTimestamp();
+
+	if (shared_profiles_HashTable)
+	{
+		profiles = shared_profiles_HashTable;
+		profiler_lwlock_acquire(profiler_ss->lock, LW_SHARED,
+								PROFILER_INTERNAL_PROFILER_LOCK_WAIT);
+		shared_profiles = true;
+	}
+	else
+	{
+		profiles = profiles_HashTable;
+		shared_profiles = false;
+	}
+
+	/* don't need too strong lock for reading shared memory */
+	profile = (profiler_profile *) hash_search(profiles,
+											   (void *) &pp->key,
+											   HASH_FIND,
+											   &found);
+
+	/* We need exclusive lock, when we want to add new profile */
+	if (!found && shared_profiles)
+	{
+		LWLockRelease(profiler_ss->lock);
+		profiler_lwlock_acquire(profiler_ss->lock, LW_EXCLUSIVE,
+								PROFILER_INTERNAL_PROFILER_LOCK_WAIT);
+
+		/* repeat searching under exclusive lock */
+		profile = (profiler_profile *) hash_search(profiles,
+												   (void *) &pp->key,
+												   HASH_FIND,
+												   &found);
+	}
+
+	if (!found)
+	{
+		profile = create_profile(profiles, shared_profiles, &pp->key, pp->nstatements);
+
+		if (!profile)
+		{
+			if (shared_profiles)
+				LWLockRelease(profiler_ss->lock);
+
+			profiler_internal_stat_add(PROFILER_INTERNAL_PROFILE_INSERT_FAILURE, NULL);
+
+			ereport(elevel,
+					(errcode(ERRCODE_OUT_OF_MEMORY),
+					 errmsg("out of shared memory"),
+					 errhint("You might need to increase \"plpgsql_check.profiler_max_shared_chunks\" or \"plpgsql_check.profiler_max_shared_memory\".")));
+
+			return false;
+		}
+
+		init_profile_stmts(profile, pp->stmts, now);
+
+		if (shared_profiles)
+			LWLockRelease(profiler_ss->lock);
+
+		return true;
+	}
+
+	/*
+	 * Now we know, so there is already profile, and we have all necessary locks.
+	 * The counters are updated by atomic operations, so shared lock is enough,
+	 * and more backends can merge profiles of same function in parallel.
+	 */
+	if (profile->nstatements != pp->nstatements)
+	{
+		if (shared_profiles)
+			LWLockRelease(profiler_ss->lock);
+
+		elog(elevel, "broken consistency of plpgsql_check profile %d %d", profile->nstatements, pp->nstatements);
+
+		return false;
+	}
+
+	pg_atomic_write_u64(&profile->last_update, now);
+
+	stmts = get_profile_stmts(profile);
+
+	for (i = 0; i < pp->nstatements; i++)
+	{
+		profiler_stmt_reduced *prstmt = &stmts[i].stmt;
+		profiler_stmt_counters *pstmt = &pp->stmts[i];
+
+		if (prstmt->lineno != pstmt->lineno)
+		{
+			if (shared_profiles)
+				LWLockRelease(profiler_ss->lock);
+
+			elog(elevel, "broken consistency of plpgsql_check profile %d %d", prstmt->lineno, pstmt->lineno);
+
+			return false;
+		}
+
+		/* don't touch shared memory when statement was not executed */
+		if (pstmt->exec_count == 0)
+			continue;
+
+		atomic_update_max_u64(&prstmt->us_max, pstmt->us_max);
+
+		pg_atomic_fetch_add_u64(&prstmt->us_total, pstmt->us_total);
+		pg_atomic_fetch_add_u64(&prstmt->rows, pstmt->rows);
+		pg_atomic_fetch_add_u64(&prstmt->exec_count, pstmt->exec_count);
+
+		if (pstmt->exec_count_err > 0)
+			pg_atomic_fetch_add_u64(&prstmt->exec_count_err, pstmt->exec_count_err);
+
+		/* statement is usually executed with similar latency, so most buckets are empty */
+		for (j = 0; j < PROFILER_HISTOGRAM_BUCKETS; j++)
+		{
+			if (pstmt->histogram[j] > 0)
+				pg_atomic_fetch_add_u32(&prstmt->histogram[j], pstmt->histogram[j]);
+		}
+	}
+
+	/* should be incremented after update of counters */
+	pg_atomic_fetch_add_u64(&profile->generation, 1);
+
+	if (shared_profiles)
+		LWLockRelease(profiler_ss->lock);
+
+	return true;
+}
+
+/*
+ * Returns pending (not flushed yet) profile of function. The
+ * profile is created, when it doesn't exist.
+ */
+static profiler_pending_profile *
+get_pending_profile(profiler_info *pinfo, const int *stmtid_map)
+{
+	profiler_pending_profile *pp;
+	profiler_hashkey hk;
+	bool		found;
+
+	profiler_init_hashkey(&hk, pinfo->func);
+
+	pp = (profiler_pending_profile *) hash_search(profiler_pending_HashTable,
+												  (void *) &hk,
+												  HASH_FIND,
+												  &found);
+
+	if (!found)
+	{
+		profiler_stmt_counters *stmts;
+		int			nstatements = 0;
+		int			i;
+
+		stmts = MemoryContextAllocZero(profiler_mcxt,
+									   pinfo->nstatements * sizeof(profiler_stmt_counters));
+
+		/*
+		 * We need to store statement statistics in natural order. Unfortunately
+		 * buildin stmtid has inverse order based on bison parser processing.
+		 */
+		for (i = 0; i < pinfo->nstatements; i++)
+		{
+			int		n = stmtid_map[i] - 1;
+
+			/* Skip gaps in reorder map */
+			if (n == -1)
+				continue;
+
+			stmts[nstatements++].lineno = pinfo->stmts_info[n].lineno;
+		}
+
+		pp = (profiler_pending_profile *) hash_search(profiler_pending_HashTable,
+													  (void *) &hk,
+													  HASH_ENTER,
+													  NULL);
+
+		pp->ncalls = 0;
+		pp->ncalls_err = 0;
+		pp->total_time = 0;
+		pp->total_time_xx = 0.0;
+		pp->min_time = 0;
+		pp->max_time = 0;
+		memset(pp->histogram, 0, sizeof(pp->histogram));
+		pp->nstatements = nstatements;
+		pp->stmts = stmts;
+	}
+
+	return pp;
+}
+
+/*
+ * Add local profile of finished function call to pending profile.
+ */
+static void
+accum_pending_profile(profiler_pending_profile *pp,
+					  profiler_info *pinfo,
+					  const int *stmtid_map,
+					  uint64 elapsed,
+					  bool is_aborted)
+{
+	int			stmt_counter = 0;
+	int			i,
+				j;
+
+	if (pp->ncalls == 0)
+	{
+		pp->min_time = elapsed;
+		pp->max_time = elapsed;
+	}
+	else
+	{
+		pp->min_time = pp->min_time < elapsed ? pp->min_time : elapsed;
+		pp->max_time = pp->max_time > elapsed ? pp->max_time : elapsed;
+	}
+
+	/*
+	 * The sampled call represents weight calls with same execution time,
+	 * so the variance of these calls is zero.
+	 */
+	if (pinfo->weight > 1)
+		eval_stddev_combine(&pp->ncalls,
+							&pp->total_time,
+							&pp->total_time_xx,
+							pinfo->weight,
+							pinfo->weight * elapsed,
+							0.0);
+	else
+		eval_stddev_accum(&pp->ncalls,
+						  &pp->total_time,
+						  &pp->total_time_xx,
+						  elapsed);
+
+	pp->histogram[histogram_bucket(elapsed)] += pinfo->weight;
+
+	if (is_aborted)
+		pp->ncalls_err += pinfo->weight;
+
+	for (i = 0; i < pinfo->nstatements; i++)
+	{
+		profiler_stmt_counters *ppstmt;
+		profiler_stmt *pstmt;
+		int		n = stmtid_map[i] - 1;
+
+		/* Skip gaps in reorder map */
+		if (n == -1)
+			continue;
+
+		Assert(stmt_counter < pp->nstatements);
+
+		ppstmt = &pp->stmts[stmt_counter++];
+		pstmt = &pinfo->stmts[n];
+
+		Assert(ppstmt->lineno == pinfo->stmts_info[n].lineno);
+
+		if (ppstmt->queryid == NOQUERYID)
+			ppstmt->queryid = pstmt->queryid;
+
+		ppstmt->has_queryid |= pstmt->has_queryid;
+
+		if (pstmt->exec_count == 0)
+			continue;
+
+		if (ppstmt->us_max < pstmt->us_max)
+			ppstmt->us_max = pstmt->us_max;
+
+		ppstmt->us_total += pstmt->us_total * pinfo->weight;
+		ppstmt->rows += pstmt->rows * pinfo->weight;
+		ppstmt->exec_count += pstmt->exec_count * pinfo->weight;
+		ppstmt->exec_count_err += pstmt->exec_count_err * pinfo->weight;
+
+		/*
+		 * The histogram is allocated only for statements executed more
+		 * times. Latency of only one execution is same like max time.
+		 */
+		if (pstmt->histogram)
+		{
+			for (j = 0; j < PROFILER_HISTOGRAM_BUCKETS; j++)
+				ppstmt->histogram[j] += pstmt->histogram[j] * pinfo->weight;
+		}
+		else
+			ppstmt->histogram[histogram_bucket(pstmt->us_max)] += pinfo->weight;
+	}
+}
+
+/*
+ * Add finished call to pending call stacks. The stack is composed
+ * from frames of profiled callers. Their current statements are
+ * the statements, that called the nested function.
+ */
+static void
+accum_pending_stack(profiler_info *pinfo, uint64 elapsed)
+{
+	profiler_stack_hashkey key;
+	profiler_stack *pstack;
+	profiler_info *caller;
+	uint64		self_time;
+	int			depth = pinfo->stack_depth;
+	int			i;
+	bool		found;
+
+	/* the caller is current profiled function again */
+	profiler_current_pinfo = pinfo->caller;
+
+	if (depth > PROFILER_MAX_STACK_DEPTH)
+		return;
+
+	self_time = elapsed > pinfo->nested_time ? elapsed - pinfo->nested_time : 0;
+
+	if (pinfo->caller)
+		pinfo->caller->nested_time += elapsed;
+
+	/* ensure correct complete content of hash key */
+	memset(&key, 0, sizeof(profiler_stack_hashkey));
+	key.db_oid = MyDatabaseId;
+	key.depth = depth;
+
+	key.frames[depth - 1].fn_oid = pinfo->func->fn_oid;
+	key.frames[depth - 1].lineno = 0;
+
+	for (caller = pinfo->caller, i = depth - 2; caller; caller = caller->caller, i--)
+	{
+		Assert(i >= 0);
+
+		key.frames[i].fn_oid = caller->func->fn_oid;
+		key.frames[i].lineno = caller->current_stmtid > 0 ?
+			caller->stmts_info[caller->current_stmtid - 1].lineno : 0;
+	}
+
+	pstack = (profiler_stack *) hash_search(profiler_pending_stacks_HashTable,
+											(void *) &key,
+											HASH_ENTER,
+											&found);
+
+	if (!found)
+	{
+		pstack->exec_count = 0;
+		pstack->total_time = 0;
+		pstack->self_time = 0;
+	}
+
+	/*
+	 * The counters of stack are extrapolated like counters of statements.
+	 * The callers are sampled independently, so not profiled caller is
+	 * not in stack, and the time of not profiled nested call is counted
+	 * in self time.
+	 */
+	pstack->exec_count += pinfo->weight;
+	pstack->total_time += elapsed * pinfo->weight;
+	pstack->self_time += self_time * pinfo->weight;
+}
+
+/*
+ * Accumulate counters of one execution of dynamic statement to pending
+ * queries of this statement.
+ */
+static void
+accum_pending_dynq(profiler_info *pinfo, int stmtid, pc_queryid queryid,
+				   uint64 elapsed, uint64 rows)
+{
+	profiler_dynq_hashkey key;
+	profiler_dynq *pdynq;
+	profiler_dynq_counters q;
+	bool		found;
+
+	memset(&key, 0, sizeof(profiler_dynq_hashkey));
+	profiler_init_hashkey(&key.fkey, pinfo->func);
+	key.stmtid = stmtid;
+
+	pdynq = (profiler_dynq *) hash_search(profiler_pending_dynq_HashTable,
+										  (void *) &key,
+										  HASH_ENTER,
+										  &found);
+
+	if (!found)
+	{
+		pdynq->lineno = pinfo->stmts_info[stmtid - 1].lineno;
+		pdynq->nqueries = 0;
+	}
+
+	q.queryid = queryid;
+	q.exec_count = pinfo->weight;
+	q.us_total = elapsed * pinfo->weight;
+	q.us_max = elapsed;
+	q.rows = rows * pinfo->weight;
+
+	dynq_add_query(pdynq, &q);
+}
+
+/*
+ * Merge all pending profiles to persistent profiles. Pending profiles
+ * of functions that were not executed from last flush are released.
+ * When elevel is lower than ERROR, then this routine doesn't raise
+ * an exception (can be used in transaction's end callback).
+ */
+static void
+profiler_flush_pending(int elevel)
+{
+	HASH_SEQ_STATUS hash_seq;
+	HASH_SEQ_STATUS hash_seq_stacks;
+	HASH_SEQ_STATUS hash_seq_dynq;
+	HASH_SEQ_STATUS hash_seq_coverage;
+	profiler_pending_profile *pp;
+	profiler_stack *pstack;
+	profiler_dynq *pdynq;
+	coverage_bitmap *pcb;
+	instr_time	start_time;
+
+	if (!profiler_pending_HashTable)
+		return;
+
+	hash_seq_init(&hash_seq, profiler_pending_HashTable);
+
+	while ((pp = hash_seq_search(&hash_seq)) != NULL)
+	{
+		int			i;
+
+		if (pp->ncalls == 0)
+		{
+			pfree(pp->stmts);
+
+			hash_search(profiler_pending_HashTable,
+						(void *) &pp->key,
+						HASH_REMOVE,
+						NULL);
+			continue;
+		}
+
+		INSTR_TIME_SET_CURRENT(start_time);
+
+		if (update_persistent_profile(pp, elevel))
+		{
+			profiler_internal_stat_add(PROFILER_INTERNAL_PROFILE_UPDATE, &start_time);
+
+			INSTR_TIME_SET_CURRENT(start_time);
+
+			if (update_persistent_fstats(pp, elevel))
+				profiler_internal_stat_add(PROFILER_INTERNAL_FSTATS_UPDATE, &start_time);
+		}
+
+		pp->ncalls = 0;
+		pp->ncalls_err = 0;
+		pp->total_time = 0;
+		pp->total_time_xx = 0.0;
+		pp->min_time = 0;
+		pp->max_time = 0;
+		memset(pp->histogram, 0, sizeof(pp->histogram));
+
+		for (i = 0; i < pp->nstatements; i++)
+		{
+			profiler_stmt_counters *ppstmt = &pp->stmts[i];
+
+			ppstmt->us_max = 0;
+			ppstmt->us_total = 0;
+			ppstmt->rows = 0;
+			ppstmt->exec_count = 0;
+			ppstmt->exec_count_err = 0;
+			memset(ppstmt->histogram, 0, sizeof(ppstmt->histogram));
+		}
+	}
+
+	hash_seq_init(&hash_seq_stacks, profiler_pending_stacks_HashTable);
+
+	while ((pstack = hash_seq_search(&hash_seq_stacks)) != NULL)
+	{
+		INSTR_TIME_SET_CURRENT(start_time);
+
+		/* the entry is removed after merge, so call stacks cannot hold too much memory */
+		if (!update_persistent_stack(pstack, elevel))
+			continue;
+
+		profiler_internal_stat_add(PROFILER_INTERNAL_STACK_UPDATE, &start_time);
+
+		hash_search(profiler_pending_stacks_HashTable,
+					(void *) &pstack->key,
+					HASH_REMOVE,
+					NULL);
+	}
+
+	hash_seq_init(&hash_seq_dynq, profiler_pending_dynq_HashTable);
+
+	while ((pdynq = hash_seq_search(&hash_seq_dynq)) != NULL)
+	{
+		if (!update_persistent_dynq(pdynq, elevel))
+			continue;
+
+		hash_search(profiler_pending_dynq_HashTable,
+					(void *) &pdynq->key,
+					HASH_REMOVE,
+					NULL);
+	}
+
+	hash_seq_init(&hash_seq_coverage, coverage_pending_HashTable);
+
+	while ((pcb = hash_seq_search(&hash_seq_coverage)) != NULL)
+	{
+		if (!update_persistent_coverage(pcb, elevel))
+			continue;
+
+		pfree(pcb->bits);
+
+		hash_search(coverage_pending_HashTable,
+					(void *) &pcb->key,
+					HASH_REMOVE,
+					NULL);
+	}
+
+	profiler_flush_internal_stats();
+
+	INSTR_TIME_SET_CURRENT(profiler_last_flush_time);
+}
+
+static bool
+profiler_flush_interval_elapsed(instr_time *now)
+{
+	instr_time	diff;
+
+	if (INSTR_TIME_IS_ZERO(profiler_last_flush_time))
+		return true;
+
+	diff = *now;
+	INSTR_TIME_SUBTRACT(diff, profiler_last_flush_time);
+
+	return INSTR_TIME_GET_MILLISEC(diff) >= (double) plpgsql_check_profiler_flush_interval;
+}
+
+/*
+ * Flush pending profiles at the end of function, when flush interval
+ * is elapsed. Others are flushed at transaction end or before exit.
+ */
+static void
+profiler_flush_pending_deferred(instr_time *now)
+{
+	/*
+	 * Without shared memory, the profile is stored in session memory,
+	 * and then there is not any reason for deferred flush.
+	 */
+	if (!shared_profiles_HashTable ||
+		plpgsql_check_profiler_flush_interval <= 0)
+	{
+		profiler_flush_pending(ERROR);
+		return;
+	}
+
+	if (!profiler_flush_callbacks_registered)
+	{
+		RegisterXactCallback(profiler_xact_callback, NULL);
+		before_shmem_exit(profiler_exit_callback, (Datum) 0);
+
+		profiler_flush_callbacks_registered = true;
+	}
+
+	if (profiler_flush_interval_elapsed(now))
+		profiler_flush_pending(ERROR);
+}
+
+/*
+ * Flush pending profiles before commit of transaction. The profiles are
+ * merged with WARNING elevel, so the transaction is not aborted there.
+ * After abort, the shared memory should not be allocated, so the pending
+ * profiles are merged later (by next profiled function, next commit or
+ * before backend exit).
+ */
+static void
+profiler_xact_callback(XactEvent event, void *arg)
+{
+	(void) arg;
+
+	if (event == XACT_EVENT_PRE_COMMIT)
+		profiler_flush_pending(WARNING);
+}
+
+/*
+ * Flush pending profiles before backend exit
+ */
+static void
+profiler_exit_callback(int code, Datum arg)
+{
+	(void) code;
+	(void) arg;
+
+	profiler_flush_pending(WARNING);
+}
+
+/*
+ * Write content of shared profiles to file. The statements are saved
+ * without padding and other fields are saved as plain values, so the
+ * file is much smaller than used shared memory. Only shared locks are
+ * used, and the file is renamed and synced without locks, so other
+ * backends are not blocked by writing. When some backend attached
+ * shared profiles after last detach (nattaches is different), then
+ * the file is not valid already, and it is removed.
+ */
+static void
+profiler_snapshot_save(uint64 nattaches)
+{
+	FILE	   *file;
+	HASH_SEQ_STATUS hash_seq;
+	profiler_profile *profile;
+	fstats	   *fstats_item;
+	profiler_stack *stack;
+	profiler_stmt_counters *pstmts = NULL;
+	int			max_nstatements = 0;
+	int32		num_entries;
+	bool		is_valid;
+
+	file = AllocateFile(PROFILER_DUMP_FILE ".tmp", PG_BINARY_W);
+	if (file == NULL)
+		goto error;
+
+	if (fwrite(&PROFILER_FILE_HEADER, sizeof(uint32), 1, file) != 1)
+		goto error;
+	if (fwrite(&PROFILER_PG_MAJOR_VERSION, sizeof(uint32), 1, file) != 1)
+		goto error;
+
+	LWLockAcquire(profiler_ss->lock, LW_SHARED);
+
+	num_entries = hash_get_num_entries(shared_profiles_HashTable);
+	if (fwrite(&num_entries, sizeof(int32), 1, file) != 1)
+	{
+		LWLockRelease(profiler_ss->lock);
+		goto error;
+	}
+
+	hash_seq_init(&hash_seq, shared_profiles_HashTable);
+
+	while ((profile = hash_seq_search(&hash_seq)) != NULL)
+	{
+		profiler_stmt_reduced_padded *stmts;
+		uint64		last_update;
+		int			i,
+					j;
+
+		if (profile->nstatements > max_nstatements)
+		{
+			if (pstmts)
+				pfree(pstmts);
+
+			pstmts = palloc_extended(profile->nstatements * sizeof(profiler_stmt_counters),
+									 MCXT_ALLOC_NO_OOM);
+			if (!pstmts)
+			{
+				hash_seq_term(&hash_seq);
+				LWLockRelease(profiler_ss->lock);
+				goto error;
+			}
+
+			max_nstatements = profile->nstatements;
+		}
+
+		stmts = get_profile_stmts(profile);
+
+		for (i = 0; i < profile->nstatements; i++)
+		{
+			profiler_stmt_reduced *prstmt = &stmts[i].stmt;
+			profiler_stmt_counters *pstmt = &pstmts[i];
+
+			pstmt->lineno = prstmt->lineno;
+			pstmt->queryid = prstmt->queryid;
+			pstmt->has_queryid = prstmt->has_queryid;
+			pstmt->us_max = pg_atomic_read_u64(&prstmt->us_max);
+			pstmt->us_total = pg_atomic_read_u64(&prstmt->us_total);
+			pstmt->rows = pg_atomic_read_u64(&prstmt->rows);
+			pstmt->exec_count = pg_atomic_read_u64(&prstmt->exec_count);
+			pstmt->exec_count_err = pg_atomic_read_u64(&prstmt->exec_count_err);
+
+			for (j = 0; j < PROFILER_HISTOGRAM_BUCKETS; j++)
+				pstmt->histogram[j] = pg_atomic_read_u32(&prstmt->histogram[j]);
+		}
+
+		last_update = pg_atomic_read_u64(&profile->last_update);
+
+		if (fwrite(&profile->key, sizeof(profiler_hashkey), 1, file) != 1 ||
+			fwrite(&profile->nstatements, sizeof(int), 1, file) != 1 ||
+			fwrite(&last_update, sizeof(uint64), 1, file) != 1 ||
+			fwrite(pstmts, sizeof(profiler_stmt_counters), profile->nstatements, file) != (size_t) profile->nstatements)
+		{
+			hash_seq_term(&hash_seq);
+			LWLockRelease(profiler_ss->lock);
+			goto error;
+		}
+	}
+
+	LWLockRelease(profiler_ss->lock);
+
+	LWLockAcquire(profiler_ss->fstats_lock, LW_SHARED);
+
+	num_entries = hash_get_num_entries(shared_fstats_HashTable);
+	if (fwrite(&num_entries, sizeof(int32), 1, file) != 1)
+	{
+		LWLockRelease(profiler_ss->fstats_lock);
+		goto error;
+	}
+
+	hash_seq_init(&hash_seq, shared_fstats_HashTable);
+
+	while ((fstats_item = hash_seq_search(&hash_seq)) != NULL)
+	{
+		fstats_shard agg;
+
+		aggregate_fstats(fstats_item, true, &agg);
+
+		if (fwrite(&fstats_item->key, sizeof(fstats_hashkey), 1, file) != 1 ||
+			fwrite(&agg, sizeof(fstats_shard), 1, file) != 1)
+		{
+			hash_seq_term(&hash_seq);
+			LWLockRelease(profiler_ss->fstats_lock);
+			goto error;
+		}
+	}
+
+	LWLockRelease(profiler_ss->fstats_lock);
+
+	LWLockAcquire(profiler_ss->stacks_lock, LW_SHARED);
+
+	num_entries = hash_get_num_entries(shared_stacks_HashTable);
+	if (fwrite(&num_entries, sizeof(int32), 1, file) != 1)
+	{
+		LWLockRelease(profiler_ss->stacks_lock);
+		goto error;
+	}
+
+	hash_seq_init(&hash_seq, shared_stacks_HashTable);
+
+	while ((stack = hash_seq_search(&hash_seq)) != NULL)
+	{
+		profiler_stack stack_copy;
+
+		SpinLockAcquire(&stack->mutex);
+		stack_copy = *stack;
+		SpinLockRelease(&stack->mutex);
+
+		/* only used frames are saved */
+		if (fwrite(&stack_copy.key.db_oid, sizeof(Oid), 1, file) != 1 ||
+			fwrite(&stack_copy.exec_count, sizeof(uint64), 1, file) != 1 ||
+			fwrite(&stack_copy.total_time, sizeof(uint64), 1, file) != 1 ||
+			fwrite(&stack_copy.self_time, sizeof(uint64), 1, file) != 1 ||
+			fwrite(&stack_copy.key.depth, sizeof(int), 1, file) != 1 ||
+			fwrite(stack_copy.key.frames, sizeof(profiler_stack_frame),
+				   stack_copy.key.depth, file) != (size_t) stack_copy.key.depth)
+		{
+			hash_seq_term(&hash_seq);
+			LWLockRelease(profiler_ss->stacks_lock);
+			goto error;
+		}
+	}
+
+	LWLockRelease(profiler_ss->stacks_lock);
+
+	if (pstmts)
+	{
+		pfree(pstmts);
+		pstmts = NULL;
+	}
+
+	if (FreeFile(file))
+	{
+		file = NULL;
+		goto error;
+	}
+
+	/* rename file into place, so we atomically replace any old one */
+	(void) durable_rename(PROFILER_DUMP_FILE ".tmp", PROFILER_DUMP_FILE, LOG);
+
+	SpinLockAcquire(&profiler_ss->attach_mutex);
+	is_valid = profiler_ss->nattaches == nattaches;
+	SpinLockRelease(&profiler_ss->attach_mutex);
+
+	if (!is_valid)
+		unlink(PROFILER_DUMP_FILE);
+
+	return;
+
+error:
+	ereport(LOG,
+			(errcode_for_file_access(),
+			 errmsg("could not write file \"%s\": %m",
+					PROFILER_DUMP_FILE ".tmp")));
+
+	if (pstmts)
+		pfree(pstmts);
+
+	if (file)
+		FreeFile(file);
+
+	unlink(PROFILER_DUMP_FILE ".tmp");
+}
+
+/*
+ * Load shared profiles from file. Exclusive lock on profiles should be hold,
+ * and shared profiles, function's statistics and call stacks should be empty.
+ * When the file is broken, then nothing is loaded. An exception is not
+ * raised here (the content of file is not trusted), and the dynamic shared
+ * memory area should be attached before.
+ */
+static void
+profiler_snapshot_load(void)
+{
+	FILE	   *file;
+	uint32		header;
+	uint32		pgver;
+	int32		num_entries;
+	int32		i;
+	profiler_stmt_counters *pstmts = NULL;
+	int			max_nstatements = 0;
+	bool		is_valid = false;
+
+	file = AllocateFile(PROFILER_DUMP_FILE, PG_BINARY_R);
+	if (file == NULL)
+	{
+		if (errno != ENOENT)
+			ereport(LOG,
+					(errcode_for_file_access(),
+					 errmsg("could not read file \"%s\": %m",
+							PROFILER_DUMP_FILE)));
+		return;
+	}
+
+	LWLockAcquire(profiler_ss->fstats_lock, LW_EXCLUSIVE);
+	LWLockAcquire(profiler_ss->stacks_lock, LW_EXCLUSIVE);
+
+	if (fread(&header, sizeof(uint32), 1, file) != 1 ||
+		fread(&pgver, sizeof(uint32), 1, file) != 1)
+		goto done;
+
+	if (header != PROFILER_FILE_HEADER ||
+		pgver != PROFILER_PG_MAJOR_VERSION)
+		goto done;
+
+	/* profiles */
+	if (fread(&num_entries, sizeof(int32), 1, file) != 1)
+		goto done;
+
+	for (i = 0; i < num_entries; i++)
+	{
+		profiler_hashkey hk;
+		int			nstatements;
+		uint64		last_update;
+		profiler_profile *profile;
+
+		if (fread(&hk, sizeof(profiler_hashkey), 1, file) != 1 ||
+			fread(&nstatements, sizeof(int), 1, file) != 1 ||
+			fread(&last_update, sizeof(uint64), 1, file) != 1)
+			goto done;
+
+		if (nstatements <= 0 || nstatements > 1000000)
+			goto done;
+
+		if (nstatements > max_nstatements)
+		{
+			if (pstmts)
+				pfree(pstmts);
+
+			pstmts = palloc_extended(nstatements * sizeof(profiler_stmt_counters),
+									 MCXT_ALLOC_NO_OOM);
+			if (!pstmts)
+				goto done;
+
+			max_nstatements = nstatements;
+		}
+
+		if (fread(pstmts, sizeof(profiler_stmt_counters), nstatements, file) != (size_t) nstatements)
+			goto done;
+
+		/* create_profile raises an exception for duplicate key */
+		if (hash_search(shared_profiles_HashTable, (void *) &hk, HASH_FIND, NULL))
+			goto done;
+
+		/* the profile can be lost, when the limits were decreased */
+		profile = create_profile(shared_profiles_HashTable, true, &hk, nstatements);
+		if (profile)
+			init_profile_stmts(profile, pstmts, last_update);
+	}
+
+	/* function's statistics */
+	if (fread(&num_entries, sizeof(int32), 1, file) != 1)
+		goto done;
+
+	for (i = 0; i < num_entries; i++)
+	{
+		fstats_hashkey fhk;
+		fstats_shard agg;
+		fstats	   *fstats_item;
+		bool		found;
+		int			j;
+
+		if (fread(&fhk, sizeof(fstats_hashkey), 1, file) != 1 ||
+			fread(&agg, sizeof(fstats_shard), 1, file) != 1)
+			goto done;
+
+		fstats_item = (fstats *) hash_search(shared_fstats_HashTable,
+											 (void *) &fhk,
+											 HASH_ENTER_NULL,
+											 &found);
+		if (!fstats_item)
+			continue;
+
+		for (j = 0; j < FSTATS_SHARDS; j++)
+		{
+			fstats_shard *shard = get_fstats_shard(fstats_item, j);
+
+			if (j == 0)
+				*shard = agg;
+			else
+			{
+				shard->exec_count = 0;
+				shard->exec_count_err = 0;
+				shard->total_time = 0;
+				shard->total_time_xx = 0.0;
+				shard->min_time = 0;
+				shard->max_time = 0;
+				memset(shard->histogram, 0, sizeof(shard->histogram));
+			}
+
+			SpinLockInit(&shard->mutex);
+		}
+
+		pg_atomic_init_u64(&fstats_item->generation, initial_generation());
+	}
+
+	/* call stacks */
+	if (fread(&num_entries, sizeof(int32), 1, file) != 1)
+		goto done;
+
+	for (i = 0; i < num_entries; i++)
+	{
+		profiler_stack pstack;
+		profiler_stack *stack;
+		bool		found;
+
+		/* ensure correct complete content of hash key */
+		memset(&pstack.key, 0, sizeof(profiler_stack_hashkey));
+
+		if (fread(&pstack.key.db_oid, sizeof(Oid), 1, file) != 1 ||
+			fread(&pstack.exec_count, sizeof(uint64), 1, file) != 1 ||
+			fread(&pstack.total_time, sizeof(uint64), 1, file) != 1 ||
+			fread(&pstack.self_time, sizeof(uint64), 1, file) != 1 ||
+			fread(&pstack.key.depth, sizeof(int), 1, file) != 1)
+			goto done;
+
+		if (pstack.key.depth < 0 || pstack.key.depth > PROFILER_MAX_STACK_DEPTH)
+			goto done;
+
+		if (fread(pstack.key.frames, sizeof(profiler_stack_frame),
+				  pstack.key.depth, file) != (size_t) pstack.key.depth)
+			goto done;
+
+		stack = (profiler_stack *) hash_search(shared_stacks_HashTable,
+											   (void *) &pstack.key,
+											   HASH_ENTER_NULL,
+											   &found);
+		if (!stack)
+			continue;
+
+		SpinLockInit(&stack->mutex);
+		stack->exec_count = pstack.exec_count;
+		stack->total_time = pstack.total_time;
+		stack->self_time = pstack.self_time;
+	}
+
+	is_valid = true;
+
+done:
+	if (!is_valid)
+	{
+		HASH_SEQ_STATUS hash_seq;
+		profiler_profile *profile;
+		fstats	   *fstats_item;
+		profiler_stack *stack;
+
+		ereport(LOG,
+				(errmsg("ignoring invalid data in file \"%s\"",
+						PROFILER_DUMP_FILE)));
+
+		hash_seq_init(&hash_seq, shared_profiles_HashTable);
+		while ((profile = hash_seq_search(&hash_seq)) != NULL)
+			remove_profile(shared_profiles_HashTable, profile);
+
+		hash_seq_init(&hash_seq, shared_fstats_HashTable);
+		while ((fstats_item = hash_seq_search(&hash_seq)) != NULL)
+			hash_search(shared_fstats_HashTable, &(fstats_item->key), HASH_REMOVE, NULL);
+
+		hash_seq_init(&hash_seq, shared_stacks_HashTable);
+		while ((stack = hash_seq_search(&hash_seq)) != NULL)
+			hash_search(shared_stacks_HashTable, &(stack->key), HASH_REMOVE, NULL);
+	}
+
+	LWLockRelease(profiler_ss->stacks_lock);
+	LWLockRelease(profiler_ss->fstats_lock);
+
+	if (pstmts)
+		pfree(pstmts);
+
+	FreeFile(file);
+
+	/*
+	 * Remove the file, so it is not used after crash and it is not
+	 * included in backups. It is written again, when last backend
+	 * is finished.
+	 */
+	unlink(PROFILER_DUMP_FILE);
+}
+
+/*
+ * Registers current backend as user of shared profiles. First backend
+ * loads saved shared profiles. When the backend attaches shared profiles
+ * after all backends detached them, then the saved file is removed, so
+ * older content is not loaded after crash.
+ *
+ * It should be called before any change of shared profiles, and it
+ * should not be called from transaction's end callback (it can raise
+ * an exception).
+ */
+static void
+profiler_snapshot_attach(void)
+{
+	bool		is_first;
+
+	if (profiler_snapshot_attached)
+		return;
+
+	Assert(shared_profiles_HashTable);
+
+	/* the load cannot raise an exception, so dsa is attached before */
+	(void) profiler_get_dsa();
+
+	if (!profiler_ss->snapshot_loaded)
+	{
+		LWLockAcquire(profiler_ss->lock, LW_EXCLUSIVE);
+
+		if (!profiler_ss->snapshot_loaded)
+		{
+			if (plpgsql_check_profiler_save)
+				profiler_snapshot_load();
+			else
+				unlink(PROFILER_DUMP_FILE);
+
+			profiler_ss->snapshot_loaded = true;
+		}
+
+		LWLockRelease(profiler_ss->lock);
+	}
+
+	/*
+	 * The statements of shared profiles are stored in dynamic shared
+	 * memory, that is detached before on_shmem_exit callbacks, so the
+	 * profiles should be saved before.
+	 */
+	before_shmem_exit(profiler_snapshot_detach, (Datum) 0);
+
+	profiler_snapshot_attached = true;
+
+	SpinLockAcquire(&profiler_ss->attach_mutex);
+	is_first = profiler_ss->nattached++ == 0;
+	profiler_ss->nattaches += 1;
+	SpinLockRelease(&profiler_ss->attach_mutex);
+
+	if (is_first)
+		unlink(PROFILER_DUMP_FILE);
+}
+
+/*
+ * Unregisters current backend as user of shared profiles. Last backend
+ * saves shared profiles.
+ */
+static void
+profiler_snapshot_detach(int code, Datum arg)
+{
+	bool		is_last;
+	uint64		nattaches;
+
+	(void) code;
+	(void) arg;
+
+	/* own pending profiles should be saved too */
+	profiler_flush_pending(WARNING);
+
+	SpinLockAcquire(&profiler_ss->attach_mutex);
+	Assert(profiler_ss->nattached > 0);
+	is_last = --profiler_ss->nattached == 0;
+	nattaches = profiler_ss->nattaches;
+	SpinLockRelease(&profiler_ss->attach_mutex);
+
+	if (is_last && plpgsql_check_profiler_save)
+		profiler_snapshot_save(nattaches);
+}
+
+/*
+ * Iterate over list of statements
+ */
+static void
+stmts_walker(profiler_stmt_walker_mode mode,
+			 List *stmts,
+			 PLpgSQL_stmt *parent_stmt,
+			 const char *description,
+			 profiler_stmt_walker_options *opts)
+{
+	bool	collect_coverage = mode == PLPGSQL_CHECK_STMT_WALKER_COLLECT_COVERAGE;
+
+	int64 nested_exec_count = 0;
+
+	int			stmt_block_num = 1;
+
+	ListCell   *lc;
+
+	foreach(lc, stmts)
+	{
+		PLpgSQL_stmt *stmt = (PLpgSQL_stmt *) lfirst(lc);
+
+		profiler_stmt_walker(mode,
+							 stmt, parent_stmt, description,
+							 stmt_block_num,
+							 opts);
+
+		/*
+		 * For calculation of coverage we need a numbers of nested statements
+		 * execution. Usually or statements in list has same number of execution.
+		 * But it should not be true for some reasons (after RETURN or some exception).
+		 * I am not sure if following simplification is accurate, but maybe. I use
+		 * number of execution of first statement in block like number of execution
+		 * all statements in list.
+		 */
+		if (collect_coverage && stmt_block_num == 1)
+			nested_exec_count = opts->nested_exec_count;
+
+		stmt_block_num += 1;
+	}
+
+	if (collect_coverage)
+		opts->nested_exec_count = nested_exec_count;
+}
+
+/*
+ * Given a PLpgSQL_stmt, return the underlying PLpgSQL_expr that may contain a
+ * queryid.
+ */
+static PLpgSQL_expr  *
+profiler_get_expr(PLpgSQL_stmt *stmt, bool *dynamic, List **params)
+{
+	PLpgSQL_expr *expr = NULL;
+
+	*params = NIL;
+	*dynamic = false;
+
+	switch(stmt->cmd_type)
+	{
+		case PLPGSQL_STMT_ASSIGN:
+			expr = ((PLpgSQL_stmt_assign *) stmt)->expr;
+			break;
+		case PLPGSQL_STMT_PERFORM:
+			expr = ((PLpgSQL_stmt_perform *) stmt)->expr;
+			break;
+		case PLPGSQL_STMT_CALL:
+			expr = ((PLpgSQL_stmt_call *) stmt)->expr;
+			break;
+
+#if PG_VERSION_NUM < 140000
+
+		case PLPGSQL_STMT_SET:
+			expr = ((PLpgSQL_stmt_set *) stmt)->expr;
+			break;
+
+#endif			/* PG_VERSION_NUM < 140000 */
+
+		case PLPGSQL_STMT_IF:
+			expr = ((PLpgSQL_stmt_if *) stmt)->cond;
+			break;
+		case 	PLPGSQL_STMT_CASE:
+			expr = ((PLpgSQL_stmt_case *) stmt)->t_expr;
+			break;
+		case PLPGSQL_STMT_WHILE:
+			expr = ((PLpgSQL_stmt_while *) stmt)->cond;
+			break;
+		case PLPGSQL_STMT_FORC:
+			expr = ((PLpgSQL_stmt_forc *) stmt)->argquery;
+			break;
+		case PLPGSQL_STMT_FORS:
+			expr = ((PLpgSQL_stmt_fors *) stmt)->query;
+			break;
+		case PLPGSQL_STMT_DYNFORS:
+			expr = ((PLpgSQL_stmt_dynfors *) stmt)->query;
+			*params = ((PLpgSQL_stmt_dynfors *) stmt)->params;
+			*dynamic = true;
+			break;
+		case PLPGSQL_STMT_FOREACH_A:
+			expr = ((PLpgSQL_stmt_foreach_a *) stmt)->expr;
+			break;
+		case PLPGSQL_STMT_FETCH:
+			expr = ((PLpgSQL_stmt_fetch *) stmt)->expr;
+			break;
+		case PLPGSQL_STMT_EXIT:
+			expr = ((PLpgSQL_stmt_exit *) stmt)->cond;
+			break;
+		case PLPGSQL_STMT_RETURN:
+			expr = ((PLpgSQL_stmt_return *) stmt)->expr;
+			break;
+		case PLPGSQL_STMT_RETURN_NEXT:
+			expr = ((PLpgSQL_stmt_return_next *) stmt)->expr;
+			break;
+		case PLPGSQL_STMT_RETURN_QUERY:
+			{
+				PLpgSQL_stmt_return_query *q;
+
+				q = (PLpgSQL_stmt_return_query *) stmt;
+				if (q->query)
+					expr = q->query;
+				else
+				{
+					expr = q->dynquery;
+					*params = q->params;
+					*dynamic = true;
+				}
+			}
+			break;
+		case PLPGSQL_STMT_ASSERT:
+			expr = ((PLpgSQL_stmt_assert *) stmt)->cond;
+			break;
+		case PLPGSQL_STMT_EXECSQL:
+			expr = ((PLpgSQL_stmt_execsql *) stmt)->sqlstmt;
+			break;
+		case PLPGSQL_STMT_DYNEXECUTE:
+			expr = ((PLpgSQL_stmt_dynexecute *) stmt)->query;
+			*params = ((PLpgSQL_stmt_dynexecute *) stmt)->params;
+			*dynamic = true;
+			break;
+		case PLPGSQL_STMT_OPEN:
+			{
+				PLpgSQL_stmt_open *o;
+
+				o = (PLpgSQL_stmt_open *) stmt;
+				if (o->query)
+					expr = o->query;
+				else if (o->dynquery)
+				{
+					expr = o->dynquery;
+					*params = o->params;
+					*dynamic = true;
+				}
+				else
+					expr = o->argquery;
+			}
+		case PLPGSQL_STMT_BLOCK:
+		case PLPGSQL_STMT_COMMIT:
+		case PLPGSQL_STMT_ROLLBACK:
+		case PLPGSQL_STMT_GETDIAG:
+		case PLPGSQL_STMT_LOOP:
+		case PLPGSQL_STMT_FORI:
+		case PLPGSQL_STMT_RAISE:
+		case PLPGSQL_STMT_CLOSE:
+			break;
+	}
+
+	return expr;
+}
+
+static void
+profiler_dyn_queryid_syscache_callback(Datum arg, int cacheid, uint32 hashvalue)
+{
+	(void) arg;
+	(void) cacheid;
+	(void) hashvalue;
+
+	profiler_dyn_queryid_HashTable = NULL;
+}
+
+static void
+profiler_dyn_queryid_relcache_callback(Datum arg, Oid relid)
+{
+	(void) arg;
+	(void) relid;
+
+	profiler_dyn_queryid_HashTable = NULL;
+}
+
+static void
+profiler_dyn_queryid_cache_init(void)
+{
+	HASHCTL		ctl;
+
+	if (!profiler_dyn_queryid_callbacks_registered)
+	{
+		CacheRegisterSyscacheCallback(PROCOID, profiler_dyn_queryid_syscache_callback, (Datum) 0);
+		CacheRegisterSyscacheCallback(TYPEOID, profiler_dyn_queryid_syscache_callback, (Datum) 0);
+		CacheRegisterSyscacheCallback(NAMESPACEOID, profiler_dyn_queryid_syscache_callback, (Datum) 0);
+		CacheRegisterRelcacheCallback(profiler_dyn_queryid_relcache_callback, (Datum) 0);
+
+		profiler_dyn_queryid_callbacks_registered = true;
+	}
+
+	if (profiler_dyn_queryid_mcxt)
+		MemoryContextReset(profiler_dyn_queryid_mcxt);
+	else
+		profiler_dyn_queryid_mcxt = AllocSetContextCreate(TopMemoryContext,
+														  "plpgsql_check - profiler dynamic queryid cache",
+														  ALLOCSET_DEFAULT_SIZES);
+
+	memset(&ctl, 0, sizeof(ctl));
+	ctl.keysize = sizeof(uint64);
+	ctl.entrysize = sizeof(profiler_dyn_queryid_entry);
+	ctl.hcxt = profiler_dyn_queryid_mcxt;
+
+	profiler_dyn_queryid_HashTable = hash_create("plpgsql_check profiler dynamic queryid cache",
+												 256,
+												 &ctl,
+												 HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+}
+
+static uint64
+profiler_dyn_queryid_hash(const char *query_string, Oid *paramtypes, int nparams)
+{
+	uint64		hashval;
+
+	hashval = DatumGetUInt64(hash_any_extended((const unsigned char *) query_string,
+											   strlen(query_string),
+											   0));
+	hashval = DatumGetUInt64(hash_any_extended((const unsigned char *) namespace_search_path,
+											   strlen(namespace_search_path),
+											   hashval));
+
+	if (nparams > 0)
+		hashval = DatumGetUInt64(hash_any_extended((const unsigned char *) paramtypes,
+												   nparams * sizeof(Oid),
+												   hashval));
+
+	return hashval;
+}
+
+static pc_queryid
+profiler_get_dyn_queryid(PLpgSQL_execstate *estate, PLpgSQL_expr *expr, query_params *qparams)
+{
+	MemoryContext oldcxt;
+	Query	   *query;
+	RawStmt    *parsetree;
+	bool		snapshot_set;
+	List	   *parsetree_list;
+	PLpgSQL_var result;
+	PLpgSQL_type typ;
+	char	   *query_string = NULL;
+	Oid		   *paramtypes = NULL;
+	int			nparams = 0;
+	uint64		hashval;
+	profiler_dyn_queryid_entry *qentry;
+	bool		found;
+
+	if (qparams)
+	{
+		paramtypes = qparams->paramtypes;
+		nparams = qparams->nparams;
+	}
+
+	memset(&result, 0, sizeof(result));
+	memset(&typ, 0, sizeof(typ));
+
+	result.dtype = PLPGSQL_DTYPE_VAR;
+	result.refname = "*auxstorage*";
+	result.datatype = &typ;
+
+	typ.typoid = TEXTOID;
+	typ.ttype = PLPGSQL_TTYPE_SCALAR;
+	typ.typlen = -1;
+	typ.typbyval = false;
+	typ.typtype = 'b';
+
+	if (profiler_queryid_mcxt == NULL)
+		profiler_queryid_mcxt = AllocSetContextCreate(TopMemoryContext,
+				"plpgsql_check - profiler queryid context",
+				ALLOCSET_DEFAULT_MINSIZE,
+				ALLOCSET_DEFAULT_INITSIZE,
+				ALLOCSET_DEFAULT_MAXSIZE);
+
+	oldcxt = MemoryContextSwitchTo(profiler_queryid_mcxt);
+	MemoryContextSwitchTo(oldcxt);
+
+	profiler_plugin2.assign_expr(estate, (PLpgSQL_datum *) &result, expr);
+
+	query_string = TextDatumGetCString(result.value);
+
+	if (!profiler_dyn_queryid_HashTable ||
+		hash_get_num_entries(profiler_dyn_queryid_HashTable) >= PROFILER_DYN_QUERYID_CACHE_MAX_ENTRIES)
+		profiler_dyn_queryid_cache_init();
+
+	hashval = profiler_dyn_queryid_hash(query_string, paramtypes, nparams);
+
+	qentry = (profiler_dyn_queryid_entry *) hash_search(profiler_dyn_queryid_HashTable,
+														(void *) &hashval,
+														HASH_FIND,
+														&found);
+	if (found)
+		return qentry->queryid;
+
+	/*
+	 * Do basic parsing of the query or queries (this should be safe even if
+	 * we are in aborted transaction state!)
+	 */
+	parsetree_list = pg_parse_query(query_string);
+
+
+	/* The query can be empty. Returns NOQUERYID is this case. */
+	if (!parsetree_list)
+	{
+		MemoryContextSwitchTo(oldcxt);
+		MemoryContextReset(profiler_queryid_mcxt);
+		return NOQUERYID;
+	}
+
+	/*
+	 * There should not be more than one query, silently ignore rather than
+	 * error out in that case.
+	 */
+	if (list_length(parsetree_list) > 1)
+	{
+		MemoryContextSwitchTo(oldcxt);
+		MemoryContextReset(profiler_queryid_mcxt);
+		return NOQUERYID;
+	}
+
+	/* Run through the raw parsetree and process it. */
+	parsetree = (RawStmt *) linitial(parsetree_list);
+	snapshot_set = false;
+
+	/*
+	 * Set up a snapshot if parse analysis/planning will need one.
+	 */
+	if (analyze_requires_snapshot(parsetree))
+	{
+		PushActiveSnapshot(GetTransactionSnapshot());
+		snapshot_set = true;
+	}
+
+	query = parse_analyze_fixedparams(parsetree, query_string, paramtypes, nparams, NULL);
+
+	if (snapshot_set)
+		PopActiveSnapshot();
+
+	MemoryContextSwitchTo(oldcxt);
+	MemoryContextReset(profiler_queryid_mcxt);
+
+	/*
+	 * The parse analysis can invalidate system caches, so the cache
+	 * can be released already.
+	 */
+	if (query->queryId != NOQUERYID && profiler_dyn_queryid_HashTable)
+	{
+		qentry = (profiler_dyn_queryid_entry *) hash_search(profiler_dyn_queryid_HashTable,
+															(void *) &hashval,
+															HASH_ENTER,
+															&found);
+		qentry->queryid = query->queryId;
+	}
+
+	return query->queryId;
+}
+
+/*
+ * Returns result type of already executed (has assigned plan) expression
+ */
+static bool
+get_expr_type(PLpgSQL_expr *expr, Oid *result_type)
+{
+	if (expr)
+	{
+		SPIPlanPtr ptr  = expr->plan;
+
+		if (ptr)
+		{
+			List	   *plan_sources = SPI_plan_get_plan_sources(ptr);
+
+			if (plan_sources && list_length(plan_sources) == 1)
+			{
+				CachedPlanSource *plan_source;
+				TupleDesc	tupdesc;
+
+				plan_source = (CachedPlanSource *) linitial(plan_sources);
+				tupdesc = plan_source->resultDesc;
+
+				if (tupdesc->natts == 1)
+				{
+					*result_type = TupleDescAttr(tupdesc, 0)->atttypid;
+
+					return true;
+				}
+			}
+		}
+	}
+
+	return false;
+}
+
+
+/*
+ * Return the first queryid found in the given PLpgSQL_stmt, if any.
+ * The array of parameter's types of dynamic query is allocated in
+ * mcxt memory context.
+ */
+static pc_queryid
+profiler_get_queryid(PLpgSQL_execstate *estate, PLpgSQL_stmt *stmt,
+					 bool *has_queryid, bool *is_dynamic,
+					 query_params **qparams, MemoryContext mcxt)
+{
+	PLpgSQL_expr *expr;
+	bool		dynamic;
+	List	   *params;
+	List	   *plan_sources;
+
+	expr = profiler_get_expr(stmt, &dynamic, &params);
+	*has_queryid = (expr != NULL);
+	*is_dynamic = dynamic;
+
+	/* fast leaving, when expression has not assigned plan */
+	if (!expr || !expr->plan)
+		return NOQUERYID;
+
+	if (dynamic)
+	{
+		Assert(expr);
+
+		if (params && !*qparams)
+		{
+			query_params *qps = NULL;
+			int		nparams = list_length(params);
+			int		paramno = 0;
+			MemoryContext oldcxt;
+			ListCell *lc;
+
+			/* build array of Oid used like dynamic query parameters */
+			oldcxt = MemoryContextSwitchTo(mcxt);
+			qps = (query_params *) palloc(sizeof(Oid) * nparams + sizeof(int));
+			MemoryContextSwitchTo(oldcxt);
+
+			foreach(lc, params)
+			{
+				PLpgSQL_expr *param_expr = (PLpgSQL_expr *) lfirst(lc);
+
+				if (!get_expr_type(param_expr, &qps->paramtypes[paramno++]))
+				{
+					pfree(qps);
+					return NOQUERYID;
+				}
+			}
+
+			qps->nparams = nparams;
+			*qparams = qps;
+		}
+
+		return profiler_get_dyn_queryid(estate, expr, *qparams);
+	}
+
+	plan_sources = SPI_plan_get_plan_sources(expr->plan);
+
+	if (plan_sources)
+	{
+		CachedPlanSource *plan_source = (CachedPlanSource *) linitial(plan_sources);
+
+		if (plan_source->query_list)
+		{
+			Query *q = linitial_node(Query, plan_source->query_list);
+
+			return q->queryId;
+		}
+	}
+
+	return NOQUERYID;
+}
+
+/*
+ * Generate simple queryid  for testing purpose.
+ * DO NOT USE IN PRODUCTION.
+ */
+#if PG_VERSION_NUM >= 140000
+
+static void
+profiler_fake_queryid_hook(ParseState *pstate, Query *query, JumbleState *jstate)
+{
+	(void) jstate;
+
+#else
+
+static void
+profiler_fake_queryid_hook(ParseState *pstate, Query *query)
+{
+
+#endif
+
+	(void) pstate;
+
+	Assert(query->queryId == NOQUERYID);
+
+	query->queryId = query->commandType;
+}
+
+/*
+ * Displays critical path of function - the sequence of nested statements,
+ * where the statement with highest total time is selected on every level.
+ * The total time of statement (including nested statements) is calculated
+ * from self times of statements. The statements are stored in natural order
+ * (parent statement is before nested statements), so one pass in reverse
+ * order is enough.
+ */
+static void
+profiler_critical_path(profiler_stmt_walker_options *opts)
+{
+	profiler_iterator *pi = opts->pi;
+	uint64	   *total_time;
+	int		   *parent;
+	int			nstatements;
+	int			level = 1;
+	int			current;
+	int			i;
+
+	if (!pi->profile || !pi->ri)
+		return;
+
+	nstatements = pi->profile->nstatements;
+
+	total_time = palloc0(nstatements * sizeof(uint64));
+	parent = palloc(nstatements * sizeof(int));
+
+	for (i = 0; i < nstatements; i++)
+	{
+		plpgsql_check_plugin2_stmt_info *sinfo;
+		int			stmtid = opts->stmtid_map[i];
+
+		if (stmtid <= 0)
+			elog(ERROR, "broken consistency of plpgsql_check profile");
+
+		sinfo = &opts->stmts_info[stmtid - 1];
+
+		parent[i] = sinfo->parent_id > 0 ?
+			opts->stmts_info[sinfo->parent_id - 1].natural_id - 1 : -1;
+
+		total_time[i] = pg_atomic_read_u64(&pi->stmts[i].stmt.us_total);
+	}
+
+	for (i = nstatements - 1; i > 0; i--)
+	{
+		if (parent[i] >= 0)
+			total_time[parent[i]] += total_time[i];
+	}
+
+	current = 0;
+
+	while (current >= 0)
+	{
+		plpgsql_check_plugin2_stmt_info *sinfo;
+		profiler_stmt_reduced *prstmt = &pi->stmts[current].stmt;
+		uint64		exec_count = pg_atomic_read_u64(&prstmt->exec_count);
+		int			next = -1;
+
+		if (exec_count == 0)
+			break;
+
+		sinfo = &opts->stmts_info[opts->stmtid_map[current] - 1];
+
+		/* invisible block is not displayed */
+		if (!sinfo->is_invisible)
+			plpgsql_check_put_profiler_critical_path(pi->ri,
+													 level++,
+													 sinfo->natural_id,
+													 sinfo->lineno,
+													 sinfo->typname,
+													 exec_count,
+													 (double) total_time[current],
+													 (double) pg_atomic_read_u64(&prstmt->us_total));
+
+		for (i = current + 1; i < nstatements; i++)
+		{
+			if (parent[i] != current ||
+				pg_atomic_read_u64(&pi->stmts[i].stmt.exec_count) == 0)
+				continue;
+
+			if (next == -1 || total_time[i] > total_time[next])
+				next = i;
+		}
+
+		current = next;
+	}
+
+	pfree(total_time);
+	pfree(parent);
+}
+
+/*
+ * Prepare tuplestore with function profile
+ *
+ */
+void
+plpgsql_check_iterate_over_profile(plpgsql_check_info *cinfo,
+								   profiler_stmt_walker_mode mode,
+								   plpgsql_check_result_info *ri,
+								   coverage_state *cs)
+{
+	LOCAL_FCINFO(fake_fcinfo, 0);
+	PLpgSQL_function *func;
+	FmgrInfo	flinfo;
+	TriggerData trigdata;
+	EventTriggerData etrigdata;
+	Trigger tg_trigger;
+	ReturnSetInfo rsinfo;
+	bool		fake_rtd;
+	profiler_iterator		pi;
+	bool		shared_profiles;
+	profiler_stmt_walker_options opts;
+
+	/* own not flushed data should be visible */
+	profiler_flush_pending(ERROR);
+
+	memset(&opts, 0, sizeof(profiler_stmt_walker_options));
+
+	memset(&pi, 0, sizeof(profiler_iterator));
+	pi.key.fn_oid = cinfo->fn_oid;
+	pi.key.db_oid = MyDatabaseId;
+	pi.key.fn_xmin = HeapTupleHeaderGetRawXmin(cinfo->proctuple->t_data);
+	pi.key.fn_tid =  cinfo->proctuple->t_self;
+	pi.ri = ri;
+
+	/* try to find profile in shared (or local) memory */
+	if (shared_profiles_HashTable)
+	{
+		LWLockAcquire(profiler_ss->lock, LW_SHARED);
+		pi.profile = (profiler_profile *) hash_search(shared_profiles_HashTable,
+													  (void *) &pi.key,
+													  HASH_FIND,
+													  NULL);
+		shared_profiles = true;
+	}
+	else
+	{
+		pi.profile = (profiler_profile *) hash_search(profiles_HashTable,
+													  (void *) &pi.key,
+													  HASH_FIND,
+													  NULL);
+		shared_profiles = false;
+	}
+
+	if (pi.profile)
+		pi.stmts = get_profile_stmts(pi.profile);
+
+	plpgsql_check_setup_fcinfo(cinfo,
+							   &flinfo,
+							   fake_fcinfo,
+							   &rsinfo,
+							   &trigdata,
+							   &etrigdata,
+							   &tg_trigger,
+							   &fake_rtd);
+
+	func = plpgsql_check__compile_p(fake_fcinfo, false);
+
+	opts.stmtid_map = plpgsql_check_get_stmtid_map(func);
+	opts.stmts_info = plpgsql_check_get_stmts_info(func);
+
+	opts.pi =  &pi;
+	opts.cs = cs;
+
+	if (mode == PLPGSQL_CHECK_STMT_WALKER_COLLECT_COVERAGE)
+	{
+		opts.coverage_bits = get_coverage_bits(&pi.key, func->nstatements);
+		opts.nstatements = func->nstatements;
+	}
+
+	if (mode == PLPGSQL_CHECK_STMT_WALKER_CRITICAL_PATH)
+		profiler_critical_path(&opts);
+	else
+		profiler_stmt_walker(mode, (PLpgSQL_stmt *) func->action, NULL, NULL, 1, &opts);
+
+	pfree(opts.stmtid_map);
+	pfree(opts.stmts_info);
+
+	if (opts.coverage_bits)
+		pfree(opts.coverage_bits);
+
+	if (shared_profiles)
+		LWLockRelease(profiler_ss->lock);
+}
+
+/*
+ * Prepare tuplestore with function profile
+ *
+ */
+void
+plpgsql_check_profiler_show_profile(plpgsql_check_result_info *ri,
+									plpgsql_check_info *cinfo)
+{
+	profiler_hashkey hk;
+	bool		shared_profiles;
+	char	   *prosrc = cinfo->src;
+	profiler_profile *profile = NULL;
+	profiler_stmt_reduced_padded *stmts = NULL;
+	int			lineno = 1;
+	int			current_statement = 0;
+
+	/* own not flushed data should be visible */
+	profiler_flush_pending(ERROR);
+
+	/* ensure correct complete content of hash key */
+	memset(&hk, 0, sizeof(profiler_hashkey));
+	hk.fn_oid = cinfo->fn_oid;
+	hk.db_oid = MyDatabaseId;
+	hk.fn_xmin = HeapTupleHeaderGetRawXmin(cinfo->proctuple->t_data);
+	hk.fn_tid =  cinfo->proctuple->t_self;
+
+	/* try to find profile in shared (or local) memory */
+	if (shared_profiles_HashTable)
+	{
+		LWLockAcquire(profiler_ss->lock, LW_SHARED);
+		profile = (profiler_profile *) hash_search(shared_profiles_HashTable,
+												   (void *) &hk,
+												   HASH_FIND,
+												   NULL);
+		shared_profiles = true;
+	}
+	else
+	{
+		profile = (profiler_profile *) hash_search(profiles_HashTable,
+												   (void *) &hk,
+												   HASH_FIND,
+												   NULL);
+		shared_profiles = false;
+	}
+
+	if (profile)
+		stmts = get_profile_stmts(profile);
+
+	/* iterate over source code rows */
+	while (*prosrc)
+	{
+		char	   *lineend = NULL;
+		char	   *linebeg = NULL;
+
+		int			stmt_lineno = -1;
+		int64		us_total = 0;
+		int64		exec_count = 0;
+		int64		exec_count_err = 0;
+		Datum		queryids_array = (Datum) 0;
+		Datum		max_time_array = (Datum) 0;
+		Datum		processed_rows_array = (Datum) 0;
+		int			cmds_on_row = 0;
+
+		lineend = prosrc;
+		linebeg = prosrc;
+
+		/* find lineend */
+		while (*lineend != '\0' && *lineend != '\n')
+			lineend += 1;
+
+		if (*lineend == '\n')
+		{
+			*lineend = '\0';
+			prosrc = lineend + 1;
+		}
+		else
+			prosrc = lineend;
+
+		if (stmts)
+		{
+			ArrayBuildState *queryids_abs = NULL;
+			ArrayBuildState *max_time_abs = NULL;
+			ArrayBuildState *processed_rows_abs = NULL;
+			int			queryids_on_row = 0;
+
+			queryids_abs = initArrayResult(INT8OID, CurrentMemoryContext, true);
+			max_time_abs = initArrayResult(FLOAT8OID, CurrentMemoryContext, true);
+			processed_rows_abs = initArrayResult(INT8OID, CurrentMemoryContext, true);
+
+			/* process all statements on this line */
+			for(;;)
+			{
+				profiler_stmt_reduced *prstmt;
+
+				/* all statements was processed */
+				if (current_statement >= profile->nstatements)
+				{
+					stmts = NULL;
+					break;
+				}
+
+				prstmt = &stmts[current_statement].stmt;
+
+				/* skip invisible statements if any */
+				if (prstmt->lineno < lineno)
+				{
+					current_statement += 1;
+					continue;
+				}
+				else if (prstmt->lineno == lineno)
+				{
+					us_total += pg_atomic_read_u64(&prstmt->us_total);
+					exec_count += pg_atomic_read_u64(&prstmt->exec_count);
+					exec_count_err += pg_atomic_read_u64(&prstmt->exec_count_err);
+
+					stmt_lineno = lineno;
+
+					if (prstmt->has_queryid)
+					{
+						if (prstmt->queryid != NOQUERYID)
+						{
+							queryids_abs = accumArrayResult(queryids_abs,
+															Int64GetDatum((int64) prstmt->queryid),
+															prstmt->queryid == NOQUERYID,
+															INT8OID,
+															CurrentMemoryContext);
+							queryids_on_row += 1;
+						}
+					}
+
+					max_time_abs = accumArrayResult(max_time_abs,
+													Float8GetDatum(pg_atomic_read_u64(&prstmt->us_max) / 1000.0), false,
+													FLOAT8OID,
+													CurrentMemoryContext);
+
+					processed_rows_abs = accumArrayResult(processed_rows_abs,
+														 Int64GetDatum(pg_atomic_read_u64(&prstmt->rows)), false,
+														 INT8OID,
+														 CurrentMemoryContext);
+					cmds_on_row += 1;
+					current_statement += 1;
+					continue;
+				}
+				else
+					break;
+			}
+
+			if (queryids_on_row > 0)
+				queryids_array = makeArrayResult(queryids_abs, CurrentMemoryContext);
+
+			if (cmds_on_row > 0)
+			{
+				max_time_array = makeArrayResult(max_time_abs, CurrentMemoryContext);
+				processed_rows_array = makeArrayResult(processed_rows_abs, CurrentMemoryContext);
+			}
+		}
+
+		plpgsql_check_put_profile(ri,
+							   queryids_array,
+							   lineno,
+							   stmt_lineno,
+							   cmds_on_row,
+							   exec_count,
+							   exec_count_err,
+							   us_total,
+							   max_time_array,
+							   processed_rows_array,
+							   (char *) linebeg);
+
+		lineno += 1;
+	}
+
+	if (shared_profiles)
+		LWLockRelease(profiler_ss->lock);
+}
+
+/*
+ * Returns true, when current call should be profiled. When sampling
+ * is active, only randomly selected calls are profiled.
+ */
+static bool
+profiler_sample_call(void)
+{
+	if (plpgsql_check_profiler_sample_rate <= 1)
+		return true;
+
+#if PG_VERSION_NUM >= 150000
+
+	return pg_prng_uint64_range(&pg_global_prng_state, 1,
+								(uint64) plpgsql_check_profiler_sample_rate) == 1;
+
+#else
+
+	return (random() % plpgsql_check_profiler_sample_rate) == 0;
+
+#endif
+
+}
+
+/*
+ * Try to search profile pattern for function. Creates profile pattern when
+ * it doesn't exists.
+ */
+static void
+profiler_func_setup(PLpgSQL_execstate *estate, PLpgSQL_function *func, void **plugin2_info)
+{
+	if (plpgsql_check_profiler && OidIsValid(func->fn_oid) &&
+		profiler_sample_call())
+	{
+		profiler_info *pinfo;
+		void	  **fcache_ptr;
+
+		/* the first flush can be in transaction's end callback */
+		if (shared_profiles_HashTable)
+			profiler_snapshot_attach();
+
+		pinfo = palloc0(sizeof(profiler_info));
+		pinfo->weight = plpgsql_check_profiler_sample_rate;
+		pinfo->nstatements = func->nstatements;
+		pinfo->stmts = palloc0(func->nstatements * sizeof(profiler_stmt));
+		pinfo->mcxt = CurrentMemoryContext;
+
+		INSTR_TIME_SET_CURRENT(pinfo->start_time);
+
+		pinfo->func = func;
+		pinfo->stmts_info = plpgsql_check_get_current_stmts_info();
+
+		if (plpgsql_check_profiler_call_stacks)
+		{
+			pinfo->caller = profiler_current_pinfo;
+			pinfo->stack_depth = pinfo->caller ? pinfo->caller->stack_depth + 1 : 1;
+
+			profiler_current_pinfo = pinfo;
+		}
+
+		fcache_ptr = plpgsql_check_get_current_func_info_plugin2_data(&profiler_plugin2);
+		if (fcache_ptr)
+		{
+			profiler_func_info_cache *fcache = *fcache_ptr;
+
+			if (fcache && fcache->nstatements != func->nstatements)
+			{
+				pfree(fcache);
+				fcache = NULL;
+			}
+
+			if (!fcache)
+			{
+				fcache = MemoryContextAllocZero(plpgsql_check_get_func_info_mcxt(),
+												offsetof(profiler_func_info_cache, stmts) +
+												func->nstatements * sizeof(profiler_queryid_cache_entry));
+				fcache->nstatements = func->nstatements;
+				*fcache_ptr = fcache;
+			}
+
+			pinfo->fcache = fcache;
+		}
+
+		*plugin2_info = pinfo;
+	}
+}
+
+static void
+_profiler_func_end(profiler_info *pinfo, Oid fn_oid, bool is_aborted)
+{
+	int			entry_stmtid;
+	instr_time	end_time;
+	instr_time	now;
+	uint64		elapsed;
+	profiler_pending_profile *pp;
+	int		   *stmtid_map;
+
+	Assert(pinfo);
+	Assert(pinfo->func);
+	Assert(pinfo->func->fn_oid == fn_oid);
+
+	entry_stmtid = pinfo->func->action->stmtid - 1;
+
+	INSTR_TIME_SET_CURRENT(now);
+	end_time = now;
+	INSTR_TIME_SUBTRACT(end_time, pinfo->start_time);
+
+	elapsed = INSTR_TIME_GET_MICROSEC(end_time);
+
+	if (pinfo->stack_depth > 0)
+		accum_pending_stack(pinfo, elapsed);
+
+	/*
+	 * The hooks are not called for entry statement on some PostgreSQL
+	 * versions. The self time of other statements is already calculated
+	 * by statement's end hook.
+	 */
+	if (pinfo->stmts[entry_stmtid].exec_count == 0)
+	{
+		profiler_stmt *pstmt = &pinfo->stmts[entry_stmtid];
+
+		pstmt->exec_count = 1;
+		pstmt->exec_count_err = is_aborted ? 1 : 0;
+		pstmt->us_total = elapsed > pstmt->us_nested ? elapsed - pstmt->us_nested : 0;
+		pstmt->us_max = elapsed;
+	}
+
+	stmtid_map = plpgsql_check_get_current_stmtid_map();
+
+	pp = get_pending_profile(pinfo, stmtid_map);
+	accum_pending_profile(pp, pinfo, stmtid_map, elapsed, is_aborted);
+
+	profiler_flush_pending_deferred(&now);
+}
+
+static void
+profiler_func_end(PLpgSQL_execstate *estate,
+				  PLpgSQL_function *func,
+				  void **plugin2_info)
+{
+	profiler_info *pinfo = *plugin2_info;
+
+	if (!pinfo)
+		return;
+
+	Assert(pinfo->func == func);
+
+	_profiler_func_end(pinfo, func->fn_oid, false);
+}
+
+static void
+profiler_func_end_aborted(Oid fn_oid, void **plugin2_info)
+{
+	profiler_info *pinfo = *plugin2_info;
+
+	if (!pinfo)
+		return;
+
+	_profiler_func_end(pinfo, fn_oid, true);
+}
+
+static void
+profiler_stmt_beg(PLpgSQL_execstate *estate,
+				  PLpgSQL_stmt *stmt,
+				  void **plugin2_info)
+{
+	profiler_info *pinfo = (profiler_info *) *plugin2_info;
+
+	if (pinfo)
+	{
+		profiler_stmt *pstmt = &pinfo->stmts[stmt->stmtid - 1];
+
+		pinfo->current_stmtid = stmt->stmtid;
+		pstmt->us_nested_start = pstmt->us_nested;
+
+		INSTR_TIME_SET_CURRENT(pstmt->start_time);
+	}
+}
+
+/*
+ * Returns self time of this execution of statement. When end_time_ptr
+ * is NULL, then the statement is finished now.
+ */
+static uint64
+_profiler_stmt_end(profiler_info *pinfo, int stmtid, bool is_aborted, instr_time *end_time_ptr)
+{
+	profiler_stmt  *pstmt = &pinfo->stmts[stmtid - 1];
+	int				parent_id = pinfo->stmts_info[stmtid - 1].parent_id;
+	instr_time		end_time;
+	uint64			elapsed;
+	uint64			us_total;
+	uint64			us_nested;
+	instr_time		end_time2;
+
+	/* nested functions can be called by outer statement again */
+	pinfo->current_stmtid = parent_id;
+
+	if (end_time_ptr)
+		end_time = *end_time_ptr;
+	else
+		INSTR_TIME_SET_CURRENT(end_time);
+
+	end_time2 = end_time;
+	INSTR_TIME_ACCUM_DIFF(pstmt->total, end_time, pstmt->start_time);
+
+	INSTR_TIME_SUBTRACT(end_time2, pstmt->start_time);
+	elapsed = INSTR_TIME_GET_MICROSEC(end_time2);
+
+	/*
+	 * Most statements are executed only once per call, and then
+	 * their latency is same like max time. The histogram is allocated
+	 * by second execution, and then first latency is taken from max time.
+	 */
+	if (pstmt->exec_count == 1 && !pstmt->histogram)
+	{
+		pstmt->histogram = MemoryContextAllocZero(pinfo->mcxt,
+												  PROFILER_HISTOGRAM_BUCKETS * sizeof(uint32));
+		pstmt->histogram[histogram_bucket(pstmt->us_max)] += 1;
+	}
+
+	if (pstmt->histogram)
+		pstmt->histogram[histogram_bucket(elapsed)] += 1;
+
+	if (elapsed > pstmt->us_max)
+		pstmt->us_max = elapsed;
+
+	/*
+	 * The self time is total time without time of nested statements.
+	 * The nested statements are finished before outer statement, so
+	 * the time of nested statements is complete here.
+	 */
+	us_total = INSTR_TIME_GET_MICROSEC(pstmt->total);
+	pstmt->us_total = us_total > pstmt->us_nested ? us_total - pstmt->us_nested : 0;
+
+	if (parent_id > 0)
+		pinfo->stmts[parent_id - 1].us_nested += elapsed;
+
+	pstmt->exec_count_err += is_aborted ? 1 : 0;
+	pstmt->exec_count++;
+
+	us_nested = pstmt->us_nested - pstmt->us_nested_start;
+
+	return elapsed > us_nested ? elapsed - us_nested : 0;
+}
+
+
+/*
+ * Cleaning mode is used for closing unfinished statements after an exception.
+ */
+static void
+profiler_stmt_end(PLpgSQL_execstate *estate,
+				  PLpgSQL_stmt *stmt,
+				  void **plugin2_info)
+{
+	profiler_info *pinfo = *plugin2_info;
+
+	if (pinfo)
+	{
+		profiler_stmt *pstmt = &pinfo->stmts[stmt->stmtid - 1];
+		pc_queryid	queryid = NOQUERYID;
+		instr_time	end_time;
+		uint64		processed;
+		uint64		elapsed;
+
+		/*
+		 * The search of queryid can evaluate an expression (and it can
+		 * parse query), so the statement is finished before, and the
+		 * number of processed rows is read before too.
+		 */
+		INSTR_TIME_SET_CURRENT(end_time);
+		processed = estate->eval_processed;
+
+		/*
+		 * We can get query id only if stmt_end is not executed
+		 * in cleaning mode, because we need to execute expression.
+		 * The queryid of dynamic statement is searched for every
+		 * execution, when the queries of dynamic statements are
+		 * collected.
+		 */
+		if (pstmt->queryid == NOQUERYID ||
+			(pstmt->is_dynamic && plpgsql_check_profiler_dynamic_queries))
+		{
+			profiler_queryid_cache_entry *qce = NULL;
+
+			if (pinfo->fcache)
+				qce = &pinfo->fcache->stmts[stmt->stmtid - 1];
+
+			if (qce && qce->is_valid)
+			{
+				pstmt->queryid = qce->queryid;
+				pstmt->has_queryid = qce->has_queryid;
+			}
+			else
+			{
+				bool		is_dynamic;
+
+				queryid = profiler_get_queryid(estate, stmt,
+											   &pstmt->has_queryid,
+											   &is_dynamic,
+											   &pstmt->qparams,
+											   pinfo->mcxt);
+
+				if (pstmt->queryid == NOQUERYID)
+					pstmt->queryid = queryid;
+
+				pstmt->is_dynamic = is_dynamic;
+
+				/*
+				 * Only queryid of static query can be cached. The queryid of
+				 * dynamic query depends on query string, and the missing
+				 * queryid of static query can be available later.
+				 */
+				if (qce && !is_dynamic &&
+					(pstmt->queryid != NOQUERYID || !pstmt->has_queryid))
+				{
+					qce->queryid = pstmt->queryid;
+					qce->has_queryid = pstmt->has_queryid;
+					qce->is_valid = true;
+				}
+			}
+		}
+
+		elapsed = _profiler_stmt_end(pinfo, stmt->stmtid, false, &end_time);
+
+		if (pstmt->is_dynamic && queryid != NOQUERYID &&
+			plpgsql_check_profiler_dynamic_queries)
+			accum_pending_dynq(pinfo, stmt->stmtid, queryid,
+							   elapsed, processed);
+	}
+}
+
+static void
+profiler_stmt_end_aborted(Oid fn_oid, int stmtid, void **plugin2_info)
+{
+	profiler_info *pinfo = *plugin2_info;
+
+	if (pinfo)
+		(void) _profiler_stmt_end(pinfo, stmtid, true, NULL);
+}
+
+/*
+ * Merge session (pending) coverage bitmap of function to shared
+ * coverage bitmap.
+ */
+static bool
+update_persistent_coverage(coverage_bitmap *pcb, int elevel)
+{
+	coverage_bitmap *cb;
+	pg_atomic_uint32 *sbits;
+	int			nwords = COVERAGE_BITMAP_WORDS(pcb->nstatements);
+	bool		found;
+	int			i;
+
+	Assert(shared_coverage_HashTable);
+
+	LWLockAcquire(profiler_ss->coverage_lock, LW_SHARED);
+
+	cb = (coverage_bitmap *) hash_search(shared_coverage_HashTable,
+										 (void *) &pcb->key,
+										 HASH_FIND,
+										 &found);
+
+	if (!found)
+	{
+		LWLockRelease(profiler_ss->coverage_lock);
+		LWLockAcquire(profiler_ss->coverage_lock, LW_EXCLUSIVE);
+
+		cb = (coverage_bitmap *) hash_search(shared_coverage_HashTable,
+											 (void *) &pcb->key,
+											 HASH_ENTER_NULL,
+											 &found);
+
+		if (cb && !found)
+		{
+			cb->nstatements = pcb->nstatements;
+			cb->bits = NULL;
+			cb->bits_dp = dsa_allocate_extended(profiler_get_dsa(),
+												nwords * sizeof(pg_atomic_uint32),
+												DSA_ALLOC_NO_OOM);
+
+			if (!DsaPointerIsValid(cb->bits_dp))
+			{
+				hash_search(shared_coverage_HashTable, (void *) &pcb->key, HASH_REMOVE, NULL);
+				cb = NULL;
+			}
+			else
+			{
+				sbits = dsa_get_address(profiler_get_dsa(), cb->bits_dp);
+
+				for (i = 0; i < nwords; i++)
+					pg_atomic_init_u32(&sbits[i], 0);
+			}
+		}
+	}
+
+	if (!cb)
+	{
+		LWLockRelease(profiler_ss->coverage_lock);
+
+		profiler_internal_stat_add(PROFILER_INTERNAL_COVERAGE_INSERT_FAILURE, NULL);
+
+		elog(elevel,
+			 "cannot to insert new entry to profiler's coverage bitmaps");
+
+		return false;
+	}
+
+	sbits = dsa_get_address(profiler_get_dsa(), cb->bits_dp);
+
+	for (i = 0; i < nwords; i++)
+	{
+		/* usually only few words are changed from last flush */
+		if (pcb->bits[i] & ~pg_atomic_read_u32(&sbits[i]))
+			(void) pg_atomic_fetch_or_u32(&sbits[i], pcb->bits[i]);
+	}
+
+	LWLockRelease(profiler_ss->coverage_lock);
+
+	return true;
+}
+
+/*
+ * Merge bitmap of finished call to session bitmap of function. Without
+ * shared memory, the session bitmap is persistent bitmap, else it is
+ * merged to shared bitmap, when pending profiles are flushed.
+ */
+static void
+accum_pending_coverage(coverage_info *cinfo)
+{
+	profiler_hashkey hk;
+	coverage_bitmap *cb;
+	HTAB	   *htab;
+	bool		found;
+	int			i;
+
+	profiler_init_hashkey(&hk, cinfo->func);
+
+	htab = shared_coverage_HashTable ? coverage_pending_HashTable : coverage_HashTable;
+
+	cb = (coverage_bitmap *) hash_search(htab,
+										 (void *) &hk,
+										 HASH_ENTER,
+										 &found);
+
+	if (!found)
+	{
+		cb->nstatements = cinfo->func->nstatements;
+		cb->bits_dp = InvalidDsaPointer;
+		cb->bits = MemoryContextAllocZero(profiler_mcxt,
+										  cinfo->nwords * sizeof(uint32));
+	}
+
+	for (i = 0; i < cinfo->nwords; i++)
+		cb->bits[i] |= cinfo->bits[i];
+}
+
+/*
+ * Returns copy of persistent coverage bitmap of function or NULL
+ */
+static uint32 *
+get_coverage_bits(profiler_hashkey *hk, int nstatements)
+{
+	coverage_bitmap *cb;
+	uint32	   *result = NULL;
+	int			nwords = COVERAGE_BITMAP_WORDS(nstatements);
+	int			i;
+
+	if (shared_coverage_HashTable)
+	{
+		LWLockAcquire(profiler_ss->coverage_lock, LW_SHARED);
+
+		cb = (coverage_bitmap *) hash_search(shared_coverage_HashTable,
+											 (void *) hk,
+											 HASH_FIND,
+											 NULL);
+
+		if (cb && cb->nstatements == nstatements)
+		{
+			pg_atomic_uint32 *sbits = dsa_get_address(profiler_get_dsa(), cb->bits_dp);
+
+			result = palloc(nwords * sizeof(uint32));
+
+			for (i = 0; i < nwords; i++)
+				result[i] = pg_atomic_read_u32(&sbits[i]);
+		}
+
+		LWLockRelease(profiler_ss->coverage_lock);
+	}
+	else
+	{
+		cb = (coverage_bitmap *) hash_search(coverage_HashTable,
+											 (void *) hk,
+											 HASH_FIND,
+											 NULL);
+
+		if (cb && cb->nstatements == nstatements)
+		{
+			result = palloc(nwords * sizeof(uint32));
+			memcpy(result, cb->bits, nwords * sizeof(uint32));
+		}
+	}
+
+	return result;
+}
+
+static void
+coverage_func_setup(PLpgSQL_execstate *estate, PLpgSQL_function *func, void **plugin2_info)
+{
+	(void) estate;
+
+	if (plpgsql_check_coverage && OidIsValid(func->fn_oid))
+	{
+		coverage_info *cinfo;
+		void	  **cinfo_ptr;
+		int			nwords = COVERAGE_BITMAP_WORDS(func->nstatements);
+
+		if (shared_profiles_HashTable)
+			profiler_snapshot_attach();
+
+		cinfo_ptr = plpgsql_check_get_current_fn_plugin2_data(&coverage_plugin2);
+		cinfo = *cinfo_ptr;
+
+		if (cinfo && cinfo->is_active)
+		{
+			/* recursive call by same FmgrInfo, use private coverage_info */
+			cinfo = palloc(sizeof(coverage_info));
+			cinfo->nwords = nwords;
+			cinfo->bits = palloc(nwords * sizeof(uint32));
+		}
+		else
+		{
+			if (!cinfo)
+			{
+				cinfo = MemoryContextAlloc(plpgsql_check_get_current_fn_mcxt(),
+										   sizeof(coverage_info));
+				cinfo->nwords = 0;
+				cinfo->bits = NULL;
+
+				*cinfo_ptr = cinfo;
+			}
+
+			/* the function can be recompiled, so the size can be changed */
+			if (cinfo->nwords != nwords)
+			{
+				if (cinfo->bits)
+					pfree(cinfo->bits);
+
+				cinfo->bits = MemoryContextAlloc(plpgsql_check_get_current_fn_mcxt(),
+												 nwords * sizeof(uint32));
+				cinfo->nwords = nwords;
+			}
+		}
+
+		cinfo->func = func;
+		cinfo->last_stmtid = 0;
+		cinfo->is_active = true;
+		memset(cinfo->bits, 0, nwords * sizeof(uint32));
+
+		*plugin2_info = cinfo;
+	}
+}
+
+static void
+_coverage_func_end(coverage_info *cinfo)
+{
+	instr_time	now;
+
+	/* the hooks are not called for entry statement on some PostgreSQL versions */
+	COVERAGE_BIT_SET(cinfo->bits, cinfo->func->action->stmtid - 1);
+
+	cinfo->is_active = false;
+
+	accum_pending_coverage(cinfo);
+
+	if (shared_coverage_HashTable)
+	{
+		INSTR_TIME_SET_CURRENT(now);
+		profiler_flush_pending_deferred(&now);
+	}
+}
+
+static void
+coverage_func_end(PLpgSQL_execstate *estate,
+				  PLpgSQL_function *func,
+				  void **plugin2_info)
+{
+	coverage_info *cinfo = (coverage_info *) *plugin2_info;
+
+	(void) estate;
+
+	if (!cinfo)
+		return;
+
+	Assert(cinfo->func == func);
+
+	_coverage_func_end(cinfo);
+}
+
+static void
+coverage_func_end_aborted(Oid fn_oid, void **plugin2_info)
+{
+	coverage_info *cinfo = (coverage_info *) *plugin2_info;
+
+	(void) fn_oid;
+
+	if (!cinfo)
+		return;
+
+	_coverage_func_end(cinfo);
+}
+
+static void
+coverage_stmt_beg(PLpgSQL_execstate *estate,
+				  PLpgSQL_stmt *stmt,
+				  void **plugin2_info)
+{
+	coverage_info *cinfo = (coverage_info *) *plugin2_info;
+
+	(void) estate;
+
+	if (cinfo)
+	{
+		COVERAGE_BIT_SET(cinfo->bits, stmt->stmtid - 1);
+		cinfo->last_stmtid = stmt->stmtid;
+	}
+}
+
+/*
+ * When no nested statement was started after start of IF statement,
+ * then the implicit else path was executed.
+ */
+static void
+coverage_stmt_end(PLpgSQL_execstate *estate,
+				  PLpgSQL_stmt *stmt,
+				  void **plugin2_info)
+{
+	coverage_info *cinfo = (coverage_info *) *plugin2_info;
+
+	(void) estate;
 
-		profiler_stmt_walker(pinfo, mode,
-							 stmt, parent_stmt, description,
-							 stmt_block_num,
-							 opts);
+	if (cinfo &&
+		cinfo->last_stmtid == stmt->stmtid &&
+		stmt->cmd_type == PLPGSQL_STMT_IF &&
+		((PLpgSQL_stmt_if *) stmt)->else_body == NIL)
+		COVERAGE_BIT_SET(cinfo->bits, cinfo->func->nstatements + stmt->stmtid - 1);
+}
+
+/*
+ * Returns array of oids of profiled functions of current database. The
+ * statistics of functions are read later (one function per call of
+ * table function), so only oids are held in memory.
+ */
+Oid *
+plpgsql_check_profiler_get_all_functions(int *nfuncs)
+{
+	HASH_SEQ_STATUS seqstatus;
+	fstats		*fstats_item;
+	HTAB	   *fstats_ht;
+	bool		htab_is_shared;
+	Oid		   *result;
+	long		size;
+
+	/* own not flushed data should be visible */
+	profiler_flush_pending(ERROR);
+
+	/* try to find first chunk in shared (or local) memory */
+	if (shared_fstats_HashTable)
+	{
+		LWLockAcquire(profiler_ss->fstats_lock, LW_SHARED);
+		fstats_ht = shared_fstats_HashTable;
+		htab_is_shared = true;
+	}
+	else
+	{
+		fstats_ht = fstats_HashTable;
+		htab_is_shared = false;
+	}
 
-		 /* add stmt execution time to total execution time */
-		if (count_exec_time)
-			nested_us_time += opts->nested_us_time;
+	size = hash_get_num_entries(fstats_ht);
+	result = palloc(Max(size, 1) * sizeof(Oid));
+	*nfuncs = 0;
+
+	hash_seq_init(&seqstatus, fstats_ht);
 
+	while ((fstats_item = (fstats *) hash_seq_search(&seqstatus)) != NULL)
+	{
 		/*
-		 * For calculation of coverage we need a numbers of nested statements
-		 * execution. Usually or statements in list has same number of execution.
-		 * But it should not be true for some reasons (after RETURN or some exception).
-		 * I am not sure if following simplification is accurate, but maybe. I use
-		 * number of execution of first statement in block like number of execution
-		 * all statements in list.
+		 * only function's statistics for current database can be displayed here,
+		 * Oid of functions from other databases has unassigned oids to current
+		 * system catalogue.
 		 */
-		if (collect_coverage && stmt_block_num == 1)
-			nested_exec_count = opts->nested_exec_count;
+		if (fstats_item->key.db_oid != MyDatabaseId)
+			continue;
 
-		stmt_block_num += 1;
+		/* shared hash table cannot be grown, when we hold lock */
+		Assert(*nfuncs < size);
+
+		result[(*nfuncs)++] = fstats_item->key.fn_oid;
 	}
 
-	if (count_exec_time)
-		opts->nested_us_time = nested_us_time;
+	if (htab_is_shared)
+		LWLockRelease(profiler_ss->fstats_lock);
 
-	if (collect_coverage)
-		opts->nested_exec_count = nested_exec_count;
+	return result;
 }
 
 /*
- * Given a PLpgSQL_stmt, return the underlying PLpgSQL_expr that may contain a
- * queryid.
+ * Put aggregated statistics of one function to result. Nothing is
+ * displayed when function was dropped or was not executed.
  */
-static PLpgSQL_expr  *
-profiler_get_expr(PLpgSQL_stmt *stmt, bool *dynamic, List **params)
+void
+plpgsql_check_profiler_put_function_stats(plpgsql_check_result_info *ri, Oid fn_oid)
 {
-	PLpgSQL_expr *expr = NULL;
+	fstats_hashkey fhk;
+	fstats		*fstats_item;
+	fstats_shard agg;
+	HTAB	   *fstats_ht;
+	bool		htab_is_shared;
+	HeapTuple	tp;
 
-	*params = NIL;
-	*dynamic = false;
+	/* check if function has name */
+	tp = SearchSysCache1(PROCOID, ObjectIdGetDatum(fn_oid));
+	if (!HeapTupleIsValid(tp))
+		return;
 
-	switch(stmt->cmd_type)
-	{
-		case PLPGSQL_STMT_ASSIGN:
-			expr = ((PLpgSQL_stmt_assign *) stmt)->expr;
-			break;
-		case PLPGSQL_STMT_PERFORM:
-			expr = ((PLpgSQL_stmt_perform *) stmt)->expr;
-			break;
-		case PLPGSQL_STMT_CALL:
-			expr = ((PLpgSQL_stmt_call *) stmt)->expr;
-			break;
+	ReleaseSysCache(tp);
 
-#if PG_VERSION_NUM < 140000
+	fstats_init_hashkey(&fhk, fn_oid);
 
-		case PLPGSQL_STMT_SET:
-			expr = ((PLpgSQL_stmt_set *) stmt)->expr;
-			break;
+	if (shared_fstats_HashTable)
+	{
+		LWLockAcquire(profiler_ss->fstats_lock, LW_SHARED);
+		fstats_ht = shared_fstats_HashTable;
+		htab_is_shared = true;
+	}
+	else
+	{
+		fstats_ht = fstats_HashTable;
+		htab_is_shared = false;
+	}
 
-#endif			/* PG_VERSION_NUM < 140000 */
+	fstats_item = (fstats *) hash_search(fstats_ht,
+										 (void *) &fhk,
+										 HASH_FIND,
+										 NULL);
 
-		case PLPGSQL_STMT_IF:
-			expr = ((PLpgSQL_stmt_if *) stmt)->cond;
-			break;
-		case 	PLPGSQL_STMT_CASE:
-			expr = ((PLpgSQL_stmt_case *) stmt)->t_expr;
-			break;
-		case PLPGSQL_STMT_WHILE:
-			expr = ((PLpgSQL_stmt_while *) stmt)->cond;
-			break;
-		case PLPGSQL_STMT_FORC:
-			expr = ((PLpgSQL_stmt_forc *) stmt)->argquery;
-			break;
-		case PLPGSQL_STMT_FORS:
-			expr = ((PLpgSQL_stmt_fors *) stmt)->query;
-			break;
-		case PLPGSQL_STMT_DYNFORS:
-			expr = ((PLpgSQL_stmt_dynfors *) stmt)->query;
-			*params = ((PLpgSQL_stmt_dynfors *) stmt)->params;
-			*dynamic = true;
-			break;
-		case PLPGSQL_STMT_FOREACH_A:
-			expr = ((PLpgSQL_stmt_foreach_a *) stmt)->expr;
-			break;
-		case PLPGSQL_STMT_FETCH:
-			expr = ((PLpgSQL_stmt_fetch *) stmt)->expr;
-			break;
-		case PLPGSQL_STMT_EXIT:
-			expr = ((PLpgSQL_stmt_exit *) stmt)->cond;
-			break;
-		case PLPGSQL_STMT_RETURN:
-			expr = ((PLpgSQL_stmt_return *) stmt)->expr;
-			break;
-		case PLPGSQL_STMT_RETURN_NEXT:
-			expr = ((PLpgSQL_stmt_return_next *) stmt)->expr;
-			break;
-		case PLPGSQL_STMT_RETURN_QUERY:
-			{
-				PLpgSQL_stmt_return_query *q;
+	/* the statistics can be removed concurrently */
+	if (fstats_item)
+		aggregate_fstats(fstats_item, htab_is_shared, &agg);
+	else
+		agg.exec_count = 0;
 
-				q = (PLpgSQL_stmt_return_query *) stmt;
-				if (q->query)
-					expr = q->query;
-				else
-				{
-					expr = q->dynquery;
-					*params = q->params;
-					*dynamic = true;
-				}
-			}
-			break;
-		case PLPGSQL_STMT_ASSERT:
-			expr = ((PLpgSQL_stmt_assert *) stmt)->cond;
-			break;
-		case PLPGSQL_STMT_EXECSQL:
-			expr = ((PLpgSQL_stmt_execsql *) stmt)->sqlstmt;
-			break;
-		case PLPGSQL_STMT_DYNEXECUTE:
-			expr = ((PLpgSQL_stmt_dynexecute *) stmt)->query;
-			*params = ((PLpgSQL_stmt_dynexecute *) stmt)->params;
-			*dynamic = true;
-			break;
-		case PLPGSQL_STMT_OPEN:
-			{
-				PLpgSQL_stmt_open *o;
+	if (htab_is_shared)
+		LWLockRelease(profiler_ss->fstats_lock);
 
-				o = (PLpgSQL_stmt_open *) stmt;
-				if (o->query)
-					expr = o->query;
-				else if (o->dynquery)
-				{
-					expr = o->dynquery;
-					*params = o->params;
-					*dynamic = true;
-				}
-				else
-					expr = o->argquery;
-			}
-		case PLPGSQL_STMT_BLOCK:
-		case PLPGSQL_STMT_COMMIT:
-		case PLPGSQL_STMT_ROLLBACK:
-		case PLPGSQL_STMT_GETDIAG:
-		case PLPGSQL_STMT_LOOP:
-		case PLPGSQL_STMT_FORI:
-		case PLPGSQL_STMT_RAISE:
-		case PLPGSQL_STMT_CLOSE:
-			break;
-	}
+	if (agg.exec_count == 0)
+		return;
 
-	return expr;
+	plpgsql_check_put_profiler_functions_all_tb(ri,
+												fn_oid,
+												agg.exec_count,
+												agg.exec_count_err,
+												(double) agg.total_time,
+												ceil(agg.total_time / ((double) agg.exec_count)),
+												ceil(sqrt(agg.total_time_xx / agg.exec_count)),
+												(double) agg.min_time,
+												(double) agg.max_time,
+												histogram_percentile(agg.histogram, 0.95, agg.max_time),
+												histogram_percentile(agg.histogram, 0.99, agg.max_time));
 }
 
-static pc_queryid
-profiler_get_dyn_queryid(PLpgSQL_execstate *estate, PLpgSQL_expr *expr, query_params *qparams)
+/*
+ * Returns call stacks of functions of current database. The frames are
+ * separated by semicolon, and the line of statement, that called next
+ * function, is appended to name of function.
+ */
+void
+plpgsql_check_profiler_iterate_over_all_stacks(plpgsql_check_result_info *ri)
 {
-	MemoryContext oldcxt;
-	Query	   *query;
-	RawStmt    *parsetree;
-	bool		snapshot_set;
-	List	   *parsetree_list;
-	PLpgSQL_var result;
-	PLpgSQL_type typ;
-	char	   *query_string = NULL;
-	Oid		   *paramtypes = NULL;
-	int			nparams = 0;
+	HASH_SEQ_STATUS seqstatus;
+	profiler_stack *stack;
+	profiler_stack *stacks;
+	HTAB	   *stacks_ht;
+	bool		htab_is_shared;
+	long		nstacks;
+	long		n = 0;
+	long		i;
+	StringInfoData sinfo;
 
-	if (qparams)
+	/* own not flushed data should be visible */
+	profiler_flush_pending(ERROR);
+
+	if (shared_stacks_HashTable)
 	{
-		paramtypes = qparams->paramtypes;
-		nparams = qparams->nparams;
+		LWLockAcquire(profiler_ss->stacks_lock, LW_SHARED);
+		stacks_ht = shared_stacks_HashTable;
+		htab_is_shared = true;
+	}
+	else
+	{
+		stacks_ht = stacks_HashTable;
+		htab_is_shared = false;
 	}
 
-	memset(&result, 0, sizeof(result));
-	memset(&typ, 0, sizeof(typ));
+	/*
+	 * Names of functions are searched in system catalogue, so we copy
+	 * stacks, and we don't hold lock longer than necessary.
+	 */
+	nstacks = hash_get_num_entries(stacks_ht);
+	stacks = palloc(Max(nstacks, 1) * sizeof(profiler_stack));
 
-	result.dtype = PLPGSQL_DTYPE_VAR;
-	result.refname = "*auxstorage*";
-	result.datatype = &typ;
+	hash_seq_init(&seqstatus, stacks_ht);
 
-	typ.typoid = TEXTOID;
-	typ.ttype = PLPGSQL_TTYPE_SCALAR;
-	typ.typlen = -1;
-	typ.typbyval = false;
-	typ.typtype = 'b';
+	while ((stack = (profiler_stack *) hash_seq_search(&seqstatus)) != NULL)
+	{
+		if (stack->key.db_oid != MyDatabaseId)
+			continue;
 
-	if (profiler_queryid_mcxt == NULL)
-		profiler_queryid_mcxt = AllocSetContextCreate(TopMemoryContext,
-				"plpgsql_check - profiler queryid context",
-				ALLOCSET_DEFAULT_MINSIZE,
-				ALLOCSET_DEFAULT_INITSIZE,
-				ALLOCSET_DEFAULT_MAXSIZE);
+		if (htab_is_shared)
+			SpinLockAcquire(&stack->mutex);
 
-	oldcxt = MemoryContextSwitchTo(profiler_queryid_mcxt);
-	MemoryContextSwitchTo(oldcxt);
+		stacks[n++] = *stack;
+
+		if (htab_is_shared)
+			SpinLockRelease(&stack->mutex);
+	}
+
+	if (htab_is_shared)
+		LWLockRelease(profiler_ss->stacks_lock);
+
+	initStringInfo(&sinfo);
+
+	for (i = 0; i < n; i++)
+	{
+		int			j;
+
+		resetStringInfo(&sinfo);
+
+		for (j = 0; j < stacks[i].key.depth; j++)
+		{
+			profiler_stack_frame *frame = &stacks[i].key.frames[j];
+
+			if (j > 0)
+				appendStringInfoChar(&sinfo, ';');
+
+			appendStringInfoString(&sinfo, format_procedure(frame->fn_oid));
+
+			if (frame->lineno > 0)
+				appendStringInfo(&sinfo, ":%d", frame->lineno);
+		}
+
+		plpgsql_check_put_profiler_call_stack(ri,
+											  sinfo.data,
+											  stacks[i].exec_count,
+											  (double) stacks[i].total_time,
+											  (double) stacks[i].self_time);
+	}
+
+	pfree(sinfo.data);
+	pfree(stacks);
+}
+
+typedef struct profiler_dynq_row
+{
+	profiler_hashkey fkey;
+	int			stmtid;
+	int			lineno;
+	profiler_dynq_counters q;
+} profiler_dynq_row;
+
+static int
+dynq_row_cmp(const void *a, const void *b)
+{
+	const profiler_dynq_row *ra = (const profiler_dynq_row *) a;
+	const profiler_dynq_row *rb = (const profiler_dynq_row *) b;
+
+	if (ra->fkey.fn_oid != rb->fkey.fn_oid)
+		return ra->fkey.fn_oid < rb->fkey.fn_oid ? -1 : 1;
+	if (ra->stmtid != rb->stmtid)
+		return ra->stmtid < rb->stmtid ? -1 : 1;
+	if (ra->q.us_total != rb->q.us_total)
+		return ra->q.us_total > rb->q.us_total ? -1 : 1;
 
-	profiler_plugin2.assign_expr(estate, (PLpgSQL_datum *) &result, expr);
+	return 0;
+}
 
-	query_string = TextDatumGetCString(result.value);
+/*
+ * Returns counters of queries of dynamic statements of current database.
+ * The queries of older versions of functions are ignored.
+ */
+void
+plpgsql_check_profiler_iterate_dynamic_queries(plpgsql_check_result_info *ri)
+{
+	HASH_SEQ_STATUS seqstatus;
+	profiler_dynq *dynq;
+	profiler_dynq_row *rows;
+	HTAB	   *dynq_ht;
+	bool		htab_is_shared;
+	long		nrows = 0;
+	long		i;
+	Oid			last_fn_oid = InvalidOid;
+	bool		fn_exists = false;
+	TransactionId fn_xmin = InvalidTransactionId;
+	ItemPointerData fn_tid;
 
-	/*
-	 * Do basic parsing of the query or queries (this should be safe even if
-	 * we are in aborted transaction state!)
-	 */
-	parsetree_list = pg_parse_query(query_string);
+	ItemPointerSetInvalid(&fn_tid);
 
+	/* own not flushed data should be visible */
+	profiler_flush_pending(ERROR);
 
-	/* The query can be empty. Returns NOQUERYID is this case. */
-	if (!parsetree_list)
+	if (shared_dynq_HashTable)
 	{
-		MemoryContextSwitchTo(oldcxt);
-		MemoryContextReset(profiler_queryid_mcxt);
-		return NOQUERYID;
+		LWLockAcquire(profiler_ss->dynq_lock, LW_SHARED);
+		dynq_ht = shared_dynq_HashTable;
+		htab_is_shared = true;
 	}
-
-	/*
-	 * There should not be more than one query, silently ignore rather than
-	 * error out in that case.
-	 */
-	if (list_length(parsetree_list) > 1)
+	else
 	{
-		MemoryContextSwitchTo(oldcxt);
-		MemoryContextReset(profiler_queryid_mcxt);
-		return NOQUERYID;
+		dynq_ht = dynq_HashTable;
+		htab_is_shared = false;
 	}
 
-	/* Run through the raw parsetree and process it. */
-	parsetree = (RawStmt *) linitial(parsetree_list);
-	snapshot_set = false;
+	/* the names of functions are searched later without lock */
+	rows = palloc(Max(hash_get_num_entries(dynq_ht), 1) *
+				  PROFILER_DYNQ_TOPK * sizeof(profiler_dynq_row));
 
-	/*
-	 * Set up a snapshot if parse analysis/planning will need one.
-	 */
-	if (analyze_requires_snapshot(parsetree))
+	hash_seq_init(&seqstatus, dynq_ht);
+
+	while ((dynq = (profiler_dynq *) hash_seq_search(&seqstatus)) != NULL)
 	{
-		PushActiveSnapshot(GetTransactionSnapshot());
-		snapshot_set = true;
-	}
+		if (dynq->key.fkey.db_oid != MyDatabaseId)
+			continue;
 
-	query = parse_analyze_fixedparams(parsetree, query_string, paramtypes, nparams, NULL);
+		if (htab_is_shared)
+			SpinLockAcquire(&dynq->mutex);
 
-	if (snapshot_set)
-		PopActiveSnapshot();
+		for (i = 0; i < dynq->nqueries; i++)
+		{
+			rows[nrows].fkey = dynq->key.fkey;
+			rows[nrows].stmtid = dynq->key.stmtid;
+			rows[nrows].lineno = dynq->lineno;
+			rows[nrows++].q = dynq->queries[i];
+		}
 
-	MemoryContextSwitchTo(oldcxt);
-	MemoryContextReset(profiler_queryid_mcxt);
+		if (htab_is_shared)
+			SpinLockRelease(&dynq->mutex);
+	}
 
-	return query->queryId;
-}
+	if (htab_is_shared)
+		LWLockRelease(profiler_ss->dynq_lock);
 
-/*
- * Returns result type of already executed (has assigned plan) expression
- */
-static bool
-get_expr_type(PLpgSQL_expr *expr, Oid *result_type)
-{
-	if (expr)
+	qsort(rows, nrows, sizeof(profiler_dynq_row), dynq_row_cmp);
+
+	for (i = 0; i < nrows; i++)
 	{
-		SPIPlanPtr ptr  = expr->plan;
+		profiler_dynq_row *row = &rows[i];
+		HeapTuple	procTuple;
 
-		if (ptr)
+		/* the rows of one function are together, so syscache is searched once */
+		if (row->fkey.fn_oid != last_fn_oid)
 		{
-			List	   *plan_sources = SPI_plan_get_plan_sources(ptr);
+			procTuple = SearchSysCache1(PROCOID, ObjectIdGetDatum(row->fkey.fn_oid));
+			fn_exists = HeapTupleIsValid(procTuple);
 
-			if (plan_sources && list_length(plan_sources) == 1)
+			if (fn_exists)
 			{
-				CachedPlanSource *plan_source;
-				TupleDesc	tupdesc;
+				fn_xmin = HeapTupleHeaderGetRawXmin(procTuple->t_data);
+				fn_tid = procTuple->t_self;
+				ReleaseSysCache(procTuple);
+			}
 
-				plan_source = (CachedPlanSource *) linitial(plan_sources);
-				tupdesc = plan_source->resultDesc;
+			last_fn_oid = row->fkey.fn_oid;
+		}
 
-				if (tupdesc->natts == 1)
-				{
-					*result_type = TupleDescAttr(tupdesc, 0)->atttypid;
+		if (!fn_exists ||
+			row->fkey.fn_xmin != fn_xmin ||
+			!ItemPointerEquals(&row->fkey.fn_tid, &fn_tid))
+			continue;
 
-					return true;
-				}
-			}
-		}
+		plpgsql_check_put_profiler_dynamic_query(ri,
+												 row->fkey.fn_oid,
+												 row->stmtid,
+												 row->lineno,
+												 row->q.queryid,
+												 row->q.exec_count,
+												 (double) row->q.us_total,
+												 (double) row->q.us_max,
+												 row->q.rows);
 	}
 
-	return false;
+	pfree(rows);
 }
 
+/*
+ * Counters of one executed statement, copied from profile, so they
+ * can be processed without lock.
+ */
+typedef struct profiler_stmt_export_counters
+{
+	profiler_hashkey key;
+	int			stmtid;
+	int			lineno;
+	uint64		queryid;
+	uint64		exec_count;
+	uint64		exec_count_err;
+	uint64		us_total;
+	uint64		us_max;
+	uint64		rows;
+} profiler_stmt_export_counters;
 
-/* Return the first queryid found in the given PLpgSQL_stmt, if any. */
-static pc_queryid
-profiler_get_queryid(PLpgSQL_execstate *estate, PLpgSQL_stmt *stmt,
-					 bool *has_queryid, query_params **qparams)
+typedef void (*profiler_stmt_export_callback) (profiler_stmt_export_counters *counters,
+											  void *arg);
+
+/*
+ * Calls callback for any executed statement of current versions of
+ * functions of current database. The counters are copied under lock,
+ * and the versions of functions are checked (with possible access to
+ * system catalog) after releasing the lock. The statements of one
+ * function are passed together and in order of stmtid.
+ */
+static void
+profiler_iterate_current_stmts(profiler_stmt_export_callback callback, void *arg)
 {
-	PLpgSQL_expr *expr;
-	bool		dynamic;
-	List	   *params;
-	List	   *plan_sources;
+	HASH_SEQ_STATUS seqstatus;
+	profiler_profile *profile;
+	HTAB	   *profiles;
+	profiler_stmt_export_counters *counters;
+	int			ncounters = 0;
+	int			maxcounters = 64;
+	Oid			last_fn_oid = InvalidOid;
+	TransactionId fn_xmin = InvalidTransactionId;
+	ItemPointerData fn_tid;
+	bool		fn_exists = false;
+	int			i;
 
-	expr = profiler_get_expr(stmt, &dynamic, &params);
-	*has_queryid = (expr != NULL);
+	ItemPointerSetInvalid(&fn_tid);
 
-	/* fast leaving, when expression has not assigned plan */
-	if (!expr || !expr->plan)
-		return NOQUERYID;
+	counters = palloc(maxcounters * sizeof(profiler_stmt_export_counters));
 
-	if (dynamic)
+	if (shared_profiles_HashTable)
 	{
-		Assert(expr);
+		LWLockAcquire(profiler_ss->lock, LW_SHARED);
+		profiles = shared_profiles_HashTable;
+	}
+	else
+		profiles = profiles_HashTable;
 
-		if (params && !*qparams)
+	hash_seq_init(&seqstatus, profiles);
+
+	while ((profile = (profiler_profile *) hash_seq_search(&seqstatus)) != NULL)
+	{
+		profiler_stmt_reduced_padded *stmts;
+
+		if (profile->key.db_oid != MyDatabaseId)
+			continue;
+
+		stmts = get_profile_stmts(profile);
+
+		for (i = 0; i < profile->nstatements; i++)
 		{
-			query_params *qps = NULL;
-			int		nparams = list_length(params);
-			int		paramno = 0;
-			MemoryContext oldcxt;
-			ListCell *lc;
+			profiler_stmt_reduced *prstmt = &stmts[i].stmt;
+			profiler_stmt_export_counters *c;
+			uint64		exec_count = pg_atomic_read_u64(&prstmt->exec_count);
 
-			/* build array of Oid used like dynamic query parameters */
-			oldcxt = MemoryContextSwitchTo(profiler_mcxt);
-			qps = (query_params *) palloc(sizeof(Oid) * nparams + sizeof(int));
-			MemoryContextSwitchTo(oldcxt);
+			if (exec_count == 0)
+				continue;
 
-			foreach(lc, params)
+			if (ncounters == maxcounters)
 			{
-				PLpgSQL_expr *param_expr = (PLpgSQL_expr *) lfirst(lc);
-
-				if (!get_expr_type(param_expr, &qps->paramtypes[paramno++]))
-				{
-					free(qps);
-					return NOQUERYID;
-				}
+				maxcounters *= 2;
+				counters = repalloc(counters,
+									maxcounters * sizeof(profiler_stmt_export_counters));
 			}
 
-			qps->nparams = nparams;
-			*qparams = qps;
+			c = &counters[ncounters++];
+
+			c->key = profile->key;
+			c->stmtid = i + 1;
+			c->lineno = prstmt->lineno;
+			c->queryid = prstmt->has_queryid ? prstmt->queryid : NOQUERYID;
+			c->exec_count = exec_count;
+			c->exec_count_err = pg_atomic_read_u64(&prstmt->exec_count_err);
+			c->us_total = pg_atomic_read_u64(&prstmt->us_total);
+			c->us_max = pg_atomic_read_u64(&prstmt->us_max);
+			c->rows = pg_atomic_read_u64(&prstmt->rows);
 		}
-
-		return profiler_get_dyn_queryid(estate, expr, *qparams);
 	}
 
-	plan_sources = SPI_plan_get_plan_sources(expr->plan);
+	if (shared_profiles_HashTable)
+		LWLockRelease(profiler_ss->lock);
 
-	if (plan_sources)
+	for (i = 0; i < ncounters; i++)
 	{
-		CachedPlanSource *plan_source = (CachedPlanSource *) linitial(plan_sources);
+		profiler_stmt_export_counters *c = &counters[i];
 
-		if (plan_source->query_list)
+		/* the statements of one profile are together */
+		if (c->key.fn_oid != last_fn_oid)
 		{
-			Query *q = linitial_node(Query, plan_source->query_list);
+			HeapTuple	procTuple;
 
-			return q->queryId;
-		}
-	}
+			procTuple = SearchSysCache1(PROCOID, ObjectIdGetDatum(c->key.fn_oid));
+			fn_exists = HeapTupleIsValid(procTuple);
 
-	return NOQUERYID;
-}
+			if (fn_exists)
+			{
+				fn_xmin = HeapTupleHeaderGetRawXmin(procTuple->t_data);
+				fn_tid = procTuple->t_self;
+				ReleaseSysCache(procTuple);
+			}
 
-/*
- * Generate simple queryid  for testing purpose.
- * DO NOT USE IN PRODUCTION.
- */
-#if PG_VERSION_NUM >= 140000
+			last_fn_oid = c->key.fn_oid;
+		}
 
-static void
-profiler_fake_queryid_hook(ParseState *pstate, Query *query, JumbleState *jstate)
-{
-	(void) jstate;
+		if (!fn_exists ||
+			c->key.fn_xmin != fn_xmin ||
+			!ItemPointerEquals(&c->key.fn_tid, &fn_tid))
+			continue;
 
-#else
+		callback(c, arg);
+	}
+
+	pfree(counters);
+}
 
 static void
-profiler_fake_queryid_hook(ParseState *pstate, Query *query)
+snapshot_stmt_callback(profiler_stmt_export_counters *c, void *arg)
 {
-
-#endif
-
-	(void) pstate;
-
-	Assert(query->queryId == NOQUERYID);
-
-	query->queryId = query->commandType;
+	plpgsql_check_result_info *ri = (plpgsql_check_result_info *) arg;
+
+	plpgsql_check_put_profiler_snapshot(ri,
+										c->key.fn_oid,
+										c->stmtid,
+										c->lineno,
+										c->exec_count,
+										c->exec_count_err,
+										(double) c->us_total,
+										c->rows);
 }
 
 /*
- * Prepare tuplestore with function profile
- *
+ * Returns cumulative counters of functions and statements of current
+ * database. Only counters are returned (without names of functions and
+ * statements), so two snapshots can be cheaply stored and compared.
+ * The statements of older versions of functions are ignored.
  */
 void
-plpgsql_check_iterate_over_profile(plpgsql_check_info *cinfo,
-								   profiler_stmt_walker_mode mode,
-								   plpgsql_check_result_info *ri,
-								   coverage_state *cs)
+plpgsql_check_profiler_iterate_snapshot(plpgsql_check_result_info *ri)
 {
-	LOCAL_FCINFO(fake_fcinfo, 0);
-	PLpgSQL_function *func;
-	FmgrInfo	flinfo;
-	TriggerData trigdata;
-	EventTriggerData etrigdata;
-	Trigger tg_trigger;
-	ReturnSetInfo rsinfo;
-	bool		fake_rtd;
-	profiler_info pinfo;
-	profiler_stmt_chunk *first_chunk = NULL;
-	profiler_iterator		pi;
-	volatile bool		unlock_mutex = false;
-	bool		shared_chunks;
-	profiler_stmt_walker_options opts;
-
-	memset(&opts, 0, sizeof(profiler_stmt_walker_options));
+	HASH_SEQ_STATUS seqstatus;
+	fstats	   *fstats_item;
+	HTAB	   *fstats_ht;
+	bool		htab_is_shared;
 
-	memset(&pi, 0, sizeof(profiler_iterator));
-	pi.key.fn_oid = cinfo->fn_oid;
-	pi.key.db_oid = MyDatabaseId;
-	pi.key.fn_xmin = HeapTupleHeaderGetRawXmin(cinfo->proctuple->t_data);
-	pi.key.fn_tid =  cinfo->proctuple->t_self;
-	pi.key.chunk_num = 1;
-	pi.ri = ri;
+	/* own not flushed data should be visible */
+	profiler_flush_pending(ERROR);
 
-	/* try to find first chunk in shared (or local) memory */
-	if (shared_profiler_chunks_HashTable)
+	if (shared_fstats_HashTable)
 	{
-		LWLockAcquire(profiler_ss->lock, LW_SHARED);
-		pi.chunks = shared_profiler_chunks_HashTable;
-		shared_chunks = true;
+		LWLockAcquire(profiler_ss->fstats_lock, LW_SHARED);
+		fstats_ht = shared_fstats_HashTable;
+		htab_is_shared = true;
 	}
 	else
 	{
-		pi.chunks = profiler_chunks_HashTable;
-		shared_chunks = false;
+		fstats_ht = fstats_HashTable;
+		htab_is_shared = false;
 	}
 
-	pi.current_chunk = first_chunk = (profiler_stmt_chunk *) hash_search(pi.chunks,
-																		 (void *) &pi.key,
-																		 HASH_FIND,
-																		 NULL);
+	hash_seq_init(&seqstatus, fstats_ht);
 
-	PG_TRY();
+	while ((fstats_item = (fstats *) hash_seq_search(&seqstatus)) != NULL)
 	{
-		if (shared_chunks && first_chunk)
-		{
-			SpinLockAcquire(&first_chunk->mutex);
-			unlock_mutex = true;
-		}
+		fstats_shard agg;
+
+		if (fstats_item->key.db_oid != MyDatabaseId)
+			continue;
+
+		aggregate_fstats(fstats_item, htab_is_shared, &agg);
+
+		if (agg.exec_count == 0)
+			continue;
+
+		plpgsql_check_put_profiler_snapshot(ri,
+											fstats_item->key.fn_oid,
+											-1, -1,
+											agg.exec_count,
+											agg.exec_count_err,
+											(double) agg.total_time,
+											-1);
+	}
+
+	if (htab_is_shared)
+		LWLockRelease(profiler_ss->fstats_lock);
+
+	profiler_iterate_current_stmts(snapshot_stmt_callback, ri);
+}
+
+/*
+ * The cursors of consumers of deltas of profiles. Any consumer (identified
+ * by name) has own copy of counters from last read, and the generations of
+ * entries from last read. The entries with unchanged generation are skipped
+ * without reading counters. The cursors are stored in session memory.
+ */
+typedef struct profiler_cursor_fstats
+{
+	fstats_hashkey key;
+	uint64		generation;
+	uint64		pass;
+	uint64		exec_count;
+	uint64		exec_count_err;
+	uint64		total_time;
+} profiler_cursor_fstats;
+
+typedef struct profiler_cursor_stmt
+{
+	uint64		exec_count;
+	uint64		exec_count_err;
+	uint64		us_total;
+	uint64		rows;
+} profiler_cursor_stmt;
+
+typedef struct profiler_cursor_profile
+{
+	profiler_hashkey key;
+	uint64		generation;
+	uint64		pass;
+	int			nstatements;
+	profiler_cursor_stmt *stmts;
+} profiler_cursor_profile;
+
+typedef struct profiler_cursor
+{
+	NameData	name;
+	uint64		pass;
+	MemoryContext mcxt;
+	HTAB	   *fstats;
+	HTAB	   *profiles;
+} profiler_cursor;
+
+static void
+cursor_name(text *consumer, NameData *name)
+{
+	char	   *str = text_to_cstring(consumer);
 
-		plpgsql_check_setup_fcinfo(cinfo,
-								   &flinfo,
-								   fake_fcinfo,
-								   &rsinfo,
-								   &trigdata,
-								   &etrigdata,
-								   &tg_trigger,
-								   &fake_rtd);
+	if (strlen(str) >= NAMEDATALEN)
+		ereport(ERROR,
+				(errcode(ERRCODE_NAME_TOO_LONG),
+				 errmsg("name of consumer \"%s\" is too long", str)));
 
-		func = plpgsql_check__compile_p(fake_fcinfo, false);
+	memset(name, 0, sizeof(NameData));
+	strlcpy(NameStr(*name), str, NAMEDATALEN);
 
-		opts.stmtid_map = plpgsql_check_get_stmtid_map(func);
-		opts.stmts_info = plpgsql_check_get_stmts_info(func);
+	pfree(str);
+}
 
-		opts.pi =  &pi;
-		opts.cs = cs;
+static profiler_cursor *
+get_cursor(text *consumer)
+{
+	profiler_cursor *cursor;
+	NameData	name;
+	bool		found;
 
-		pinfo.func = func;
-		pinfo.nstatements = 0;
-		pinfo.stmts = NULL;
+	cursor_name(consumer, &name);
 
-		profiler_stmt_walker(&pinfo, mode, (PLpgSQL_stmt *) func->action, NULL, NULL, 1, &opts);
+	if (!profiler_cursors_HashTable)
+	{
+		HASHCTL		ctl;
 
-		pfree(opts.stmtid_map);
-		pfree(opts.stmts_info);
+		memset(&ctl, 0, sizeof(ctl));
+		ctl.keysize = sizeof(NameData);
+		ctl.entrysize = sizeof(profiler_cursor);
+		ctl.hcxt = profiler_mcxt;
 
+		profiler_cursors_HashTable = hash_create("plpgsql_check profiler cursors",
+												 16,
+												 &ctl,
+												 HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
 	}
-	PG_CATCH();
-	{
-		if (unlock_mutex)
-			SpinLockRelease(&first_chunk->mutex);
 
-		PG_RE_THROW();
-	}
-	PG_END_TRY();
+	cursor = (profiler_cursor *) hash_search(profiler_cursors_HashTable,
+											 (void *) &name,
+											 HASH_ENTER,
+											 &found);
 
-	if (unlock_mutex)
-		SpinLockRelease(&first_chunk->mutex);
+	if (!found)
+	{
+		HASHCTL		ctl;
+
+		cursor->pass = 0;
+		cursor->mcxt = AllocSetContextCreate(profiler_mcxt,
+											 "plpgsql_check profiler cursor",
+											 ALLOCSET_DEFAULT_SIZES);
+
+		memset(&ctl, 0, sizeof(ctl));
+		ctl.keysize = sizeof(fstats_hashkey);
+		ctl.entrysize = sizeof(profiler_cursor_fstats);
+		ctl.hcxt = cursor->mcxt;
+
+		cursor->fstats = hash_create("plpgsql_check profiler cursor fstats",
+									 128,
+									 &ctl,
+									 HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+
+		memset(&ctl, 0, sizeof(ctl));
+		ctl.keysize = sizeof(profiler_hashkey);
+		ctl.entrysize = sizeof(profiler_cursor_profile);
+		ctl.hcxt = cursor->mcxt;
+
+		cursor->profiles = hash_create("plpgsql_check profiler cursor profiles",
+									   128,
+									   &ctl,
+									   HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+	}
 
-	if (shared_chunks)
-		LWLockRelease(profiler_ss->lock);
+	return cursor;
 }
 
+/* counters can be reseted, then the delta is current value */
+#define COUNTER_DELTA(cur, prev)	((cur) >= (prev) ? (cur) - (prev) : (cur))
+
 /*
- * Prepare tuplestore with function profile
- *
+ * Returns deltas of counters of functions and statements of current
+ * database from last read of consumer. Only entries updated after
+ * last read are processed.
  */
 void
-plpgsql_check_profiler_show_profile(plpgsql_check_result_info *ri,
-									plpgsql_check_info *cinfo)
+plpgsql_check_profiler_iterate_delta(plpgsql_check_result_info *ri,
+									  text *consumer)
 {
-	profiler_hashkey hk;
-	bool found;
-	HTAB	   *chunks;
-	bool		shared_chunks;
-	volatile profiler_stmt_chunk *first_chunk = NULL;
-	volatile bool		unlock_mutex = false;
+	HASH_SEQ_STATUS seqstatus;
+	profiler_cursor *cursor;
+	profiler_cursor_fstats *cfstats;
+	profiler_cursor_profile *cprofile;
+	fstats	   *fstats_item;
+	profiler_profile *profile;
+	HTAB	   *fstats_ht;
+	HTAB	   *profiles;
+	bool		htab_is_shared;
 
-	/* ensure correct complete content of hash key */
-	memset(&hk, 0, sizeof(profiler_hashkey));
-	hk.fn_oid = cinfo->fn_oid;
-	hk.db_oid = MyDatabaseId;
-	hk.fn_xmin = HeapTupleHeaderGetRawXmin(cinfo->proctuple->t_data);
-	hk.fn_tid =  cinfo->proctuple->t_self;
-	hk.chunk_num = 1;
+	/* own not flushed data should be visible */
+	profiler_flush_pending(ERROR);
 
-	/* try to find first chunk in shared (or local) memory */
-	if (shared_profiler_chunks_HashTable)
+	cursor = get_cursor(consumer);
+	cursor->pass += 1;
+
+	if (shared_fstats_HashTable)
 	{
-		LWLockAcquire(profiler_ss->lock, LW_SHARED);
-		chunks = shared_profiler_chunks_HashTable;
-		shared_chunks = true;
+		LWLockAcquire(profiler_ss->fstats_lock, LW_SHARED);
+		fstats_ht = shared_fstats_HashTable;
+		htab_is_shared = true;
 	}
 	else
 	{
-		chunks = profiler_chunks_HashTable;
-		shared_chunks = false;
+		fstats_ht = fstats_HashTable;
+		htab_is_shared = false;
 	}
 
-	PG_TRY();
+	hash_seq_init(&seqstatus, fstats_ht);
+
+	while ((fstats_item = (fstats *) hash_seq_search(&seqstatus)) != NULL)
 	{
-		char	   *prosrc = cinfo->src;
-		profiler_stmt_chunk *chunk = NULL;
-		int			lineno = 1;
-		int			current_statement = 0;
+		fstats_shard agg;
+		uint64		generation;
+		bool		found;
 
-		chunk = (profiler_stmt_chunk *) hash_search(chunks,
-											 (void *) &hk,
-											 HASH_FIND,
-											 &found);
+		if (fstats_item->key.db_oid != MyDatabaseId)
+			continue;
 
-		if (shared_chunks && chunk)
+		cfstats = (profiler_cursor_fstats *) hash_search(cursor->fstats,
+														 (void *) &fstats_item->key,
+														 HASH_ENTER,
+														 &found);
+		if (!found)
 		{
-			first_chunk = chunk;
-			SpinLockAcquire(&first_chunk->mutex);
-			unlock_mutex = true;
+			cfstats->generation = 0;
+			cfstats->exec_count = 0;
+			cfstats->exec_count_err = 0;
+			cfstats->total_time = 0;
 		}
 
-		/* iterate over source code rows */
-		while (*prosrc)
-		{
-			char	   *lineend = NULL;
-			char	   *linebeg = NULL;
+		cfstats->pass = cursor->pass;
 
-			int			stmt_lineno = -1;
-			int64		us_total = 0;
-			int64		exec_count = 0;
-			int64		exec_count_err = 0;
-			Datum		queryids_array = (Datum) 0;
-			Datum		max_time_array = (Datum) 0;
-			Datum		processed_rows_array = (Datum) 0;
-			int			cmds_on_row = 0;
+		generation = pg_atomic_read_u64(&fstats_item->generation);
+		if (found && generation == cfstats->generation)
+			continue;
 
-			lineend = prosrc;
-			linebeg = prosrc;
+		/* counters should not be older than generation */
+		pg_read_barrier();
 
-			/* find lineend */
-			while (*lineend != '\0' && *lineend != '\n')
-				lineend += 1;
+		aggregate_fstats(fstats_item, htab_is_shared, &agg);
 
-			if (*lineend == '\n')
-			{
-				*lineend = '\0';
-				prosrc = lineend + 1;
-			}
-			else
-				prosrc = lineend;
+		if (agg.exec_count != cfstats->exec_count)
+			plpgsql_check_put_profiler_snapshot(ri,
+												fstats_item->key.fn_oid,
+												-1, -1,
+												COUNTER_DELTA(agg.exec_count, cfstats->exec_count),
+												COUNTER_DELTA(agg.exec_count_err, cfstats->exec_count_err),
+												(double) COUNTER_DELTA(agg.total_time, cfstats->total_time),
+												-1);
 
-			if (chunk)
-			{
-				ArrayBuildState *queryids_abs = NULL;
-				ArrayBuildState *max_time_abs = NULL;
-				ArrayBuildState *processed_rows_abs = NULL;
-				int			queryids_on_row = 0;
+		cfstats->generation = generation;
+		cfstats->exec_count = agg.exec_count;
+		cfstats->exec_count_err = agg.exec_count_err;
+		cfstats->total_time = agg.total_time;
+	}
 
-				queryids_abs = initArrayResult(INT8OID, CurrentMemoryContext, true);
-				max_time_abs = initArrayResult(FLOAT8OID, CurrentMemoryContext, true);
-				processed_rows_abs = initArrayResult(INT8OID, CurrentMemoryContext, true);
+	if (htab_is_shared)
+		LWLockRelease(profiler_ss->fstats_lock);
 
-				/* process all statements on this line */
-				for(;;)
-				{
-					/* ensure so  access to chunks is correct */
-					if (current_statement >= STATEMENTS_PER_CHUNK)
-					{
-						hk.chunk_num += 1;
+	if (shared_profiles_HashTable)
+	{
+		LWLockAcquire(profiler_ss->lock, LW_SHARED);
+		profiles = shared_profiles_HashTable;
+	}
+	else
+		profiles = profiles_HashTable;
 
-						chunk = (profiler_stmt_chunk *) hash_search(chunks,
-														 (void *) &hk,
-														 HASH_FIND,
-														 &found);
+	hash_seq_init(&seqstatus, profiles);
 
-						if (!found)
-						{
-							chunk = NULL;
-							break;
-						}
+	while ((profile = (profiler_profile *) hash_seq_search(&seqstatus)) != NULL)
+	{
+		profiler_stmt_reduced_padded *stmts;
+		HeapTuple	procTuple;
+		uint64		generation;
+		bool		is_current;
+		bool		found;
+		int			i;
+
+		if (profile->key.db_oid != MyDatabaseId)
+			continue;
 
-						current_statement = 0;
-					}
+		cprofile = (profiler_cursor_profile *) hash_search(cursor->profiles,
+														   (void *) &profile->key,
+														   HASH_ENTER,
+														   &found);
+		if (!found)
+		{
+			cprofile->generation = 0;
+			cprofile->nstatements = profile->nstatements;
+			cprofile->stmts = MemoryContextAllocZero(cursor->mcxt,
+													 sizeof(profiler_cursor_stmt) * Max(profile->nstatements, 1));
+		}
 
-					Assert(chunk != NULL);
+		cprofile->pass = cursor->pass;
 
-					/* skip invisible statements if any */
-					if (chunk->stmts[current_statement].lineno < lineno)
-					{
-						current_statement += 1;
-						continue;
-					}
-					else if (chunk->stmts[current_statement].lineno == lineno)
-					{
-						profiler_stmt_reduced *prstmt = &chunk->stmts[current_statement];
+		generation = pg_atomic_read_u64(&profile->generation);
+		if (found && generation == cprofile->generation)
+			continue;
 
-						us_total += prstmt->us_total;
-						exec_count += prstmt->exec_count;
-						exec_count_err += prstmt->exec_count_err;
+		/* profiles of older versions of functions are checked only once */
+		cprofile->generation = generation;
 
-						stmt_lineno = lineno;
+		procTuple = SearchSysCache1(PROCOID, ObjectIdGetDatum(profile->key.fn_oid));
+		if (!HeapTupleIsValid(procTuple))
+			continue;
 
-						if (prstmt->has_queryid)
-						{
-							if (prstmt->queryid != NOQUERYID)
-							{
-								queryids_abs = accumArrayResult(queryids_abs,
-																Int64GetDatum((int64) prstmt->queryid),
-																prstmt->queryid == NOQUERYID,
-																INT8OID,
-																CurrentMemoryContext);
-								queryids_on_row += 1;
-							}
-						}
+		is_current = profile->key.fn_xmin == HeapTupleHeaderGetRawXmin(procTuple->t_data) &&
+			ItemPointerEquals(&profile->key.fn_tid, &procTuple->t_self);
 
-						max_time_abs = accumArrayResult(max_time_abs,
-														Float8GetDatum(prstmt->us_max / 1000.0), false,
-														FLOAT8OID,
-														CurrentMemoryContext);
-
-						processed_rows_abs = accumArrayResult(processed_rows_abs,
-															 Int64GetDatum(prstmt->rows), false,
-															 INT8OID,
-															 CurrentMemoryContext);
-						cmds_on_row += 1;
-						current_statement += 1;
-						continue;
-					}
-					else
-						break;
-				}
+		ReleaseSysCache(procTuple);
+
+		if (!is_current)
+			continue;
 
-				if (queryids_on_row > 0)
-					queryids_array = makeArrayResult(queryids_abs, CurrentMemoryContext);
+		/* counters should not be older than generation */
+		pg_read_barrier();
 
-				if (cmds_on_row > 0)
-				{
-					max_time_array = makeArrayResult(max_time_abs, CurrentMemoryContext);
-					processed_rows_array = makeArrayResult(processed_rows_abs, CurrentMemoryContext);
-				}
-			}
+		stmts = get_profile_stmts(profile);
 
-			plpgsql_check_put_profile(ri,
-								   queryids_array,
-								   lineno,
-								   stmt_lineno,
-								   cmds_on_row,
-								   exec_count,
-								   exec_count_err,
-								   us_total,
-								   max_time_array,
-								   processed_rows_array,
-								   (char *) linebeg);
+		for (i = 0; i < profile->nstatements && i < cprofile->nstatements; i++)
+		{
+			profiler_stmt_reduced *prstmt = &stmts[i].stmt;
+			profiler_cursor_stmt *cstmt = &cprofile->stmts[i];
+			uint64		exec_count = pg_atomic_read_u64(&prstmt->exec_count);
+			uint64		exec_count_err;
+			uint64		us_total;
+			uint64		rows;
+
+			if (exec_count == cstmt->exec_count)
+				continue;
 
-			lineno += 1;
+			exec_count_err = pg_atomic_read_u64(&prstmt->exec_count_err);
+			us_total = pg_atomic_read_u64(&prstmt->us_total);
+			rows = pg_atomic_read_u64(&prstmt->rows);
+
+			plpgsql_check_put_profiler_snapshot(ri,
+												profile->key.fn_oid,
+												i + 1,
+												prstmt->lineno,
+												COUNTER_DELTA(exec_count, cstmt->exec_count),
+												COUNTER_DELTA(exec_count_err, cstmt->exec_count_err),
+												(double) COUNTER_DELTA(us_total, cstmt->us_total),
+												COUNTER_DELTA(rows, cstmt->rows));
+
+			cstmt->exec_count = exec_count;
+			cstmt->exec_count_err = exec_count_err;
+			cstmt->us_total = us_total;
+			cstmt->rows = rows;
 		}
 	}
-	PG_CATCH();
-	{
-		if (unlock_mutex)
-			SpinLockRelease(&first_chunk->mutex);
-		PG_RE_THROW();
-	}
-	PG_END_TRY();
 
-	if (unlock_mutex)
-		SpinLockRelease(&first_chunk->mutex);
-
-	if (shared_chunks)
+	if (shared_profiles_HashTable)
 		LWLockRelease(profiler_ss->lock);
-}
-
-/*
- * Try to search profile pattern for function. Creates profile pattern when
- * it doesn't exists.
- */
-static void
-profiler_func_setup(PLpgSQL_execstate *estate, PLpgSQL_function *func, void **plugin2_info)
-{
-	if (plpgsql_check_profiler && OidIsValid(func->fn_oid))
-	{
-		profiler_info *pinfo;
 
-		pinfo = palloc0(sizeof(profiler_info));
-		pinfo->nstatements = func->nstatements;
-		pinfo->stmts = palloc0(func->nstatements * sizeof(profiler_stmt));
+	/* remove entries of removed profiles */
+	hash_seq_init(&seqstatus, cursor->fstats);
 
-		INSTR_TIME_SET_CURRENT(pinfo->start_time);
+	while ((cfstats = (profiler_cursor_fstats *) hash_seq_search(&seqstatus)) != NULL)
+	{
+		if (cfstats->pass != cursor->pass)
+			hash_search(cursor->fstats, (void *) &cfstats->key, HASH_REMOVE, NULL);
+	}
 
-		pinfo->func = func;
+	hash_seq_init(&seqstatus, cursor->profiles);
 
-		*plugin2_info = pinfo;
+	while ((cprofile = (profiler_cursor_profile *) hash_seq_search(&seqstatus)) != NULL)
+	{
+		if (cprofile->pass != cursor->pass)
+		{
+			pfree(cprofile->stmts);
+			hash_search(cursor->profiles, (void *) &cprofile->key, HASH_REMOVE, NULL);
+		}
 	}
 }
 
-static void
-_profiler_func_end(profiler_info *pinfo, Oid fn_oid, bool is_aborted)
+/*
+ * Removes cursor of consumer of deltas. Returns false, when the cursor
+ * doesn't exist.
+ */
+Datum
+plpgsql_profiler_delta_close(PG_FUNCTION_ARGS)
 {
-	int			entry_stmtid;
-	instr_time	end_time;
-	uint64		elapsed;
-	profiler_stmt_walker_options opts;
-	int		   *stmtid_map;
-
-	Assert(pinfo);
-	Assert(pinfo->func);
-	Assert(pinfo->func->fn_oid == fn_oid);
-
-	entry_stmtid = pinfo->func->action->stmtid - 1;
-
-	memset(&opts, 0, sizeof(profiler_stmt_walker_options));
-
-	INSTR_TIME_SET_CURRENT(end_time);
-	INSTR_TIME_SUBTRACT(end_time, pinfo->start_time);
-
-	elapsed = INSTR_TIME_GET_MICROSEC(end_time);
+	profiler_cursor *cursor;
+	NameData	name;
 
-	if (pinfo->stmts[entry_stmtid].exec_count == 0)
-	{
-		pinfo->stmts[entry_stmtid].exec_count = 1;
-		pinfo->stmts[entry_stmtid].exec_count_err = is_aborted ? 1 : 0;
-		pinfo->stmts[entry_stmtid].us_total = elapsed;
-		pinfo->stmts[entry_stmtid].us_max = elapsed;
-	}
+	cursor_name(PG_GETARG_TEXT_PP(0), &name);
 
-	stmtid_map = plpgsql_check_get_current_stmtid_map();
+	if (!profiler_cursors_HashTable)
+		PG_RETURN_BOOL(false);
 
-	opts.stmts_info = plpgsql_check_get_current_stmts_info();
-	opts.stmtid_map = stmtid_map;
+	cursor = (profiler_cursor *) hash_search(profiler_cursors_HashTable,
+											 (void *) &name,
+											 HASH_FIND,
+											 NULL);
+	if (!cursor)
+		PG_RETURN_BOOL(false);
 
-	/* finalize profile - get result profile */
-	profiler_stmt_walker(pinfo, PLPGSQL_CHECK_STMT_WALKER_COUNT_EXEC_TIME,
-						 (PLpgSQL_stmt *) pinfo->func->action, NULL, NULL, 1,
-						 &opts);
+	MemoryContextDelete(cursor->mcxt);
+	hash_search(profiler_cursors_HashTable, (void *) &name, HASH_REMOVE, NULL);
 
-	update_persistent_profile(pinfo, pinfo->func, stmtid_map);
-	update_persistent_fstats(pinfo->func, elapsed);
+	PG_RETURN_BOOL(true);
 }
 
+/*
+ * Format of exported profiles. All numbers are in network byte order.
+ *
+ *   header:    int32 magic, int32 version, int32 number of functions
+ *   function:  uint32 fn_oid, int32 number of statements
+ *   statement: int32 stmtid, int32 lineno, int64 queryid (0 when
+ *              it is not known), int64 exec_count, int64 exec_count_err,
+ *              int64 total_time (self time in us), int64 max_time (us),
+ *              int64 processed_rows
+ *
+ * Only executed statements of current versions of functions of current
+ * database are exported.
+ */
+#define PROFILER_EXPORT_MAGIC		0x504C5045
+#define PROFILER_EXPORT_VERSION		1
+
 static void
-profiler_func_end(PLpgSQL_execstate *estate,
-				  PLpgSQL_function *func,
-				  void **plugin2_info)
+export_patch_int32(StringInfo buf, int offset, int32 value)
 {
-	profiler_info *pinfo = *plugin2_info;
-
-	if (!pinfo)
-		return;
-
-	Assert(pinfo->func == func);
+	uint32		n32 = pg_hton32((uint32) value);
 
-	_profiler_func_end(pinfo, func->fn_oid, false);
+	memcpy(buf->data + offset, &n32, sizeof(uint32));
 }
 
-static void
-profiler_func_end_aborted(Oid fn_oid, void **plugin2_info)
+typedef struct profiler_export_state
 {
-	profiler_info *pinfo = *plugin2_info;
-
-	if (!pinfo)
-		return;
-
-	_profiler_func_end(pinfo, fn_oid, true);
-}
+	StringInfoData buf;
+	int			nfuncs;
+	int			nstmts;
+	int			nstmts_offset;
+	Oid			last_fn_oid;
+} profiler_export_state;
 
 static void
-profiler_stmt_beg(PLpgSQL_execstate *estate,
-				  PLpgSQL_stmt *stmt,
-				  void **plugin2_info)
+export_stmt_callback(profiler_stmt_export_counters *c, void *arg)
 {
-	profiler_info *pinfo = (profiler_info *) *plugin2_info;
+	profiler_export_state *es = (profiler_export_state *) arg;
 
-	if (pinfo)
+	if (c->key.fn_oid != es->last_fn_oid)
 	{
-		INSTR_TIME_SET_CURRENT(pinfo->stmts[stmt->stmtid - 1].start_time);
-	}
-}
+		if (es->nfuncs > 0)
+			export_patch_int32(&es->buf, es->nstmts_offset, es->nstmts);
 
-static void
-_profiler_stmt_end(profiler_stmt *pstmt, bool is_aborted)
-{
-	instr_time		end_time;
-	uint64			elapsed;
-	instr_time		end_time2;
+		pq_sendint32(&es->buf, c->key.fn_oid);
 
-	INSTR_TIME_SET_CURRENT(end_time);
-	end_time2 = end_time;
-	INSTR_TIME_ACCUM_DIFF(pstmt->total, end_time, pstmt->start_time);
+		es->nstmts_offset = es->buf.len;
+		pq_sendint32(&es->buf, 0);
 
-	INSTR_TIME_SUBTRACT(end_time2, pstmt->start_time);
-	elapsed = INSTR_TIME_GET_MICROSEC(end_time2);
+		es->last_fn_oid = c->key.fn_oid;
+		es->nstmts = 0;
+		es->nfuncs += 1;
+	}
 
-	if (elapsed > pstmt->us_max)
-		pstmt->us_max = elapsed;
+	pq_sendint32(&es->buf, c->stmtid);
+	pq_sendint32(&es->buf, c->lineno);
+	pq_sendint64(&es->buf, c->queryid);
+	pq_sendint64(&es->buf, c->exec_count);
+	pq_sendint64(&es->buf, c->exec_count_err);
+	pq_sendint64(&es->buf, c->us_total);
+	pq_sendint64(&es->buf, c->us_max);
+	pq_sendint64(&es->buf, c->rows);
 
-	pstmt->us_total = INSTR_TIME_GET_MICROSEC(pstmt->total);
-	pstmt->exec_count_err += is_aborted ? 1 : 0;
-	pstmt->exec_count++;
+	es->nstmts += 1;
 }
 
-
 /*
- * Cleaning mode is used for closing unfinished statements after an exception.
+ * Returns counters of all profiles as one bytea value in compact binary
+ * format. The shared profiles are read under one shared lock.
  */
-static void
-profiler_stmt_end(PLpgSQL_execstate *estate,
-				  PLpgSQL_stmt *stmt,
-				  void **plugin2_info)
-{
-	profiler_info *pinfo = *plugin2_info;
-
-	if (pinfo)
-	{
-		profiler_stmt *pstmt = &pinfo->stmts[stmt->stmtid - 1];
-
-		/*
-		 * We can get query id only if stmt_end is not executed
-		 * in cleaning mode, because we need to execute expression
-		 */
-		if (pstmt->queryid == NOQUERYID)
-			pstmt->queryid = profiler_get_queryid(estate, stmt,
-												  &pstmt->has_queryid,
-												  &pstmt->qparams);
-
-		_profiler_stmt_end(pstmt, false);
-	}
-}
-
-static void
-profiler_stmt_end_aborted(Oid fn_oid, int stmtid, void **plugin2_info)
+Datum
+plpgsql_profiler_export(PG_FUNCTION_ARGS)
 {
-	profiler_info *pinfo = *plugin2_info;
+	profiler_export_state es;
+	int			nfuncs_offset;
 
-	if (pinfo)
-	{
-		profiler_stmt *pstmt = &pinfo->stmts[stmtid - 1];
+	(void) fcinfo;
 
-		_profiler_stmt_end(pstmt, true);
-	}
-}
+	/* own not flushed data should be visible */
+	profiler_flush_pending(ERROR);
 
-void
-plpgsql_check_profiler_iterate_over_all_profiles(plpgsql_check_result_info *ri)
-{
-	HASH_SEQ_STATUS seqstatus;
-	fstats		*fstats_item;
+	pq_begintypsend(&es.buf);
 
-	HTAB	   *fstats_ht;
-	bool		htab_is_shared;
+	pq_sendint32(&es.buf, PROFILER_EXPORT_MAGIC);
+	pq_sendint32(&es.buf, PROFILER_EXPORT_VERSION);
 
-	/* try to find first chunk in shared (or local) memory */
-	if (shared_fstats_HashTable)
-	{
-		LWLockAcquire(profiler_ss->fstats_lock, LW_SHARED);
-		fstats_ht = shared_fstats_HashTable;
-		htab_is_shared = true;
-	}
-	else
-	{
-		fstats_ht = fstats_HashTable;
-		htab_is_shared = false;
-	}
+	nfuncs_offset = es.buf.len;
+	pq_sendint32(&es.buf, 0);
 
-	hash_seq_init(&seqstatus, fstats_ht);
+	es.nfuncs = 0;
+	es.nstmts = 0;
+	es.nstmts_offset = 0;
+	es.last_fn_oid = InvalidOid;
 
-	while ((fstats_item = (fstats *) hash_seq_search(&seqstatus)) != NULL)
-	{
-		Oid		fn_oid,
-				db_oid;
-		uint64	exec_count,
-				exec_count_err,
-				total_time,
-				min_time,
-				max_time;
+	profiler_iterate_current_stmts(export_stmt_callback, &es);
 
-		float8	total_time_xx;
-		HeapTuple	tp;
+	if (es.nfuncs > 0)
+		export_patch_int32(&es.buf, es.nstmts_offset, es.nstmts);
 
-		if (htab_is_shared)
-			SpinLockAcquire(&fstats_item->mutex);
+	export_patch_int32(&es.buf, nfuncs_offset, es.nfuncs);
 
-		fn_oid = fstats_item->key.fn_oid;
-		db_oid = fstats_item->key.db_oid;
-		exec_count = fstats_item->exec_count;
-		exec_count_err = fstats_item->exec_count_err;
-		total_time = fstats_item->total_time;
-		total_time_xx = fstats_item->total_time_xx;
-		min_time = fstats_item->min_time;
-		max_time = fstats_item->max_time;
+	PG_RETURN_BYTEA_P(pq_endtypsend(&es.buf));
+}
 
-		if (htab_is_shared)
-			SpinLockRelease(&fstats_item->mutex);
+/*
+ * Returns counters of own overhead of profiler. When shared memory is
+ * used, then the counters are aggregated for all processes.
+ */
+void
+plpgsql_check_profiler_iterate_internal_stats(plpgsql_check_result_info *ri)
+{
+	int			i;
 
-		/*
-		 * only function's statistics for current database can be displayed here,
-		 * Oid of functions from other databases has unassigned oids to current
-		 * system catalogue.
-		 */
-		if (db_oid != MyDatabaseId)
-			continue;
+	profiler_flush_internal_stats();
 
-		/* check if function has name */
-		tp = SearchSysCache1(PROCOID, ObjectIdGetDatum(fn_oid));
-		if (!HeapTupleIsValid(tp))
-			continue;
+	for (i = 0; i < PROFILER_INTERNAL_COUNTERS; i++)
+	{
+		uint64		count;
+		uint64		us_total;
 
-		ReleaseSysCache(tp);
+		if (shared_profiles_HashTable)
+		{
+			count = pg_atomic_read_u64(&profiler_ss->internal_count[i]);
+			us_total = pg_atomic_read_u64(&profiler_ss->internal_us_total[i]);
+		}
+		else
+		{
+			count = profiler_internal_stats[i].count;
+			us_total = profiler_internal_stats[i].us_total;
+		}
 
-		plpgsql_check_put_profiler_functions_all_tb(ri,
-													fn_oid,
-													exec_count,
-													exec_count_err,
-													(double) total_time,
-													ceil(total_time / ((double) exec_count)),
-													ceil(sqrt(total_time_xx / exec_count)),
-													(double) min_time,
-													(double) max_time);
+		plpgsql_check_put_internal_stat(ri,
+										profiler_internal_counter_desc[i].name,
+										count,
+										profiler_internal_counter_desc[i].has_time,
+										(double) us_total);
 	}
-
-	if (htab_is_shared)
-		LWLockRelease(profiler_ss->fstats_lock);
 }
 
 /*
@@ -2399,4 +6384,5 @@ void
 plpgsql_check_profiler_init(void)
 {
 	plpgsql_check_register_pldbgapi2_plugin(&profiler_plugin2);
+	plpgsql_check_register_pldbgapi2_plugin(&coverage_plugin2);
 }
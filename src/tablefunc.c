@@ -12,9 +12,31 @@
 #include "plpgsql_check.h"
 #include "plpgsql_check_builtins.h"
 
+#include "access/genam.h"
+#include "access/htup_details.h"
+#include "access/table.h"
+#include "catalog/namespace.h"
+#include "catalog/pg_proc.h"
+#include "catalog/pg_trigger.h"
+#include "catalog/pg_type.h"
+#include "commands/proclang.h"
 #include "utils/builtins.h"
+#include "utils/memutils.h"
+#include "utils/rel.h"
 #include "utils/syscache.h"
 
+/*
+ * One item of bulk check - function and (for dml trigger functions)
+ * trigger relation and optional transition tables.
+ */
+typedef struct check_all_item
+{
+	Oid			fn_oid;
+	Oid			relid;
+	char	   *oldtable;
+	char	   *newtable;
+} check_all_item;
+
 static void SetReturningFunctionCheck(ReturnSetInfo *rsinfo);
 
 PG_FUNCTION_INFO_V1(plpgsql_check_function);
@@ -28,6 +50,15 @@ PG_FUNCTION_INFO_V1(plpgsql_show_dependency_tb_name);
 PG_FUNCTION_INFO_V1(plpgsql_profiler_function_tb_name);
 PG_FUNCTION_INFO_V1(plpgsql_profiler_function_statements_tb_name);
 PG_FUNCTION_INFO_V1(plpgsql_profiler_functions_all_tb);
+PG_FUNCTION_INFO_V1(plpgsql_profiler_critical_path);
+PG_FUNCTION_INFO_V1(plpgsql_profiler_critical_path_name);
+PG_FUNCTION_INFO_V1(plpgsql_profiler_call_stacks_tb);
+PG_FUNCTION_INFO_V1(plpgsql_profiler_dynamic_queries);
+PG_FUNCTION_INFO_V1(plpgsql_check_internal_stats);
+PG_FUNCTION_INFO_V1(plpgsql_profiler_collapsed_stacks);
+PG_FUNCTION_INFO_V1(plpgsql_profiler_snapshot);
+PG_FUNCTION_INFO_V1(plpgsql_profiler_delta);
+PG_FUNCTION_INFO_V1(plpgsql_check_all_tb);
 
 #define ERR_NULL_OPTION(option)		ereport(ERROR, \
 									  (errcode(ERRCODE_NULL_VALUE_NOT_ALLOWED), \
@@ -481,10 +512,14 @@ profiler_function_tb_internal(Oid fnoid, FunctionCallInfo fcinfo)
 }
 
 /*
- * Displaying a function profile
+ * Displaying a function profile per statements or critical path
+ * of function
  */
 static Datum
-profiler_function_statements_tb_internal(Oid fnoid, FunctionCallInfo fcinfo)
+profiler_function_statements_tb_internal(Oid fnoid,
+										 int format,
+										 profiler_stmt_walker_mode mode,
+										 FunctionCallInfo fcinfo)
 {
 	plpgsql_check_info		cinfo;
 	plpgsql_check_result_info ri;
@@ -509,11 +544,9 @@ profiler_function_statements_tb_internal(Oid fnoid, FunctionCallInfo fcinfo)
 
 	plpgsql_check_precheck_conditions(&cinfo);
 
-	plpgsql_check_init_ri(&ri, PLPGSQL_SHOW_PROFILE_STATEMENTS_TABULAR, rsinfo);
+	plpgsql_check_init_ri(&ri, format, rsinfo);
 
-	plpgsql_check_iterate_over_profile(&cinfo,
-									   PLPGSQL_CHECK_STMT_WALKER_PREPARE_RESULT,
-									   &ri, NULL);
+	plpgsql_check_iterate_over_profile(&cinfo, mode, &ri, NULL);
 
 	plpgsql_check_finalize_ri(&ri);
 
@@ -587,7 +620,10 @@ plpgsql_profiler_function_statements_tb(PG_FUNCTION_ARGS)
 
 	fnoid = PG_GETARG_OID(0);
 
-	return profiler_function_statements_tb_internal(fnoid, fcinfo);
+	return profiler_function_statements_tb_internal(fnoid,
+													PLPGSQL_SHOW_PROFILE_STATEMENTS_TABULAR,
+													PLPGSQL_CHECK_STMT_WALKER_PREPARE_RESULT,
+													fcinfo);
 }
 
 Datum
@@ -662,14 +698,58 @@ plpgsql_profiler_function_statements_tb_name(PG_FUNCTION_ARGS)
 	name_or_signature = text_to_cstring(PG_GETARG_TEXT_PP(0));
 	fnoid = plpgsql_check_parse_name_or_signature(name_or_signature);
 
-	return profiler_function_statements_tb_internal(fnoid, fcinfo);
+	return profiler_function_statements_tb_internal(fnoid,
+													PLPGSQL_SHOW_PROFILE_STATEMENTS_TABULAR,
+													PLPGSQL_CHECK_STMT_WALKER_PREPARE_RESULT,
+													fcinfo);
+}
+
+Datum
+plpgsql_profiler_critical_path(PG_FUNCTION_ARGS)
+{
+	Oid fnoid;
+
+	if (PG_ARGISNULL(0))
+		ERR_NULL_OPTION("funcoid");
+
+	fnoid = PG_GETARG_OID(0);
+
+	return profiler_function_statements_tb_internal(fnoid,
+													PLPGSQL_SHOW_PROFILE_CRITICAL_PATH_TABULAR,
+													PLPGSQL_CHECK_STMT_WALKER_CRITICAL_PATH,
+													fcinfo);
+}
+
+Datum
+plpgsql_profiler_critical_path_name(PG_FUNCTION_ARGS)
+{
+	Oid		fnoid;
+	char   *name_or_signature;
+
+	if (PG_ARGISNULL(0))
+		ERR_NULL_OPTION("name");
+
+	name_or_signature = text_to_cstring(PG_GETARG_TEXT_PP(0));
+	fnoid = plpgsql_check_parse_name_or_signature(name_or_signature);
+
+	return profiler_function_statements_tb_internal(fnoid,
+													PLPGSQL_SHOW_PROFILE_CRITICAL_PATH_TABULAR,
+													PLPGSQL_CHECK_STMT_WALKER_CRITICAL_PATH,
+													fcinfo);
 }
 
+/*
+ * Displays statistics of all profiled functions. Only oids of functions
+ * are collected under lock, and the statistics are read per function.
+ */
 Datum
 plpgsql_profiler_functions_all_tb(PG_FUNCTION_ARGS)
 {
 	plpgsql_check_result_info ri;
 	ReturnSetInfo *rsinfo;
+	Oid		   *funcoids;
+	int			nfuncs;
+	int			i;
 
 	/* check to see if caller supports us returning a tuplestore */
 	rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
@@ -677,7 +757,451 @@ plpgsql_profiler_functions_all_tb(PG_FUNCTION_ARGS)
 
 	plpgsql_check_init_ri(&ri, PLPGSQL_SHOW_PROFILE_FUNCTIONS_ALL_TABULAR, rsinfo);
 
-	plpgsql_check_profiler_iterate_over_all_profiles(&ri);
+	funcoids = plpgsql_check_profiler_get_all_functions(&nfuncs);
+
+	for (i = 0; i < nfuncs; i++)
+		plpgsql_check_profiler_put_function_stats(&ri, funcoids[i]);
+
+	pfree(funcoids);
+
+	return (Datum) 0;
+}
+
+/*
+ * Displays call stacks of profiled functions
+ */
+Datum
+plpgsql_profiler_call_stacks_tb(PG_FUNCTION_ARGS)
+{
+	plpgsql_check_result_info ri;
+	ReturnSetInfo *rsinfo;
+
+	/* check to see if caller supports us returning a tuplestore */
+	rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	SetReturningFunctionCheck(rsinfo);
+
+	plpgsql_check_init_ri(&ri, PLPGSQL_SHOW_PROFILE_CALL_STACKS_TABULAR, rsinfo);
+
+	plpgsql_check_profiler_iterate_over_all_stacks(&ri);
+
+	return (Datum) 0;
+}
+
+/*
+ * Displays call stacks of profiled functions in collapsed format,
+ * that can be used by flamegraph tools.
+ */
+Datum
+plpgsql_profiler_collapsed_stacks(PG_FUNCTION_ARGS)
+{
+	plpgsql_check_result_info ri;
+	ReturnSetInfo *rsinfo;
+
+	/* check to see if caller supports us returning a tuplestore */
+	rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	SetReturningFunctionCheck(rsinfo);
+
+	plpgsql_check_init_ri(&ri, PLPGSQL_SHOW_PROFILE_COLLAPSED_STACKS, rsinfo);
+
+	plpgsql_check_profiler_iterate_over_all_stacks(&ri);
+
+	return (Datum) 0;
+}
+
+/*
+ * Displays counters of queries of dynamic statements
+ */
+Datum
+plpgsql_profiler_dynamic_queries(PG_FUNCTION_ARGS)
+{
+	plpgsql_check_result_info ri;
+	ReturnSetInfo *rsinfo;
+
+	/* check to see if caller supports us returning a tuplestore */
+	rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	SetReturningFunctionCheck(rsinfo);
+
+	plpgsql_check_init_ri(&ri, PLPGSQL_SHOW_PROFILE_DYNAMIC_QUERIES_TABULAR, rsinfo);
+
+	plpgsql_check_profiler_iterate_dynamic_queries(&ri);
+
+	return (Datum) 0;
+}
+
+/*
+ * Displays counters of own overhead of plpgsql_check
+ */
+Datum
+plpgsql_check_internal_stats(PG_FUNCTION_ARGS)
+{
+	plpgsql_check_result_info ri;
+	ReturnSetInfo *rsinfo;
+
+	/* check to see if caller supports us returning a tuplestore */
+	rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	SetReturningFunctionCheck(rsinfo);
+
+	plpgsql_check_init_ri(&ri, PLPGSQL_SHOW_INTERNAL_STATS_TABULAR, rsinfo);
+
+	plpgsql_check_profiler_iterate_internal_stats(&ri);
+
+	return (Datum) 0;
+}
+
+/*
+ * Displays cumulative counters of profiled functions and statements
+ */
+Datum
+plpgsql_profiler_snapshot(PG_FUNCTION_ARGS)
+{
+	plpgsql_check_result_info ri;
+	ReturnSetInfo *rsinfo;
+
+	/* check to see if caller supports us returning a tuplestore */
+	rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	SetReturningFunctionCheck(rsinfo);
+
+	plpgsql_check_init_ri(&ri, PLPGSQL_SHOW_PROFILE_SNAPSHOT_TABULAR, rsinfo);
+
+	plpgsql_check_profiler_iterate_snapshot(&ri);
+
+	return (Datum) 0;
+}
+
+/*
+ * Displays deltas of counters of profiled functions and statements
+ * from last read of consumer.
+ */
+Datum
+plpgsql_profiler_delta(PG_FUNCTION_ARGS)
+{
+	plpgsql_check_result_info ri;
+	ReturnSetInfo *rsinfo;
+
+	/* check to see if caller supports us returning a tuplestore */
+	rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	SetReturningFunctionCheck(rsinfo);
+
+	plpgsql_check_init_ri(&ri, PLPGSQL_SHOW_PROFILE_SNAPSHOT_TABULAR, rsinfo);
+
+	plpgsql_check_profiler_iterate_delta(&ri, PG_GETARG_TEXT_PP(0));
+
+	return (Datum) 0;
+}
+
+static int
+check_all_item_cmp(const void *a, const void *b)
+{
+	const check_all_item *ia = (const check_all_item *) a;
+	const check_all_item *ib = (const check_all_item *) b;
+
+	if (ia->fn_oid != ib->fn_oid)
+		return ia->fn_oid < ib->fn_oid ? -1 : 1;
+	if (ia->relid != ib->relid)
+		return ia->relid < ib->relid ? -1 : 1;
+
+	return 0;
+}
+
+static int
+oid_bsearch_cmp(const void *a, const void *b)
+{
+	Oid			oa = *((const Oid *) a);
+	Oid			ob = *((const Oid *) b);
+
+	if (oa == ob)
+		return 0;
+
+	return oa < ob ? -1 : 1;
+}
+
+/*
+ * Returns array of items (functions and trigger relations) that should
+ * be checked by plpgsql_check_all. Only functions from the selected shard
+ * are returned. DML trigger functions are checked against every relation
+ * that uses them, unused trigger functions are ignored (there is not
+ * possible to check them without relation).
+ */
+static check_all_item *
+get_check_all_items(Oid nspoid, int nshards, int shard, int *nitems)
+{
+	Oid			plpgsql_langid;
+	Relation	rel;
+	SysScanDesc scandesc;
+	HeapTuple	tuple;
+	check_all_item *items;
+	int			items_size = 64;
+	Oid		   *trgfuncs;
+	int			trgfuncs_size = 16;
+	int			ntrgfuncs = 0;
+
+	plpgsql_langid = get_language_oid("plpgsql", false);
+
+	items = palloc(items_size * sizeof(check_all_item));
+	trgfuncs = palloc(trgfuncs_size * sizeof(Oid));
+	*nitems = 0;
+
+	rel = table_open(ProcedureRelationId, AccessShareLock);
+	scandesc = systable_beginscan(rel, InvalidOid, false, NULL, 0, NULL);
+
+	while (HeapTupleIsValid(tuple = systable_getnext(scandesc)))
+	{
+		Form_pg_proc proc = (Form_pg_proc) GETSTRUCT(tuple);
+		Oid			fn_oid = proc->oid;
+
+		if (proc->prolang != plpgsql_langid)
+			continue;
+
+		if (OidIsValid(nspoid))
+		{
+			if (proc->pronamespace != nspoid)
+				continue;
+		}
+		else if (proc->pronamespace == PG_CATALOG_NAMESPACE)
+			continue;
+
+		if (fn_oid % nshards != (Oid) shard)
+			continue;
+
+		if (proc->prorettype == TRIGGEROID
+
+#if PG_VERSION_NUM < 130000
+
+			|| (proc->prorettype == OPAQUEOID && proc->pronargs == 0)
+
+#endif
+
+			)
+		{
+			if (ntrgfuncs >= trgfuncs_size)
+			{
+				trgfuncs_size *= 2;
+				trgfuncs = repalloc(trgfuncs, trgfuncs_size * sizeof(Oid));
+			}
+
+			trgfuncs[ntrgfuncs++] = fn_oid;
+			continue;
+		}
+
+		if (*nitems >= items_size)
+		{
+			items_size *= 2;
+			items = repalloc(items, items_size * sizeof(check_all_item));
+		}
+
+		items[*nitems].fn_oid = fn_oid;
+		items[*nitems].relid = InvalidOid;
+		items[*nitems].oldtable = NULL;
+		items[*nitems].newtable = NULL;
+		(*nitems)++;
+	}
+
+	systable_endscan(scandesc);
+	table_close(rel, AccessShareLock);
+
+	if (ntrgfuncs > 0)
+	{
+		qsort(trgfuncs, ntrgfuncs, sizeof(Oid), oid_bsearch_cmp);
+
+		rel = table_open(TriggerRelationId, AccessShareLock);
+		scandesc = systable_beginscan(rel, InvalidOid, false, NULL, 0, NULL);
+
+		while (HeapTupleIsValid(tuple = systable_getnext(scandesc)))
+		{
+			Form_pg_trigger trg = (Form_pg_trigger) GETSTRUCT(tuple);
+			Datum		value;
+			bool		isnull;
+
+			if (!bsearch(&trg->tgfoid, trgfuncs, ntrgfuncs, sizeof(Oid), oid_bsearch_cmp))
+				continue;
+
+			if (*nitems >= items_size)
+			{
+				items_size *= 2;
+				items = repalloc(items, items_size * sizeof(check_all_item));
+			}
+
+			items[*nitems].fn_oid = trg->tgfoid;
+			items[*nitems].relid = trg->tgrelid;
+
+			value = heap_getattr(tuple, Anum_pg_trigger_tgoldtable,
+								 RelationGetDescr(rel), &isnull);
+			items[*nitems].oldtable = !isnull ? pstrdup(NameStr(*DatumGetName(value))) : NULL;
+
+			value = heap_getattr(tuple, Anum_pg_trigger_tgnewtable,
+								 RelationGetDescr(rel), &isnull);
+			items[*nitems].newtable = !isnull ? pstrdup(NameStr(*DatumGetName(value))) : NULL;
+
+			(*nitems)++;
+		}
+
+		systable_endscan(scandesc);
+		table_close(rel, AccessShareLock);
+	}
+
+	pfree(trgfuncs);
+
+	/* stable order of results */
+	qsort(items, *nitems, sizeof(check_all_item), check_all_item_cmp);
+
+	return items;
+}
+
+/*
+ * plpgsql_check_all_tb
+ *
+ * Check all plpgsql functions of schema (or of all schemas except pg_catalog)
+ * and returns result as multicolumn table. The set of functions can be
+ * divided to nshards disjunct parts, so more connections can check the
+ * database in parallel.
+ */
+Datum
+plpgsql_check_all_tb(PG_FUNCTION_ARGS)
+{
+	plpgsql_check_result_info ri;
+	ReturnSetInfo *rsinfo;
+	ErrorContextCallback *prev_errorcontext;
+	MemoryContext check_all_cxt;
+	MemoryContext oldcxt;
+	check_all_item *items;
+	Oid			nspoid = InvalidOid;
+	int			nitems;
+	int			nshards;
+	int			shard;
+	int			i;
+
+	plpgsql_check_check_ext_version(fcinfo->flinfo->fn_oid);
+
+	Assert(PG_NARGS() == 14);
+
+	/* check to see if caller supports us returning a tuplestore */
+	rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	SetReturningFunctionCheck(rsinfo);
+
+	if (PG_ARGISNULL(1))
+		ERR_NULL_OPTION("fatal_errors");
+	if (PG_ARGISNULL(2))
+		ERR_NULL_OPTION("other_warnings");
+	if (PG_ARGISNULL(3))
+		ERR_NULL_OPTION("performance_warnings");
+	if (PG_ARGISNULL(4))
+		ERR_NULL_OPTION("extra_warnings");
+	if (PG_ARGISNULL(5))
+		ERR_NULL_OPTION("security_warnings");
+	if (PG_ARGISNULL(6))
+		ERR_NULL_OPTION("compatibility_warnings");
+	if (PG_ARGISNULL(7))
+		ERR_NULL_OPTION("without_warnings");
+	if (PG_ARGISNULL(8))
+		ERR_NULL_OPTION("all_warnings");
+	if (PG_ARGISNULL(9))
+		ERR_NULL_OPTION("use_incomment_options");
+	if (PG_ARGISNULL(10))
+		ERR_NULL_OPTION("incomment_options_usage_warning");
+	if (PG_ARGISNULL(11))
+		ERR_NULL_OPTION("constants_tracing");
+	if (PG_ARGISNULL(12))
+		ERR_NULL_OPTION("nshards");
+	if (PG_ARGISNULL(13))
+		ERR_NULL_OPTION("shard");
+
+	if (PG_GETARG_BOOL(7) && PG_GETARG_BOOL(8))
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("without_warnings and all_warnings cannot be true same time")));
+
+	nshards = PG_GETARG_INT32(12);
+	shard = PG_GETARG_INT32(13);
+
+	if (nshards < 1)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("nshards should be greater than zero")));
+
+	if (shard < 0 || shard >= nshards)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("shard should be between 0 and %d", nshards - 1)));
+
+	if (!PG_ARGISNULL(0))
+		nspoid = get_namespace_oid(NameStr(*(PG_GETARG_NAME(0))), false);
+
+	items = get_check_all_items(nspoid, nshards, shard, &nitems);
+
+	/* Envelope outer plpgsql function is not interesting */
+	prev_errorcontext = error_context_stack;
+	error_context_stack = NULL;
+
+	plpgsql_check_init_ri(&ri, PLPGSQL_CHECK_FORMAT_TABULAR, rsinfo);
+
+	check_all_cxt = AllocSetContextCreate(CurrentMemoryContext,
+										  "plpgsql_check_all context",
+										  ALLOCSET_DEFAULT_SIZES);
+
+	for (i = 0; i < nitems; i++)
+	{
+		plpgsql_check_info cinfo;
+
+		CHECK_FOR_INTERRUPTS();
+
+		oldcxt = MemoryContextSwitchTo(check_all_cxt);
+
+		plpgsql_check_info_init(&cinfo, items[i].fn_oid);
+
+		cinfo.proctuple = SearchSysCache1(PROCOID, ObjectIdGetDatum(cinfo.fn_oid));
+
+		/* function can be dropped concurrently */
+		if (!HeapTupleIsValid(cinfo.proctuple))
+		{
+			MemoryContextSwitchTo(oldcxt);
+			continue;
+		}
+
+		cinfo.relid = items[i].relid;
+		cinfo.oldtable = items[i].oldtable;
+		cinfo.newtable = items[i].newtable;
+
+		cinfo.fatal_errors = PG_GETARG_BOOL(1);
+		cinfo.other_warnings = PG_GETARG_BOOL(2);
+		cinfo.performance_warnings = PG_GETARG_BOOL(3);
+		cinfo.extra_warnings = PG_GETARG_BOOL(4);
+		cinfo.security_warnings = PG_GETARG_BOOL(5);
+		cinfo.compatibility_warnings = PG_GETARG_BOOL(6);
+
+		cinfo.incomment_options_usage_warning = PG_GETARG_BOOL(10);
+		cinfo.constants_tracing = PG_GETARG_BOOL(11);
+
+		if (PG_GETARG_BOOL(7))
+			plpgsql_check_set_without_warnings(&cinfo);
+		else if (PG_GETARG_BOOL(8))
+			plpgsql_check_set_all_warnings(&cinfo);
+
+		/* same defaults like plpgsql_check_function_tb */
+		cinfo.anyelementoid = INT4OID;
+		cinfo.anyenumoid = InvalidOid;
+		cinfo.anyrangeoid = INT4RANGEOID;
+		cinfo.anycompatibleoid = INT4OID;
+		cinfo.anycompatiblerangeoid = INT4RANGEOID;
+
+		plpgsql_check_get_function_info(&cinfo);
+		plpgsql_check_precheck_conditions(&cinfo);
+
+		if (PG_GETARG_BOOL(9))
+			plpgsql_check_search_comment_options(&cinfo);
+
+		plpgsql_check_function_internal(&ri, &cinfo);
+
+		ReleaseSysCache(cinfo.proctuple);
+
+		MemoryContextSwitchTo(oldcxt);
+		MemoryContextReset(check_all_cxt);
+	}
+
+	plpgsql_check_finalize_ri(&ri);
+
+	MemoryContextDelete(check_all_cxt);
+
+	error_context_stack = prev_errorcontext;
 
 	return (Datum) 0;
 }
@@ -12,14 +12,37 @@
 #include "plpgsql_check.h"
 #include "plpgsql_check_builtins.h"
 
+#include "access/tupmacs.h"
+#include "catalog/pg_proc.h"
 #include "catalog/pg_type.h"
+#include "funcapi.h"
+#include "miscadmin.h"
 #include "mb/pg_wchar.h"
+#include "parser/scansup.h"
+#include "storage/lwlock.h"
 #include "storage/proc.h"
+#include "storage/shmem.h"
+#include "utils/array.h"
 #include "utils/builtins.h"
+#include "utils/expandeddatum.h"
+#include "utils/fmgroids.h"
 #include "utils/guc.h"
 #include "utils/lsyscache.h"
 #include "utils/memutils.h"
 #include "utils/syscache.h"
+#include "utils/timestamp.h"
+#include "utils/varlena.h"
+
+#if PG_VERSION_NUM >= 130000
+
+#include "common/hashfn.h"
+
+#else
+
+#include "access/hash.h"
+#include "utils/hashutils.h"
+
+#endif
 
 bool plpgsql_check_enable_tracer = false;
 bool plpgsql_check_tracer = false;
@@ -35,11 +58,68 @@ PGErrorVerbosity plpgsql_check_trace_assert_verbosity = PGERROR_DEFAULT;
 int plpgsql_check_tracer_errlevel = NOTICE;
 int plpgsql_check_tracer_variable_max_length = 1024;
 
-static void print_datum(PLpgSQL_execstate *estate, PLpgSQL_datum *dtm, char *frame, int level);
-static char *convert_plpgsql_datum_to_string(PLpgSQL_execstate *estate, PLpgSQL_datum *dtm, bool *isnull, char **refname);
+int plpgsql_check_tracer_output = PLPGSQL_CHECK_TRACER_OUTPUT_NOTICE;
+int plpgsql_check_tracer_buffer_size = 1024;
+
+char *plpgsql_check_tracer_functions = NULL;
+char *plpgsql_check_tracer_lines = NULL;
+int plpgsql_check_tracer_stmt_min_duration = 0;
+
+/*
+ * When plpgsql_check.tracer_output is "buffer", then tracer's messages
+ * are not raised, but they are stored to ring buffer. The buffer is in
+ * shared memory (when plpgsql_check is loaded by shared_preload_libraries)
+ * or in session memory, and it is read by plpgsql_check_tracer_messages().
+ * When the buffer is full, then the oldest messages are overwritten.
+ *
+ * Records are not divided on the end of buffer. When there is not enough
+ * space to the end of buffer, then the rest of buffer is filled by padding
+ * record (with zero pid). Removed records have zero pid too.
+ */
+typedef struct tracer_buffer_record
+{
+	uint32		len;			/* MAXALIGNed size of record */
+	int			pid;
+	Oid			roleid;
+	uint64		seqno;
+	TimestampTz time;
+	char		message[FLEXIBLE_ARRAY_MEMBER];
+} tracer_buffer_record;
+
+typedef struct tracer_buffer
+{
+	LWLock	   *lock;			/* NULL for buffer in session memory */
+	Size		size;			/* size of data */
+	uint64		head;			/* position of next record */
+	uint64		tail;			/* position of oldest record */
+	uint64		seqno;
+	uint64		dropped;		/* number of overwritten records */
+} tracer_buffer;
+
+#define TRACER_BUFFER_DATA(buf)			(((char *) (buf)) + MAXALIGN(sizeof(tracer_buffer)))
+#define TRACER_BUFFER_RECORD(buf, pos)	((tracer_buffer_record *) (TRACER_BUFFER_DATA(buf) + (pos) % (buf)->size))
+
+static tracer_buffer *shared_tracer_buffer = NULL;
+static tracer_buffer *local_tracer_buffer = NULL;
+
+static void tracer_buffer_printf(const char *fmt,...) pg_attribute_printf(1, 2);
+
+/*
+ * Raise tracer's message or store it to tracer's buffer
+ */
+#define tracer_elog(...) \
+	do { \
+		if (plpgsql_check_tracer_output == PLPGSQL_CHECK_TRACER_OUTPUT_BUFFER) \
+			tracer_buffer_printf(__VA_ARGS__); \
+		else \
+			elog(plpgsql_check_tracer_errlevel, __VA_ARGS__); \
+	} while (0)
+
 
 
 PG_FUNCTION_INFO_V1(plpgsql_check_tracer_ctrl);
+PG_FUNCTION_INFO_V1(plpgsql_check_tracer_messages);
+PG_FUNCTION_INFO_V1(plpgsql_check_tracer_messages_reset);
 
 #if PG_VERSION_NUM >= 140000
 
@@ -66,8 +146,99 @@ typedef struct tracer_info
 
 	/* true when function is traced from func_beg */
 	bool		is_traced;
+
+	/* compiled filter of traced statements, NULL when filter is not used */
+	struct tracer_func_filter *filter;
+
+	/* last printed values of variables (indexed by dno) */
+	struct tracer_value_cache *value_cache;
+	int			nvalue_cache;
+	MemoryContext mcxt;
 } tracer_info;
 
+/*
+ * Full serialization of large value can be much more expensive than
+ * execution of traced statement. Only prefix of string value is
+ * displayed, so the types, that allows it, are formatted by special
+ * printers, that process only necessary part of value. The values of
+ * other types are formatted by type's output function, and then the
+ * result is cached, so unchanged value is not serialized again.
+ */
+typedef enum
+{
+	TRACER_PRINTER_OUTPUT,		/* type's output function */
+	TRACER_PRINTER_TEXT,		/* text, varchar, bpchar, json */
+	TRACER_PRINTER_BYTEA,
+	TRACER_PRINTER_ARRAY
+} tracer_printer;
+
+/*
+ * The cached result is identified by type, size and hash of raw value.
+ * Toasted values are hashed in raw form, so for values stored externally,
+ * only the toast pointers are compared.
+ */
+typedef struct tracer_value_cache
+{
+	Oid			typoid;
+	uint32		rawsize;
+	uint64		hashval;
+	char	   *str;			/* NULL when entry is not valid */
+} tracer_value_cache;
+
+/*
+ * Size of detoasted prefix of array, that should be enough for printing.
+ * The output of element of usual types is not shorter than quarter of
+ * its binary size (with delimiter). When it is not enough, then all
+ * array is detoasted.
+ */
+#define TRACER_ARRAY_PREFIX_SIZE(limit)		((limit) * 4)
+
+/*
+ * The tracer can be limited to some functions (plpgsql_check.tracer_functions)
+ * and to some lines (plpgsql_check.tracer_lines). The values of these
+ * options are parsed by check hooks, and then they are compiled for any
+ * version of function to bitmap of traced statements. This bitmap is
+ * stored in session cache of function, so statements, that should not
+ * be traced, are skipped without any string operation.
+ */
+typedef struct tracer_functions_filter
+{
+	int			nnames;
+	char		names[FLEXIBLE_ARRAY_MEMBER];	/* zero terminated strings */
+} tracer_functions_filter;
+
+typedef struct tracer_lines_range
+{
+	int			first_lineno;
+	int			last_lineno;
+} tracer_lines_range;
+
+typedef struct tracer_lines_filter
+{
+	int			nranges;
+	tracer_lines_range ranges[FLEXIBLE_ARRAY_MEMBER];
+} tracer_lines_filter;
+
+typedef struct tracer_func_filter
+{
+	uint32		generation;
+	bool		is_traced;		/* false, when function is filtered out */
+	int			nstatements;
+	bits8		stmts[FLEXIBLE_ARRAY_MEMBER];	/* bitmap of traced statements */
+} tracer_func_filter;
+
+#define TRACER_FILTER_IS_TRACED_STMT(filter, stmtid) \
+	(((filter)->stmts[((stmtid) - 1) / BITS_PER_BYTE] & (1 << (((stmtid) - 1) % BITS_PER_BYTE))) != 0)
+
+static tracer_functions_filter *functions_filter = NULL;
+static tracer_lines_filter *lines_filter = NULL;
+
+/* it is increased when some filter is changed */
+static uint32 tracer_filter_generation = 0;
+
+static void print_datum(PLpgSQL_execstate *estate, PLpgSQL_datum *dtm, char *frame, int level, tracer_info *tinfo);
+static char *convert_plpgsql_datum_to_string(PLpgSQL_execstate *estate, PLpgSQL_datum *dtm, bool *isnull, char **refname, tracer_info *tinfo);
+
 static void trace_assert(PLpgSQL_execstate *estate, PLpgSQL_stmt *stmt, tracer_info *tinfo);
 
 static void tracer_func_setup(PLpgSQL_execstate *estate, PLpgSQL_function *func, void **plugin2_info);
@@ -84,26 +255,810 @@ static plpgsql_check_plugin2 tracer_plugin2 = { tracer_func_setup,
 												NULL, NULL, NULL, NULL, NULL };
 
 /*
- * Convert binary value to text
+ * Parse list of traced functions. The function can be specified by name,
+ * by qualified name or by oid.
+ */
+bool
+plpgsql_check_tracer_functions_check_hook(char **newval, void **extra, GucSource source)
+{
+	tracer_functions_filter *filter;
+	char	   *rawstring;
+	List	   *elemlist;
+	ListCell   *lc;
+	Size		size;
+	char	   *ptr;
+
+	(void) source;
+
+	if (!*newval || !**newval)
+	{
+		*extra = NULL;
+		return true;
+	}
+
+	rawstring = pstrdup(*newval);
+
+	if (!SplitIdentifierString(rawstring, ',', &elemlist))
+	{
+		GUC_check_errdetail("List syntax is invalid.");
+		pfree(rawstring);
+		list_free(elemlist);
+		return false;
+	}
+
+	size = offsetof(tracer_functions_filter, names);
+	foreach(lc, elemlist)
+		size += strlen((char *) lfirst(lc)) + 1;
+
+	filter = malloc(size);
+	if (!filter)
+	{
+		GUC_check_errcode(ERRCODE_OUT_OF_MEMORY);
+		pfree(rawstring);
+		list_free(elemlist);
+		return false;
+	}
+
+	filter->nnames = list_length(elemlist);
+
+	ptr = filter->names;
+	foreach(lc, elemlist)
+	{
+		strcpy(ptr, (char *) lfirst(lc));
+		ptr += strlen(ptr) + 1;
+	}
+
+	pfree(rawstring);
+	list_free(elemlist);
+
+	*extra = filter;
+
+	return true;
+}
+
+void
+plpgsql_check_tracer_functions_assign_hook(const char *newval, void *extra)
+{
+	(void) newval;
+
+	functions_filter = (tracer_functions_filter *) extra;
+	tracer_filter_generation += 1;
+}
+
+/*
+ * Parse list of traced lines. The items of list are line numbers
+ * or ranges of line numbers like 10-20.
+ */
+bool
+plpgsql_check_tracer_lines_check_hook(char **newval, void **extra, GucSource source)
+{
+	tracer_lines_filter *filter;
+	const char *ptr;
+	int			maxranges = 1;
+
+	(void) source;
+
+	if (!*newval || !**newval)
+	{
+		*extra = NULL;
+		return true;
+	}
+
+	for (ptr = *newval; *ptr; ptr++)
+		if (*ptr == ',')
+			maxranges += 1;
+
+	filter = malloc(offsetof(tracer_lines_filter, ranges) +
+					maxranges * sizeof(tracer_lines_range));
+	if (!filter)
+	{
+		GUC_check_errcode(ERRCODE_OUT_OF_MEMORY);
+		return false;
+	}
+
+	filter->nranges = 0;
+
+	ptr = *newval;
+	for (;;)
+	{
+		long		first_lineno;
+		long		last_lineno;
+		char	   *endptr;
+
+		while (scanner_isspace(*ptr))
+			ptr++;
+
+		if (*ptr == '\0')
+			break;
+
+		first_lineno = strtol(ptr, &endptr, 10);
+		if (endptr == ptr || first_lineno < 1 || first_lineno > INT_MAX)
+			goto syntax_error;
+
+		ptr = endptr;
+		while (scanner_isspace(*ptr))
+			ptr++;
+
+		if (*ptr == '-')
+		{
+			ptr++;
+
+			last_lineno = strtol(ptr, &endptr, 10);
+			if (endptr == ptr || last_lineno < first_lineno || last_lineno > INT_MAX)
+				goto syntax_error;
+
+			ptr = endptr;
+			while (scanner_isspace(*ptr))
+				ptr++;
+		}
+		else
+			last_lineno = first_lineno;
+
+		filter->ranges[filter->nranges].first_lineno = (int) first_lineno;
+		filter->ranges[filter->nranges].last_lineno = (int) last_lineno;
+		filter->nranges += 1;
+
+		if (*ptr == ',')
+			ptr++;
+		else if (*ptr != '\0')
+			goto syntax_error;
+	}
+
+	if (filter->nranges == 0)
+	{
+		free(filter);
+		filter = NULL;
+	}
+
+	*extra = filter;
+
+	return true;
+
+syntax_error:
+	GUC_check_errdetail("List of line numbers or ranges of line numbers (like 10-20) is expected.");
+	free(filter);
+
+	return false;
+}
+
+void
+plpgsql_check_tracer_lines_assign_hook(const char *newval, void *extra)
+{
+	(void) newval;
+
+	lines_filter = (tracer_lines_filter *) extra;
+	tracer_filter_generation += 1;
+}
+
+static bool
+is_traced_function(PLpgSQL_function *func)
+{
+	HeapTuple	tp;
+	Form_pg_proc procform;
+	char	   *nspname;
+	char		oidbuf[12];
+	const char *name;
+	bool		result = false;
+	int			i;
+
+	if (!functions_filter)
+		return true;
+
+	/* inline blocks has not name */
+	if (!OidIsValid(func->fn_oid))
+		return false;
+
+	tp = SearchSysCache1(PROCOID, ObjectIdGetDatum(func->fn_oid));
+	if (!HeapTupleIsValid(tp))
+		elog(ERROR, "cache lookup failed for function %u", func->fn_oid);
+
+	procform = (Form_pg_proc) GETSTRUCT(tp);
+	nspname = get_namespace_name(procform->pronamespace);
+
+	snprintf(oidbuf, sizeof(oidbuf), "%u", func->fn_oid);
+
+	name = functions_filter->names;
+	for (i = 0; i < functions_filter->nnames; i++)
+	{
+		const char *dot = strchr(name, '.');
+
+		if (dot)
+		{
+			if (nspname &&
+				strlen(nspname) == (size_t) (dot - name) &&
+				strncmp(name, nspname, dot - name) == 0 &&
+				strcmp(dot + 1, NameStr(procform->proname)) == 0)
+				result = true;
+		}
+		else if (strcmp(name, NameStr(procform->proname)) == 0 ||
+				 strcmp(name, oidbuf) == 0)
+			result = true;
+
+		if (result)
+			break;
+
+		name += strlen(name) + 1;
+	}
+
+	ReleaseSysCache(tp);
+
+	return result;
+}
+
+static bool
+is_traced_line(int lineno)
+{
+	int			i;
+
+	if (!lines_filter)
+		return true;
+
+	for (i = 0; i < lines_filter->nranges; i++)
+	{
+		if (lineno >= lines_filter->ranges[i].first_lineno &&
+			lineno <= lines_filter->ranges[i].last_lineno)
+			return true;
+	}
+
+	return false;
+}
+
+/*
+ * Returns compiled filter for current version of function. Returns
+ * NULL, when filter is not used.
+ */
+static tracer_func_filter *
+get_func_filter(PLpgSQL_function *func)
+{
+	tracer_func_filter *filter;
+	plpgsql_check_plugin2_stmt_info *stmts_info;
+	void	  **fcache_ptr;
+	Size		size;
+	int			i;
+
+	if (!functions_filter && !lines_filter)
+		return NULL;
+
+	size = offsetof(tracer_func_filter, stmts) +
+		(func->nstatements + BITS_PER_BYTE - 1) / BITS_PER_BYTE;
+
+	fcache_ptr = plpgsql_check_get_current_func_info_plugin2_data(&tracer_plugin2);
+	if (fcache_ptr)
+	{
+		filter = *fcache_ptr;
+
+		/*
+		 * The outdated filter is compiled again in place, because it can
+		 * be used by outer (recursive) call of the function.
+		 */
+		if (filter && filter->nstatements == func->nstatements)
+		{
+			if (filter->generation == tracer_filter_generation)
+				return filter;
+		}
+		else
+		{
+			filter = MemoryContextAlloc(plpgsql_check_get_func_info_mcxt(), size);
+			*fcache_ptr = filter;
+		}
+	}
+	else
+		/* metadata of inline blocks are not cached */
+		filter = palloc(size);
+
+	memset(filter, 0, size);
+
+	filter->generation = tracer_filter_generation;
+	filter->nstatements = func->nstatements;
+	filter->is_traced = is_traced_function(func);
+
+	if (filter->is_traced)
+	{
+		stmts_info = plpgsql_check_get_current_stmts_info();
+
+		for (i = 0; i < func->nstatements; i++)
+		{
+			if (is_traced_line(stmts_info[i].lineno))
+				filter->stmts[i / BITS_PER_BYTE] |= (1 << (i % BITS_PER_BYTE));
+		}
+	}
+
+	return filter;
+}
+
+/*
+ * Returns max length of displayed value. The string should be longer
+ * than plpgsql_check.tracer_variable_max_length, so callers can detect
+ * too long values.
+ */
+static int
+get_value_limit(void)
+{
+	return plpgsql_check_tracer_variable_max_length + MAX_MULTIBYTE_CHAR_LEN;
+}
+
+/*
+ * Returns copy of string trimmed to limit bytes on character boundary.
+ * The string can be a slice of value, so the last character can be
+ * incomplete.
  */
 static char *
-convert_value_to_string(PLpgSQL_execstate *estate, Datum value, Oid valtype)
+pnstrdup_clipped(const char *str, int len, int limit)
 {
-	char	   *result;
+	if (len >= limit)
+		len = pg_mbcliplen(str, len, limit);
+
+	return pnstrdup(str, len);
+}
+
+static tracer_printer
+get_tracer_printer(Oid typoutput)
+{
+	switch (typoutput)
+	{
+		case F_TEXTOUT:
+		case F_VARCHAROUT:
+		case F_BPCHAROUT:
+		case F_JSON_OUT:
+			return TRACER_PRINTER_TEXT;
+
+		case F_BYTEAOUT:
+			return TRACER_PRINTER_BYTEA;
+
+		case F_ARRAY_OUT:
+			return TRACER_PRINTER_ARRAY;
+
+		default:
+			return TRACER_PRINTER_OUTPUT;
+	}
+}
+
+static bool
+array_isspace(char ch)
+{
+	if (ch == ' ' ||
+		ch == '\t' ||
+		ch == '\n' ||
+		ch == '\r' ||
+		ch == '\v' ||
+		ch == '\f')
+		return true;
+
+	return false;
+}
+
+/*
+ * Append element of array in format of array_out
+ */
+static void
+append_array_element(StringInfo ds, const char *str, char typdelim)
+{
+	const char *ptr;
+	bool		needquote;
+
+	if (*str == '\0' || pg_strcasecmp(str, "NULL") == 0)
+		needquote = true;
+	else
+	{
+		needquote = false;
+
+		for (ptr = str; *ptr; ptr++)
+		{
+			char		ch = *ptr;
+
+			if (ch == '"' || ch == '\\' ||
+				ch == '{' || ch == '}' || ch == typdelim ||
+				array_isspace(ch))
+			{
+				needquote = true;
+				break;
+			}
+		}
+	}
+
+	if (!needquote)
+	{
+		appendStringInfoString(ds, str);
+		return;
+	}
+
+	appendStringInfoChar(ds, '"');
+
+	for (ptr = str; *ptr; ptr++)
+	{
+		if (*ptr == '"' || *ptr == '\\')
+			appendStringInfoChar(ds, '\\');
+
+		appendStringInfoChar(ds, *ptr);
+	}
+
+	appendStringInfoChar(ds, '"');
+}
+
+/*
+ * Returns one dimensional array detoasted from prefix of toasted value.
+ * The number of elements is reduced to the elements, that are complete
+ * in this prefix. Returns NULL for other arrays.
+ */
+static ArrayType *
+get_array_prefix(Datum value, int32 nbytes, bool *is_truncated)
+{
+	ArrayType  *arr;
+	int32		slicesize;
+	int16		typlen;
+	bool		typbyval;
+	char		typalign;
+	bits8	   *bitmap;
+	char	   *ptr;
+	char	   *endptr;
+	int			nitems;
+	int			nvalid = 0;
+
+	/* header of one dimensional array */
+	arr = (ArrayType *) PG_DETOAST_DATUM_SLICE(value, 0,
+											   ARR_OVERHEAD_NONULLS(1) - VARHDRSZ);
+
+	if (VARSIZE(arr) < ARR_OVERHEAD_NONULLS(1) || ARR_NDIM(arr) != 1)
+	{
+		pfree(arr);
+		return NULL;
+	}
+
+	/* the null bitmap is before data, so it is detoasted too */
+	slicesize = ARR_DATA_OFFSET(arr) - VARHDRSZ + nbytes;
+
+	pfree(arr);
+
+	arr = (ArrayType *) PG_DETOAST_DATUM_SLICE(value, 0, slicesize);
+
+	nitems = ARR_DIMS(arr)[0];
+
+	if (VARSIZE(arr) - VARHDRSZ < slicesize)
+	{
+		/* the array is not longer than slice */
+		*is_truncated = false;
+		return arr;
+	}
+
+	get_typlenbyvalalign(ARR_ELEMTYPE(arr), &typlen, &typbyval, &typalign);
+
+	bitmap = ARR_NULLBITMAP(arr);
+	ptr = ARR_DATA_PTR(arr);
+	endptr = (char *) arr + VARSIZE(arr);
+
+	while (nvalid < nitems)
+	{
+		Size		len;
+
+		if (bitmap && (bitmap[nvalid / 8] & (1 << (nvalid % 8))) == 0)
+		{
+			nvalid += 1;
+			continue;
+		}
+
+		if (typlen > 0)
+			len = typlen;
+		else if (typlen == -1)
+		{
+			if (ptr >= endptr ||
+				(!VARATT_IS_1B(ptr) && ptr + VARHDRSZ > endptr))
+				break;
+
+			len = VARSIZE_ANY(ptr);
+		}
+		else
+		{
+			char	   *zeroptr = memchr(ptr, '\0', endptr - ptr);
+
+			if (!zeroptr)
+				break;
+
+			len = zeroptr - ptr + 1;
+		}
+
+		if (ptr + len > endptr)
+			break;
+
+		ptr = (char *) att_align_nominal(ptr + len, typalign);
+		nvalid += 1;
+	}
+
+	if (nvalid == 0)
+	{
+		pfree(arr);
+		return NULL;
+	}
+
+	ARR_DIMS(arr)[0] = nvalid;
+	*is_truncated = nvalid < nitems;
+
+	return arr;
+}
+
+/*
+ * Prints prefix of one dimensional array. Elements are serialized only
+ * until the result is longer than limit. Returns NULL, when the array
+ * cannot be printed by this routine. When detoast_prefix is true, then
+ * only prefix of toasted array is detoasted, and is_incomplete is set,
+ * when the elements of this prefix are not enough for full result.
+ */
+static char *
+print_array_prefix(Datum value, int limit, bool detoast_prefix, bool *is_incomplete)
+{
+	bool		is_truncated = false;
+	ArrayType  *arr = NULL;
+	Datum	   *dvalues = NULL;
+	bool	   *dnulls = NULL;
+	Oid			elemtype;
+	int			ndims;
+	int		   *lbound;
+	int			nelems;
+	int16		typlen;
+	bool		typbyval;
+	char		typalign;
+	char		typdelim;
+	Oid			typioparam;
+	Oid			typoutput;
+	FmgrInfo	flinfo;
+	StringInfoData ds;
+	ArrayIterator iterator = NULL;
+	int			i;
+
+	if (VARATT_IS_EXTERNAL_EXPANDED(DatumGetPointer(value)))
+	{
+		ExpandedArrayHeader *eah = (ExpandedArrayHeader *) DatumGetEOHP(value);
+
+		Assert(eah->ea_magic == EA_MAGIC);
+
+		if (eah->dvalues)
+		{
+			elemtype = eah->element_type;
+			ndims = eah->ndims;
+			lbound = eah->lbound;
+			nelems = eah->nelems;
+			dvalues = eah->dvalues;
+			dnulls = eah->dnulls;
+		}
+		else
+			arr = eah->fvalue;
+	}
+	else if (detoast_prefix)
+	{
+		arr = get_array_prefix(value, TRACER_ARRAY_PREFIX_SIZE(limit), &is_truncated);
+		if (!arr)
+			return NULL;
+	}
+	else
+		arr = DatumGetArrayTypeP(value);
+
+	if (arr)
+	{
+		elemtype = ARR_ELEMTYPE(arr);
+		ndims = ARR_NDIM(arr);
+		lbound = ARR_LBOUND(arr);
+		nelems = ArrayGetNItems(ndims, ARR_DIMS(arr));
+	}
+
+	/* only simple arrays, others use array_out */
+	if (ndims != 1 || lbound[0] != 1)
+		return NULL;
+
+	get_type_io_data(elemtype, IOFunc_output,
+					 &typlen, &typbyval, &typalign,
+					 &typdelim, &typioparam, &typoutput);
+
+	fmgr_info(typoutput, &flinfo);
+
+	if (arr)
+		iterator = array_create_iterator(arr, 0, NULL);
+
+	initStringInfo(&ds);
+	appendStringInfoChar(&ds, '{');
+
+	for (i = 0; i < nelems && ds.len <= limit; i++)
+	{
+		Datum		elem;
+		bool		isnull;
+
+		if (iterator)
+		{
+			if (!array_iterate(iterator, &elem, &isnull))
+				break;
+		}
+		else
+		{
+			elem = dvalues[i];
+			isnull = dnulls ? dnulls[i] : false;
+		}
+
+		if (i > 0)
+			appendStringInfoChar(&ds, typdelim);
+
+		if (!isnull)
+		{
+			char	   *str = OutputFunctionCall(&flinfo, elem);
+
+			append_array_element(&ds, str, typdelim);
+			pfree(str);
+		}
+		else
+			appendStringInfoString(&ds, "NULL");
+	}
+
+	if (iterator)
+		array_free_iterator(iterator);
+
+	if (is_truncated && ds.len <= limit)
+	{
+		/* the detoasted elements are not enough */
+		pfree(ds.data);
+		*is_incomplete = true;
+
+		return NULL;
+	}
+
+	if (ds.len <= limit)
+		appendStringInfoChar(&ds, '}');
+
+	if (ds.len > limit)
+		ds.len = pg_mbcliplen(ds.data, ds.len, limit);
+
+	ds.data[ds.len] = '\0';
+
+	return ds.data;
+}
+
+static char *
+array_prefix_to_string(Datum value, int limit)
+{
+	struct varlena *raw = (struct varlena *) DatumGetPointer(value);
+
+	/* try to detoast only prefix of large array */
+	if (VARATT_IS_EXTERNAL_ONDISK(raw) || VARATT_IS_COMPRESSED(raw))
+	{
+		bool		is_incomplete = false;
+		char	   *result;
+
+		result = print_array_prefix(value, limit, true, &is_incomplete);
+
+		if (!is_incomplete)
+			return result;
+	}
+
+	return print_array_prefix(value, limit, false, NULL);
+}
+
+/*
+ * Returns cache entry for variable, or NULL
+ */
+static tracer_value_cache *
+get_value_cache(tracer_info *tinfo, PLpgSQL_execstate *estate, int dno)
+{
+	if (!tinfo)
+		return NULL;
+
+	if (!tinfo->value_cache)
+	{
+		tinfo->value_cache = MemoryContextAllocZero(tinfo->mcxt,
+													sizeof(tracer_value_cache) * estate->ndatums);
+		tinfo->nvalue_cache = estate->ndatums;
+	}
+
+	if (dno < 0 || dno >= tinfo->nvalue_cache)
+		return NULL;
+
+	return &tinfo->value_cache[dno];
+}
+
+/*
+ * Convert binary value to text. Only first limit bytes of result
+ * are returned.
+ */
+static char *
+convert_value_to_string(PLpgSQL_execstate *estate,
+						Datum value,
+						Oid valtype,
+						tracer_info *tinfo,
+						int dno)
+{
+	tracer_value_cache *vc = get_value_cache(tinfo, estate, dno);
+	char	   *result = NULL;
 	MemoryContext oldcontext;
 	Oid			typoutput;
 	bool		typIsVarlena;
+	tracer_printer printer;
+	int			limit = get_value_limit();
+	uint32		rawsize = 0;
+	uint64		hashval = 0;
 
 	oldcontext = MemoryContextSwitchTo(estate->eval_econtext->ecxt_per_tuple_memory);
 	getTypeOutputInfo(valtype, &typoutput, &typIsVarlena);
-	result = OidOutputFunctionCall(typoutput, value);
+
+	printer = typIsVarlena ? get_tracer_printer(typoutput) : TRACER_PRINTER_OUTPUT;
+
+	/*
+	 * Printers of text and bytea are cheap, and there is not necessary
+	 * to cache their result. The expanded objects can be modified in
+	 * place, so their pointer or content cannot be used for detection
+	 * of change.
+	 */
+	if (vc && typIsVarlena &&
+		(printer == TRACER_PRINTER_OUTPUT || printer == TRACER_PRINTER_ARRAY) &&
+		!VARATT_IS_EXTERNAL_EXPANDED(DatumGetPointer(value)))
+	{
+		struct varlena *raw = (struct varlena *) DatumGetPointer(value);
+
+		/* hashing of all value is still cheaper than its serialization */
+		rawsize = VARSIZE_ANY(raw);
+		hashval = DatumGetUInt64(hash_any_extended((const unsigned char *) raw,
+												   rawsize, 0));
+
+		if (vc->str && vc->typoid == valtype &&
+			vc->rawsize == rawsize && vc->hashval == hashval)
+		{
+			result = pstrdup(vc->str);
+			MemoryContextSwitchTo(oldcontext);
+
+			return result;
+		}
+	}
+	else
+		vc = NULL;
+
+	switch (printer)
+	{
+		case TRACER_PRINTER_TEXT:
+			{
+				text	   *t = DatumGetTextPSlice(value, 0, limit);
+
+				result = pnstrdup_clipped(VARDATA_ANY(t), VARSIZE_ANY_EXHDR(t), limit);
+			}
+			break;
+
+		case TRACER_PRINTER_BYTEA:
+			{
+				/* output of prefix of bytea is prefix of output of bytea */
+				bytea	   *b = DatumGetByteaPSlice(value, 0, limit);
+				char	   *str;
+
+				str = OidOutputFunctionCall(typoutput, PointerGetDatum(b));
+				result = pnstrdup_clipped(str, strlen(str), limit);
+			}
+			break;
+
+		case TRACER_PRINTER_ARRAY:
+			result = array_prefix_to_string(value, limit);
+			break;
+
+		default:
+			;
+	}
+
+	if (!result)
+	{
+		char	   *str = OidOutputFunctionCall(typoutput, value);
+
+		result = pnstrdup_clipped(str, strlen(str), limit);
+	}
+
 	MemoryContextSwitchTo(oldcontext);
 
+	if (vc)
+	{
+		if (vc->str)
+			pfree(vc->str);
+
+		vc->str = MemoryContextStrdup(tinfo->mcxt, result);
+		vc->typoid = valtype;
+		vc->rawsize = rawsize;
+		vc->hashval = hashval;
+	}
+
 	return result;
 }
 
 static void
-StringInfoPrintRow(StringInfo ds, PLpgSQL_execstate *estate, PLpgSQL_row *row)
+StringInfoPrintRow(StringInfo ds, PLpgSQL_execstate *estate, PLpgSQL_row *row, tracer_info *tinfo)
 {
 	bool		isfirst = true;
 	int			i;
@@ -119,7 +1074,8 @@ StringInfoPrintRow(StringInfo ds, PLpgSQL_execstate *estate, PLpgSQL_row *row)
 		str = convert_plpgsql_datum_to_string(estate,
 											  estate->datums[row->varnos[i]],
 											  &isnull,
-											  &refname);
+											  &refname,
+											  tinfo);
 		if (!isfirst)
 			appendStringInfoChar(ds, ',');
 		else
@@ -145,7 +1101,8 @@ static char *
 convert_plpgsql_datum_to_string(PLpgSQL_execstate *estate,
 								PLpgSQL_datum *dtm,
 								bool *isnull,
-								char **refname)
+								char **refname,
+								tracer_info *tinfo)
 {
 	*isnull = true;
 	*refname = NULL;
@@ -164,7 +1121,9 @@ convert_plpgsql_datum_to_string(PLpgSQL_execstate *estate,
 
 					return convert_value_to_string(estate,
 												   var->value,
-												   var->datatype->typoid);
+												   var->datatype->typoid,
+												   tinfo,
+												   var->dno);
 				}
 				else
 					return NULL;
@@ -183,7 +1142,9 @@ convert_plpgsql_datum_to_string(PLpgSQL_execstate *estate,
 
 					return convert_value_to_string(estate,
 												   ExpandedRecordGetDatum(rec->erh),
-												   rec->rectypeid);
+												   rec->rectypeid,
+												   tinfo,
+												   rec->dno);
 				}
 				else
 					return NULL;
@@ -201,7 +1162,7 @@ convert_plpgsql_datum_to_string(PLpgSQL_execstate *estate,
 
 				initStringInfo(&ds);
 
-				StringInfoPrintRow(&ds, estate, row);
+				StringInfoPrintRow(&ds, estate, row, tinfo);
 
 				return ds.data;
 			}
@@ -247,7 +1208,7 @@ trim_string(char *str, int n)
  * Print function's arguments
  */
 static void
-print_func_args(PLpgSQL_execstate *estate, PLpgSQL_function *func, int frame_num, int level)
+print_func_args(PLpgSQL_execstate *estate, PLpgSQL_function *func, int frame_num, int level, tracer_info *tinfo)
 {
 	int		i;
 	int indent = level * 2 + (plpgsql_check_tracer_verbosity == PGERROR_VERBOSE ? 6 : 0);
@@ -290,8 +1251,7 @@ print_func_args(PLpgSQL_execstate *estate, PLpgSQL_function *func, int frame_num
 			trgcmd = "";
 		}
 
-		elog(plpgsql_check_tracer_errlevel,
-							 "#%-*d%*s triggered by %s %s%s trigger",
+		tracer_elog("#%-*d%*s triggered by %s %s%s trigger",
 											frame_width,
 											frame_num,
 											indent + 4, "",
@@ -302,17 +1262,16 @@ print_func_args(PLpgSQL_execstate *estate, PLpgSQL_function *func, int frame_num
 		sprintf(buffer, "%d", frame_num);
 
 		if (rec_new_varno != -1)
-			print_datum(estate, estate->datums[rec_new_varno], buffer, level);
+			print_datum(estate, estate->datums[rec_new_varno], buffer, level, tinfo);
 		if (rec_old_varno != -1)
-			print_datum(estate, estate->datums[rec_new_varno], buffer, level);
+			print_datum(estate, estate->datums[rec_new_varno], buffer, level, tinfo);
 	}
 
 	if (func->fn_is_trigger == PLPGSQL_EVENT_TRIGGER)
 	{
 		Assert(estate->evtrigdata);
 
-		elog(plpgsql_check_tracer_errlevel,
-							 "#%-*d%*s triggered by event trigger",
+		tracer_elog("#%-*d%*s triggered by event trigger",
 											frame_width,
 											frame_num,
 											indent + 4, "");
@@ -329,7 +1288,8 @@ print_func_args(PLpgSQL_execstate *estate, PLpgSQL_function *func, int frame_num
 		str = convert_plpgsql_datum_to_string(estate,
 											  estate->datums[n],
 											  &isnull,
-											  &refname);
+											  &refname,
+											  tinfo);
 
 		if (refname)
 		{
@@ -344,8 +1304,7 @@ print_func_args(PLpgSQL_execstate *estate, PLpgSQL_function *func, int frame_num
 				{
 					if (*ds.data)
 					{
-						elog(plpgsql_check_tracer_errlevel,
-							 "#%-*d%*s %s",
+						tracer_elog("#%-*d%*s %s",
 											frame_width,
 											frame_num,
 											indent + 4, "",
@@ -355,8 +1314,7 @@ print_func_args(PLpgSQL_execstate *estate, PLpgSQL_function *func, int frame_num
 					}
 
 					trim_string(str, plpgsql_check_tracer_variable_max_length);
-					elog(plpgsql_check_tracer_errlevel,
-						 "#%-*d%*s \"%s\" => '%s'",
+					tracer_elog("#%-*d%*s \"%s\" => '%s'",
 										frame_width,
 										frame_num,
 										indent + 4, "",
@@ -386,8 +1344,7 @@ print_func_args(PLpgSQL_execstate *estate, PLpgSQL_function *func, int frame_num
 		/*print too long lines immediately */
 		if (ds.len > plpgsql_check_tracer_variable_max_length)
 		{
-			elog(plpgsql_check_tracer_errlevel,
-				 "#%-*d%*s %s",
+			tracer_elog("#%-*d%*s %s",
 										frame_width,
 										frame_num,
 										indent + 4, "",
@@ -397,8 +1354,7 @@ print_func_args(PLpgSQL_execstate *estate, PLpgSQL_function *func, int frame_num
 	}
 
 	if (*ds.data)
-		elog(plpgsql_check_tracer_errlevel,
-			 "#%-*d%*s %s",
+		tracer_elog("#%-*d%*s %s",
 									frame_width,
 									frame_num,
 									indent + 4, "",
@@ -414,7 +1370,8 @@ static void
 print_expr_args(PLpgSQL_execstate *estate,
 				PLpgSQL_expr *expr,
 				char *frame,
-				int level)
+				int level,
+				tracer_info *tinfo)
 {
 	int			dno;
 	int			indent = level * 2 + (plpgsql_check_tracer_verbosity == PGERROR_VERBOSE ? 6 : 0);
@@ -478,7 +1435,8 @@ print_expr_args(PLpgSQL_execstate *estate,
 		str = convert_plpgsql_datum_to_string(estate,
 											  estate->datums[dno],
 											  &isnull,
-											  &refname);
+											  &refname,
+											  tinfo);
 
 		if (refname)
 		{
@@ -493,8 +1451,7 @@ print_expr_args(PLpgSQL_execstate *estate,
 				{
 					if (*ds.data)
 					{
-						elog(plpgsql_check_tracer_errlevel,
-							 "#%-*s%*s %s",
+						tracer_elog("#%-*s%*s %s",
 											frame_width,
 											frame,
 											indent + 4, "",
@@ -504,8 +1461,7 @@ print_expr_args(PLpgSQL_execstate *estate,
 					}
 
 					trim_string(str, plpgsql_check_tracer_variable_max_length);
-					elog(plpgsql_check_tracer_errlevel,
-						 "#%-*s%*s \"%s\" => '%s'",
+					tracer_elog("#%-*s%*s \"%s\" => '%s'",
 										frame_width,
 										frame,
 										indent + 4, "",
@@ -535,8 +1491,7 @@ print_expr_args(PLpgSQL_execstate *estate,
 		/*print too long lines immediately */
 		if (ds.len > plpgsql_check_tracer_variable_max_length)
 		{
-			elog(plpgsql_check_tracer_errlevel,
-				 "#%-*s%*s %s",
+			tracer_elog("#%-*s%*s %s",
 										frame_width,
 										frame,
 										indent + 4, "",
@@ -546,8 +1501,7 @@ print_expr_args(PLpgSQL_execstate *estate,
 	}
 
 	if (*ds.data)
-		elog(plpgsql_check_tracer_errlevel,
-			 "#%-*s%*s %s",
+		tracer_elog("#%-*s%*s %s",
 									frame_width,
 									frame,
 									indent + 4, "",
@@ -622,7 +1576,8 @@ print_assert_args(PLpgSQL_execstate *estate, PLpgSQL_stmt_assert *stmt)
 		str = convert_plpgsql_datum_to_string(estate,
 											  estate->datums[dno],
 											  &isnull,
-											  &refname);
+											  &refname,
+											  NULL);
 
 		if (refname)
 		{
@@ -637,14 +1592,13 @@ print_assert_args(PLpgSQL_execstate *estate, PLpgSQL_stmt_assert *stmt)
 				{
 					if (*ds.data)
 					{
-						elog(plpgsql_check_tracer_errlevel, " %s", ds.data);
+						tracer_elog(" %s", ds.data);
 
 						resetStringInfo(&ds);
 					}
 
 					trim_string(str, plpgsql_check_tracer_variable_max_length);
-					elog(plpgsql_check_tracer_errlevel,
-						 " \"%s\" => '%s'",
+					tracer_elog(" \"%s\" => '%s'",
 										refname,
 										str);
 				}
@@ -671,13 +1625,13 @@ print_assert_args(PLpgSQL_execstate *estate, PLpgSQL_stmt_assert *stmt)
 		/*print too long lines immediately */
 		if (ds.len > plpgsql_check_tracer_variable_max_length)
 		{
-			elog(plpgsql_check_tracer_errlevel, " %s", ds.data);
+			tracer_elog(" %s", ds.data);
 			resetStringInfo(&ds);
 		}
 	}
 
 	if (*ds.data)
-		elog(plpgsql_check_tracer_errlevel, " %s", ds.data);
+		tracer_elog(" %s", ds.data);
 
 	pfree(ds.data);
 }
@@ -706,7 +1660,8 @@ print_all_variables(PLpgSQL_execstate *estate)
 		str = convert_plpgsql_datum_to_string(estate,
 											  estate->datums[dno],
 											  &isnull,
-											  &refname);
+											  &refname,
+											  NULL);
 
 		if (strcmp(refname, "*internal*") == 0 ||
 				strcmp(refname, "(unnamed row)") == 0)
@@ -725,14 +1680,13 @@ print_all_variables(PLpgSQL_execstate *estate)
 				{
 					if (*ds.data)
 					{
-						elog(plpgsql_check_tracer_errlevel, "%*s%s", indent, "", ds.data);
+						tracer_elog("%*s%s", indent, "", ds.data);
 						indent = 2;
 						resetStringInfo(&ds);
 					}
 
 					trim_string(str, plpgsql_check_tracer_variable_max_length);
-					elog(plpgsql_check_tracer_errlevel,
-														"%*s \"%s\" => '%s'",
+					tracer_elog("%*s \"%s\" => '%s'",
 														indent, "",
 														refname,
 														str);
@@ -761,14 +1715,14 @@ print_all_variables(PLpgSQL_execstate *estate)
 		/*print too long lines immediately */
 		if (ds.len > plpgsql_check_tracer_variable_max_length)
 		{
-			elog(plpgsql_check_tracer_errlevel, "%*s%s", indent, "", ds.data);
+			tracer_elog("%*s%s", indent, "", ds.data);
 			indent = 2;
 			resetStringInfo(&ds);
 		}
 	}
 
 	if (*ds.data)
-		elog(plpgsql_check_tracer_errlevel, "%*s%s", indent, "", ds.data);
+		tracer_elog("%*s%s", indent, "", ds.data);
 
 	pfree(ds.data);
 }
@@ -777,7 +1731,7 @@ print_all_variables(PLpgSQL_execstate *estate)
  * Print plpgsql datum
  */
 static void
-print_datum(PLpgSQL_execstate *estate, PLpgSQL_datum *dtm, char *frame, int level)
+print_datum(PLpgSQL_execstate *estate, PLpgSQL_datum *dtm, char *frame, int level, tracer_info *tinfo)
 {
 	int indent = level * 2 + (plpgsql_check_tracer_verbosity == PGERROR_VERBOSE ? 6 : 0);
 	int frame_width = plpgsql_check_tracer_verbosity == PGERROR_VERBOSE ? 6 : 3;
@@ -789,15 +1743,15 @@ print_datum(PLpgSQL_execstate *estate, PLpgSQL_datum *dtm, char *frame, int leve
 	str = convert_plpgsql_datum_to_string(estate,
 											  dtm,
 											  &isnull,
-											  &refname);
+											  &refname,
+											  tinfo);
 
 	if (refname)
 	{
 		if (!isnull)
 		{
 			trim_string(str, plpgsql_check_tracer_variable_max_length);
-			elog(plpgsql_check_tracer_errlevel,
-				 "#%-*s%*s \"%s\" => '%s'",
+			tracer_elog("#%-*s%*s \"%s\" => '%s'",
 										frame_width,
 										frame,
 										indent + 4, "",
@@ -805,8 +1759,7 @@ print_datum(PLpgSQL_execstate *estate, PLpgSQL_datum *dtm, char *frame, int leve
 										str);
 		}
 		else
-			elog(plpgsql_check_tracer_errlevel,
-				 "#%-*s%*s \"%s\" => null",
+			tracer_elog("#%-*s%*s \"%s\" => null",
 										frame_width,
 										frame,
 										indent + 4, "",
@@ -830,10 +1783,13 @@ tracer_func_setup(PLpgSQL_execstate *estate, PLpgSQL_function *func, void **plug
 		tinfo->stmts_tracer_state = palloc(sizeof(bool) * func->nstatements);
 
 		tinfo->fn_oid = func->fn_oid;
+		tinfo->mcxt = CurrentMemoryContext;
 
 		tinfo->fn_name = plpgsql_check_get_current_func_info_name();
 		tinfo->fn_signature = plpgsql_check_get_current_func_info_signature();
 
+		tinfo->filter = get_func_filter(func);
+
 		INSTR_TIME_SET_CURRENT(tinfo->start_time);
 	}
 
@@ -914,6 +1870,10 @@ tracer_func_beg(PLpgSQL_execstate *estate,
 	if (!plpgsql_check_tracer)
 		return;
 
+	/* function is filtered out */
+	if (tinfo->filter && !tinfo->filter->is_traced)
+		return;
+
 	indent = tinfo->frame_num * 2 + (plpgsql_check_tracer_verbosity == PGERROR_VERBOSE ? 6 : 0);
 	frame_width = plpgsql_check_tracer_verbosity == PGERROR_VERBOSE ? 6 : 3;
 
@@ -941,8 +1901,7 @@ tracer_func_beg(PLpgSQL_execstate *estate,
 		buffer[0] = '\0';
 
 	if (plpgsql_check_tracer_verbosity >= PGERROR_DEFAULT)
-		elog(plpgsql_check_tracer_errlevel,
-			 "#%-*d%*s ->> start of %s%s (oid=%u, tnl=%d%s)",
+		tracer_elog("#%-*d%*s ->> start of %s%s (oid=%u, tnl=%d%s)",
 												  frame_width,
 												  tinfo->frame_num,
 												  indent,
@@ -953,8 +1912,7 @@ tracer_func_beg(PLpgSQL_execstate *estate,
 												  GetCurrentTransactionNestLevel(),
 												  buffer);
 	else
-		elog(plpgsql_check_tracer_errlevel,
-			 "#%-*d start of %s (oid=%u, tnl=%d%s)",
+		tracer_elog("#%-*d start of %s (oid=%u, tnl=%d%s)",
 												  frame_width,
 												  tinfo->frame_num,
 												  func->fn_oid ? get_func_name(func->fn_oid) : "inline code block",
@@ -966,8 +1924,7 @@ tracer_func_beg(PLpgSQL_execstate *estate,
 	{
 		if (caller_errcontext)
 		{
-			elog(plpgsql_check_tracer_errlevel,
-				 "#%-*d%*s context: %s",
+			tracer_elog("#%-*d%*s context: %s",
 													frame_width,
 													tinfo->frame_num,
 													indent + 4, "  ",
@@ -975,7 +1932,7 @@ tracer_func_beg(PLpgSQL_execstate *estate,
 			pfree(caller_errcontext);
 		}
 
-		print_func_args(estate, func, tinfo->frame_num, tinfo->frame_num);
+		print_func_args(estate, func, tinfo->frame_num, tinfo->frame_num, tinfo);
 	}
 
 	tinfo->is_traced = true;
@@ -1015,8 +1972,7 @@ _tracer_func_end(tracer_info *tinfo, bool is_aborted)
 	if (plpgsql_check_tracer_verbosity >= PGERROR_DEFAULT)
 	{
 		if (OidIsValid(tinfo->fn_oid))
-			elog(plpgsql_check_tracer_errlevel,
-				 "#%-*d%*s <<- end of function %s (elapsed time=%.3f ms)%s",
+			tracer_elog("#%-*d%*s <<- end of function %s (elapsed time=%.3f ms)%s",
 														frame_width,
 														tinfo->frame_num,
 														indent, "",
@@ -1024,8 +1980,7 @@ _tracer_func_end(tracer_info *tinfo, bool is_aborted)
 														elapsed / 1000.0,
 														aborted);
 		else
-			elog(plpgsql_check_tracer_errlevel,
-				 "#%-*d%*s <<- end of block (elapsed time=%.3f ms)%s",
+			tracer_elog("#%-*d%*s <<- end of block (elapsed time=%.3f ms)%s",
 														frame_width,
 														tinfo->frame_num,
 														indent, "",
@@ -1033,8 +1988,7 @@ _tracer_func_end(tracer_info *tinfo, bool is_aborted)
 														aborted);
 	}
 	else
-		elog(plpgsql_check_tracer_errlevel,
-			 "#%-3d end of %s%s",
+		tracer_elog("#%-3d end of %s%s",
 							tinfo->frame_num,
 							tinfo->fn_oid ? tinfo->fn_name : "inline code block",
 							aborted);
@@ -1116,6 +2070,10 @@ tracer_stmt_beg(PLpgSQL_execstate *estate,
 	if (sinfo->is_invisible || !plpgsql_check_tracer)
 		return;
 
+	/* statement is filtered out */
+	if (tinfo->filter && !TRACER_FILTER_IS_TRACED_STMT(tinfo->filter, stmt->stmtid))
+		return;
+
 	if (stmt->cmd_type == PLPGSQL_STMT_ASSERT && plpgsql_check_trace_assert)
 		trace_assert(estate, stmt, tinfo);
 
@@ -1226,6 +2184,10 @@ tracer_stmt_beg(PLpgSQL_execstate *estate,
 
 		INSTR_TIME_SET_CURRENT(tinfo->stmts_start_time[stmt->stmtid - 1]);
 
+		/* only end of slow statements is displayed */
+		if (plpgsql_check_tracer_stmt_min_duration > 0)
+			return;
+
 		snprintf(printbuf, 20, "%d.%d", tinfo->frame_num, sinfo->natural_id);
 
 		if (expr)
@@ -1258,8 +2220,7 @@ tracer_stmt_beg(PLpgSQL_execstate *estate,
 
 			if (is_assignment)
 			{
-				elog(plpgsql_check_tracer_errlevel,
-					 "#%-*s %4d %*s --> start of assignment %s%s",
+				tracer_elog("#%-*s %4d %*s --> start of assignment %s%s",
 												frame_width, printbuf,
 												stmt->lineno,
 												indent, "",
@@ -1268,8 +2229,7 @@ tracer_stmt_beg(PLpgSQL_execstate *estate,
 			}
 			else if (is_perform)
 			{
-				elog(plpgsql_check_tracer_errlevel,
-					 "#%-*s %4d %*s --> start of perform %s%s",
+				tracer_elog("#%-*s %4d %*s --> start of perform %s%s",
 												frame_width, printbuf,
 												stmt->lineno,
 												indent, "",
@@ -1278,8 +2238,7 @@ tracer_stmt_beg(PLpgSQL_execstate *estate,
 			}
 			else
 			{
-				elog(plpgsql_check_tracer_errlevel,
-					 "#%-*s %4d %*s --> start of %s (%s='%s')%s",
+				tracer_elog("#%-*s %4d %*s --> start of %s (%s='%s')%s",
 												frame_width, printbuf,
 												stmt->lineno,
 												indent, "",
@@ -1290,8 +2249,7 @@ tracer_stmt_beg(PLpgSQL_execstate *estate,
 			}
 		}
 		else
-			elog(plpgsql_check_tracer_errlevel,
-				 "#%-*s %4d %*s --> start of %s%s",
+			tracer_elog("#%-*s %4d %*s --> start of %s%s",
 											frame_width, printbuf,
 											stmt->lineno,
 											indent, "",
@@ -1299,10 +2257,10 @@ tracer_stmt_beg(PLpgSQL_execstate *estate,
 											buffer);
 
 		if (expr)
-			print_expr_args(estate, expr, printbuf, total_level);
+			print_expr_args(estate, expr, printbuf, total_level, tinfo);
 
 		if (retvarno >= 0)
-			print_datum(estate, estate->datums[retvarno], printbuf, total_level);
+			print_datum(estate, estate->datums[retvarno], printbuf, total_level, tinfo);
 
 		switch (stmt->cmd_type)
 		{
@@ -1315,14 +2273,13 @@ tracer_stmt_beg(PLpgSQL_execstate *estate,
 					{
 						PLpgSQL_if_elsif *ifelseif = (PLpgSQL_if_elsif *) lfirst(lc);
 
-						elog(plpgsql_check_tracer_errlevel,
-							 "#%-*s %4d %*s     ELSEIF (expr='%s')",
+						tracer_elog("#%-*s %4d %*s     ELSEIF (expr='%s')",
 											frame_width, printbuf,
 											ifelseif->lineno,
 											indent, "",
 											copy_string_part(exprbuf, ifelseif->cond->query + STREXPR_START, 30));
 
-						print_expr_args(estate, ifelseif->cond, printbuf, total_level);
+						print_expr_args(estate, ifelseif->cond, printbuf, total_level, tinfo);
 					}
 					break;
 				}
@@ -1333,13 +2290,17 @@ tracer_stmt_beg(PLpgSQL_execstate *estate,
 	}
 }
 
-static void
+/*
+ * Returns true, when end of statement was displayed
+ */
+static bool
 _tracer_stmt_end(tracer_info *tinfo,
 				 plpgsql_check_plugin2_stmt_info *sinfo,
 				 int stmtid,
 				 bool is_aborted)
 {
 	const char *aborted = is_aborted ? " aborted" : "";
+	bool		result = false;
 
 	Assert(tinfo);
 	Assert(sinfo);
@@ -1351,11 +2312,12 @@ _tracer_stmt_end(tracer_info *tinfo,
 			/* restore tracer state (enabled | disabled) */
 			plpgsql_check_tracer = tinfo->stmts_tracer_state[stmtid - 1];
 
-		return;
+		return false;
 	}
 
 	if (tinfo->stmts_tracer_state[stmtid - 1] && 
-		plpgsql_check_tracer_verbosity == PGERROR_VERBOSE)
+		plpgsql_check_tracer_verbosity == PGERROR_VERBOSE &&
+		(!tinfo->filter || TRACER_FILTER_IS_TRACED_STMT(tinfo->filter, stmtid)))
 	{
 		int		indent = (tinfo->frame_num + sinfo->level) * 2;
 		int		frame_width = 6;
@@ -1376,13 +2338,28 @@ _tracer_stmt_end(tracer_info *tinfo,
 
 		snprintf(printbuf, 20, "%d.%d", tinfo->frame_num, stmtid);
 
-		elog(plpgsql_check_tracer_errlevel,
-			 "#%-*s      %*s <-- end of %s (elapsed time=%.3f ms)%s",
-												frame_width, printbuf,
-												indent, "",
-												sinfo->typname,
-												elapsed/1000.0,
-												aborted);
+		if (plpgsql_check_tracer_stmt_min_duration <= 0)
+		{
+			tracer_elog("#%-*s      %*s <-- end of %s (elapsed time=%.3f ms)%s",
+													frame_width, printbuf,
+													indent, "",
+													sinfo->typname,
+													elapsed/1000.0,
+													aborted);
+			result = true;
+		}
+		else if (elapsed >= (uint64) plpgsql_check_tracer_stmt_min_duration * 1000)
+		{
+			/* start of statement was not displayed, so show line number */
+			tracer_elog("#%-*s %4d %*s <-- end of %s (elapsed time=%.3f ms)%s",
+													frame_width, printbuf,
+													sinfo->lineno,
+													indent, "",
+													sinfo->typname,
+													elapsed/1000.0,
+													aborted);
+			result = true;
+		}
 	}
 
 	if (sinfo->is_container)
@@ -1391,6 +2368,7 @@ _tracer_stmt_end(tracer_info *tinfo,
 		plpgsql_check_tracer = tinfo->stmts_tracer_state[stmtid - 1];
 	}
 
+	return result;
 }
 
 
@@ -1401,17 +2379,24 @@ tracer_stmt_end(PLpgSQL_execstate *estate,
 {
 	tracer_info *tinfo = *plugin2_info;
 	plpgsql_check_plugin2_stmt_info *sinfo;
+	bool		is_displayed;
 
 	if (!tinfo)
 		return;
 
 	sinfo = plpgsql_check_get_current_stmt_info(stmt->stmtid);
 
-	_tracer_stmt_end(tinfo, sinfo, stmt->stmtid, false);
+	is_displayed = _tracer_stmt_end(tinfo, sinfo, stmt->stmtid, false);
 
 	if (!plpgsql_check_tracer)
 		return;
 
+	if (tinfo->filter && !TRACER_FILTER_IS_TRACED_STMT(tinfo->filter, stmt->stmtid))
+		return;
+
+	if (plpgsql_check_tracer_stmt_min_duration > 0 && !is_displayed)
+		return;
+
 	if (plpgsql_check_tracer_verbosity == PGERROR_VERBOSE &&
 		stmt->cmd_type == PLPGSQL_STMT_ASSIGN &&
 		!sinfo->is_invisible)
@@ -1423,7 +2408,8 @@ tracer_stmt_end(PLpgSQL_execstate *estate,
 		print_datum(estate,
 					estate->datums[((PLpgSQL_stmt_assign *) stmt)->varno],
 					printbuf,
-					tinfo->frame_num + sinfo->level);
+					tinfo->frame_num + sinfo->level,
+					tinfo);
 	}
 }
 
@@ -1469,7 +2455,7 @@ trace_assert(PLpgSQL_execstate *estate, PLpgSQL_stmt *stmt, tracer_info *tinfo)
 	{
 		if (plpgsql_check_trace_assert_verbosity >= PGERROR_DEFAULT)
 		{
-			elog(plpgsql_check_tracer_errlevel, "PLpgSQL assert expression (%s) on line %d of %s is true",
+			tracer_elog("PLpgSQL assert expression (%s) on line %d of %s is true",
 												copy_string_part(exprbuf, stmt_assert->cond->query + STREXPR_START, 30),
 												stmt->lineno,
 												estate->func->fn_signature);
@@ -1482,7 +2468,7 @@ trace_assert(PLpgSQL_execstate *estate, PLpgSQL_stmt *stmt, tracer_info *tinfo)
 		ErrorContextCallback *econtext;
 		int		frame_num = tinfo->frame_num;
 
-		elog(plpgsql_check_tracer_errlevel, "#%d PLpgSQL assert expression (%s) on line %d of %s is false",
+		tracer_elog("#%d PLpgSQL assert expression (%s) on line %d of %s is false",
 											frame_num,
 											copy_string_part(exprbuf, stmt_assert->cond->query + STREXPR_START, 30),
 											stmt->lineno,
@@ -1508,16 +2494,14 @@ trace_assert(PLpgSQL_execstate *estate, PLpgSQL_stmt *stmt, tracer_info *tinfo)
 					PLpgSQL_execstate *oestate = (PLpgSQL_execstate *) econtext->arg;
 
 					if (oestate->err_stmt)
-						elog(plpgsql_check_tracer_errlevel,
-							 "#%d PL/pgSQL function %s line %d at %s",
+						tracer_elog("#%d PL/pgSQL function %s line %d at %s",
 															  frame_num,
 															  oestate->func->fn_signature,
 															  oestate->err_stmt->lineno,
 															  plpgsql_check__stmt_typename_p(oestate->err_stmt));
 
 					else
-						elog(plpgsql_check_tracer_errlevel,
-							 "#%d PLpgSQL function %s",
+						tracer_elog("#%d PLpgSQL function %s",
 															  frame_num,
 															  oestate->func->fn_signature);
 
@@ -1529,6 +2513,254 @@ trace_assert(PLpgSQL_execstate *estate, PLpgSQL_stmt *stmt, tracer_info *tinfo)
 	}
 }
 
+/*
+ * Calculate required size of shared memory for tracer's buffer
+ */
+Size
+plpgsql_check_tracer_shmem_size(void)
+{
+	return add_size(MAXALIGN(sizeof(tracer_buffer)),
+					(Size) plpgsql_check_tracer_buffer_size * 1024);
+}
+
+/*
+ * Initialize shared tracer's buffer. It is called from profiler's shmem
+ * startup hook, and caller should to hold AddinShmemInitLock.
+ */
+void
+plpgsql_check_tracer_shmem_init(void)
+{
+	bool		found;
+
+	shared_tracer_buffer = ShmemInitStruct("plpgsql_check tracer buffer",
+										   plpgsql_check_tracer_shmem_size(),
+										   &found);
+
+	if (!found)
+	{
+		shared_tracer_buffer->lock = &(GetNamedLWLockTranche("plpgsql_check tracer"))->lock;
+		shared_tracer_buffer->size = (Size) plpgsql_check_tracer_buffer_size * 1024;
+		shared_tracer_buffer->head = 0;
+		shared_tracer_buffer->tail = 0;
+		shared_tracer_buffer->seqno = 0;
+		shared_tracer_buffer->dropped = 0;
+	}
+}
+
+static tracer_buffer *
+get_tracer_buffer(void)
+{
+	if (shared_tracer_buffer)
+		return shared_tracer_buffer;
+
+	if (!local_tracer_buffer)
+	{
+		Size		size = (Size) plpgsql_check_tracer_buffer_size * 1024;
+
+		local_tracer_buffer = MemoryContextAllocZero(TopMemoryContext,
+													 MAXALIGN(sizeof(tracer_buffer)) + size);
+		local_tracer_buffer->lock = NULL;
+		local_tracer_buffer->size = size;
+	}
+
+	return local_tracer_buffer;
+}
+
+/*
+ * Append message to tracer's buffer. When there is not free space,
+ * then the oldest records are overwritten.
+ */
+static void
+tracer_buffer_put(const char *message, int len)
+{
+	tracer_buffer *buf = get_tracer_buffer();
+	tracer_buffer_record *rec;
+	Size		maxlen;
+	Size		reclen;
+	Size		padlen = 0;
+	Size		offset;
+	TimestampTz now = GetCurrentTimestamp();
+	Oid			roleid = GetSessionUserId();
+
+	/* one message can use max quarter of buffer */
+	maxlen = buf->size / 4 - MAXALIGN(offsetof(tracer_buffer_record, message)) - 1;
+	if ((Size) len > maxlen)
+		len = pg_mbcliplen(message, len, (int) maxlen);
+
+	reclen = MAXALIGN(offsetof(tracer_buffer_record, message) + len + 1);
+
+	if (buf->lock)
+		LWLockAcquire(buf->lock, LW_EXCLUSIVE);
+
+	offset = buf->head % buf->size;
+	if (offset + reclen > buf->size)
+		padlen = buf->size - offset;
+
+	/* release space for new record */
+	while (buf->head + padlen + reclen - buf->tail > buf->size)
+	{
+		rec = TRACER_BUFFER_RECORD(buf, buf->tail);
+
+		if (rec->pid != 0)
+			buf->dropped += 1;
+
+		buf->tail += rec->len;
+	}
+
+	if (padlen > 0)
+	{
+		rec = TRACER_BUFFER_RECORD(buf, buf->head);
+		rec->len = padlen;
+		rec->pid = 0;
+
+		buf->head += padlen;
+	}
+
+	rec = TRACER_BUFFER_RECORD(buf, buf->head);
+
+	rec->len = reclen;
+	rec->pid = MyProcPid;
+	rec->roleid = roleid;
+	rec->seqno = ++buf->seqno;
+	rec->time = now;
+	memcpy(rec->message, message, len);
+	rec->message[len] = '\0';
+
+	buf->head += reclen;
+
+	if (buf->lock)
+		LWLockRelease(buf->lock);
+}
+
+static void
+tracer_buffer_printf(const char *fmt,...)
+{
+	StringInfoData str;
+
+	initStringInfo(&str);
+
+	for (;;)
+	{
+		va_list		args;
+		int			needed;
+
+		va_start(args, fmt);
+		needed = appendStringInfoVA(&str, fmt, args);
+		va_end(args);
+
+		if (needed == 0)
+			break;
+
+		enlargeStringInfo(&str, needed);
+	}
+
+	tracer_buffer_put(str.data, str.len);
+
+	pfree(str.data);
+}
+
+/*
+ * Returns messages from tracer's buffer. Only superuser can see
+ * messages of other users.
+ */
+Datum
+plpgsql_check_tracer_messages(PG_FUNCTION_ARGS)
+{
+	plpgsql_check_result_info ri;
+	ReturnSetInfo *rsinfo;
+	tracer_buffer *buf = get_tracer_buffer();
+	StringInfoData records;
+	bool		is_superuser = superuser();
+	Oid			roleid = GetSessionUserId();
+	uint64		pos;
+	int			offset;
+
+	/* check to see if caller supports us returning a tuplestore */
+	rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("set-valued function called in context that cannot accept a set")));
+
+	if (!(rsinfo->allowedModes & SFRM_Materialize))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("materialize mode required, but it is not allowed in this context")));
+
+	plpgsql_check_init_ri(&ri, PLPGSQL_SHOW_TRACER_MESSAGES_TABULAR, rsinfo);
+
+	/* copy visible records, so lock is not held when tuplestore is filled */
+	initStringInfo(&records);
+
+	if (buf->lock)
+		LWLockAcquire(buf->lock, LW_SHARED);
+
+	for (pos = buf->tail; pos < buf->head;)
+	{
+		tracer_buffer_record *rec = TRACER_BUFFER_RECORD(buf, pos);
+
+		if (rec->pid != 0 && (is_superuser || rec->roleid == roleid))
+			appendBinaryStringInfo(&records, (char *) rec, rec->len);
+
+		pos += rec->len;
+	}
+
+	if (buf->lock)
+		LWLockRelease(buf->lock);
+
+	for (offset = 0; offset < records.len;)
+	{
+		tracer_buffer_record *rec = (tracer_buffer_record *) (records.data + offset);
+
+		plpgsql_check_put_tracer_message(&ri, rec->pid, (int64) rec->seqno,
+										 rec->time, rec->message);
+
+		offset += rec->len;
+	}
+
+	pfree(records.data);
+
+	plpgsql_check_finalize_ri(&ri);
+
+	return (Datum) 0;
+}
+
+/*
+ * Removes visible messages from tracer's buffer
+ */
+Datum
+plpgsql_check_tracer_messages_reset(PG_FUNCTION_ARGS)
+{
+	tracer_buffer *buf = get_tracer_buffer();
+	bool		is_superuser = superuser();
+	Oid			roleid = GetSessionUserId();
+
+	if (buf->lock)
+		LWLockAcquire(buf->lock, LW_EXCLUSIVE);
+
+	if (is_superuser)
+		buf->tail = buf->head;
+	else
+	{
+		uint64		pos;
+
+		for (pos = buf->tail; pos < buf->head;)
+		{
+			tracer_buffer_record *rec = TRACER_BUFFER_RECORD(buf, pos);
+
+			if (rec->roleid == roleid)
+				rec->pid = 0;
+
+			pos += rec->len;
+		}
+	}
+
+	if (buf->lock)
+		LWLockRelease(buf->lock);
+
+	PG_RETURN_VOID();
+}
+
 void
 plpgsql_check_tracer_init(void)
 {